@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <endian.h>
+#include <time.h>
+
+#include "qmi_dialer.h"
+#include "qmi_device.h"
+#include "qmi_hdrs.h"
+#include "qmi_shared.h"
+#include "qmi_nas.h"
+#include "qmi_helpers.h"
+
+//Microbenchmark for the cost of decoding messages. It is not built by default,
+//configure with -DQMID_BENCH=ON and run qmid_bench [iterations] on the target.
+//Messages are decoded by the normal handlers, from the same buffer and at the
+//same (unaligned) offsets as when read from the device. The first two rows
+//compare the old way of reading values (casting into the buffer) with the
+//alignment-safe helpers, and the _cast row is the RF band handler as it was
+//before the helpers, to compare with the real handler
+
+#define QMID_BENCH_DEFAULT_ITERATIONS   1000000
+//Number of values read per iteration in the raw access rows
+#define QMID_BENCH_NUM_VALUES           32
+
+static struct qmi_device qmid;
+static uint8_t raw_buf[QMID_BENCH_NUM_VALUES * 8 + 8];
+static volatile uint32_t bench_sink;
+
+static uint64_t qmid_bench_now(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//What handlers used to do. Only valid where unaligned access is allowed (or
+//fixed up by the kernel)
+static void qmid_bench_raw_cast(){
+    uint32_t sum = 0;
+    uint8_t i;
+
+    for(i=0; i<QMID_BENCH_NUM_VALUES; i++){
+        sum += le16toh(*((uint16_t*) (raw_buf + i*6 + 1)));
+        sum += le32toh(*((uint32_t*) (raw_buf + i*6 + 3)));
+    }
+
+    bench_sink = sum;
+}
+
+static void qmid_bench_raw_helpers(){
+    uint32_t sum = 0;
+    uint8_t i;
+
+    for(i=0; i<QMID_BENCH_NUM_VALUES; i++){
+        sum += qmi_helpers_get_le16(raw_buf + i*6 + 1);
+        sum += qmi_helpers_get_le32(raw_buf + i*6 + 3);
+    }
+
+    bench_sink = sum;
+}
+
+static void qmid_bench_nas(){
+    qmi_nas_handle_msg(&qmid);
+}
+
+//qmi_nas_handle_rf_band_info() before the alignment-safe helpers, reading the
+//result by casting into the buffer. The set is the same in every iteration,
+//so storing it is only a comparison, like in qmi_nas_update_rf_bands()
+static uint8_t qmid_bench_rf_band_info_cast(struct qmi_device *qmid){
+    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
+    qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
+    qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
+    uint16_t tlv_length = le16toh(qmi_hdr->length), i = 0;
+    uint16_t result = le16toh(*((uint16_t*) (tlv+1)));
+    qmi_nas_rf_band_info_t *rf_info = NULL;
+    qmi_nas_rf_band_info_ext_t *rf_info_ext = NULL;
+    qmi_nas_rf_bandwidth_t *rf_bw = NULL;
+    struct qmid_rf_band_set set, *old = &(qmid->rf_bands);
+    uint8_t num_instances = 0, j, got_bands = 0;
+
+    memset(&set, 0, sizeof(set));
+
+    for(j=0; j<QMID_MAX_RF_BANDS; j++)
+        set.bands[j].bandwidth = QMI_NAS_BANDWIDTH_UNKNOWN;
+
+    if(qmi_hdr->control_flags & QMI_CTL_FLAGS_RESP){
+        if(result == QMI_RESULT_FAILURE)
+            return QMI_MSG_IGNORE;
+
+        tlv_length = tlv_length - sizeof(qmi_tlv_t) - le16toh(tlv->length);
+        tlv = (qmi_tlv_t*) (((uint8_t*) (tlv+1)) + le16toh(tlv->length));
+    }
+
+    while(i<tlv_length){
+        num_instances = *((uint8_t*) (tlv+1));
+
+        switch(tlv->type){
+            case QMI_NAS_TLV_RF_BAND_INFO:
+                if(le16toh(tlv->length) < 1 + num_instances *
+                        sizeof(qmi_nas_rf_band_info_t))
+                    return QMI_MSG_IGNORE;
+
+                if(num_instances > QMID_MAX_RF_BANDS)
+                    num_instances = QMID_MAX_RF_BANDS;
+
+                rf_info = (qmi_nas_rf_band_info_t*) (((uint8_t*) (tlv+1)) + 1);
+
+                for(j=0; j<num_instances; j++){
+                    set.bands[j].radio_if = rf_info[j].radio_if;
+                    set.bands[j].band = le16toh(rf_info[j].active_band);
+
+                    if(!set.bands[j].channel)
+                        set.bands[j].channel =
+                            le16toh(rf_info[j].active_channel);
+                }
+
+                set.num_bands = num_instances;
+                got_bands = 1;
+                break;
+            case QMI_NAS_TLV_RF_BAND_INFO_EXT:
+                if(le16toh(tlv->length) < 1 + num_instances *
+                        sizeof(qmi_nas_rf_band_info_ext_t))
+                    break;
+
+                rf_info_ext = (qmi_nas_rf_band_info_ext_t*)
+                    (((uint8_t*) (tlv+1)) + 1);
+
+                for(j=0; j<num_instances && j<QMID_MAX_RF_BANDS; j++)
+                    set.bands[j].channel =
+                        le32toh(rf_info_ext[j].active_channel);
+                break;
+            case QMI_NAS_TLV_RF_BAND_BANDWIDTH:
+                if(le16toh(tlv->length) < 1 + num_instances *
+                        sizeof(qmi_nas_rf_bandwidth_t))
+                    break;
+
+                rf_bw = (qmi_nas_rf_bandwidth_t*) (((uint8_t*) (tlv+1)) + 1);
+
+                for(j=0; j<num_instances && j<QMID_MAX_RF_BANDS; j++)
+                    set.bands[j].bandwidth = le32toh(rf_bw[j].bandwidth);
+                break;
+        }
+
+        i += sizeof(qmi_tlv_t) + le16toh(tlv->length);
+
+        if(i==tlv_length)
+            break;
+        else
+            tlv = (qmi_tlv_t*) (((uint8_t*) (tlv+1)) + le16toh(tlv->length));
+    }
+
+    if(!got_bands)
+        return QMI_MSG_IGNORE;
+
+    for(j=set.num_bands; j<QMID_MAX_RF_BANDS; j++){
+        set.bands[j].channel = 0;
+        set.bands[j].bandwidth = QMI_NAS_BANDWIDTH_UNKNOWN;
+    }
+
+    if(set.num_bands != old->num_bands || memcmp(set.bands, old->bands,
+                sizeof(struct qmid_rf_band) * set.num_bands))
+        memcpy(old, &set, sizeof(set));
+
+    return QMI_MSG_SUCCESS;
+}
+
+//Dispatched on the message id, like qmi_nas_handle_msg()
+static void qmid_bench_nas_cast(){
+    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid.buf;
+    qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
+
+    switch(le16toh(qmi_hdr->message_id)){
+        case QMI_NAS_GET_RF_BAND_INFO:
+            qmid_bench_rf_band_info_cast(&qmid);
+            break;
+    }
+}
+
+//Store a NAS message (built as a request) in the receive buffer
+static void qmid_bench_set_msg(uint8_t *buf, uint8_t control_flags){
+    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
+    qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
+
+    //Messages from the modem are sent by the service
+    qmux_hdr->control_flags = 0x80;
+    qmi_hdr->control_flags = control_flags;
+
+    memcpy(qmid.buf, buf, le16toh(qmux_hdr->length) + 1);
+    qmi_helpers_put_buf(buf);
+}
+
+static void qmid_bench_add_result(uint8_t *buf){
+    uint8_t value[4];
+
+    qmi_helpers_put_le16(value, QMI_RESULT_SUCCESS);
+    qmi_helpers_put_le16(value + 2, 0);
+    add_tlv(buf, QMI_TLV_RESULT_CODE, sizeof(value), value);
+}
+
+static void qmid_bench_sig_info(){
+    uint8_t *buf = qmi_helpers_get_buf();
+    uint8_t lte[6] = {(uint8_t) -65, (uint8_t) -9};
+
+    create_qmi_request(buf, QMI_SERVICE_NAS, 1, 1, QMI_NAS_GET_SIG_INFO);
+    qmid_bench_add_result(buf);
+    qmi_helpers_put_le16(lte + 2, (uint16_t) -95);
+    qmi_helpers_put_le16(lte + 4, 125);
+    add_tlv(buf, 0x14, sizeof(lte), lte);
+    qmid_bench_set_msg(buf, QMI_CTL_FLAGS_RESP);
+}
+
+static void qmid_bench_serving_system(){
+    uint8_t *buf = qmi_helpers_get_buf();
+    uint8_t ss[6] = {0x01, 0x01, 0x01, 0x02, 0x01, QMI_NAS_RADIO_IF_LTE};
+    uint8_t roaming = 0x01;
+    uint8_t plmn[9] = {0};
+
+    create_qmi_request(buf, QMI_SERVICE_NAS, 1, 0,
+            QMI_NAS_SERVING_SYSTEM_IND);
+    add_tlv(buf, 0x01, sizeof(ss), ss);
+    add_tlv(buf, 0x10, sizeof(roaming), &roaming);
+    qmi_helpers_put_le16(plmn, 242);
+    qmi_helpers_put_le16(plmn + 2, 1);
+    plmn[4] = 4;
+    memcpy(plmn + 5, "qmid", 4);
+    add_tlv(buf, 0x12, sizeof(plmn), plmn);
+    qmid_bench_set_msg(buf, QMI_CTL_FLAGS_IND);
+}
+
+static void qmid_bench_sys_info(){
+    uint8_t *buf = qmi_helpers_get_buf();
+    uint8_t srv[3] = {QMI_NAS_TLV_SI_SRV_STATUS_SRV,
+        QMI_NAS_TLV_SI_SRV_STATUS_SRV, 0};
+
+    create_qmi_request(buf, QMI_SERVICE_NAS, 1, 1, QMI_NAS_GET_SYS_INFO);
+    qmid_bench_add_result(buf);
+    add_tlv(buf, QMI_NAS_TLV_SI_LTE_SS, sizeof(srv), srv);
+    qmid_bench_set_msg(buf, QMI_CTL_FLAGS_RESP);
+}
+
+//Two carriers, with 32 bit channels and bandwidth
+static void qmid_bench_rf_band_info(){
+    uint8_t *buf = qmi_helpers_get_buf();
+    uint8_t info[11] = {2}, info_ext[15] = {2}, bw[11] = {2};
+    uint16_t bands[2] = {123, 127};
+    uint32_t channels[2] = {1300, 6300};
+    uint8_t i;
+
+    create_qmi_request(buf, QMI_SERVICE_NAS, 1, 1, QMI_NAS_GET_RF_BAND_INFO);
+    qmid_bench_add_result(buf);
+
+    for(i=0; i<2; i++){
+        info[1 + i*5] = QMI_NAS_RADIO_IF_LTE;
+        qmi_helpers_put_le16(info + 2 + i*5, bands[i]);
+        qmi_helpers_put_le16(info + 4 + i*5, channels[i]);
+        info_ext[1 + i*7] = QMI_NAS_RADIO_IF_LTE;
+        qmi_helpers_put_le16(info_ext + 2 + i*7, bands[i]);
+        qmi_helpers_put_le32(info_ext + 4 + i*7, channels[i]);
+        bw[1 + i*5] = QMI_NAS_RADIO_IF_LTE;
+        qmi_helpers_put_le32(bw + 2 + i*5, 5 - i*2);
+    }
+
+    add_tlv(buf, QMI_NAS_TLV_RF_BAND_INFO, sizeof(info), info);
+    add_tlv(buf, QMI_NAS_TLV_RF_BAND_INFO_EXT, sizeof(info_ext), info_ext);
+    add_tlv(buf, QMI_NAS_TLV_RF_BAND_BANDWIDTH, sizeof(bw), bw);
+    qmid_bench_set_msg(buf, QMI_CTL_FLAGS_RESP);
+}
+
+static void qmid_bench_run(const char *name, void (*setup)(),
+        void (*run)(), uint32_t iterations){
+    uint64_t start, diff;
+    uint32_t i;
+
+    if(setup != NULL)
+        setup();
+
+    start = qmid_bench_now();
+
+    for(i=0; i<iterations; i++)
+        run();
+
+    diff = qmid_bench_now() - start;
+
+    printf("%-24s %10u %12.1f\n", name, iterations,
+            (double) diff / iterations);
+}
+
+int main(int argc, char *argv[]){
+    uint16_t sig_windows[QMI_SIG_MAX_WINDOWS] = {QMI_SIG_DEFAULT_WINDOW_0,
+        QMI_SIG_DEFAULT_WINDOW_1, QMI_SIG_DEFAULT_WINDOW_2};
+    uint32_t iterations = QMID_BENCH_DEFAULT_ITERATIONS;
+    uint16_t i;
+
+    if(argc > 1)
+        iterations = strtoul(argv[1], NULL, 10);
+
+    if(!iterations){
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    for(i=0; i<sizeof(raw_buf); i++)
+        raw_buf[i] = i;
+
+    memset(&qmid, 0, sizeof(qmid));
+    qmid.qmi_fd = -1;
+    qmi_sig_history_init(&(qmid.sig_history), sig_windows,
+            QMI_SIG_MAX_WINDOWS, QMI_SIG_DEFAULT_EWMA_ALPHA);
+
+    printf("%-24s %10s %12s\n", "Benchmark", "Iterations", "ns/iteration");
+    qmid_bench_run("raw_cast", NULL, qmid_bench_raw_cast, iterations);
+    qmid_bench_run("raw_helpers", NULL, qmid_bench_raw_helpers, iterations);
+    qmid_bench_run("nas_sig_info", qmid_bench_sig_info, qmid_bench_nas,
+            iterations);
+    qmid_bench_run("nas_serving_system", qmid_bench_serving_system,
+            qmid_bench_nas, iterations);
+    qmid_bench_run("nas_sys_info", qmid_bench_sys_info, qmid_bench_nas,
+            iterations);
+    qmid_bench_run("nas_rf_band_info", qmid_bench_rf_band_info,
+            qmid_bench_nas, iterations);
+    qmid_bench_run("nas_rf_band_info_cast", qmid_bench_rf_band_info,
+            qmid_bench_nas_cast, iterations);
+
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "qmi_config.h"
+#include "qmi_nas.h"
+
+//Remove leading and trailing whitespace (in place)
+static char *qmi_config_trim(char *str){
+    char *end;
+
+    while(isspace((unsigned char) *str))
+        str++;
+
+    end = str + strlen(str);
+
+    while(end > str && isspace((unsigned char) *(end - 1)))
+        end--;
+
+    *end = '\0';
+    return str;
+}
+
+//Copy value into dst (of size len). Returns -1 if it does not fit
+static int qmi_config_copy(char *dst, const char *value, size_t len){
+    if(!strlen(value) || strlen(value) >= len)
+        return -1;
+
+    memcpy(dst, value, strlen(value) + 1);
+    return 0;
+}
+
+//Returns 0 if value is a number between min and max
+static int qmi_config_number(const char *value, long min, long max,
+        long *number){
+    char *end;
+
+    errno = 0;
+    *number = strtol(value, &end, 10);
+
+    if(errno || end == value || *end != '\0' || *number < min ||
+            *number > max)
+        return -1;
+
+    return 0;
+}
+
+int qmi_config_parse_band_pref(const char *value, uint64_t *mask){
+    char *end;
+
+    errno = 0;
+    *mask = strtoull(value, &end, 16);
+
+    if(errno || end == value || *end != '\0' || !*mask)
+        return -1;
+
+    return 0;
+}
+
+int qmi_config_parse_lte_bands(const char *value, uint64_t *mask){
+    const char *cur = value;
+    unsigned long band;
+    char *end;
+
+    *mask = 0;
+
+    while(1){
+        errno = 0;
+        band = strtoul(cur, &end, 10);
+
+        if(errno || end == cur || band < 1 || band > 64)
+            return -1;
+
+        *mask |= 1ULL << (band - 1);
+
+        if(*end == '\0')
+            break;
+        else if(*end != ',')
+            return -1;
+
+        cur = end + 1;
+    }
+
+    return 0;
+}
+
+static const char *qmi_config_set(struct qmi_config *config, const char *key,
+        const char *value){
+    long number;
+
+    if(!strcmp(key, "device")){
+        if(qmi_config_copy(config->dev_path, value, sizeof(config->dev_path)))
+            return "invalid device path";
+
+        config->present |= QMI_CONFIG_DEVICE;
+    } else if(!strcmp(key, "interface")){
+        if(qmi_config_copy(config->ifname, value, sizeof(config->ifname)))
+            return "invalid interface name";
+
+        config->present |= QMI_CONFIG_INTERFACE;
+    } else if(!strcmp(key, "apn")){
+        if(config->num_apns == QMID_MAX_PDNS)
+            return "too many APNs";
+
+        if(qmi_config_copy(config->apns[config->num_apns], value,
+                    sizeof(config->apns[0])))
+            return "invalid APN";
+
+        config->num_apns++;
+        config->present |= QMI_CONFIG_APN;
+    } else if(!strcmp(key, "pin")){
+        if(qmi_config_copy(config->pin, value, sizeof(config->pin)))
+            return "invalid PIN code";
+
+        config->present |= QMI_CONFIG_PIN;
+    } else if(!strcmp(key, "rat")){
+        if(!strcmp(value, "all"))
+            config->rat_mode_pref = QMI_NAS_RAT_MODE_PREF_ALL;
+        else if(!strcmp(value, "umts"))
+            config->rat_mode_pref = QMI_NAS_RAT_MODE_PREF_MIN;
+        else if(!strcmp(value, "lte"))
+            config->rat_mode_pref = QMI_NAS_RAT_MODE_PREF_LTE;
+        else
+            return "RAT must be all, umts or lte";
+
+        config->present |= QMI_CONFIG_RAT;
+    } else if(!strcmp(key, "band-pref")){
+        if(qmi_config_parse_band_pref(value, &(config->band_pref)))
+            return "band preference must be a hexadecimal mask";
+
+        config->present |= QMI_CONFIG_BAND_PREF;
+    } else if(!strcmp(key, "lte-bands")){
+        if(qmi_config_parse_lte_bands(value, &(config->lte_band_pref)))
+            return "LTE bands must be a list of bands 1 - 64";
+
+        config->present |= QMI_CONFIG_LTE_BANDS;
+    } else if(!strcmp(key, "probe")){
+        if(config->num_probe_targets == QMI_PROBE_MAX_TARGETS)
+            return "too many probe targets";
+
+        if(qmi_probe_parse_target(value,
+                    &(config->probe_targets[config->num_probe_targets])))
+            return "probe target must be an IP address";
+
+        config->num_probe_targets++;
+        config->present |= QMI_CONFIG_PROBE;
+    } else if(!strcmp(key, "probe-interval")){
+        if(qmi_config_number(value, 1, UINT16_MAX, &number))
+            return "invalid probe interval";
+
+        config->probe_interval = number;
+        config->present |= QMI_CONFIG_PROBE_INTERVAL;
+    } else if(!strcmp(key, "probe-failures")){
+        if(qmi_config_number(value, 1, UINT8_MAX, &number))
+            return "invalid number of probe failures";
+
+        config->probe_failures = number;
+        config->present |= QMI_CONFIG_PROBE_FAILURES;
+    } else{
+        return "unknown key";
+    }
+
+    return NULL;
+}
+
+int qmi_config_read(const char *path, struct qmi_config *config){
+    char line[QMI_CONFIG_MAX_LINE], *key, *value, *sep;
+    const char *error = NULL;
+    uint32_t line_num = 0;
+    FILE *fp;
+
+    memset(config, 0, sizeof(*config));
+
+    if((fp = fopen(path, "r")) == NULL){
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), fp) != NULL){
+        line_num++;
+
+        if(strchr(line, '\n') == NULL && !feof(fp)){
+            error = "line too long";
+            break;
+        }
+
+        key = qmi_config_trim(line);
+
+        if(*key == '\0' || *key == '#')
+            continue;
+
+        if((sep = strchr(key, '=')) == NULL){
+            error = "expected key = value";
+            break;
+        }
+
+        *sep = '\0';
+        key = qmi_config_trim(key);
+        value = qmi_config_trim(sep + 1);
+
+        if((error = qmi_config_set(config, key, value)) != NULL)
+            break;
+    }
+
+    fclose(fp);
+
+    if(error != NULL){
+        fprintf(stderr, "%s:%u: %s\n", path, line_num, error);
+        return -1;
+    }
+
+    return 0;
+}
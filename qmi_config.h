@@ -0,0 +1,59 @@
+#ifndef QMI_CONFIG_H
+#define QMI_CONFIG_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <net/if.h>
+
+#include "qmi_shared.h"
+#include "qmi_probe.h"
+
+//Config file, one "key = value" per line. Lines starting with # are comments.
+//Keys are the same as the long command line options. The file is read again
+//on SIGHUP, and only what changed is applied
+#define QMI_CONFIG_MAX_LINE     512
+
+//Settings present in a config file
+#define QMI_CONFIG_DEVICE       0x01
+#define QMI_CONFIG_INTERFACE    0x02
+#define QMI_CONFIG_APN          0x04
+#define QMI_CONFIG_PIN          0x08
+#define QMI_CONFIG_RAT          0x10
+#define QMI_CONFIG_PROBE        0x20
+#define QMI_CONFIG_PROBE_INTERVAL   0x40
+#define QMI_CONFIG_PROBE_FAILURES   0x80
+#define QMI_CONFIG_BAND_PREF        0x100
+#define QMI_CONFIG_LTE_BANDS        0x200
+
+struct qmi_config{
+    //QMI_CONFIG_*, settings that are not in the file keep their current
+    //value (for example from the command line)
+    uint16_t present;
+
+    char dev_path[PATH_MAX];
+    char ifname[IFNAMSIZ];
+    char apns[QMID_MAX_PDNS][QMID_MAX_LENGTH_APN + 1];
+    uint8_t num_apns;
+    char pin[QMID_MAX_LENGTH_PIN + 1];
+    //QMI_NAS_RAT_MODE_PREF_*
+    uint16_t rat_mode_pref;
+    //GSM/WCDMA band preference (QMI bits) and LTE bands (bit N-1 is band N)
+    uint64_t band_pref;
+    uint64_t lte_band_pref;
+
+    struct qmi_probe_target probe_targets[QMI_PROBE_MAX_TARGETS];
+    uint8_t num_probe_targets;
+    uint16_t probe_interval;
+    uint8_t probe_failures;
+};
+
+//Parse path into config. Errors are written to stderr (with line number).
+//Returns 0 on success, -1 otherwise
+int qmi_config_read(const char *path, struct qmi_config *config);
+
+//Parse a GSM/WCDMA band preference (hex mask) or a comma separated list of
+//E-UTRA bands into a mask, also used for the command line. Returns 0 on
+//success, -1 if value is invalid or empty
+int qmi_config_parse_band_pref(const char *value, uint64_t *mask);
+int qmi_config_parse_lte_bands(const char *value, uint64_t *mask);
+#endif
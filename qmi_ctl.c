@@ -12,16 +12,28 @@
 #include "qmi_nas.h"
 #include "qmi_wds.h"
 #include "qmi_dms.h"
+#include "qmi_wda.h"
+
+//Requests without TLVs
+static struct qmi_req_tmpl qmi_ctl_sync_tmpl;
+
+uint8_t qmi_ctl_next_transaction_id(struct qmi_device *qmid){
+    uint8_t transaction_id = qmid->ctl_transaction_id;
 
-static inline ssize_t qmi_ctl_write(struct qmi_device *qmid, uint8_t *buf,
-        ssize_t len){
-    //TODO: Only do this if request is sucessful?
     qmid->ctl_transaction_id = (qmid->ctl_transaction_id + 1) % UINT8_MAX;
 
     //According to spec, transaction id must be non-zero
     if(!qmid->ctl_transaction_id)
         qmid->ctl_transaction_id = 1;
 
+    return transaction_id;
+}
+
+static inline ssize_t qmi_ctl_write(struct qmi_device *qmid, uint8_t *buf,
+        ssize_t len){
+    //TODO: Only do this if request is sucessful?
+    qmi_ctl_next_transaction_id(qmid);
+
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_3){
         QMID_DEBUG_PRINT(stderr, "Will send (CTL):\n");
         parse_qmi(buf);
@@ -33,7 +45,7 @@ static inline ssize_t qmi_ctl_write(struct qmi_device *qmid, uint8_t *buf,
 
 ssize_t qmi_ctl_update_cid(struct qmi_device *qmid, uint8_t service,
         bool release, uint8_t cid){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
+    uint8_t *buf = qmi_helpers_get_buf();
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
     uint16_t message_id = release ? QMI_CTL_RELEASE_CID : QMI_CTL_GET_CID;
     //TODO: Perhaps make this nicer, sinceit is only used in one case
@@ -67,29 +79,76 @@ ssize_t qmi_ctl_update_cid(struct qmi_device *qmid, uint8_t service,
     return retval;
 }
 
+//Only replies to the releases sent by qmid end the release phase, proxy
+//clients share the transaction ids
+static void qmi_ctl_release_cid(struct qmi_device *qmid, uint8_t service,
+        uint8_t cid){
+    uint8_t transaction_id = qmid->ctl_transaction_id;
+
+    if(qmid->ctl_pending_releases == QMID_MAX_CIDS ||
+            qmi_ctl_update_cid(qmid, service, true, cid) <= 0)
+        return;
+
+    qmid->ctl_release_tids[qmid->ctl_pending_releases++] = transaction_id;
+}
+
+uint8_t qmi_ctl_release_cids(struct qmi_device *qmid){
+    uint8_t i;
+
+    qmid->ctl_pending_releases = 0;
+
+    //Nothing to release before the modem has been synced, and SYNC (which is
+    //sent on startup) releases any CID left behind
+    if(qmid->ctl_state != CTL_SYNCED){
+        qmid->ctl_state = CTL_RELEASING;
+        return 0;
+    }
+
+    if(qmid->nas_id)
+        qmi_ctl_release_cid(qmid, QMI_SERVICE_NAS, qmid->nas_id);
+
+    for(i=0; i<qmid->wds_num_sessions; i++)
+        if(qmid->wds_sessions[i].wds_id)
+            qmi_ctl_release_cid(qmid, QMI_SERVICE_WDS,
+                    qmid->wds_sessions[i].wds_id);
+
+    if(qmid->dms_id)
+        qmi_ctl_release_cid(qmid, QMI_SERVICE_DMS, qmid->dms_id);
+
+    if(qmid->wda_id)
+        qmi_ctl_release_cid(qmid, QMI_SERVICE_WDA, qmid->wda_id);
+
+    qmid->ctl_state = CTL_RELEASING;
+
+    return qmid->ctl_pending_releases;
+}
+
 ssize_t qmi_ctl_send_sync(struct qmi_device *qmid){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
-    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
+    uint8_t *buf;
+    qmux_hdr_t *qmux_hdr;
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
         QMID_DEBUG_PRINT(stderr, "Seding sync request\n");
 
-    create_qmi_request(buf, QMI_SERVICE_CTL, 0, qmid->ctl_transaction_id,
-            QMI_CTL_SYNC);
+    buf = qmi_helpers_use_tmpl(&qmi_ctl_sync_tmpl, QMI_SERVICE_CTL, 0,
+            qmid->ctl_transaction_id, QMI_CTL_SYNC);
+    qmux_hdr = (qmux_hdr_t*) buf;
 
     return qmi_ctl_write(qmid, buf, le16toh(qmux_hdr->length));
 }
 
 ssize_t qmi_ctl_send_data_format(struct qmi_device *qmid){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
+    uint8_t *buf = qmi_helpers_get_buf();
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
 
-	//Values fetched from windows_telenor_qmi
-	uint8_t format = 0;
-	uint16_t proto = htole16(0x0001);
+    //I never want the QoS header, only the link protocol is negotiated
+    uint8_t format = QMI_CTL_DATA_FORMAT_NO_QOS;
+    uint16_t proto = htole16(qmid->link_proto);
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
-        QMID_DEBUG_PRINT(stderr, "Seding set data format request\n");
+        QMID_DEBUG_PRINT(stderr, "Seding set data format request (%s)\n",
+                qmid->link_proto == QMI_CTL_LINK_PROTO_RAW_IP ? "raw-ip" :
+                "802.3");
 
     create_qmi_request(buf, QMI_SERVICE_CTL, 0, qmid->ctl_transaction_id,
             QMI_CTL_SET_DATA_FORMAT);
@@ -104,17 +163,18 @@ static uint8_t qmi_ctl_handle_cid_reply(struct qmi_device *qmid){
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
     qmi_hdr_ctl_t *qmi_hdr = (qmi_hdr_ctl_t*) (qmux_hdr + 1);
     qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
-    uint16_t *result = NULL;
-    uint8_t service = 0, cid = 0;
+    uint16_t result;
+    uint8_t service = 0, cid = 0, i;
+    struct qmi_wds_session *wds = NULL;
 
     //A CID reply has two TLVs. First is always the result of the operation
-    result = (uint16_t*) (tlv+1);
+    result = qmi_helpers_get_result(tlv);
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
-        QMID_DEBUG_PRINT(stderr, "Received CID get/release reply\n");
+        QMID_DEBUG_PRINT(stderr, "Received CID get reply\n");
 
     //TODO: Improve logic so that I know which service this is?
-    if(le16toh(*result) == QMI_RESULT_FAILURE){
+    if(result == QMI_RESULT_FAILURE){
         if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
             QMID_DEBUG_PRINT(stderr, "Failed to get a CID for service %x\n",
                     service);
@@ -136,8 +196,24 @@ static uint8_t qmi_ctl_handle_cid_reply(struct qmi_device *qmid){
             qmid->ctl_num_cids++;
             break;
         case QMI_SERVICE_WDS:
-            qmid->wds_id = cid;
-            qmid->wds_state = WDS_GOT_CID;
+            //Replies are not tied to a session, so give the CID to the first
+            //session that does not have one yet
+            for(i=0; i<qmid->wds_num_sessions; i++){
+                if(!qmid->wds_sessions[i].wds_id){
+                    wds = &(qmid->wds_sessions[i]);
+                    break;
+                }
+            }
+
+            if(wds == NULL){
+                if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+                    QMID_DEBUG_PRINT(stderr, "No WDS session waiting for "
+                            "CID\n");
+                break;
+            }
+
+            wds->wds_id = cid;
+            wds->wds_state = WDS_GOT_CID;
             qmid->ctl_num_cids++;
             break;
         case QMI_SERVICE_NAS:
@@ -145,6 +221,11 @@ static uint8_t qmi_ctl_handle_cid_reply(struct qmi_device *qmid){
             qmid->nas_state = NAS_GOT_CID;
             qmid->ctl_num_cids++;
             break;
+        case QMI_SERVICE_WDA:
+            qmid->wda_id = cid;
+            qmid->wda_state = WDA_GOT_CID;
+            qmid->ctl_num_cids++;
+            break;
         default:
             if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
                 QMID_DEBUG_PRINT(stderr, "CID for service not handled by "
@@ -153,15 +234,20 @@ static uint8_t qmi_ctl_handle_cid_reply(struct qmi_device *qmid){
     }
 
     //Only start sending when I have received all CIDs
-    if(qmid->ctl_num_cids == QMID_NUM_SERVICES){
+    if(qmid->ctl_num_cids == qmi_ctl_num_cids(qmid)){
         //Only send DMS messages if I have a pin code to try
         //TODO: Base DMS CID request also on if PIN code is set
         if(qmid->pin_code)
             qmi_dms_send(qmid);
         else
             qmid->pin_unlocked = 1;
+
+        if(qmid->wda_id)
+            qmi_wda_send(qmid);
         
-        qmi_wds_send(qmid);
+        for(i=0; i<qmid->wds_num_sessions; i++)
+            qmi_wds_send(qmid, &(qmid->wds_sessions[i]));
+
         qmi_nas_send(qmid);
     }
 
@@ -173,7 +259,7 @@ static uint8_t qmi_ctl_handle_sync_reply(struct qmi_device *qmid){
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
     qmi_hdr_ctl_t *qmi_hdr = (qmi_hdr_ctl_t*) (qmux_hdr + 1);
     qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
-    uint16_t result = *((uint16_t*) (tlv+1));
+    uint16_t result = qmi_helpers_get_result(tlv);
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
         QMID_DEBUG_PRINT(stderr, "Received SYNC reply\n");
@@ -181,14 +267,14 @@ static uint8_t qmi_ctl_handle_sync_reply(struct qmi_device *qmid){
     //All the "rouge" SYNC messages seem to have transaction_id == 0. Use that
     //for now, see if it is consistent or not. I know that I only send one sync
     //message with ID 1, so ignore all SYNC messages that does not have this ID
-    if(qmi_hdr->transaction_id != 1 || qmid->ctl_state == CTL_SYNCED){
+    if(qmi_hdr->transaction_id != 1 || qmid->ctl_state != CTL_NOT_SYNCED){
         if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
             QMID_DEBUG_PRINT(stderr, "Ignoring sync packet from modem. %u %u\n",
                     qmi_hdr->transaction_id, qmid->ctl_state);
         return QMI_MSG_IGNORE;
     }
 
-    if(le16toh(result) == QMI_RESULT_FAILURE){
+    if(result == QMI_RESULT_FAILURE){
         if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
             QMID_DEBUG_PRINT(stderr, "Sync operation failed\n");
         return QMI_MSG_FAILURE;
@@ -202,38 +288,140 @@ static uint8_t qmi_ctl_handle_sync_reply(struct qmi_device *qmid){
     }
 }
 
+//Raw-IP is only used if both the modem and the driver agrees, otherwise fall
+//back to 802.3 (which is what modems and qmi_wwan default to)
+static uint8_t qmi_ctl_data_format_fallback(struct qmi_device *qmid){
+    if(qmid->link_proto == QMI_CTL_LINK_PROTO_802_3)
+        return QMI_MSG_FAILURE;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Raw-IP not supported, falling back to "
+                "802.3\n");
+
+    qmid->link_proto = QMI_CTL_LINK_PROTO_802_3;
+
+    if(qmi_ctl_send_data_format(qmid) <= 0)
+        return QMI_MSG_FAILURE;
+
+    return QMI_MSG_SUCCESS;
+}
+
 static uint8_t qmi_ctl_handle_data_format(struct qmi_device *qmid){
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
     qmi_hdr_ctl_t *qmi_hdr = (qmi_hdr_ctl_t*) (qmux_hdr + 1);
     qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
-    uint16_t result = *((uint16_t*) (tlv+1));
+    uint16_t tlv_length = le16toh(qmi_hdr->length), i = 0;
+    uint16_t result = qmi_helpers_get_result(tlv);
+    uint16_t link_proto = QMI_CTL_LINK_PROTO_802_3;
+
+    if(result == QMI_RESULT_FAILURE){
+        if(qmi_ctl_data_format_fallback(qmid) == QMI_MSG_SUCCESS)
+            return QMI_MSG_SUCCESS;
 
-	if(le16toh(result) == QMI_RESULT_FAILURE){
+        //Some modems does not support setting the data format at all. They
+        //will use 802.3, so there is no reason to give up
         if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
-            QMID_DEBUG_PRINT(stderr, "Sync operation failed\n");
-        return QMI_MSG_FAILURE;
+            QMID_DEBUG_PRINT(stderr, "Could not set data format, assuming "
+                    "802.3\n");
+    } else {
+        //Remove first tlv
+        tlv_length = tlv_length - sizeof(qmi_tlv_t) - le16toh(tlv->length);
+        tlv = (qmi_tlv_t*) (((uint8_t*) (tlv+1)) + le16toh(tlv->length));
+
+        while(i<tlv_length){
+            if(tlv->type == QMI_CTL_TLV_DATA_PROTO){
+                link_proto = qmi_helpers_get_le16(tlv+1);
+                break;
+            }
+
+            i += sizeof(qmi_tlv_t) + le16toh(tlv->length);
+
+            if(i==tlv_length)
+                break;
+            else
+                tlv = (qmi_tlv_t*) (((uint8_t*) (tlv+1)) +
+                        le16toh(tlv->length));
+        }
+    }
+
+    //The kernel must frame packets the same way as the modem. A driver without
+    //raw-ip support can't be used with a raw-ip modem
+    if(qmi_helpers_set_raw_ip(qmid->ifname,
+                link_proto == QMI_CTL_LINK_PROTO_RAW_IP)){
+        if(link_proto == QMI_CTL_LINK_PROTO_RAW_IP &&
+                qmi_ctl_data_format_fallback(qmid) == QMI_MSG_SUCCESS)
+            return QMI_MSG_SUCCESS;
+
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+            QMID_DEBUG_PRINT(stderr, "Could not update raw_ip of %s\n",
+                    qmid->ifname);
     }
 
-	tlv = (qmi_tlv_t*) (((uint8_t*) (tlv+1)) + le16toh(tlv->length));
-	result = *((uint16_t*) (tlv+1));
+    qmid->link_proto = link_proto;
 
-	if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
-		QMID_DEBUG_PRINT(stderr, "Data format set to %x\n", le16toh(result));
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Data format set to %s\n",
+                link_proto == QMI_CTL_LINK_PROTO_RAW_IP ? "raw-ip" : "802.3");
+
+    return qmi_ctl_request_cid(qmid);
+}
 
-	return qmi_ctl_request_cid(qmid);
+uint8_t qmi_ctl_num_cids(struct qmi_device *qmid){
+    //One CID for each service, except WDS which needs one per session. WDA
+    //is only used for aggregation
+    return QMID_NUM_SERVICES - 1 + qmid->wds_num_sessions +
+        (qmi_wda_needed(qmid) ? 1 : 0);
 }
 
 uint8_t qmi_ctl_request_cid(struct qmi_device *qmid){
+    uint8_t i;
+
     //TODO: Add to timeout
     if(qmi_ctl_update_cid(qmid, QMI_SERVICE_NAS, false, 0) <= 0)
         return QMI_MSG_FAILURE;
 
-    if(qmi_ctl_update_cid(qmid, QMI_SERVICE_WDS, false, 0) <= 0)
-        return QMI_MSG_FAILURE;
+    for(i=0; i<qmid->wds_num_sessions; i++)
+        if(qmi_ctl_update_cid(qmid, QMI_SERVICE_WDS, false, 0) <= 0)
+            return QMI_MSG_FAILURE;
 
     if(qmi_ctl_update_cid(qmid, QMI_SERVICE_DMS, false, 0) <= 0)
         return QMI_MSG_FAILURE;
 
+    if(qmi_wda_needed(qmid) &&
+            qmi_ctl_update_cid(qmid, QMI_SERVICE_WDA, false, 0) <= 0)
+        return QMI_MSG_FAILURE;
+
+    return QMI_MSG_SUCCESS;
+}
+
+//Failing to release a CID is not critical, it is released by the SYNC sent
+//next time qmid starts
+static uint8_t qmi_ctl_handle_release_reply(struct qmi_device *qmid){
+    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
+    qmi_hdr_ctl_t *qmi_hdr = (qmi_hdr_ctl_t*) (qmux_hdr + 1);
+    qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
+    uint16_t result = qmi_helpers_get_result(tlv);
+    uint8_t i;
+
+    if(qmid->ctl_state != CTL_RELEASING)
+        return QMI_MSG_IGNORE;
+
+    for(i=0; i<qmid->ctl_pending_releases; i++)
+        if(qmid->ctl_release_tids[i] == qmi_hdr->transaction_id)
+            break;
+
+    //Late, duplicate or not sent by qmid
+    if(i == qmid->ctl_pending_releases)
+        return QMI_MSG_IGNORE;
+
+    qmid->ctl_release_tids[i] =
+        qmid->ctl_release_tids[--qmid->ctl_pending_releases];
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+        QMID_DEBUG_PRINT(stderr, "Received CID release reply (%s), %u "
+                "pending\n", result == QMI_RESULT_FAILURE ? "failure" :
+                "success", qmid->ctl_pending_releases);
+
     return QMI_MSG_SUCCESS;
 }
 
@@ -243,10 +431,12 @@ uint8_t qmi_ctl_handle_msg(struct qmi_device *qmid){
     uint8_t retval;
 
     switch(le16toh(qmi_hdr->message_id)){
-        case QMI_CTL_GET_CID:
         case QMI_CTL_RELEASE_CID:
+            retval = qmi_ctl_handle_release_reply(qmid);
+            break;
+        case QMI_CTL_GET_CID:
             //Do not set any values unless I am synced
-            if(qmid->ctl_state == CTL_NOT_SYNCED){
+            if(qmid->ctl_state != CTL_SYNCED){
                 retval = QMI_MSG_IGNORE;
                 break;
             }
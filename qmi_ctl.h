@@ -7,6 +7,7 @@
 #include <stdbool.h>
 
 //CTL message types
+#define QMI_CTL_GET_VERSION_INFO    0x0021
 #define QMI_CTL_GET_CID         0x0022
 #define QMI_CTL_RELEASE_CID     0x0023
 #define QMI_CTL_SET_DATA_FORMAT	0x0026
@@ -19,6 +20,11 @@
 #define	QMI_CTL_TLV_DATA_FORMAT	0x01
 #define QMI_CTL_TLV_DATA_PROTO	0x10
 
+//Data format values
+#define QMI_CTL_DATA_FORMAT_NO_QOS      0x00
+#define QMI_CTL_LINK_PROTO_802_3        0x0001
+#define QMI_CTL_LINK_PROTO_RAW_IP       0x0002
+
 struct qmi_device;
 
 //Method for either releasing or updating a CID. Propagtes return from write()
@@ -34,5 +40,19 @@ ssize_t qmi_ctl_send_sync(struct qmi_device *qmid);
 
 uint8_t qmi_ctl_request_cid(struct qmi_device *qmid);
 
+//Release all CIDs and move to CTL_RELEASING. Returns the number of releases
+//sent, qmid->ctl_pending_releases counts down as replies arrive
+uint8_t qmi_ctl_release_cids(struct qmi_device *qmid);
+
+//Request the link protocol stored in qmid->link_proto
+ssize_t qmi_ctl_send_data_format(struct qmi_device *qmid);
+
+//Return the transaction id to use for the next CTL request and advance it.
+//Everything sent on CTL (also by proxy clients) must use these ids
+uint8_t qmi_ctl_next_transaction_id(struct qmi_device *qmid);
+
+//Number of CIDs qmid needs before it can start using the services
+uint8_t qmi_ctl_num_cids(struct qmi_device *qmid);
+
 //TODO: Consider implementing a generic send function? Or is it not needed?
 #endif
@@ -6,11 +6,23 @@
 #include <net/if.h>
 
 #include "qmi_shared.h"
+#include "qmi_sig_history.h"
+#include "qmi_probe.h"
+#include "qmi_config.h"
+#include "qmi_hooks.h"
+#include "qmi_lkg.h"
+#include "qmi_policy.h"
+#include "qmi_proxy.h"
+#include "qmi_status.h"
+#include "qmi_events.h"
 
 //Different sates for each service type
 enum{
     CTL_NOT_SYNCED = 0,
     CTL_SYNCED,
+    //Shutting down, waiting for CIDs to be released. Only CTL messages are
+    //handled in this state
+    CTL_RELEASING,
 };
 
 //NAS state machine
@@ -24,6 +36,10 @@ enum{
     NAS_SET_SYSTEM,
     //Indication request is sent
     NAS_IND_REQ,
+    //Register for signal indications (optional, not all modems support them)
+    NAS_SIG_IND_REQ,
+    //Set the levels at which signal indications are sent
+    NAS_SIG_CONFIG,
     //Indication request received, so query system information to check for
     //attached state
     NAS_SYS_INFO_QUERY,
@@ -36,6 +52,10 @@ enum{
     WDS_INIT = 0,
     WDS_GOT_CID,
     WDS_RESET,
+    //Bind the client to the QMAP mux ID of the PDN (only when multiplexing)
+    WDS_BIND_MUX,
+    //Bind the client to the IP family of the session
+    WDS_IP_FAMILY,
     WDS_IND_REQ,
     //Ready to start connection
     WDS_DISCONNECTED,
@@ -56,6 +76,14 @@ enum{
     DMS_IDLE
 };
 
+//WDA state machine (only used when QMAP is enabled)
+enum{
+    WDA_INIT = 0,
+    WDA_GOT_CID,
+    WDA_SET_FORMAT,
+    WDA_IDLE
+};
+
 //The different values for the current service
 enum{
     NO_SERVICE = 0,
@@ -68,24 +96,154 @@ typedef uint8_t ctl_state_t;
 typedef uint8_t nas_state_t;
 typedef uint8_t wds_state_t;
 typedef uint8_t dms_state_t;
+typedef uint8_t wda_state_t;
 typedef uint8_t cur_service_t;
 typedef uint8_t cur_subservice_t;
 
+//Which IP families the user wants connections for. Dual-stack is realised as
+//one WDS client (and one connection) per family
+enum{
+    QMID_IP_MODE_IPV4 = 0,
+    QMID_IP_MODE_IPV6,
+    QMID_IP_MODE_DUAL,
+};
+
+//QMAP aggregation settings, both what is requested and what the modem accepted
+//(QMI_WDA_AGG_PROTO_* and limits)
+struct qmid_qmap_config{
+    uint32_t dl_proto;
+    uint32_t ul_proto;
+    uint32_t dl_max_datagrams;
+    uint32_t dl_max_size;
+    uint32_t ul_max_datagrams;
+    uint32_t ul_max_size;
+};
+
+//Addressing the modem has assigned to a connection. Addresses are stored in
+//network byte order, IPv4 only uses the first four bytes
+struct qmid_ip_config{
+    uint8_t addr[16];
+    uint8_t gateway[16];
+    uint8_t dns[QMID_MAX_DNS][16];
+    uint8_t prefix_len;
+    uint8_t has_gateway;
+    uint8_t num_dns;
+    uint32_t mtu;
+};
+
+//One carrier the modem is currently using. Bandwidth is QMI_NAS_BANDWIDTH_*,
+//or QMI_NAS_BANDWIDTH_UNKNOWN if the modem does not report it
+struct qmid_rf_band{
+    uint8_t radio_if;
+    uint8_t bandwidth;
+    uint16_t band;
+    uint32_t channel;
+};
+
+//A combination of carriers (first is primary) and when it became active. Dwell
+//time is only set once the combination has been replaced
+struct qmid_rf_band_set{
+    time_t start;
+    uint32_t dwell;
+    uint8_t num_bands;
+    struct qmid_rf_band bands[QMID_MAX_RF_BANDS];
+};
+
+//Registration state as reported by SERVING_SYSTEM (QMI_GEN_NAS_REG_STATE_*)
+struct qmid_serving_system{
+    //A SERVING_SYSTEM response or indication has been received, and it
+    //contained a PS attach state. Service is not gated on what is not known
+    uint8_t known;
+    uint8_t ps_attach_known;
+    uint8_t reg_state;
+    uint8_t cs_attached;
+    uint8_t ps_attached;
+    uint8_t roaming;
+    uint16_t mcc;
+    uint16_t mnc;
+    //MNC has three digits (001 is not 01)
+    uint8_t mnc_3digit;
+    char plmn_desc[QMID_MAX_LENGTH_PLMN + 1];
+};
+
+//Each WDS client has its own connection and, thus, its own state machine
+struct qmi_wds_session{
+    uint8_t wds_id;
+    wds_state_t wds_state;
+    uint16_t wds_transaction_id;
+    time_t wds_sent_time;
+
+    //QMI_WDS_IP_FAMILY_* value this client is bound to
+    uint8_t ip_family;
+
+    //The PDN this session belongs to. The families of a PDN share APN, mux ID
+    //and network interface. Mux ID is 0 when QMAP is not used, then the
+    //network interface is the one belonging to the device
+    uint8_t pdn;
+    uint8_t mux_id;
+    char *apn_name;
+    char ifname[IFNAMSIZ];
+
+    //Handle used to stop connection
+    uint32_t pkt_data_handle;
+
+    //Runtime settings and if they have been written to the interface
+    struct qmid_ip_config ip_cfg;
+    uint8_t ip_cfg_applied;
+
+    //If the connected hook has been run (and disconnected is due), and the
+    //last data bearer (QMI_WDS_ER_RAT_*)
+    uint8_t hook_connected;
+    uint32_t bearer_rat_mask;
+};
+
 struct qmi_device{
     char *dev_path;
-    char *apn_name;
+    //Config file (optional), read again on SIGHUP. Strings from the file are
+    //stored in config
+    const char *config_path;
+    struct qmi_config config;
+    //Name of the device node in uevents (cdc-wdmX)
+    char dev_name[QMID_MAX_LENGTH_DEV_NAME];
+    //USB interface of the device in sysfs (DEVPATH), to recognise the uevents
+    //of its network interface. Empty if not known
+    char dev_parent[PATH_MAX];
+    char *apn_names[QMID_MAX_PDNS];
+    uint8_t num_pdns;
     char *pin_code;
     char ifname[IFNAMSIZ];
 
     int32_t qmi_fd;
+    //Used to configure ifname
+    int32_t rtnl_fd;
+    //SIGTERM, SIGINT, SIGHUP and SIGUSR1 are read from here
+    int32_t signal_fd;
+    //Kernel uevents, to detect that the device is removed or added. -1 if
+    //not available
+    int32_t uevent_fd;
+    //Addressing is left to DHCP
+    uint8_t use_dhcp;
 
     //Buffer has to be persistent accross calls to recv
     uint16_t qmux_progress;
     uint16_t cur_qmux_length;
     uint16_t rat_mode_pref;
+    //Configured GSM/WCDMA and LTE band preference, 0 leaves the modem's
+    //preference alone. Set when the preference should be read back from the
+    //modem and compared
+    uint64_t band_pref;
+    uint64_t lte_band_pref;
+    uint8_t sys_sel_verify;
+    //Link protocol (QMI_CTL_LINK_PROTO_*) the user wants, and the one in use.
+    //The one in use starts as the requested one every time the device is
+    //opened, and is replaced by the one accepted by the modem
+    uint16_t link_proto_req;
+    uint16_t link_proto;
     uint8_t buf[QMI_DEFAULT_BUF_SIZE];
     uint8_t pin_unlocked;
     uint8_t umts_locked;
+    uint8_t ip_mode;
+    uint8_t qmap_enabled;
 
     //Service is main service (GSM, UMTS, LTE)
     //Subservice is the type of connection, will only really matter for UMTS
@@ -100,24 +258,62 @@ struct qmi_device{
     uint8_t ctl_num_cids;
     uint8_t ctl_transaction_id;
     ctl_state_t ctl_state;
+    //RELEASE_CID requests without a reply (CTL_RELEASING), and their
+    //transaction ids
+    uint8_t ctl_pending_releases;
+    uint8_t ctl_release_tids[QMID_MAX_CIDS];
 
     uint8_t nas_id;
     nas_state_t nas_state;
     uint16_t nas_transaction_id;
     time_t nas_sent_time;
+    //Signal changes are reported by SIG_INFO_IND, no need to poll as often
+    uint8_t nas_sig_ind;
+    //Signal quality reported by SIG_INFO
+    struct qmi_sig_history sig_history;
+    struct qmid_serving_system serving_system;
+    //Current band combination and the previous ones (ring buffer)
+    struct qmid_rf_band_set rf_bands;
+    struct qmid_rf_band_set rf_band_history[QMID_RF_BAND_HISTORY];
+    uint8_t rf_band_history_idx;
+    uint8_t rf_band_history_len;
+    //Last-known-good system and the acquisition bias towards it
+    struct qmi_lkg lkg;
+    //LTE/UMTS selection from signal and throughput
+    struct qmi_policy policy;
+    //Other programs using the device through qmid
+    struct qmi_proxy proxy;
+    //Published state for monitoring agents
+    struct qmi_status status;
+    //Stream of state changes to subscribers
+    struct qmi_events events;
 
-    uint8_t wds_id;
-    wds_state_t wds_state;
-    uint16_t wds_transaction_id;
-    time_t wds_sent_time;
+    uint8_t wds_num_sessions;
+    struct qmi_wds_session wds_sessions[QMID_MAX_WDS_SESSIONS];
 
     uint8_t dms_id;
     dms_state_t dms_state;
     uint16_t dms_transaction_id;
     time_t dms_sent_time;
 
-    //Handle used to stop connection
-    uint32_t pkt_data_handle;
+    uint8_t wda_id;
+    wda_state_t wda_state;
+    uint16_t wda_transaction_id;
+    time_t wda_sent_time;
+    struct qmid_qmap_config qmap_req;
+    struct qmid_qmap_config qmap;
+
+    //Data path liveness
+    struct qmi_probe probe;
+    //User scripts run on events
+    struct qmi_hooks hooks;
+
+    //When the state machines were last polled. Timer wakeups are counted per
+    //hour, to see what the polling costs
+    time_t poll_time;
+    time_t wakeup_hour_start;
+    uint32_t wakeups;
+    uint32_t wakeups_last_hour;
 };
 
 #endif
@@ -7,9 +7,12 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/signalfd.h>
+#include <errno.h>
 #include <unistd.h>
 #include <time.h>
 #include <getopt.h>
+#include <limits.h>
 
 #include "qmi_dialer.h"
 #include "qmi_device.h"
@@ -18,72 +21,323 @@
 #include "qmi_wds.h"
 #include "qmi_dms.h"
 #include "qmi_nas.h"
+#include "qmi_wda.h"
 #include "qmi_helpers.h"
+#include "qmi_netlink.h"
+#include "qmi_probe.h"
+#include "qmi_config.h"
+#include "qmi_proxy.h"
+#include "qmi_status.h"
+#include "qmi_events.h"
+
+//Max number of events handled per epoll_wait()
+#define QMID_MAX_EVENTS 4
 
-//Define this variable globally (within scope of this file), so that I can
-//access it from the signal handler
 static struct qmi_device qmid;
 
-static void qmi_cleanup(){
-    //Disconnect connection (if any)
-    //Beware that some modems, for example MF821D, seems to return NoEffect here
-    if(qmid.pkt_data_handle){
-        qmid.cur_service = NO_SERVICE;
-        //qmi_wds_update_connect(&qmid);
-        qmi_wds_disconnect(&qmid);
+//Set by SIGTERM/SIGINT or on critical errors. The event loop then releases
+//the CIDs and returns qmid_exit_code
+static uint8_t qmid_stop;
+static int qmid_exit_code = EXIT_SUCCESS;
+
+static void qmid_request_stop(int exit_code){
+    qmid_exit_code = exit_code;
+    qmid_stop = 1;
+}
+
+//Signals are blocked and read from a signalfd in the event loop, so that they
+//never interrupt a read or write and are handled as any other event
+static int32_t qmid_open_signalfd(){
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGCHLD);
+
+    if(sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        return -1;
+
+    return signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+//Signal is stable when the shortest window has a few samples and they are
+//within a small range. RSRP is only reported for LTE
+static uint8_t qmid_signal_stable(struct qmi_device *qmid){
+    struct qmi_sig_stats stats;
+    uint8_t metric = qmid->cur_service == SERVICE_LTE ? QMI_SIG_RSRP :
+        QMI_SIG_RSSI;
+
+    if(!qmi_sig_history_get(&(qmid->sig_history), metric, 0, &stats))
+        return 0;
+
+    return stats.count >= QMID_POLL_STABLE_SAMPLES &&
+        stats.max - stats.min <= QMID_POLL_STABLE_RANGE;
+}
+
+//Seconds between polls in the current state. Polling is aggressive while
+//clients are configured and connections established (replies or retries are
+//waited for), and backs off once every session is connected
+static uint16_t qmid_poll_interval(struct qmi_device *qmid){
+    struct qmi_wds_session *wds;
+    uint8_t i, connected = 1;
+
+    if(qmid->qmi_fd == -1 || qmid->ctl_state != CTL_SYNCED ||
+            qmid->ctl_num_cids != qmi_ctl_num_cids(qmid) ||
+            qmid->nas_state != NAS_IDLE ||
+            (qmid->wda_id && qmid->wda_state != WDA_IDLE))
+        return QMID_POLL_SETUP_SEC;
+
+    for(i=0; i<qmid->wds_num_sessions; i++){
+        wds = &(qmid->wds_sessions[i]);
+
+        if(wds->wds_state < WDS_DISCONNECTED)
+            return QMID_POLL_SETUP_SEC;
+
+        if(wds->wds_state != WDS_CONNECTED)
+            connected = 0;
     }
 
-    //Release all CID. It is nice to be important, but more important to be nice
-    if(qmid.nas_id)
-        qmi_ctl_update_cid(&qmid, QMI_SERVICE_NAS, true, qmid.nas_id);
+    //Service changes are reported by indications, but the acquisition bias
+    //has a deadline
+    if(!qmid->cur_service)
+        return qmid->lkg.state == QMI_LKG_QUERY || qmid->lkg.state ==
+            QMI_LKG_BIASED ? QMID_POLL_SETUP_SEC : QMID_POLL_NO_SERVICE_SEC;
+
+    if(!connected)
+        return QMID_POLL_SETUP_SEC;
 
-    if(qmid.wds_id)
-        qmi_ctl_update_cid(&qmid, QMI_SERVICE_WDS, true, qmid.wds_id);
+    if(!qmid_signal_stable(qmid))
+        return QMID_POLL_CONNECTED_SEC;
 
-    if(qmid.dms_id)
-        qmi_ctl_update_cid(&qmid, QMI_SERVICE_DMS, true, qmid.dms_id);
+    return qmid->nas_sig_ind ? QMID_POLL_IND_ONLY_SEC : QMID_POLL_STABLE_SEC;
+}
 
-    //Make sure all the messages are sent before exiting application (and
-    //closing file descriptor)
-    //syncfs(qmid.qmi_fd);
-    //OpenWRT (uclibc?) does not have synfs
-    sync();
+static void qmid_dump_state(struct qmi_device *qmid){
+    QMID_DEBUG_PRINT(stderr, "Device %s (%s), CTL state %u, %u CIDs\n",
+            qmid->dev_path, qmid->ifname, qmid->ctl_state,
+            qmid->ctl_num_cids);
+    qmi_nas_print_status(qmid);
+    qmi_wds_print_status(qmid);
+    qmi_sig_history_print(&(qmid->sig_history));
+    qmi_nas_print_rf_bands(qmid);
+    qmi_lkg_print(&(qmid->lkg));
+    qmi_policy_print(&(qmid->policy));
+    qmi_proxy_print(&(qmid->proxy));
+    qmi_events_print(&(qmid->events));
+    qmi_probe_print(&(qmid->probe));
+    qmi_hooks_print(&(qmid->hooks));
+    QMID_DEBUG_PRINT(stderr, "Polling every %u s. %u timer wakeups this hour, "
+            "%u the last hour\n", qmid_poll_interval(qmid), qmid->wakeups,
+            qmid->wakeups_last_hour);
 }
 
-static void qmi_signal_handler(int signum){
-    qmi_cleanup();
-    exit(EXIT_SUCCESS);
+//Disconnect connections (if any) and release all CIDs. It is nice to be
+//important, but more important to be nice. The replies are handled by the
+//event loop, CIDs that are never released slow down the next start
+static void qmid_start_shutdown(struct qmi_device *qmid){
+    //Beware that some modems, for example MF821D, seems to return NoEffect here
+    qmid->cur_service = NO_SERVICE;
+    qmi_probe_stop(&(qmid->probe));
+    qmi_wds_disconnect(qmid);
+    //Before qmid's own releases, they are counted by CTL
+    qmi_proxy_disconnect_clients(qmid);
+    qmi_ctl_release_cids(qmid);
 }
 
 static int32_t qmid_open_modem(struct qmi_device *qmid){
     //This is not nice, add proper processing of arguments later
-    if((qmid->qmi_fd = open(qmid->dev_path, O_RDWR)) == -1)
+    if((qmid->qmi_fd = open(qmid->dev_path, O_RDWR | O_CLOEXEC)) == -1)
         return -1;
 
+    //Give CTL a full interval to reply before timing out
+    qmid->poll_time = time(NULL);
+
+    //A fallback to 802.3 belongs to the old device (or the old firmware), so
+    //the requested protocol is tried again
+    qmid->link_proto = qmid->link_proto_req;
+
     //Send request for CID(s). The rest will then be controlled by messages from
     //the modem.
     qmi_ctl_send_sync(qmid);
     return qmid->qmi_fd;
 }
 
-//Return value of -1 means failure
+//Close the device and reset everything tied to it. The state machines are
+//paused until the device is opened again, and then start over with SYNC
+//(which makes the modem release all CIDs)
+static void qmid_close_modem(struct qmi_device *qmid){
+    struct qmi_wds_session *wds;
+    uint8_t i;
+
+    if(qmid->qmi_fd != -1){
+        close(qmid->qmi_fd);
+        qmid->qmi_fd = -1;
+    }
+
+    //The CIDs of proxy clients are gone with the device, they have to
+    //reconnect
+    qmi_proxy_disconnect_clients(qmid);
+
+    qmid->qmux_progress = 0;
+    qmid->cur_qmux_length = 0;
+    qmid->cur_service = NO_SERVICE;
+    qmid->pin_unlocked = 0;
+
+    qmid->ctl_state = CTL_NOT_SYNCED;
+    qmid->ctl_num_cids = 0;
+    qmid->ctl_pending_releases = 0;
+    qmid->ctl_transaction_id = qmid->nas_transaction_id =
+        qmid->dms_transaction_id = qmid->wda_transaction_id = 1;
+    qmid->nas_id = 0;
+    qmid->nas_state = NAS_INIT;
+    qmid->nas_sig_ind = 0;
+    //Registration is reported again by the new device
+    memset(&(qmid->serving_system), 0, sizeof(qmid->serving_system));
+    //A new search, bias it again
+    qmid->lkg.state = QMI_LKG_IDLE;
+    qmid->dms_id = 0;
+    qmid->dms_state = DMS_INIT;
+    qmid->wda_id = 0;
+    qmid->wda_state = WDA_INIT;
+
+    for(i=0; i<qmid->wds_num_sessions; i++){
+        wds = &(qmid->wds_sessions[i]);
+
+        //No indication will tell that the connection is gone
+        if(wds->hook_connected){
+            wds->wds_state = WDS_DISCONNECTED;
+            qmi_wds_run_hook(qmid, wds, QMI_HOOK_DISCONNECTED);
+        }
+
+        wds->bearer_rat_mask = 0;
+        wds->wds_id = 0;
+        wds->wds_state = WDS_INIT;
+        wds->wds_transaction_id = 1;
+        wds->pkt_data_handle = 0;
+        wds->ip_cfg_applied = 0;
+    }
+}
+
+//uevents use the name of the device node relative to /dev (DEVNAME), while
+//the user might have given a symlink
+static void qmid_set_dev_name(struct qmi_device *qmid){
+    char path[PATH_MAX], *name = qmid->dev_path;
+
+    if(realpath(qmid->dev_path, path) != NULL)
+        name = path;
+
+    if(!strncmp(name, "/dev/", 5))
+        name += 5;
+    else if(strrchr(name, '/') != NULL)
+        name = strrchr(name, '/') + 1;
+
+    //Hotplug is not followed for (unlikely) longer names
+    if(strlen(name) < sizeof(qmid->dev_name))
+        memcpy(qmid->dev_name, name, strlen(name) + 1);
+}
+
+//Sessions without a mux interface use the interface of the device
+static void qmid_set_ifname(struct qmi_device *qmid, const char *ifname){
+    uint8_t i;
+
+    for(i=0; i<qmid->wds_num_sessions; i++)
+        if(!strcmp(qmid->wds_sessions[i].ifname, qmid->ifname))
+            memcpy(qmid->wds_sessions[i].ifname, ifname, IFNAMSIZ);
+
+    memcpy(qmid->ifname, ifname, IFNAMSIZ);
+}
+
+//Look up the network interface of the device in sysfs. Interface names can
+//change between boots and when the modem is re-enumerated, so this is done
+//every time the device is opened. --interface is only used if sysfs does not
+//know. Returns -1 if no interface is known
+static int qmid_resolve_ifname(struct qmi_device *qmid){
+    char ifname[IFNAMSIZ] = "";
+
+    if(qmi_helpers_get_dev_parent(qmid->dev_name, qmid->dev_parent))
+        qmid->dev_parent[0] = '\0';
+
+    if(qmi_helpers_get_ifname(qmid->dev_name, ifname)){
+        if(strlen(qmid->ifname) && qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Could not find the network interface of "
+                    "%s, using %s\n", qmid->dev_path, qmid->ifname);
+
+        return strlen(qmid->ifname) ? 0 : -1;
+    }
+
+    if(!strcmp(ifname, qmid->ifname))
+        return 0;
+
+    if(strlen(qmid->ifname) && qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Network interface of %s is %s, not %s\n",
+                qmid->dev_path, ifname, qmid->ifname);
+
+    qmid_set_ifname(qmid, ifname);
+    return 0;
+}
+
+//Returns >0 if qmi_fd has been opened, 0 if the device is not there (yet)
+static int32_t qmid_reopen_modem(struct qmi_device *qmid){
+    qmid_resolve_ifname(qmid);
+
+    if(qmid_open_modem(qmid) == -1){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+            QMID_DEBUG_PRINT(stderr, "Could not open %s, waiting for device\n",
+                    qmid->dev_path);
+        return 0;
+    }
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Opened %s, syncing\n", qmid->dev_path);
+
+    return qmid->qmi_fd;
+}
+
+static void qmid_watch_fd(int32_t efd, int32_t fd){
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+
+    if(epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) == -1 &&
+            qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Could not add fd %d to epoll\n", fd);
+}
+
 //0 means no action is needed
 //>0 means that qmi_fd has been updated
 static int32_t qmid_handle_timeout(struct qmi_device *qmid){
     time_t cur_time = time(NULL);
+    struct qmi_wds_session *wds;
+    uint8_t i;
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
         QMID_DEBUG_PRINT(stderr, "Checking for timeout events\n");
 
-    if(qmid->ctl_num_cids == QMID_NUM_SERVICES){
+    //The device is normally reopened as soon as the add uevent arrives, this is
+    //in case an event was missed or uevents are not available
+    if(qmid->qmi_fd == -1)
+        return qmid_reopen_modem(qmid);
+
+    if(qmid->ctl_num_cids == qmi_ctl_num_cids(qmid)){
         if(cur_time - qmid->nas_sent_time >= QMID_TIMEOUT_SEC)
             //TODO: Use indications for signal strength and band
             qmi_nas_send(qmid);
 
-        if(cur_time - qmid->wds_sent_time >= QMID_TIMEOUT_SEC){
+        if(qmid->wda_id && qmid->wda_state != WDA_IDLE &&
+                cur_time - qmid->wda_sent_time >= QMID_TIMEOUT_SEC)
+            qmi_wda_send(qmid);
+
+        for(i=0; i<qmid->wds_num_sessions; i++){
+            wds = &(qmid->wds_sessions[i]);
+
             //While connected, no need to query WDS
-            if(qmid->wds_state != WDS_CONNECTED)
-                qmi_wds_send(qmid);
+            if(cur_time - wds->wds_sent_time >= QMID_TIMEOUT_SEC &&
+                    wds->wds_state != WDS_CONNECTED)
+                qmi_wds_send(qmid, wds);
         }
 
         return 0;
@@ -91,19 +345,343 @@ static int32_t qmid_handle_timeout(struct qmi_device *qmid){
         if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
             QMID_DEBUG_PRINT(stderr, "CTL took to long to reply, restarting\n");
 
-        close(qmid->qmi_fd);
+        qmid_close_modem(qmid);
+        return qmid_reopen_modem(qmid);
+    }
+}
+
+//Probe the data path of the first PDN (the one with the default route) while
+//it is connected. A streak of lost probes means that the bearer is dead, even
+//if the modem says otherwise. Other PDNs are not probed (see README)
+static void qmid_update_probe(struct qmi_device *qmid, int32_t efd){
+    struct qmi_probe *probe = &(qmid->probe);
+    struct qmi_wds_session *wds = &(qmid->wds_sessions[0]);
+    uint64_t now_ms = qmi_helpers_now_ms();
+
+    if(!probe->num_targets)
+        return;
+
+    if(wds->wds_state != WDS_CONNECTED){
+        qmi_probe_stop(probe);
+        return;
+    }
 
-        //Reset parameters
-        qmid->ctl_num_cids = 0;
-        qmid->ctl_transaction_id = qmid->nas_transaction_id =
-            qmid->wds_transaction_id = qmid->dms_transaction_id = 1;
+    if(!probe->active){
+        if(qmi_probe_start(probe, wds->ifname, now_ms) == -1){
+            if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+                QMID_DEBUG_PRINT(stderr, "Could not start probing %s\n",
+                        wds->ifname);
+            return;
+        }
+
+        if(probe->fd4 != -1)
+            qmid_watch_fd(efd, probe->fd4);
+
+        if(probe->fd6 != -1)
+            qmid_watch_fd(efd, probe->fd6);
+
+        return;
+    }
+
+    if(qmi_probe_run(probe, now_ms)){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "No traffic passes on %s, reconnecting\n",
+                    probe->ifname);
+
+        qmi_wds_reconnect(qmid, probe->ifname);
+        qmi_probe_stop(probe);
+    }
+}
+
+//The network interface is registered after cdc-wdm, and might be renamed by
+//udev after that. Returns 1 if ev adds or renames the interface of the device
+static uint8_t qmid_is_netdev_uevent(struct qmi_device *qmid,
+        struct qmi_netlink_uevent *ev){
+    size_t len = strlen(qmid->dev_parent);
+
+    if(!len || strcmp(ev->subsystem, "net") || (strcmp(ev->action, "add") &&
+                strcmp(ev->action, "move")))
+        return 0;
+
+    return !strncmp(ev->devpath, qmid->dev_parent, len) &&
+        !strncmp(ev->devpath + len, "/net/", 5);
+}
+
+//Follow the cdc-wdm device. On removal, the state machines are paused. When
+//the device is back (modem reset or firmware crash), it is synced right away
+static void qmid_handle_uevents(struct qmi_device *qmid, int32_t efd){
+    struct qmi_netlink_uevent ev;
+
+    while(qmi_netlink_read_uevent(qmid->uevent_fd, &ev) == 0){
+        if(qmid_is_netdev_uevent(qmid, &ev)){
+            if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+                QMID_DEBUG_PRINT(stderr, "uevent %s %s\n", ev.action,
+                        ev.devpath);
+
+            qmid_resolve_ifname(qmid);
+            continue;
+        }
+
+        if(strcmp(ev.subsystem, "usbmisc") || strcmp(ev.devname,
+                    qmid->dev_name))
+            continue;
+
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+            QMID_DEBUG_PRINT(stderr, "uevent %s %s\n", ev.action, ev.devpath);
+
+        if(!strcmp(ev.action, "remove") && qmid->qmi_fd != -1){
+            if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+                QMID_DEBUG_PRINT(stderr, "%s was removed, waiting for it to "
+                        "come back\n", qmid->dev_path);
+
+            qmid_close_modem(qmid);
+        } else if(!strcmp(ev.action, "add") && qmid->qmi_fd == -1){
+            if(qmid_reopen_modem(qmid) > 0)
+                qmid_watch_fd(efd, qmid->qmi_fd);
+        }
+    }
+}
+
+//Copy the settings that are present in config. Strings are stored in
+//qmid->config, as the file is read again on SIGHUP
+static void qmid_set_config(struct qmi_device *qmid, struct qmi_config *config){
+    struct qmi_probe *probe = &(qmid->probe);
+    uint8_t i;
+
+    if(config->present & QMI_CONFIG_DEVICE){
+        memcpy(qmid->config.dev_path, config->dev_path, PATH_MAX);
+        qmid->dev_path = qmid->config.dev_path;
+    }
+
+    if(config->present & QMI_CONFIG_INTERFACE)
+        qmid_set_ifname(qmid, config->ifname);
+
+    if(config->present & QMI_CONFIG_APN){
+        memcpy(qmid->config.apns, config->apns, sizeof(config->apns));
+        qmid->num_pdns = config->num_apns;
+
+        for(i=0; i<qmid->num_pdns; i++)
+            qmid->apn_names[i] = qmid->config.apns[i];
+
+        for(i=0; i<qmid->wds_num_sessions; i++)
+            qmid->wds_sessions[i].apn_name =
+                qmid->apn_names[qmid->wds_sessions[i].pdn];
+    }
+
+    if(config->present & QMI_CONFIG_PIN){
+        memcpy(qmid->config.pin, config->pin, sizeof(config->pin));
+        qmid->pin_code = qmid->config.pin;
+    }
+
+    if(config->present & QMI_CONFIG_RAT)
+        qmi_policy_set_base(qmid, config->rat_mode_pref);
+
+    if(config->present & QMI_CONFIG_BAND_PREF)
+        qmid->band_pref = config->band_pref;
+
+    if(config->present & QMI_CONFIG_LTE_BANDS)
+        qmid->lte_band_pref = config->lte_band_pref;
 
-        return qmid_open_modem(qmid);
+    if(config->present & QMI_CONFIG_PROBE){
+        memcpy(probe->targets, config->probe_targets,
+                sizeof(config->probe_targets));
+        probe->num_targets = config->num_probe_targets;
+        probe->cur_target = 0;
     }
+
+    if(config->present & QMI_CONFIG_PROBE_INTERVAL)
+        probe->interval = config->probe_interval;
+
+    if(config->present & QMI_CONFIG_PROBE_FAILURES)
+        probe->max_failures = config->probe_failures;
+}
+
+//Returns the settings in config that differ from the running ones
+//(QMI_CONFIG_*). A bit is set in apn_changed for every PDN with a new APN
+static uint16_t qmid_diff_config(struct qmi_device *qmid,
+        struct qmi_config *config, uint8_t *apn_changed){
+    struct qmi_probe *probe = &(qmid->probe);
+    uint16_t changed = 0;
+    uint8_t i;
+
+    *apn_changed = 0;
+
+    if((config->present & QMI_CONFIG_DEVICE) &&
+            strcmp(config->dev_path, qmid->dev_path))
+        changed |= QMI_CONFIG_DEVICE;
+
+    if((config->present & QMI_CONFIG_INTERFACE) &&
+            strcmp(config->ifname, qmid->ifname))
+        changed |= QMI_CONFIG_INTERFACE;
+
+    if(config->present & QMI_CONFIG_APN){
+        for(i=0; i<config->num_apns; i++)
+            if(strcmp(config->apns[i], qmid->apn_names[i]))
+                *apn_changed |= 1 << i;
+
+        if(*apn_changed)
+            changed |= QMI_CONFIG_APN;
+    }
+
+    if((config->present & QMI_CONFIG_PIN) && (qmid->pin_code == NULL ||
+                strcmp(config->pin, qmid->pin_code)))
+        changed |= QMI_CONFIG_PIN;
+
+    if((config->present & QMI_CONFIG_RAT) &&
+            config->rat_mode_pref != qmid->policy.base_pref)
+        changed |= QMI_CONFIG_RAT;
+
+    if((config->present & QMI_CONFIG_BAND_PREF) &&
+            config->band_pref != qmid->band_pref)
+        changed |= QMI_CONFIG_BAND_PREF;
+
+    if((config->present & QMI_CONFIG_LTE_BANDS) &&
+            config->lte_band_pref != qmid->lte_band_pref)
+        changed |= QMI_CONFIG_LTE_BANDS;
+
+    if((config->present & QMI_CONFIG_PROBE) &&
+            (config->num_probe_targets != probe->num_targets ||
+             memcmp(config->probe_targets, probe->targets,
+                 config->num_probe_targets * sizeof(probe->targets[0]))))
+        changed |= QMI_CONFIG_PROBE;
+
+    if((config->present & QMI_CONFIG_PROBE_INTERVAL) &&
+            config->probe_interval != probe->interval)
+        changed |= QMI_CONFIG_PROBE_INTERVAL;
+
+    if((config->present & QMI_CONFIG_PROBE_FAILURES) &&
+            config->probe_failures != probe->max_failures)
+        changed |= QMI_CONFIG_PROBE_FAILURES;
+
+    return changed;
+}
+
+//Leave the current device (disconnect and release the CIDs, without waiting
+//for replies) and start over with the new one
+static void qmid_switch_device(struct qmi_device *qmid, int32_t efd){
+    if(qmid->qmi_fd != -1){
+        qmi_probe_stop(&(qmid->probe));
+        qmi_wds_disconnect(qmid);
+        //The modem is still alive, so the CIDs of proxy clients are released
+        //too, before qmid's own
+        qmi_proxy_disconnect_clients(qmid);
+        qmi_ctl_release_cids(qmid);
+        qmid_close_modem(qmid);
+    }
+
+    qmid_set_dev_name(qmid);
+
+    if(qmid_reopen_modem(qmid) > 0)
+        qmid_watch_fd(efd, qmid->qmi_fd);
 }
 
-//Signal handler for closing down connection and releasing cid
-//Seems like I have to wait for a reply?
+//Read the config file again and apply what changed with the least disruptive
+//action. Connections are only taken down when a change requires it, so that
+//pushing the same file to many units does not cause a wave of reconnects
+static void qmid_reload_config(struct qmi_device *qmid, int32_t efd){
+    struct qmi_config config;
+    char ifname[IFNAMSIZ];
+    uint16_t changed;
+    uint8_t apn_changed, i;
+
+    if(qmid->config_path == NULL){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Got SIGHUP, no config file to "
+                    "reload\n");
+        return;
+    }
+
+    if(qmi_config_read(qmid->config_path, &config)){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Could not reload %s, keeping current "
+                    "configuration\n", qmid->config_path);
+        return;
+    }
+
+    //Sessions (and CIDs) are allocated per PDN when starting
+    if((config.present & QMI_CONFIG_APN) && config.num_apns != qmid->num_pdns){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "The number of APNs can only be changed "
+                    "by a restart, APNs are not updated\n");
+
+        config.present &= ~QMI_CONFIG_APN;
+    }
+
+    changed = qmid_diff_config(qmid, &config, &apn_changed);
+
+    //The interface is only used if sysfs does not know the device
+    if((changed & QMI_CONFIG_INTERFACE) && !(changed & QMI_CONFIG_DEVICE) &&
+            !qmi_helpers_get_ifname(qmid->dev_name, ifname)){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Network interface of %s is %s, "
+                    "interface setting is not used\n", qmid->dev_path, ifname);
+
+        changed &= ~QMI_CONFIG_INTERFACE;
+        config.present &= ~QMI_CONFIG_INTERFACE;
+    }
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Reloaded %s, changed settings 0x%x\n",
+                qmid->config_path, changed);
+
+    if(!changed)
+        return;
+
+    //Sessions on the old interface must be taken down before it is renamed
+    if((changed & QMI_CONFIG_INTERFACE) && !(changed & QMI_CONFIG_DEVICE))
+        qmi_wds_reconnect(qmid, qmid->ifname);
+
+    qmid_set_config(qmid, &config);
+
+    //Everything starts over with a new device
+    if(changed & QMI_CONFIG_DEVICE){
+        qmid_switch_device(qmid, efd);
+        return;
+    }
+
+    //Only the PDNs with a new APN are redialed
+    if(changed & QMI_CONFIG_APN)
+        for(i=0; i<qmid->num_pdns; i++)
+            if(apn_changed & (1 << i))
+                qmi_wds_reconnect_pdn(qmid, i);
+
+    //A new PIN is only needed if the current one was rejected
+    if((changed & QMI_CONFIG_PIN) && !qmid->pin_unlocked &&
+            qmid->dms_state == DMS_VERIFY_PIN)
+        qmi_dms_send(qmid);
+
+    //Before NAS is idle, the preference is set as part of the setup
+    if((changed & (QMI_CONFIG_RAT | QMI_CONFIG_BAND_PREF |
+                    QMI_CONFIG_LTE_BANDS)) && qmid->nas_state == NAS_IDLE)
+        qmi_nas_set_sys_selection(qmid);
+
+    //The prober is started again (with the new settings) by the event loop
+    if(changed & (QMI_CONFIG_PROBE | QMI_CONFIG_PROBE_INTERVAL |
+                QMI_CONFIG_PROBE_FAILURES))
+        qmi_probe_stop(&(qmid->probe));
+}
+
+static void qmid_handle_signals(struct qmi_device *qmid, int32_t efd){
+    struct signalfd_siginfo ssi;
+
+    while(read(qmid->signal_fd, &ssi, sizeof(ssi)) == sizeof(ssi)){
+        switch(ssi.ssi_signo){
+            case SIGTERM:
+            case SIGINT:
+                qmid_request_stop(EXIT_SUCCESS);
+                break;
+            case SIGHUP:
+                qmid_reload_config(qmid, efd);
+                break;
+            case SIGUSR1:
+                qmid_dump_state(qmid);
+                break;
+            case SIGCHLD:
+                qmi_hooks_reap(&(qmid->hooks));
+                break;
+        }
+    }
+}
 
 static void handle_msg(struct qmi_device *qmid){
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
@@ -114,7 +692,12 @@ static void handle_msg(struct qmi_device *qmid){
         parse_qmi(qmid->buf);
     }
 
-    //Ignore messages arriving before I have got my sync ack
+    //Frames for proxy clients are not handled by qmid
+    if(qmi_proxy_route(qmid))
+        return;
+
+    //Ignore messages arriving before I have got my sync ack, or while
+    //shutting down
     if(qmux_hdr->service_type != QMI_SERVICE_CTL &&
             qmid->ctl_state != CTL_SYNCED)
         return;
@@ -127,8 +710,7 @@ static void handle_msg(struct qmi_device *qmid){
             if(qmi_ctl_handle_msg(qmid) == QMI_MSG_FAILURE){
                 QMID_DEBUG_PRINT(stderr, "Error in handling of control message, "
                         "aborting\n");
-                qmi_cleanup();
-                exit(EXIT_FAILURE);
+                qmid_request_stop(EXIT_FAILURE);
             }
 
             break;
@@ -137,26 +719,27 @@ static void handle_msg(struct qmi_device *qmid){
             if(qmi_nas_handle_msg(qmid) == QMI_MSG_FAILURE){
                 QMID_DEBUG_PRINT(stderr, "Error in handling of NAS messge, "
                         "aborting\n");
-                qmi_cleanup();
-                exit(EXIT_FAILURE);
+                qmid_request_stop(EXIT_FAILURE);
             }
             break;
         case QMI_SERVICE_WDS:
             if(qmi_wds_handle_msg(qmid) == QMI_MSG_FAILURE){
                 QMID_DEBUG_PRINT(stderr, "Error in handling of WDS message, "
                         "aborting\n");
-                qmi_cleanup();
-                exit(EXIT_FAILURE);
+                qmid_request_stop(EXIT_FAILURE);
             }
             break;
         case QMI_SERVICE_DMS:
             if(qmi_dms_handle_msg(qmid) == QMI_MSG_FAILURE){
                 QMID_DEBUG_PRINT(stderr, "Error in handling of DMS message, "
                         "aborting\n");
-                qmi_cleanup();
-                exit(EXIT_FAILURE);
+                qmid_request_stop(EXIT_FAILURE);
             }
             break;
+        case QMI_SERVICE_WDA:
+            //Aggregation is optional, so failures are handled by WDA
+            qmi_wda_handle_msg(qmid);
+            break;
         default:
             QMID_DEBUG_PRINT(stderr, "Message for non-supported service (%x)\n",
                     qmux_hdr->service_type);
@@ -222,97 +805,346 @@ static ssize_t read_data(struct qmi_device *qmid){
     return numbytes;
 }
 
-//This method only returns if there has been a critical failure
-static void qmid_run_eventloop(struct qmi_device *qmid){
-    int32_t efd, nfds, sleep_time, retval;
-    struct epoll_event ev;
-    time_t cur_time, next_timeout;
+//Timer wakeups (polls and probes) are counted per hour, so that the cost of
+//the polling policy can be checked against a budget
+static void qmid_count_wakeup(struct qmi_device *qmid){
+    time_t cur_time = time(NULL);
 
-    if((efd = epoll_create(1)) == -1){
-        perror("epoll_create");
-        return;
+    if(cur_time - qmid->wakeup_hour_start >= 3600){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "%u timer wakeups the last hour\n",
+                    qmid->wakeups);
+
+        qmid->wakeups_last_hour = qmid->wakeups;
+        qmid->wakeups = 0;
+        qmid->wakeup_hour_start = cur_time;
     }
 
-    ev.events = EPOLLIN;
-    ev.data.fd = qmid->qmi_fd;
+    qmid->wakeups++;
+}
 
-    if(epoll_ctl(efd, EPOLL_CTL_ADD, qmid->qmi_fd, &ev) == -1){
-        perror("epoll_ctl");
-        return;
+//Returns the exit code, either after a shutdown or a critical failure
+static int qmid_run_eventloop(struct qmi_device *qmid){
+    int32_t efd, nfds, sleep_time, probe_time, hook_time, i;
+    struct epoll_event events[QMID_MAX_EVENTS];
+    time_t cur_time, next_timeout = 0;
+    uint64_t now_ms, shutdown_deadline = 0;
+
+    if((efd = epoll_create1(EPOLL_CLOEXEC)) == -1){
+        perror("epoll_create1");
+        return EXIT_FAILURE;
     }
 
-    next_timeout = time(NULL) + 5;
+    qmid_watch_fd(efd, qmid->qmi_fd);
+    qmid_watch_fd(efd, qmid->signal_fd);
+
+    if(qmid->uevent_fd != -1)
+        qmid_watch_fd(efd, qmid->uevent_fd);
+
+    if(qmid->proxy.listen_fd != -1)
+        qmid_watch_fd(efd, qmid->proxy.listen_fd);
+
+    if(qmid->events.listen_fd != -1)
+        qmid_watch_fd(efd, qmid->events.listen_fd);
+
+    qmid->poll_time = qmid->wakeup_hour_start = time(NULL);
 
     while(1){
-        cur_time = time(NULL);
+        if(qmid_stop && !shutdown_deadline){
+            if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+                QMID_DEBUG_PRINT(stderr, "Shutting down\n");
 
-        if(cur_time > next_timeout)
-            sleep_time = 0;
-        else
-            sleep_time = next_timeout - cur_time;
-            
-        nfds = epoll_wait(efd, &ev, 1, sleep_time*1000);
+            qmid_start_shutdown(qmid);
+            shutdown_deadline = qmi_helpers_now_ms() + QMID_SHUTDOWN_TIMEOUT_MS;
+        }
+
+        //While shutting down, only wait for the release replies
+        if(shutdown_deadline){
+            now_ms = qmi_helpers_now_ms();
+
+            if(!qmid->ctl_pending_releases)
+                return qmid_exit_code;
+
+            if(now_ms >= shutdown_deadline){
+                if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+                    QMID_DEBUG_PRINT(stderr, "No reply to %u CID release(s), "
+                            "giving up\n", qmid->ctl_pending_releases);
+
+                return qmid_exit_code;
+            }
+
+            sleep_time = shutdown_deadline - now_ms;
+        } else{
+            //The interval follows the state, which changes with every message
+            cur_time = time(NULL);
+            next_timeout = qmid->poll_time + qmid_poll_interval(qmid);
+
+            if(cur_time > next_timeout)
+                sleep_time = 0;
+            else
+                sleep_time = (next_timeout - cur_time) * 1000;
+
+            //The prober has its own (shorter) deadlines
+            probe_time = qmi_probe_next(&(qmid->probe), qmi_helpers_now_ms());
+
+            if(probe_time != -1 && probe_time < sleep_time)
+                sleep_time = probe_time;
+        }
+
+        //A hook that runs for too long is terminated, also while shutting down
+        hook_time = qmi_hooks_next(&(qmid->hooks), qmi_helpers_now_ms());
+
+        if(hook_time != -1 && hook_time < sleep_time)
+            sleep_time = hook_time;
+
+        nfds = epoll_wait(efd, events, QMID_MAX_EVENTS, sleep_time);
 
         if(nfds == -1){
+            if(errno == EINTR)
+                continue;
+
             if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
                 QMID_DEBUG_PRINT(stderr, "epoll_wait() failed\n");
 
-            return;
-        } else if(nfds == 0){
-            retval = qmid_handle_timeout(qmid);
+            return EXIT_FAILURE;
+        }
 
-            if(retval == -1){
-                if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
-                    QMID_DEBUG_PRINT(stderr, 
-                            "Could not reopen modem after timeout, abort\n");
-                return;
-            } else if(retval > 0){
-                ev.events = EPOLLIN;
-                ev.data.fd = qmid->qmi_fd;
-                epoll_ctl(efd, EPOLL_CTL_ADD, qmid->qmi_fd, &ev);
+        qmi_hooks_check(&(qmid->hooks), qmi_helpers_now_ms());
+
+        if(nfds == 0){
+            if(shutdown_deadline)
+                continue;
+
+            qmid_count_wakeup(qmid);
+
+            if(time(NULL) >= next_timeout){
+                if(qmid_handle_timeout(qmid) > 0)
+                    qmid_watch_fd(efd, qmid->qmi_fd);
+
+                qmid->poll_time = time(NULL);
             }
+        }
 
-            next_timeout = time(NULL) + 5;
-        } else{
-            if(read_data(qmid) == -1){
-                close(qmid->qmi_fd);
-                return;
+        //The device can be closed (and reopened with the same fd) while
+        //handling events, so restart with a new epoll_wait() when that happens
+        for(i=0; i<nfds; i++){
+            if(events[i].data.fd == qmid->signal_fd){
+                //A reload can replace the device
+                qmid_handle_signals(qmid, efd);
+                break;
+            } else if(events[i].data.fd == qmid->uevent_fd){
+                qmid_handle_uevents(qmid, efd);
+                break;
+            } else if(events[i].data.fd == qmid->qmi_fd){
+                //Typically the device has been unplugged, the uevent will
+                //tell when it is back
+                if(read_data(qmid) == -1){
+                    qmid_close_modem(qmid);
+                    break;
+                }
+            } else if(events[i].data.fd == qmid->probe.fd4 ||
+                    events[i].data.fd == qmid->probe.fd6){
+                qmi_probe_handle_reply(&(qmid->probe), events[i].data.fd,
+                        qmi_helpers_now_ms());
+            } else if(qmi_proxy_has_fd(&(qmid->proxy), events[i].data.fd)){
+                qmi_proxy_handle_fd(qmid, efd, events[i].data.fd);
+            } else if(qmi_events_has_fd(&(qmid->events), events[i].data.fd)){
+                qmi_events_handle_fd(qmid, efd, events[i].data.fd);
             }
         }
+
+        if(!shutdown_deadline)
+            qmid_update_probe(qmid, efd);
+
+        //Every change is the result of an event or a timeout
+        qmi_status_update(qmid);
     }
 }
 
+//Long options without a short equivalent
+enum{
+    QMID_OPT_QMAP_DATAGRAMS = 256,
+    QMID_OPT_QMAP_SIZE,
+    QMID_OPT_SIG_WINDOWS,
+    QMID_OPT_SIG_EWMA,
+    QMID_OPT_PROBE,
+    QMID_OPT_PROBE_INTERVAL,
+    QMID_OPT_PROBE_FAILURES,
+    QMID_OPT_HOOK,
+    QMID_OPT_HOOK_TIMEOUT,
+    QMID_OPT_STATE_FILE,
+    QMID_OPT_BIAS_TIMEOUT,
+    QMID_OPT_RAT_POLICY,
+    QMID_OPT_BAND_PREF,
+    QMID_OPT_LTE_BANDS,
+    QMID_OPT_PROXY,
+    QMID_OPT_STATUS_FILE,
+    QMID_OPT_EVENTS,
+};
+
 struct option qmi_options[] = {
+    {"config",  required_argument, NULL, 'c'},
     {"device",  required_argument, NULL, 'd'},
     {"apn",     required_argument, NULL, 'a'},
     {"pin",     optional_argument, NULL, 'p'},
     {"lock",    optional_argument, NULL, 'l'},
     {"interface",  required_argument, NULL, 'i'},
+    {"family",  required_argument, NULL, 'f'},
+    {"dhcp",    no_argument,       NULL, 'D'},
+    {"ethernet",  no_argument,     NULL, 'e'},
+    {"qmap",    no_argument,       NULL, 'q'},
+    {"qmap-datagrams", required_argument, NULL, QMID_OPT_QMAP_DATAGRAMS},
+    {"qmap-size", required_argument, NULL, QMID_OPT_QMAP_SIZE},
+    {"sig-windows", required_argument, NULL, QMID_OPT_SIG_WINDOWS},
+    {"sig-ewma", required_argument, NULL, QMID_OPT_SIG_EWMA},
+    {"probe", required_argument, NULL, QMID_OPT_PROBE},
+    {"probe-interval", required_argument, NULL, QMID_OPT_PROBE_INTERVAL},
+    {"probe-failures", required_argument, NULL, QMID_OPT_PROBE_FAILURES},
+    {"hook", required_argument, NULL, QMID_OPT_HOOK},
+    {"hook-timeout", required_argument, NULL, QMID_OPT_HOOK_TIMEOUT},
+    {"state-file", required_argument, NULL, QMID_OPT_STATE_FILE},
+    {"bias-timeout", required_argument, NULL, QMID_OPT_BIAS_TIMEOUT},
+    {"rat-policy", no_argument, NULL, QMID_OPT_RAT_POLICY},
+    {"band-pref", required_argument, NULL, QMID_OPT_BAND_PREF},
+    {"lte-bands", required_argument, NULL, QMID_OPT_LTE_BANDS},
+    {"proxy", required_argument, NULL, QMID_OPT_PROXY},
+    {"status-file", required_argument, NULL, QMID_OPT_STATUS_FILE},
+    {"events", required_argument, NULL, QMID_OPT_EVENTS},
+    {0, 0, 0, 0},
 };
 
 static void usage(){
     fprintf(stderr, "How to run: ./qmid <arguments>\n");
+    fprintf(stderr, "\t--config/-c Config file, reloaded on SIGHUP "
+            "(optional)\n");
     fprintf(stderr, "\t--device/-d Path to qmi device (/dev/cdc-wdmX)\n");
-    fprintf(stderr, "\t--apn/-a Apn to connect to\n");
-    fprintf(stderr, "\t--interface/-i Network interface belonging to device\n");
+    fprintf(stderr, "\t--apn/-a Apn to connect to (repeat for multiple "
+            "PDNs, up to %u)\n", QMID_MAX_PDNS);
+    fprintf(stderr, "\t--interface/-i Network interface belonging to device "
+            "(optional, found through sysfs)\n");
     fprintf(stderr, "\t--pin/-p PIN code (optional)\n");
     fprintf(stderr, "\t--lock/-l Lock to UMTS (optional)\n");
+    fprintf(stderr, "\t--family/-f IP family, 4, 6 or 46 for dual-stack "
+            "(optional, default 4)\n");
+    fprintf(stderr, "\t--dhcp/-D Leave addressing of interface to a DHCP "
+            "client (optional)\n");
+    fprintf(stderr, "\t--ethernet/-e Use 802.3 framing, even if raw-ip is "
+            "supported (optional)\n");
+    fprintf(stderr, "\t--qmap/-q Enable QMAP aggregation (optional)\n");
+    fprintf(stderr, "\t--qmap-datagrams Max datagrams per downlink aggregate "
+            "(optional, default %u)\n", QMID_QMAP_DEFAULT_DATAGRAMS);
+    fprintf(stderr, "\t--qmap-size Max size of downlink aggregate (optional, "
+            "default %u)\n", QMID_QMAP_DEFAULT_SIZE);
+    fprintf(stderr, "\t--sig-windows Comma-separated list of up to %u signal "
+            "statistics windows, in samples (optional, default %u,%u,%u)\n",
+            QMI_SIG_MAX_WINDOWS, QMI_SIG_DEFAULT_WINDOW_0,
+            QMI_SIG_DEFAULT_WINDOW_1, QMI_SIG_DEFAULT_WINDOW_2);
+    fprintf(stderr, "\t--sig-ewma Weight of new signal samples in EWMA, in "
+            "percent (optional, default %u)\n", QMI_SIG_DEFAULT_EWMA_ALPHA);
+    fprintf(stderr, "\t--probe Address to probe (ICMP echo) while the first "
+            "PDN is connected (optional, repeat for up to %u)\n",
+            QMI_PROBE_MAX_TARGETS);
+    fprintf(stderr, "\t--probe-interval Seconds between probes (optional, "
+            "default %u)\n", QMI_PROBE_DEFAULT_INTERVAL);
+    fprintf(stderr, "\t--probe-failures Lost probes in a row before "
+            "reconnecting (optional, default %u)\n",
+            QMI_PROBE_DEFAULT_FAILURES);
+    fprintf(stderr, "\t--hook Program run on connection and service changes "
+            "(optional)\n");
+    fprintf(stderr, "\t--hook-timeout Seconds a hook can run before it is "
+            "terminated (optional, default %u)\n", QMI_HOOKS_DEFAULT_TIMEOUT);
+    fprintf(stderr, "\t--state-file File to keep the last-known-good system "
+            "in (optional)\n");
+    fprintf(stderr, "\t--bias-timeout Seconds to look for the last-known-good "
+            "system (optional, default %u)\n", QMI_LKG_DEFAULT_TIMEOUT);
+    fprintf(stderr, "\t--rat-policy Switch between LTE and UMTS based on "
+            "signal and throughput (optional)\n");
+    fprintf(stderr, "\t--band-pref GSM/WCDMA band preference, hexadecimal "
+            "mask (optional)\n");
+    fprintf(stderr, "\t--lte-bands LTE bands to use, for example 3,7,20 "
+            "(optional)\n");
+    fprintf(stderr, "\t--proxy Unix socket other programs can use the modem "
+            "through (optional)\n");
+    fprintf(stderr, "\t--status-file Memory-mapped file to publish the state "
+            "in (optional)\n");
+    fprintf(stderr, "\t--events Unix socket that streams state changes as "
+            "JSON lines (optional)\n");
     fprintf(stderr, "\t-v Verbosity level (up to vvvv)\n");
 }
 
+static void qmid_init_sessions(struct qmi_device *qmid){
+    struct qmi_wds_session *wds;
+    uint8_t i, pdn, num_families;
+
+    num_families = qmid->ip_mode == QMID_IP_MODE_DUAL ? 2 : 1;
+    qmid->wds_num_sessions = qmid->num_pdns * num_families;
+
+    for(i=0; i<qmid->wds_num_sessions; i++){
+        wds = &(qmid->wds_sessions[i]);
+        pdn = i / num_families;
+
+        wds->wds_transaction_id = 1;
+        wds->pdn = pdn;
+        wds->apn_name = qmid->apn_names[pdn];
+        memcpy(wds->ifname, qmid->ifname, IFNAMSIZ);
+
+        //With QMAP, every PDN gets its own mux ID (and interface). Mux ID 0 is
+        //reserved for the device interface
+        if(qmid->qmap_enabled)
+            wds->mux_id = pdn + 1;
+
+        //In dual-stack mode, the first session is IPv4 and the second IPv6
+        if(qmid->ip_mode == QMID_IP_MODE_IPV6 ||
+                (qmid->ip_mode == QMID_IP_MODE_DUAL && i % 2))
+            wds->ip_family = QMI_WDS_IP_FAMILY_IPV6;
+        else
+            wds->ip_family = QMI_WDS_IP_FAMILY_IPV4;
+    }
+}
+
+static uint8_t qmid_parse_sig_windows(char *arg, uint16_t *windows){
+    uint8_t num_windows = 0;
+    char *tok, *saveptr = NULL;
+
+    for(tok = strtok_r(arg, ",", &saveptr); tok != NULL;
+            tok = strtok_r(NULL, ",", &saveptr)){
+        if(num_windows == QMI_SIG_MAX_WINDOWS || atoi(tok) <= 0 ||
+                atoi(tok) > QMI_SIG_HISTORY_LEN)
+            return 0;
+
+        windows[num_windows++] = atoi(tok);
+    }
+
+    return num_windows;
+}
+
 int main(int argc, char *argv[]){
-    //Should also be global, so I can access it in signal handler
-    struct sigaction sa;
-    int c = 0;
+    int c = 0, retval;
+    uint16_t sig_windows[QMI_SIG_MAX_WINDOWS] = {QMI_SIG_DEFAULT_WINDOW_0,
+        QMI_SIG_DEFAULT_WINDOW_1, QMI_SIG_DEFAULT_WINDOW_2};
+    uint8_t num_sig_windows = QMI_SIG_MAX_WINDOWS;
+    uint8_t sig_ewma_alpha = QMI_SIG_DEFAULT_EWMA_ALPHA;
+    struct qmi_config config;
 
     memset(&qmid, 0, sizeof(qmid));
+    qmi_probe_init(&(qmid.probe));
+    qmi_hooks_init(&(qmid.hooks));
+    qmi_lkg_init(&(qmid.lkg));
+    qmi_policy_init(&(qmid.policy));
+    qmi_proxy_init(&(qmid.proxy));
+    qmi_events_init(&(qmid.events));
    
-    //Add signal handler
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = qmi_signal_handler;
+    if((qmid.signal_fd = qmid_open_signalfd()) == -1){
+        perror("Could not create signalfd");
+        return EXIT_FAILURE;
+    }
 
-    sigaction(SIGTERM, &sa, NULL);
-    sigaction(SIGINT, &sa, NULL);
+    //Default is to prefer raw-ip, it saves the fake ethernet header on every
+    //packet
+    qmid.link_proto_req = QMI_CTL_LINK_PROTO_RAW_IP;
+
+    qmid.qmap_req.dl_max_datagrams = QMID_QMAP_DEFAULT_DATAGRAMS;
+    qmid.qmap_req.dl_max_size = QMID_QMAP_DEFAULT_SIZE;
 
     //Default is to prefer both LTE and UMTS
     qmid.rat_mode_pref = QMI_NAS_RAT_MODE_PREF_LTE |
@@ -320,17 +1152,31 @@ int main(int argc, char *argv[]){
 
     //Parse arguments
     while(1){
-        c = getopt_long(argc, argv, "hvlnd:a:p:i:", qmi_options, NULL);
+        c = getopt_long(argc, argv, "hvlnDeqc:d:a:p:i:f:", qmi_options, NULL);
 
         if(c == -1)
             break;
 
         switch(c){
+            case 'c':
+                qmid.config_path = optarg;
+                break;
             case 'd':
                 qmid.dev_path = optarg;
                 break;
             case 'a':
-                qmid.apn_name = optarg;
+                if(qmid.num_pdns == QMID_MAX_PDNS){
+                    fprintf(stderr, "Too many APNs\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                //Must fit in a request buffer
+                if(strlen(optarg) > QMID_MAX_LENGTH_APN){
+                    fprintf(stderr, "APN too long\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                qmid.apn_names[qmid.num_pdns++] = optarg;
                 break;
             case 'v':
                 if(qmid_verbose_logging + 1 < QMID_LOG_LEVEL_MAX)
@@ -351,13 +1197,139 @@ int main(int argc, char *argv[]){
                 qmid.pin_code = optarg;
                 break;
             case 'i':
-                if(strlen(optarg) > IFNAMSIZ){
+                if(strlen(optarg) >= IFNAMSIZ){
                     fprintf(stderr, "Too long interface name\n");
                     exit(EXIT_FAILURE);
                 }
 
                 memcpy(qmid.ifname, optarg, strlen(optarg));
                 break;
+            case 'f':
+                if(!strcmp(optarg, "4"))
+                    qmid.ip_mode = QMID_IP_MODE_IPV4;
+                else if(!strcmp(optarg, "6"))
+                    qmid.ip_mode = QMID_IP_MODE_IPV6;
+                else if(!strcmp(optarg, "46"))
+                    qmid.ip_mode = QMID_IP_MODE_DUAL;
+                else{
+                    fprintf(stderr, "Unknown IP family\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'D':
+                qmid.use_dhcp = 1;
+                break;
+            case 'e':
+                qmid.link_proto_req = QMI_CTL_LINK_PROTO_802_3;
+                break;
+            case 'q':
+                qmid.qmap_enabled = 1;
+                break;
+            case QMID_OPT_QMAP_DATAGRAMS:
+                if(atoi(optarg) <= 0 || atoi(optarg) > QMID_QMAP_MAX_DATAGRAMS){
+                    fprintf(stderr, "QMAP datagrams must be 1 - %u\n",
+                            QMID_QMAP_MAX_DATAGRAMS);
+                    exit(EXIT_FAILURE);
+                }
+                qmid.qmap_req.dl_max_datagrams = atoi(optarg);
+                break;
+            case QMID_OPT_QMAP_SIZE:
+                if(atoi(optarg) < QMID_QMAP_MIN_SIZE ||
+                        atoi(optarg) > QMID_QMAP_MAX_SIZE){
+                    fprintf(stderr, "QMAP size must be %u - %u bytes\n",
+                            QMID_QMAP_MIN_SIZE, QMID_QMAP_MAX_SIZE);
+                    exit(EXIT_FAILURE);
+                }
+                qmid.qmap_req.dl_max_size = atoi(optarg);
+                break;
+            case QMID_OPT_SIG_WINDOWS:
+                if(!(num_sig_windows = qmid_parse_sig_windows(optarg,
+                                sig_windows))){
+                    fprintf(stderr, "Signal windows must be 1 - %u samples, "
+                            "at most %u windows\n", QMI_SIG_HISTORY_LEN,
+                            QMI_SIG_MAX_WINDOWS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case QMID_OPT_SIG_EWMA:
+                if(atoi(optarg) <= 0 || atoi(optarg) > 100){
+                    fprintf(stderr, "EWMA weight must be 1 - 100\n");
+                    exit(EXIT_FAILURE);
+                }
+                sig_ewma_alpha = atoi(optarg);
+                break;
+            case QMID_OPT_PROBE:
+                if(qmi_probe_add_target(&(qmid.probe), optarg)){
+                    fprintf(stderr, "Probe target must be an IP address (up to "
+                            "%u targets)\n", QMI_PROBE_MAX_TARGETS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case QMID_OPT_PROBE_INTERVAL:
+                if(atoi(optarg) <= 0 || atoi(optarg) > UINT16_MAX){
+                    fprintf(stderr, "Probe interval must be 1 - %u s\n",
+                            UINT16_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                qmid.probe.interval = atoi(optarg);
+                break;
+            case QMID_OPT_PROBE_FAILURES:
+                if(atoi(optarg) <= 0 || atoi(optarg) > UINT8_MAX){
+                    fprintf(stderr, "Probe failures must be 1 - %u\n",
+                            UINT8_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                qmid.probe.max_failures = atoi(optarg);
+                break;
+            case QMID_OPT_HOOK:
+                qmid.hooks.path = optarg;
+                break;
+            case QMID_OPT_HOOK_TIMEOUT:
+                if(atoi(optarg) <= 0 || atoi(optarg) > UINT16_MAX){
+                    fprintf(stderr, "Hook timeout must be 1 - %u s\n",
+                            UINT16_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                qmid.hooks.timeout = atoi(optarg);
+                break;
+            case QMID_OPT_STATE_FILE:
+                qmid.lkg.path = optarg;
+                break;
+            case QMID_OPT_BIAS_TIMEOUT:
+                if(atoi(optarg) <= 0 || atoi(optarg) > UINT16_MAX){
+                    fprintf(stderr, "Bias timeout must be 1 - %u s\n",
+                            UINT16_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                qmid.lkg.timeout = atoi(optarg);
+                break;
+            case QMID_OPT_RAT_POLICY:
+                qmid.policy.enabled = 1;
+                break;
+            case QMID_OPT_BAND_PREF:
+                if(qmi_config_parse_band_pref(optarg, &(qmid.band_pref))){
+                    fprintf(stderr, "Band preference must be a hexadecimal "
+                            "mask\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case QMID_OPT_LTE_BANDS:
+                if(qmi_config_parse_lte_bands(optarg,
+                            &(qmid.lte_band_pref))){
+                    fprintf(stderr, "LTE bands must be a list of bands 1 - "
+                            "64\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case QMID_OPT_PROXY:
+                qmid.proxy.path = optarg;
+                break;
+            case QMID_OPT_STATUS_FILE:
+                qmid.status.path = optarg;
+                break;
+            case QMID_OPT_EVENTS:
+                qmid.events.path = optarg;
+                break;
             case 'h':
             default:
                 usage();
@@ -365,24 +1337,106 @@ int main(int argc, char *argv[]){
         }
     }
 
-    if(qmid.dev_path == NULL || qmid.apn_name == NULL || !strlen(qmid.ifname)){
+    //Settings in the config file take precedence over the command line
+    if(qmid.config_path != NULL){
+        if(qmi_config_read(qmid.config_path, &config))
+            exit(EXIT_FAILURE);
+
+        qmid_set_config(&qmid, &config);
+    }
+
+    qmi_policy_set_base(&qmid, qmid.rat_mode_pref);
+
+    if(qmid.policy.enabled && (qmid.rat_mode_pref & QMI_NAS_RAT_MODE_PREF_ALL)
+            != QMI_NAS_RAT_MODE_PREF_ALL){
+        fprintf(stderr, "RAT policy requires both LTE and UMTS\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(qmid.dev_path == NULL || !qmid.num_pdns){
         fprintf(stderr, "Missing required argument\n");
         usage();
         exit(EXIT_FAILURE);
     }
 
-    qmid.ctl_transaction_id = qmid.nas_transaction_id = qmid.wds_transaction_id
-        = qmid.dms_transaction_id = 1;
+    //Without QMAP, all traffic would end up on the same interface
+    if(qmid.num_pdns > 1 && !qmid.qmap_enabled){
+        fprintf(stderr, "Multiple APNs require QMAP (--qmap)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    qmid_set_dev_name(&qmid);
+
+    if(qmid_resolve_ifname(&qmid) == -1){
+        fprintf(stderr, "Could not find network interface of %s, use "
+                "--interface\n", qmid.dev_path);
+        exit(EXIT_FAILURE);
+    }
+
+    qmid.ctl_transaction_id = qmid.nas_transaction_id =
+        qmid.dms_transaction_id = qmid.wda_transaction_id = 1;
+    qmid_init_sessions(&qmid);
+    qmi_sig_history_init(&(qmid.sig_history), sig_windows, num_sig_windows,
+            sig_ewma_alpha);
+
+    //A broken file only costs the bias, it is replaced after the next good
+    //connection
+    if(qmid.lkg.path != NULL){
+        if(qmi_lkg_load(&(qmid.lkg)) == -1)
+            fprintf(stderr, "Ignoring last-known-good system in %s (%s)\n",
+                    qmid.lkg.path, strerror(errno));
+        else if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            qmi_lkg_print(&(qmid.lkg));
+    }
+
+    //The address, routes and MTU reported by the modem are written directly to
+    //the interface, unless the user wants to use DHCP. rtnetlink is needed
+    //with DHCP too, for the link state and the MTU required by QMAP
+    if((qmid.rtnl_fd = qmi_netlink_open()) == -1){
+        perror("Could not open rtnetlink socket");
+        return EXIT_FAILURE;
+    }
     
+    //Without uevents, a removed device is only reopened by the timeout
+    if((qmid.uevent_fd = qmi_netlink_open_uevent()) == -1)
+        perror("Could not open uevent socket, hotplug is not detected");
+
+    if(qmid.proxy.path != NULL && qmi_proxy_open(&(qmid.proxy)) == -1){
+        fprintf(stderr, "Could not create proxy socket %s: %s\n",
+                qmid.proxy.path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if(qmid.status.path != NULL && qmi_status_open(&(qmid.status)) == -1){
+        fprintf(stderr, "Could not create status file %s: %s\n",
+                qmid.status.path, strerror(errno));
+        qmi_proxy_close(&(qmid.proxy));
+        return EXIT_FAILURE;
+    }
+
+    if(qmid.events.path != NULL && qmi_events_open(&(qmid.events)) == -1){
+        fprintf(stderr, "Could not create event socket %s: %s\n",
+                qmid.events.path, strerror(errno));
+        qmi_proxy_close(&(qmid.proxy));
+        qmi_status_close(&(qmid.status));
+        return EXIT_FAILURE;
+    }
+
     if(qmid_open_modem(&qmid) == -1){
         perror("Could not open modem");
+        qmi_proxy_close(&(qmid.proxy));
+        qmi_status_close(&(qmid.status));
+        qmi_events_close(&(qmid.events));
         return EXIT_FAILURE;
     }
 
-    qmi_helpers_set_link(qmid.ifname, 0);
-    qmid_run_eventloop(&qmid);
+    qmi_netlink_set_link(qmid.rtnl_fd, qmid.ifname, 0);
+
+    //Returns after the CIDs have been released, or if the device fails
+    retval = qmid_run_eventloop(&qmid);
+    qmi_proxy_close(&(qmid.proxy));
+    qmi_status_close(&(qmid.status));
+    qmi_events_close(&(qmid.events));
 
-    //Only gets here if device fails to read from interface
-    qmi_cleanup();
-    return EXIT_FAILURE;
+    return retval;
 }
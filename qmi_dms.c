@@ -8,6 +8,9 @@
 #include "qmi_device.h"
 #include "qmi_wds.h"
 
+//Requests without TLVs
+static struct qmi_req_tmpl qmi_dms_reset_tmpl;
+
 static inline ssize_t qmi_dms_write(struct qmi_device *qmid, uint8_t *buf,
         ssize_t len){
     //TODO: Only do this if request is sucessful?
@@ -30,21 +33,22 @@ static inline ssize_t qmi_dms_write(struct qmi_device *qmid, uint8_t *buf,
 }
 
 static ssize_t qmi_dms_send_reset(struct qmi_device *qmid){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
-    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
+    uint8_t *buf;
+    qmux_hdr_t *qmux_hdr;
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
         QMID_DEBUG_PRINT(stderr, "Resetting DMS\n");
 
-    create_qmi_request(buf, QMI_SERVICE_DMS, qmid->dms_id,
-            qmid->dms_transaction_id, QMI_DMS_RESET);
+    buf = qmi_helpers_use_tmpl(&qmi_dms_reset_tmpl, QMI_SERVICE_DMS,
+            qmid->dms_id, qmid->dms_transaction_id, QMI_DMS_RESET);
+    qmux_hdr = (qmux_hdr_t*) buf;
     qmid->dms_state = NAS_RESET;
 
     return qmi_dms_write(qmid, buf, qmux_hdr->length);
 }
 
 static ssize_t qmi_dms_verify_pin(struct qmi_device *qmid){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
+    uint8_t *buf = qmi_helpers_get_buf();
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
     qmi_dms_verify_pin_t uvp;
 
@@ -73,7 +77,7 @@ static ssize_t qmi_dms_verify_pin(struct qmi_device *qmid){
 
 static ssize_t qmi_dms_set_oper_mode(struct qmi_device *qmid,
         uint8_t oper_mode){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
+    uint8_t *buf = qmi_helpers_get_buf();
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
@@ -107,7 +111,7 @@ static uint8_t qmi_dms_handle_reset(struct qmi_device *qmid){
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
     qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
     qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
-    uint16_t result = le16toh(*((uint16_t*) (tlv+1)));
+    uint16_t result = qmi_helpers_get_result(tlv);
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
         QMID_DEBUG_PRINT(stderr, "Received DMS_RESET_RESP\n");
@@ -129,10 +133,10 @@ static uint8_t qmi_dms_handle_verify_pin(struct qmi_device *qmid){
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
     qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
     qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
-    uint16_t result = le16toh(*((uint16_t*) (tlv+1)));
+    uint16_t result = qmi_helpers_get_result(tlv);
     //TODO: Consider adding a generic qmi error struct, if I have to extract the
     //error code in more places
-    uint16_t err_code = le16toh(*(((uint16_t*) (tlv+1))+1));
+    uint16_t err_code = qmi_helpers_get_error(tlv);
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
         QMID_DEBUG_PRINT(stderr, "Received DMS_VERIFY_PIN\n");
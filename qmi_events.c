@@ -0,0 +1,456 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "qmi_events.h"
+#include "qmi_device.h"
+#include "qmi_dialer.h"
+#include "qmi_hooks.h"
+#include "qmi_wds.h"
+
+void qmi_events_init(struct qmi_events *events){
+    uint8_t i;
+
+    memset(events, 0, sizeof(*events));
+    events->listen_fd = -1;
+    events->efd = -1;
+
+    for(i=0; i<QMI_EVENTS_MAX_SUBSCRIBERS; i++)
+        events->subscribers[i].fd = -1;
+}
+
+int32_t qmi_events_open(struct qmi_events *events){
+    struct sockaddr_un addr;
+    int32_t fd;
+
+    if(strlen(events->path) >= sizeof(addr.sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    0)) == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, events->path, strlen(events->path) + 1);
+
+    //Left behind if qmid was killed
+    unlink(events->path);
+
+    if(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+            listen(fd, QMI_EVENTS_MAX_SUBSCRIBERS) == -1){
+        close(fd);
+        return -1;
+    }
+
+    events->listen_fd = fd;
+    return fd;
+}
+
+void qmi_events_close(struct qmi_events *events){
+    uint8_t i;
+
+    if(events->listen_fd == -1)
+        return;
+
+    for(i=0; i<QMI_EVENTS_MAX_SUBSCRIBERS; i++){
+        if(events->subscribers[i].fd != -1){
+            close(events->subscribers[i].fd);
+            events->subscribers[i].fd = -1;
+        }
+    }
+
+    close(events->listen_fd);
+    events->listen_fd = -1;
+    events->num_subscribers = 0;
+    unlink(events->path);
+}
+
+static int8_t qmi_events_find_subscriber(struct qmi_events *events,
+        int32_t fd){
+    uint8_t i;
+
+    for(i=0; i<QMI_EVENTS_MAX_SUBSCRIBERS; i++)
+        if(events->subscribers[i].fd == fd)
+            return i;
+
+    return -1;
+}
+
+uint8_t qmi_events_has_fd(struct qmi_events *events, int32_t fd){
+    if(fd == -1 || events->listen_fd == -1)
+        return 0;
+
+    return fd == events->listen_fd ||
+        qmi_events_find_subscriber(events, fd) != -1;
+}
+
+static void qmi_events_disconnect(struct qmi_events *events, uint8_t idx){
+    struct qmi_events_subscriber *sub = &(events->subscribers[idx]);
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Event subscriber %u disconnected, %u "
+                "event(s) dropped\n", idx, sub->dropped);
+
+    //Closing the fd also removes it from epoll
+    close(sub->fd);
+    sub->fd = -1;
+    events->num_subscribers--;
+}
+
+//Only wait for the socket to become writable while there is something queued
+static void qmi_events_watch(struct qmi_events *events,
+        struct qmi_events_subscriber *sub){
+    uint8_t wait_write = sub->queue_len != 0;
+    struct epoll_event ev;
+
+    if(wait_write == sub->wait_write)
+        return;
+
+    ev.events = wait_write ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.fd = sub->fd;
+
+    if(epoll_ctl(events->efd, EPOLL_CTL_MOD, sub->fd, &ev) == 0)
+        sub->wait_write = wait_write;
+}
+
+//Write as much of the queue as the socket takes. A coalesced signal update is
+//added once the queue is empty. Returns -1 if the subscriber is gone
+static int8_t qmi_events_flush(struct qmi_events *events,
+        struct qmi_events_subscriber *sub){
+    ssize_t len;
+
+    while(sub->queue_len){
+        len = send(sub->fd, sub->queue, sub->queue_len,
+                MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if(len == -1 && (errno == EAGAIN || errno == EINTR))
+            break;
+        else if(len == -1)
+            return -1;
+
+        sub->queue_len -= len;
+        memmove(sub->queue, sub->queue + len, sub->queue_len);
+
+        if(!sub->queue_len && sub->sig_pending){
+            memcpy(sub->queue, events->sig_line, events->sig_line_len);
+            sub->queue_len = events->sig_line_len;
+            sub->sig_pending = 0;
+        }
+    }
+
+    qmi_events_watch(events, sub);
+    return 0;
+}
+
+//Add a line to the queue, or drop it if it does not fit. Dropped events are
+//reported before the next one that fits
+static void qmi_events_queue(struct qmi_events_subscriber *sub,
+        const char *line, uint16_t len){
+    char lost_line[QMI_EVENTS_MAX_LINE];
+    int lost_len = 0;
+
+    if(sub->lost)
+        lost_len = snprintf(lost_line, sizeof(lost_line),
+                "{\"event\":\"dropped\",\"time\":%lld,\"count\":%u}\n",
+                (long long) time(NULL), sub->lost);
+
+    if(sub->queue_len + lost_len + len > QMI_EVENTS_QUEUE_SIZE){
+        sub->lost++;
+        sub->dropped++;
+        return;
+    }
+
+    memcpy(sub->queue + sub->queue_len, lost_line, lost_len);
+    sub->queue_len += lost_len;
+    memcpy(sub->queue + sub->queue_len, line, len);
+    sub->queue_len += len;
+    sub->lost = 0;
+}
+
+static void qmi_events_emit(struct qmi_events *events, const char *line,
+        int len, uint8_t coalesce){
+    struct qmi_events_subscriber *sub;
+    uint8_t i;
+
+    if(!events->num_subscribers || len <= 0)
+        return;
+
+    //Truncated lines are not valid JSON
+    if(len >= QMI_EVENTS_MAX_LINE){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Event is too long, not sent\n");
+        return;
+    }
+
+    if(coalesce){
+        memcpy(events->sig_line, line, len);
+        events->sig_line_len = len;
+    }
+
+    for(i=0; i<QMI_EVENTS_MAX_SUBSCRIBERS; i++){
+        sub = &(events->subscribers[i]);
+
+        if(sub->fd == -1)
+            continue;
+
+        //A subscriber that is behind gets the latest update when it catches
+        //up, the ones in between are of no use
+        if(coalesce && sub->queue_len){
+            sub->sig_pending = 1;
+            continue;
+        }
+
+        qmi_events_queue(sub, line, len);
+
+        if(qmi_events_flush(events, sub) == -1)
+            qmi_events_disconnect(events, i);
+    }
+}
+
+static int qmi_events_format_service(struct qmi_device *qmid, char *line,
+        uint8_t prev_service){
+    return snprintf(line, QMI_EVENTS_MAX_LINE, "{\"event\":\"service\","
+            "\"time\":%lld,\"service\":\"%s\",\"subservice\":%u,"
+            "\"previous\":\"%s\"}\n", (long long) time(NULL),
+            qmi_hooks_service_str(qmid->cur_service), qmid->cur_subservice,
+            qmi_hooks_service_str(prev_service));
+}
+
+//Copy src into dst (len bytes) as the contents of a JSON string. APNs come
+//from the user and might contain anything. A value that does not fit is
+//truncated, but never in the middle of an escape
+static void qmi_events_escape(char *dst, size_t len, const char *src){
+    size_t pos = 0;
+    int n;
+
+    for(; *src; src++){
+        if(*src == '"' || *src == '\\')
+            n = snprintf(dst + pos, len - pos, "\\%c", *src);
+        else if((unsigned char) *src < 0x20)
+            n = snprintf(dst + pos, len - pos, "\\u%04x",
+                    (unsigned char) *src);
+        else
+            n = snprintf(dst + pos, len - pos, "%c", *src);
+
+        if(n < 0 || (size_t) n >= len - pos)
+            break;
+
+        pos += n;
+    }
+
+    dst[pos] = '\0';
+}
+
+static int qmi_events_format_session(struct qmi_wds_session *wds, char *line,
+        uint8_t type){
+    char addr_str[INET6_ADDRSTRLEN] = "";
+    char apn[2 * QMID_MAX_LENGTH_APN + 1], ifname[6 * IFNAMSIZ];
+    uint8_t af = wds->ip_family == QMI_WDS_IP_FAMILY_IPV6 ? AF_INET6 : AF_INET;
+
+    qmi_events_escape(apn, sizeof(apn), wds->apn_name);
+    qmi_events_escape(ifname, sizeof(ifname), wds->ifname);
+
+    //Addressing is only known when qmid configures the interface
+    if(wds->ip_cfg_applied)
+        inet_ntop(af, wds->ip_cfg.addr, addr_str, sizeof(addr_str));
+
+    return snprintf(line, QMI_EVENTS_MAX_LINE, "{\"event\":\"%s\","
+            "\"time\":%lld,\"pdn\":%u,\"apn\":\"%s\",\"family\":\"%s\","
+            "\"ifname\":\"%s\",\"bearer\":%u,\"address\":\"%s\","
+            "\"prefix_len\":%u}\n", qmi_hooks_event_str(type),
+            (long long) time(NULL), wds->pdn, apn,
+            af == AF_INET6 ? "ipv6" : "ipv4", ifname,
+            wds->bearer_rat_mask, addr_str,
+            wds->ip_cfg_applied ? wds->ip_cfg.prefix_len : 0);
+}
+
+static void qmi_events_accept(struct qmi_device *qmid, int32_t efd){
+    struct qmi_events *events = &(qmid->events);
+    struct qmi_events_subscriber *sub = NULL;
+    char line[QMI_EVENTS_MAX_LINE];
+    struct qmi_wds_session *wds;
+    struct epoll_event ev;
+    int32_t fd;
+    uint8_t idx, i;
+    int len;
+
+    if((fd = accept(events->listen_fd, NULL, NULL)) == -1)
+        return;
+
+    for(idx=0; idx<QMI_EVENTS_MAX_SUBSCRIBERS; idx++){
+        if(events->subscribers[idx].fd == -1){
+            sub = &(events->subscribers[idx]);
+            break;
+        }
+    }
+
+    if(sub == NULL){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Too many event subscribers\n");
+
+        close(fd);
+        return;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+
+    if(fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+            fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+            epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) == -1){
+        close(fd);
+        return;
+    }
+
+    memset(sub, 0, sizeof(*sub));
+    sub->fd = fd;
+    events->efd = efd;
+    events->num_subscribers++;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Event subscriber %u connected\n", idx);
+
+    //Start from the current state, so that subscribers do not have to guess
+    len = qmi_events_format_service(qmid, line, qmid->cur_service);
+
+    if(len < QMI_EVENTS_MAX_LINE)
+        qmi_events_queue(sub, line, len);
+
+    for(i=0; i<qmid->wds_num_sessions; i++){
+        wds = &(qmid->wds_sessions[i]);
+
+        if(!wds->hook_connected)
+            continue;
+
+        len = qmi_events_format_session(wds, line, QMI_HOOK_CONNECTED);
+
+        if(len < QMI_EVENTS_MAX_LINE)
+            qmi_events_queue(sub, line, len);
+    }
+
+    if(qmi_events_flush(events, sub) == -1)
+        qmi_events_disconnect(events, idx);
+}
+
+void qmi_events_handle_fd(struct qmi_device *qmid, int32_t efd, int32_t fd){
+    struct qmi_events *events = &(qmid->events);
+    char buf[64];
+    ssize_t len;
+    int8_t idx;
+
+    if(fd == events->listen_fd){
+        qmi_events_accept(qmid, efd);
+        return;
+    }
+
+    if((idx = qmi_events_find_subscriber(events, fd)) == -1)
+        return;
+
+    if(qmi_events_flush(events, &(events->subscribers[idx])) == -1){
+        qmi_events_disconnect(events, idx);
+        return;
+    }
+
+    //Subscribers have nothing to say, reading only tells if they are gone
+    len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+    if(len == 0 || (len == -1 && errno != EAGAIN && errno != EINTR))
+        qmi_events_disconnect(events, idx);
+}
+
+void qmi_events_service(struct qmi_device *qmid, uint8_t prev_service){
+    char line[QMI_EVENTS_MAX_LINE];
+
+    if(!qmid->events.num_subscribers)
+        return;
+
+    qmi_events_emit(&(qmid->events), line,
+            qmi_events_format_service(qmid, line, prev_service), 0);
+}
+
+void qmi_events_session(struct qmi_device *qmid, struct qmi_wds_session *wds,
+        uint8_t type){
+    char line[QMI_EVENTS_MAX_LINE];
+
+    if(!qmid->events.num_subscribers)
+        return;
+
+    qmi_events_emit(&(qmid->events), line,
+            qmi_events_format_session(wds, line, type), 0);
+}
+
+//Value in tenths of a dB, as a decimal number
+static int qmi_events_add_tenths(char *line, int len, const char *key,
+        int32_t tenths){
+    return snprintf(line + len, QMI_EVENTS_MAX_LINE - len, ",\"%s\":%s%d.%d",
+            key, tenths < 0 ? "-" : "", abs(tenths) / 10, abs(tenths) % 10);
+}
+
+void qmi_events_signal(struct qmi_device *qmid, struct qmi_sig_sample *sample){
+    char line[QMI_EVENTS_MAX_LINE];
+    int len;
+
+    if(!qmid->events.num_subscribers)
+        return;
+
+    //Values are converted to dBm and dB. The line is far shorter than the
+    //buffer, so no checks are needed between the fields
+    len = snprintf(line, sizeof(line), "{\"event\":\"signal\",\"time\":%lld,"
+            "\"service\":\"%s\"", (long long) sample->timestamp,
+            qmi_hooks_service_str(sample->service));
+
+    if(sample->valid & (1 << QMI_SIG_RSSI))
+        len += snprintf(line + len, sizeof(line) - len, ",\"rssi\":%d",
+                sample->values[QMI_SIG_RSSI]);
+
+    if(sample->valid & (1 << QMI_SIG_ECIO))
+        len += qmi_events_add_tenths(line, len, "ecio",
+                -5 * sample->values[QMI_SIG_ECIO]);
+
+    if(sample->valid & (1 << QMI_SIG_RSRQ))
+        len += snprintf(line + len, sizeof(line) - len, ",\"rsrq\":%d",
+                sample->values[QMI_SIG_RSRQ]);
+
+    if(sample->valid & (1 << QMI_SIG_RSRP))
+        len += snprintf(line + len, sizeof(line) - len, ",\"rsrp\":%d",
+                sample->values[QMI_SIG_RSRP]);
+
+    if(sample->valid & (1 << QMI_SIG_SNR))
+        len += qmi_events_add_tenths(line, len, "snr",
+                sample->values[QMI_SIG_SNR]);
+
+    len += snprintf(line + len, sizeof(line) - len, "}\n");
+
+    qmi_events_emit(&(qmid->events), line, len, 1);
+}
+
+void qmi_events_print(struct qmi_events *events){
+    struct qmi_events_subscriber *sub;
+    uint8_t i;
+
+    if(events->listen_fd == -1)
+        return;
+
+    QMID_DEBUG_PRINT(stderr, "Events %s, %u subscriber(s)\n", events->path,
+            events->num_subscribers);
+
+    for(i=0; i<QMI_EVENTS_MAX_SUBSCRIBERS; i++){
+        sub = &(events->subscribers[i]);
+
+        if(sub->fd != -1)
+            QMID_DEBUG_PRINT(stderr, "Event subscriber %u: %u byte(s) queued, "
+                    "%u event(s) dropped\n", i, sub->queue_len, sub->dropped);
+    }
+}
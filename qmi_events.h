@@ -0,0 +1,75 @@
+#ifndef QMI_EVENTS_H
+#define QMI_EVENTS_H
+
+#include <stdint.h>
+
+//Event stream. Subscribers connect to a SOCK_STREAM Unix socket and get one
+//compact JSON object per line for every state change (service, connected,
+//disconnected, bearer and signal). qmid never waits for a subscriber. Every
+//subscriber has a bounded queue, and what does not fit is dropped and counted.
+//The count is reported with a dropped event as soon as there is room again.
+//Signal updates are coalesced instead, a subscriber that is behind only gets
+//the latest one once its queue has been written
+#define QMI_EVENTS_MAX_SUBSCRIBERS  8
+#define QMI_EVENTS_QUEUE_SIZE       4096
+#define QMI_EVENTS_MAX_LINE         512
+
+struct qmi_events_subscriber{
+    //-1 when the slot is free
+    int32_t fd;
+    //Waiting for the socket to become writable (EPOLLOUT)
+    uint8_t wait_write;
+    //Latest signal update is to be sent when the queue is empty
+    uint8_t sig_pending;
+    //Dropped events not yet reported, and the total
+    uint32_t lost;
+    uint32_t dropped;
+    uint16_t queue_len;
+    char queue[QMI_EVENTS_QUEUE_SIZE];
+};
+
+struct qmi_events{
+    //Path of the socket, NULL disables the event stream
+    const char *path;
+    int32_t listen_fd;
+    //The epoll fd subscribers are watched by
+    int32_t efd;
+    uint8_t num_subscribers;
+    struct qmi_events_subscriber subscribers[QMI_EVENTS_MAX_SUBSCRIBERS];
+    //Last signal update, for coalescing
+    char sig_line[QMI_EVENTS_MAX_LINE];
+    uint16_t sig_line_len;
+};
+
+struct qmi_device;
+struct qmi_wds_session;
+struct qmi_sig_sample;
+
+void qmi_events_init(struct qmi_events *events);
+
+//Create the listening socket, an old socket at path is replaced. Returns the
+//fd, -1 on failure
+int32_t qmi_events_open(struct qmi_events *events);
+
+//Close all sockets and remove path
+void qmi_events_close(struct qmi_events *events);
+
+//Returns 1 if fd is the listening socket or a subscriber
+uint8_t qmi_events_has_fd(struct qmi_events *events, int32_t fd);
+
+//Accept a new subscriber (added to efd), or write the queue of a subscriber
+//and check if it has gone away
+void qmi_events_handle_fd(struct qmi_device *qmid, int32_t efd, int32_t fd);
+
+//The service has changed, qmid->cur_service is the new one
+void qmi_events_service(struct qmi_device *qmid, uint8_t prev_service);
+
+//A session has connected, disconnected or changed bearer (QMI_HOOK_*)
+void qmi_events_session(struct qmi_device *qmid, struct qmi_wds_session *wds,
+        uint8_t type);
+
+//A signal sample has been added to the history
+void qmi_events_signal(struct qmi_device *qmid, struct qmi_sig_sample *sample);
+
+void qmi_events_print(struct qmi_events *events);
+#endif
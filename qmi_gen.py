@@ -0,0 +1,488 @@
+#!/usr/bin/env python3
+#Generate QMI message encoders/decoders from a message description file. See
+#qmi_messages.schema for the format.
+#
+#Usage: qmi_gen.py <schema> <output directory>
+
+import os
+import re
+import sys
+
+#Size, C type and little-endian conversion (to host) of every field type
+FIELD_TYPES = {
+    'u8': (1, 'uint8_t', None),
+    'i8': (1, 'int8_t', None),
+    'u16': (2, 'uint16_t', 'le16toh'),
+    'i16': (2, 'int16_t', 'le16toh'),
+    'u32': (4, 'uint32_t', 'le32toh'),
+    'i32': (4, 'int32_t', 'le32toh'),
+    'u64': (8, 'uint64_t', 'le64toh'),
+}
+
+HOST_TO_LE = {'le16toh': 'htole16', 'le32toh': 'htole32',
+        'le64toh': 'htole64'}
+
+class SchemaError(Exception):
+    pass
+
+class Field:
+    def __init__(self, ftype, name, count=None, count_field=None, enum=None):
+        if ftype not in FIELD_TYPES:
+            raise SchemaError('unknown field type %s' % ftype)
+
+        self.ftype = ftype
+        self.name = name
+        #Fixed size array (count) or variable size array (count_field)
+        self.count = count
+        self.count_field = count_field
+        self.enum = enum
+
+    def size(self):
+        if self.count_field:
+            return 0
+
+        return FIELD_TYPES[self.ftype][0] * (self.count or 1)
+
+class Tlv:
+    def __init__(self, tlv_type, name, mandatory):
+        self.tlv_type = tlv_type
+        self.name = name
+        self.mandatory = mandatory
+        self.fields = []
+
+    def fixed_size(self):
+        return sum(f.size() for f in self.fields)
+
+    def var_field(self):
+        if self.fields and self.fields[-1].count_field:
+            return self.fields[-1]
+
+        return None
+
+class Message:
+    def __init__(self, service, name, msg_id, kinds):
+        self.service = service
+        self.name = name
+        self.msg_id = msg_id
+        self.kinds = kinds
+        self.tlvs = []
+
+    def prefix(self):
+        return 'qmi_gen_%s_%s' % (self.service.lower(), self.name.lower())
+
+def parse_schema(path):
+    services = {}
+    enums = []
+    messages = []
+    msg = tlv = enum = None
+
+    with open(path) as f:
+        for lineno, line in enumerate(f, 1):
+            tokens = line.split('#', 1)[0].split()
+
+            if not tokens:
+                continue
+
+            try:
+                if tokens[0] == 'service' and len(tokens) == 3:
+                    services[tokens[1]] = int(tokens[2], 0)
+                elif tokens[0] == 'enum' and len(tokens) == 3:
+                    if tokens[1] not in services:
+                        raise SchemaError('unknown service %s' % tokens[1])
+
+                    enum = (tokens[1], tokens[2], [])
+                elif tokens[0] == 'message' and len(tokens) >= 5:
+                    if tokens[1] not in services:
+                        raise SchemaError('unknown service %s' % tokens[1])
+
+                    kinds = set(tokens[4:])
+
+                    if not kinds <= set(['request', 'response', 'indication']):
+                        raise SchemaError('unknown message kind')
+
+                    msg = Message(tokens[1], tokens[2], int(tokens[3], 0),
+                            kinds)
+                elif tokens[0] == 'tlv' and msg and not tlv:
+                    tlv = Tlv(int(tokens[1], 0), tokens[2],
+                            'mandatory' in tokens[3:])
+                elif tokens[0] == 'end':
+                    if tlv:
+                        msg.tlvs.append(tlv)
+                        tlv = None
+                    elif msg:
+                        messages.append(msg)
+                        msg = None
+                    elif enum:
+                        enums.append(enum)
+                        enum = None
+                    else:
+                        raise SchemaError('unexpected end')
+                elif enum:
+                    enum[2].append((tokens[0], int(tokens[1], 0)))
+                elif tlv:
+                    tlv.fields.append(parse_field(tlv, tokens))
+                else:
+                    raise SchemaError('unexpected %s' % tokens[0])
+            except (SchemaError, ValueError, IndexError) as e:
+                raise SchemaError('%s:%d: %s' % (path, lineno, e))
+
+    if msg or tlv or enum:
+        raise SchemaError('%s: missing end' % path)
+
+    for msg in messages:
+        check_message(msg)
+
+    return services, enums, messages
+
+def parse_field(tlv, tokens):
+    m = re.match(r'^(\w+)(\[(\d*)\])?$', tokens[0])
+
+    if not m:
+        raise SchemaError('bad field type %s' % tokens[0])
+
+    if tlv.var_field():
+        raise SchemaError('variable size array must be the last field')
+
+    if m.group(2) and not m.group(3):
+        #Variable size array, count is given by an earlier field
+        count_field = tokens[2]
+
+        if count_field not in [f.name for f in tlv.fields if not f.count]:
+            raise SchemaError('unknown count field %s' % count_field)
+
+        return Field(m.group(1), tokens[1], count_field=count_field)
+
+    count = int(m.group(3)) if m.group(3) else None
+    enum = tokens[2] if len(tokens) > 2 else None
+
+    return Field(m.group(1), tokens[1], count=count, enum=enum)
+
+def check_message(msg):
+    types = [t.tlv_type for t in msg.tlvs]
+
+    if len(types) != len(set(types)):
+        raise SchemaError('%s: duplicate TLV' % msg.name)
+
+    if 'request' in msg.kinds:
+        for tlv in msg.tlvs:
+            if tlv.var_field():
+                raise SchemaError('%s: variable size arrays are not '
+                        'supported in requests' % msg.name)
+
+def tlv_struct(msg, tlv):
+    return 'struct %s_%s' % (msg.prefix(), tlv.name)
+
+def c_field(field):
+    ctype = FIELD_TYPES[field.ftype][1]
+    comment = ' //%s' % field.enum if field.enum else ''
+
+    if field.count_field:
+        return '    %s %s[];%s' % (ctype, field.name, comment)
+    elif field.count:
+        return '    %s %s[%d];%s' % (ctype, field.name, field.count, comment)
+    else:
+        return '    %s %s;%s' % (ctype, field.name, comment)
+
+def gen_header(services, enums, messages):
+    out = []
+    out.append('//Generated by qmi_gen.py from qmi_messages.schema, do not edit')
+    out.append('#ifndef QMI_GEN_H')
+    out.append('#define QMI_GEN_H')
+    out.append('')
+    out.append('#include <stdint.h>')
+    out.append('')
+
+    for service, name, values in enums:
+        out.append('//%s %s' % (service, name))
+
+        for value_name, value in values:
+            out.append('#define QMI_GEN_%s_%s_%s 0x%.2X' % (service,
+                name.upper(), value_name, value))
+
+        out.append('const char *qmi_gen_%s_%s_str(uint32_t value);' %
+                (service.lower(), name))
+        out.append('')
+
+    for msg in messages:
+        out.append('//%s %s (0x%.4X)' % (msg.service, msg.name, msg.msg_id))
+
+        for tlv in msg.tlvs:
+            out.append('%s{' % tlv_struct(msg, tlv))
+            out.extend(c_field(f) for f in tlv.fields)
+            out.append('} __attribute__((packed));')
+            out.append('')
+
+        if 'request' in msg.kinds:
+            out.append('//Values in host byte order, only TLVs with has_<tlv> '
+                    'set are added')
+            out.append('struct %s_req{' % msg.prefix())
+
+            for tlv in msg.tlvs:
+                out.append('    uint8_t has_%s;' % tlv.name)
+                out.append('    %s %s;' % (tlv_struct(msg, tlv), tlv.name))
+
+            out.append('};')
+            out.append('')
+            out.append('//Build the request in buf (a request buffer). Returns '
+                    'QMI_MSG_FAILURE if a')
+            out.append('//mandatory TLV is missing')
+            out.append('uint8_t %s_encode(uint8_t *buf, uint8_t client_id,' %
+                    msg.prefix())
+            out.append('        uint16_t transaction_id, '
+                    'struct %s_req *req);' % msg.prefix())
+            out.append('')
+
+        if msg.kinds & set(['response', 'indication']):
+            out.append('//TLVs point into the receive buffer and are NULL '
+                    'when not present. Result and')
+            out.append('//error are only set for responses')
+            out.append('struct %s{' % msg.prefix())
+            out.append('    uint16_t result;')
+            out.append('    uint16_t error;')
+
+            for tlv in msg.tlvs:
+                out.append('    const %s *%s;' % (tlv_struct(msg, tlv),
+                    tlv.name))
+
+            out.append('};')
+            out.append('')
+            out.append('//Decode the message in buf (starting with the qmux '
+                    'header). Returns')
+            out.append('//QMI_MSG_FAILURE if the message is malformed or a '
+                    'mandatory TLV is missing')
+            out.append('//from a successful message')
+            out.append('uint8_t %s_decode(uint8_t *buf, struct %s *msg);' %
+                    (msg.prefix(), msg.prefix()))
+            out.append('')
+
+    out.append('#endif')
+    return '\n'.join(out) + '\n'
+
+def gen_enum_str(service, name, values):
+    out = []
+    out.append('const char *qmi_gen_%s_%s_str(uint32_t value){' %
+            (service.lower(), name))
+    out.append('    switch(value){')
+
+    for value_name, value in values:
+        out.append('        case QMI_GEN_%s_%s_%s:' % (service, name.upper(),
+            value_name))
+        out.append('            return "%s";' % value_name)
+
+    out.append('        default:')
+    out.append('            return "unknown";')
+    out.append('    }')
+    out.append('}')
+    out.append('')
+    return out
+
+def gen_encoder(services, msg):
+    out = []
+    out.append('uint8_t %s_encode(uint8_t *buf, uint8_t client_id,' %
+            msg.prefix())
+    out.append('        uint16_t transaction_id, '
+            'struct %s_req *req){' % msg.prefix())
+
+    for tlv in msg.tlvs:
+        out.append('    %s %s;' % (tlv_struct(msg, tlv), tlv.name))
+
+    out.append('')
+
+    for tlv in msg.tlvs:
+        if tlv.mandatory:
+            out.append('    if(!req->has_%s)' % tlv.name)
+            out.append('        return QMI_MSG_FAILURE;')
+            out.append('')
+
+    out.append('    create_qmi_request(buf, 0x%.2X, client_id, transaction_id, '
+            '0x%.4X);' % (services[msg.service], msg.msg_id))
+
+    for tlv in msg.tlvs:
+        out.append('')
+        out.append('    if(req->has_%s){' % tlv.name)
+
+        for field in tlv.fields:
+            conv = FIELD_TYPES[field.ftype][2]
+
+            if field.count:
+                value = 'req->%s.%s[i]' % (tlv.name, field.name)
+                value = '%s(%s)' % (HOST_TO_LE[conv], value) if conv else value
+                out.append('        for(uint16_t i=0; i<%d; i++)' %
+                        field.count)
+                out.append('            %s.%s[i] = %s;' % (tlv.name,
+                    field.name, value))
+            else:
+                value = 'req->%s.%s' % (tlv.name, field.name)
+                value = '%s(%s)' % (HOST_TO_LE[conv], value) if conv else value
+                out.append('        %s.%s = %s;' % (tlv.name, field.name,
+                    value))
+
+        out.append('        add_tlv(buf, 0x%.2X, sizeof(%s), &%s);' %
+                (tlv.tlv_type, tlv.name, tlv.name))
+        out.append('    }')
+
+    out.append('')
+    out.append('    return QMI_MSG_SUCCESS;')
+    out.append('}')
+    out.append('')
+    return out
+
+def gen_decoder(services, msg):
+    ctl = services[msg.service] == 0
+    hdr_type = 'qmi_hdr_ctl_t' if ctl else 'qmi_hdr_gen_t'
+    out = []
+
+    out.append('uint8_t %s_decode(uint8_t *buf, struct %s *msg){' %
+            (msg.prefix(), msg.prefix()))
+    out.append('    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;')
+    out.append('    %s *qmi_hdr = (%s*) (qmux_hdr + 1);' % (hdr_type,
+        hdr_type))
+    out.append('    uint8_t *tlv_buf = (uint8_t*) (qmi_hdr + 1);')
+    out.append('    uint32_t qmux_length, tlv_length, offset = 0, len;')
+    out.append('    qmi_tlv_t *tlv;')
+
+    if [t for t in msg.tlvs if t.var_field()]:
+        out.append('    uint32_t count;')
+
+    out.append('')
+    out.append('    memset(msg, 0, sizeof(*msg));')
+    out.append('')
+    out.append('    //The QMI message must fit in the qmux message (length '
+            'does not include marker)')
+    out.append('    qmux_length = le16toh(qmux_hdr->length) + 1;')
+    out.append('')
+    out.append('    if(qmux_length < sizeof(qmux_hdr_t) + sizeof(%s))' %
+            hdr_type)
+    out.append('        return QMI_MSG_FAILURE;')
+    out.append('')
+    out.append('    tlv_length = le16toh(qmi_hdr->length);')
+    out.append('')
+    out.append('    if(qmux_length < sizeof(qmux_hdr_t) + sizeof(%s) + '
+            'tlv_length)' % hdr_type)
+    out.append('        return QMI_MSG_FAILURE;')
+    out.append('')
+    out.append('    while(offset < tlv_length){')
+    out.append('        if(tlv_length - offset < sizeof(qmi_tlv_t))')
+    out.append('            return QMI_MSG_FAILURE;')
+    out.append('')
+    out.append('        tlv = (qmi_tlv_t*) (tlv_buf + offset);')
+    out.append('        len = le16toh(tlv->length);')
+    out.append('        offset += sizeof(qmi_tlv_t);')
+    out.append('')
+    out.append('        if(tlv_length - offset < len)')
+    out.append('            return QMI_MSG_FAILURE;')
+    out.append('')
+    out.append('        switch(tlv->type){')
+
+    if msg.kinds & set(['response']):
+        out.append('            case QMI_TLV_RESULT_CODE:')
+        out.append('                if(!(qmi_hdr->control_flags & '
+                'QMI_CTL_FLAGS_RESP) || len < 4)')
+        out.append('                    break;')
+        out.append('')
+        out.append('                msg->result = qmi_helpers_get_result(tlv);')
+        out.append('                msg->error = qmi_helpers_get_error(tlv);')
+        out.append('                break;')
+
+    for tlv in msg.tlvs:
+        var = tlv.var_field()
+        out.append('            case 0x%.2X:' % tlv.tlv_type)
+        out.append('                if(len < %d)' % tlv.fixed_size())
+        out.append('                    return QMI_MSG_FAILURE;')
+
+        if var:
+            count = [f for f in tlv.fields if f.name == var.count_field][0]
+            conv = FIELD_TYPES[count.ftype][2]
+            value = '((%s*) (tlv + 1))->%s' % (tlv_struct(msg, tlv),
+                    count.name)
+            out.append('')
+            out.append('                count = %s;' % ('%s(%s)' %
+                (conv, value) if conv else value))
+            out.append('')
+            out.append('                if(len - %d < count * %d)' %
+                    (tlv.fixed_size(), FIELD_TYPES[var.ftype][0]))
+            out.append('                    return QMI_MSG_FAILURE;')
+
+        out.append('')
+        out.append('                msg->%s = (const %s*) (tlv + 1);' %
+                (tlv.name, tlv_struct(msg, tlv)))
+        out.append('                break;')
+
+    out.append('        }')
+    out.append('')
+    out.append('        offset += len;')
+    out.append('    }')
+
+    mandatory = [t for t in msg.tlvs if t.mandatory]
+
+    if mandatory:
+        out.append('')
+        out.append('    //Failed responses only contain the result')
+        out.append('    if(msg->result == QMI_RESULT_FAILURE)')
+        out.append('        return QMI_MSG_SUCCESS;')
+        out.append('')
+        out.append('    if(%s)' % ' || '.join('msg->%s == NULL' % t.name
+            for t in mandatory))
+        out.append('        return QMI_MSG_FAILURE;')
+
+    out.append('')
+    out.append('    return QMI_MSG_SUCCESS;')
+    out.append('}')
+    out.append('')
+    return out
+
+def gen_source(services, enums, messages):
+    out = []
+    out.append('//Generated by qmi_gen.py from qmi_messages.schema, do not edit')
+    out.append('#include <stdint.h>')
+    out.append('#include <string.h>')
+    out.append('#include <endian.h>')
+    out.append('')
+    out.append('#include "qmi_gen.h"')
+    out.append('#include "qmi_hdrs.h"')
+    out.append('#include "qmi_shared.h"')
+    out.append('#include "qmi_helpers.h"')
+    out.append('')
+
+    for service, name, values in enums:
+        out.extend(gen_enum_str(service, name, values))
+
+    for msg in messages:
+        if 'request' in msg.kinds:
+            out.extend(gen_encoder(services, msg))
+
+        if msg.kinds & set(['response', 'indication']):
+            out.extend(gen_decoder(services, msg))
+
+    return '\n'.join(out)
+
+def write_if_changed(path, data):
+    #Avoid rebuilding everything that includes qmi_gen.h when nothing changed
+    if os.path.exists(path):
+        with open(path) as f:
+            if f.read() == data:
+                return
+
+    with open(path, 'w') as f:
+        f.write(data)
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write('Usage: %s <schema> <output directory>\n' %
+                sys.argv[0])
+        return 1
+
+    try:
+        services, enums, messages = parse_schema(sys.argv[1])
+    except SchemaError as e:
+        sys.stderr.write('%s\n' % e)
+        return 1
+
+    write_if_changed(os.path.join(sys.argv[2], 'qmi_gen.h'),
+            gen_header(services, enums, messages))
+    write_if_changed(os.path.join(sys.argv[2], 'qmi_gen.c'),
+            gen_source(services, enums, messages))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
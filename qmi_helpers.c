@@ -4,12 +4,72 @@
 #include <assert.h>
 #include <endian.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include "qmi_dialer.h"
 #include "qmi_hdrs.h"
 #include "qmi_shared.h"
 #include "qmi_device.h"
+#include "qmi_helpers.h"
+
+static uint8_t qmi_req_pool[QMI_REQ_POOL_SIZE][QMI_REQ_BUF_SIZE];
+//Bit per buffer in pool
+static uint8_t qmi_req_pool_used;
+
+uint8_t *qmi_helpers_get_buf(){
+    uint8_t i;
+
+    for(i=0; i<QMI_REQ_POOL_SIZE; i++){
+        if(!(qmi_req_pool_used & (1 << i))){
+            qmi_req_pool_used |= 1 << i;
+            return qmi_req_pool[i];
+        }
+    }
+
+    //Buffers are only held while building a request, so running out means
+    //that a buffer is not written (or put back)
+    assert(0);
+    return NULL;
+}
+
+void qmi_helpers_put_buf(uint8_t *buf){
+    uint8_t i;
+
+    for(i=0; i<QMI_REQ_POOL_SIZE; i++){
+        if(buf == qmi_req_pool[i]){
+            qmi_req_pool_used &= ~(1 << i);
+            return;
+        }
+    }
+}
+
+uint8_t *qmi_helpers_use_tmpl(struct qmi_req_tmpl *tmpl, uint8_t service,
+        uint8_t client_id, uint16_t transaction_id, uint16_t message_id){
+    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) tmpl->buf;
+
+    if(!tmpl->built){
+        create_qmi_request(tmpl->buf, service, client_id, transaction_id,
+                message_id);
+        tmpl->built = 1;
+        return tmpl->buf;
+    }
+
+    qmux_hdr->client_id = client_id;
+
+    if(service == QMI_SERVICE_CTL)
+        ((qmi_hdr_ctl_t*) (qmux_hdr+1))->transaction_id = transaction_id;
+    else
+        ((qmi_hdr_gen_t*) (qmux_hdr+1))->transaction_id =
+            htole16(transaction_id);
+
+    return tmpl->buf;
+}
 
 void create_qmi_request(uint8_t *buf, uint8_t service, uint8_t client_id, 
         uint16_t transaction_id, uint16_t message_id){
@@ -55,7 +115,7 @@ void add_tlv(uint8_t *buf, uint8_t type, uint16_t length, void *value){
     qmi_tlv_t *tlv;
 
     assert(le16toh(qmux_hdr->length) + length + sizeof(qmi_tlv_t) <
-            QMI_DEFAULT_BUF_SIZE);
+            QMI_REQ_BUF_SIZE);
 
     //+1 is to compensate or the mark, which is now part of message
     tlv = (qmi_tlv_t*) (buf + le16toh(qmux_hdr->length) + 1);
@@ -63,16 +123,20 @@ void add_tlv(uint8_t *buf, uint8_t type, uint16_t length, void *value){
     tlv->length = htole16(length);
     memcpy(tlv + 1, value, length);
 
-    //Update the length of thw qmux and qmi headers
-    qmux_hdr->length += htole16(sizeof(qmi_tlv_t) + length);
+    //Update the length of the qmux and qmi headers. Lengths are little endian,
+    //so they must be converted before the addition
+    qmux_hdr->length = htole16(le16toh(qmux_hdr->length) +
+            sizeof(qmi_tlv_t) + length);
 
     //Updte QMI service length
     if(qmux_hdr->service_type == QMI_SERVICE_CTL){
         qmi_hdr_ctl_t *qmi_hdr = (qmi_hdr_ctl_t*) (qmux_hdr+1);
-        qmi_hdr->length += htole16(sizeof(qmi_tlv_t) + length);
+        qmi_hdr->length = htole16(le16toh(qmi_hdr->length) +
+                sizeof(qmi_tlv_t) + length);
     } else {
         qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr+1);
-        qmi_hdr->length += htole16(sizeof(qmi_tlv_t) + length);
+        qmi_hdr->length = htole16(le16toh(qmi_hdr->length) +
+                sizeof(qmi_tlv_t) + length);
     }
 }
 
@@ -142,23 +206,246 @@ void parse_qmi(uint8_t *buf){
 }
 
 ssize_t qmi_helpers_write(int32_t qmi_fd, uint8_t *buf, ssize_t len){
-    return write(qmi_fd, buf, len);
+    ssize_t retval = write(qmi_fd, buf, len);
+
+    qmi_helpers_put_buf(buf);
+
+    return retval;
 }
 
-int qmi_helpers_set_link(char *ifname, uint8_t up){
-    char *ip_link_fmt = "ip link set dev";
-    //22 is strlen(ip link set dev X down\0"
-    char ip_link_cmd[22+IFNAMSIZ];
-    
-    if(up)
-        snprintf(ip_link_cmd, sizeof(ip_link_cmd), "%s %s up",
-                 ip_link_fmt, ifname);
-    else
-        snprintf(ip_link_cmd, sizeof(ip_link_cmd), "%s %s down",
-                 ip_link_fmt, ifname);
+uint64_t qmi_helpers_now_ms(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+int qmi_helpers_set_raw_ip(char *ifname, uint8_t enable){
+    char sysfs_path[64];
+    char cur_value = 0, value = enable ? 'Y' : 'N';
+    int fd, retval = -1;
+
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/class/net/%s/qmi/raw_ip",
+            ifname);
+
+    //Kernels without raw-ip support do not have the attribute, which is fine
+    //as long as I don't want raw-ip
+    if((fd = open(sysfs_path, O_RDWR)) == -1)
+        return enable ? -1 : 0;
+
+    //The driver refuses to change mode while interface is up, so avoid writing
+    //when nothing has changed
+    if(read(fd, &cur_value, 1) == 1 && cur_value == value)
+        retval = 0;
+    else if(pwrite(fd, &value, 1, 0) == 1)
+        retval = 0;
+
+    close(fd);
+    return retval;
+}
+
+int qmi_helpers_get_ifname(const char *dev_name, char *ifname){
+    //Older kernels register cdc-wdm in the usb class
+    const char *classes[] = {"usbmisc", "usb"};
+    char sysfs_path[64 + QMID_MAX_LENGTH_DEV_NAME + IFNAMSIZ];
+    struct dirent *entry;
+    char fallback[IFNAMSIZ] = "";
+    struct stat st;
+    DIR *dir = NULL;
+    uint8_t i;
+    int retval = -1;
+
+    for(i=0; i<sizeof(classes)/sizeof(classes[0]) && dir == NULL; i++){
+        snprintf(sysfs_path, sizeof(sysfs_path), "/sys/class/%s/%s/device/net",
+                classes[i], dev_name);
+        dir = opendir(sysfs_path);
+    }
+
+    if(dir == NULL)
+        return -1;
+
+    while((entry = readdir(dir)) != NULL){
+        if(entry->d_name[0] == '.' || strlen(entry->d_name) >= IFNAMSIZ)
+            continue;
+
+        //Only the qmi_wwan interface has the qmi attributes, mux interfaces
+        //might show up here as well
+        snprintf(sysfs_path, sizeof(sysfs_path), "/sys/class/net/%s/qmi",
+                entry->d_name);
+
+        if(stat(sysfs_path, &st) == 0){
+            memcpy(ifname, entry->d_name, strlen(entry->d_name) + 1);
+            retval = 0;
+            break;
+        }
+
+        //Fall back to the first interface, in case the driver does not export
+        //the attributes
+        if(!strlen(fallback))
+            memcpy(fallback, entry->d_name, strlen(entry->d_name) + 1);
+    }
+
+    closedir(dir);
+
+    if(retval && strlen(fallback)){
+        memcpy(ifname, fallback, IFNAMSIZ);
+        retval = 0;
+    }
+
+    return retval;
+}
 
-    //if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
-    //    fprintf(stderr, "Will run command %s\n", ip_link_cmd);
+int qmi_helpers_get_dev_parent(const char *dev_name, char *devpath){
+    const char *classes[] = {"usbmisc", "usb"};
+    char sysfs_path[64 + QMID_MAX_LENGTH_DEV_NAME], path[PATH_MAX];
+    uint8_t i;
+
+    for(i=0; i<sizeof(classes)/sizeof(classes[0]); i++){
+        snprintf(sysfs_path, sizeof(sysfs_path), "/sys/class/%s/%s/device",
+                classes[i], dev_name);
+
+        if(realpath(sysfs_path, path) == NULL || strncmp(path, "/sys/", 5))
+            continue;
+
+        memcpy(devpath, path + 4, strlen(path + 4) + 1);
+        return 0;
+    }
+
+    return -1;
+}
+
+int32_t qmi_helpers_get_iface_num(char *ifname){
+    char sysfs_path[64];
+    FILE *fp;
+    unsigned int iface_num;
+    int32_t retval = -1;
+
+    snprintf(sysfs_path, sizeof(sysfs_path),
+            "/sys/class/net/%s/device/bInterfaceNumber", ifname);
+
+    if((fp = fopen(sysfs_path, "r")) == NULL)
+        return -1;
+
+    //The number is exported as hex
+    if(fscanf(fp, "%x", &iface_num) == 1)
+        retval = iface_num;
+
+    fclose(fp);
+    return retval;
+}
+
+int qmi_helpers_get_rx_bytes(const char *ifname, uint64_t *rx_bytes){
+    char sysfs_path[64];
+    unsigned long long value;
+    FILE *fp;
+    int retval = -1;
+
+    snprintf(sysfs_path, sizeof(sysfs_path),
+            "/sys/class/net/%s/statistics/rx_bytes", ifname);
+
+    if((fp = fopen(sysfs_path, "r")) == NULL)
+        return -1;
+
+    if(fscanf(fp, "%llu", &value) == 1){
+        *rx_bytes = value;
+        retval = 0;
+    }
+
+    fclose(fp);
+    return retval;
+}
+
+//Mux interfaces are registered as upper devices of the qmi_wwan interface.
+//Returns the number of upper devices found and, if mux_id is found, stores
+//the name of the interface in mux_ifname. Names of all upper devices are
+//stored in upper (if not NULL)
+static int qmi_helpers_find_mux(char *ifname, uint8_t mux_id,
+        char *mux_ifname, char upper[][IFNAMSIZ], int max_upper){
+    char sysfs_path[64 + IFNAMSIZ];
+    struct dirent *entry;
+    DIR *dir;
+    FILE *fp;
+    long cur_mux_id;
+    int num_upper = 0;
+
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/class/net/%s", ifname);
+
+    if((dir = opendir(sysfs_path)) == NULL)
+        return -1;
+
+    while((entry = readdir(dir)) != NULL){
+        if(strncmp(entry->d_name, "upper_", 6) ||
+                strlen(entry->d_name + 6) >= IFNAMSIZ)
+            continue;
+
+        if(upper != NULL && num_upper < max_upper)
+            strcpy(upper[num_upper], entry->d_name + 6);
+
+        num_upper++;
+
+        snprintf(sysfs_path, sizeof(sysfs_path),
+                "/sys/class/net/%s/qmap/mux_id", entry->d_name + 6);
+
+        if((fp = fopen(sysfs_path, "r")) == NULL)
+            continue;
+
+        //Exported as hex (0x..)
+        if(fscanf(fp, "%li", &cur_mux_id) == 1 && cur_mux_id == mux_id)
+            strcpy(mux_ifname, entry->d_name + 6);
+
+        fclose(fp);
+    }
+
+    closedir(dir);
+    return num_upper;
+}
+
+int qmi_helpers_add_mux(char *ifname, uint8_t mux_id, char *mux_ifname){
+    char sysfs_path[64];
+    char before[QMID_MAX_PDNS * 2][IFNAMSIZ], after[QMID_MAX_PDNS * 2][IFNAMSIZ];
+    int num_before, num_after, i, j;
+    FILE *fp;
+
+    mux_ifname[0] = '\0';
+
+    //The interface might be left over from a previous run
+    num_before = qmi_helpers_find_mux(ifname, mux_id, mux_ifname, before,
+            QMID_MAX_PDNS * 2);
+
+    if(num_before < 0)
+        return -1;
+    else if(mux_ifname[0])
+        return 0;
+
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/class/net/%s/qmi/add_mux",
+            ifname);
+
+    if((fp = fopen(sysfs_path, "w")) == NULL)
+        return -1;
+
+    fprintf(fp, "%u", mux_id);
+
+    if(fclose(fp))
+        return -1;
+
+    num_after = qmi_helpers_find_mux(ifname, mux_id, mux_ifname, after,
+            QMID_MAX_PDNS * 2);
+
+    if(mux_ifname[0])
+        return 0;
+
+    //Older kernels does not export the mux ID, then the new upper device is
+    //the one I just added
+    for(i=0; i<num_after && i<QMID_MAX_PDNS * 2; i++){
+        for(j=0; j<num_before && j<QMID_MAX_PDNS * 2; j++)
+            if(!strcmp(after[i], before[j]))
+                break;
+
+        if(j == num_before || j == QMID_MAX_PDNS * 2){
+            strcpy(mux_ifname, after[i]);
+            return 0;
+        }
+    }
 
-    return system(ip_link_cmd);
+    return -1;
 }
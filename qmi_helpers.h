@@ -2,16 +2,112 @@
 #define QMI_PACKETS_H
 
 #include <stdint.h>
+#include <string.h>
+#include <endian.h>
 #include <sys/types.h>
 
+#include "qmi_hdrs.h"
+
+//Requests are small, so they are built in right-sized buffers from a
+//preallocated pool instead of 4 KB arrays on the stack. Requests are written
+//before the next is built, so a handful of buffers is enough
+#define QMI_REQ_BUF_SIZE        256
+#define QMI_REQ_POOL_SIZE       4
+
+//A request without TLVs (marker, qmux header and largest QMI header)
+#define QMI_REQ_TMPL_SIZE       (sizeof(qmux_hdr_t) + sizeof(qmi_hdr_gen_t))
+
+//Load/store little endian values at any offset in a message. QMUX is packed,
+//so values are in general not aligned and casting (*((uint16_t*) (tlv+1)))
+//traps on MIPS and older ARM. memcpy() with a constant size is turned into
+//plain loads where unaligned access is allowed and byte loads elsewhere
+static inline uint16_t qmi_helpers_get_le16(const void *p){
+    uint16_t val;
+    memcpy(&val, p, sizeof(val));
+    return le16toh(val);
+}
+
+static inline uint32_t qmi_helpers_get_le32(const void *p){
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return le32toh(val);
+}
+
+static inline void qmi_helpers_put_le16(void *p, uint16_t val){
+    val = htole16(val);
+    memcpy(p, &val, sizeof(val));
+}
+
+static inline void qmi_helpers_put_le32(void *p, uint32_t val){
+    val = htole32(val);
+    memcpy(p, &val, sizeof(val));
+}
+
+//Result TLV is always first in a response, value is result and error code
+static inline uint16_t qmi_helpers_get_result(qmi_tlv_t *tlv){
+    return qmi_helpers_get_le16(tlv+1);
+}
+
+static inline uint16_t qmi_helpers_get_error(qmi_tlv_t *tlv){
+    return qmi_helpers_get_le16(((uint8_t*) (tlv+1)) + sizeof(uint16_t));
+}
+
+//Requests without TLVs (reset, SYS_INFO, ...) are built once, only client id
+//and transaction id are patched before each send
+struct qmi_req_tmpl{
+    uint8_t built;
+    uint8_t buf[QMI_REQ_TMPL_SIZE];
+};
+
+//Get a buffer from the pool. The buffer is returned to the pool by
+//qmi_helpers_write()
+uint8_t *qmi_helpers_get_buf();
+
+//Return buf to the pool. Does nothing for buffers not from the pool
+//(templates)
+void qmi_helpers_put_buf(uint8_t *buf);
+
+//Build the template the first time it is used, then patch client and
+//transaction id. Returns the buffer to send
+uint8_t *qmi_helpers_use_tmpl(struct qmi_req_tmpl *tmpl, uint8_t service,
+        uint8_t client_id, uint16_t transaction_id, uint16_t message_id);
+
 //transaction_id and message_id is assumed to be received in host byte order
 void create_qmi_request(uint8_t *buf, uint8_t service, uint8_t client_id, 
         uint16_t transaction_id, uint16_t message_id);
 
 //Remember that value has to been in little endian. Length is converted by this
-//unction
+//function. buf must be a request buffer (QMI_REQ_BUF_SIZE)
 void add_tlv(uint8_t *buf, uint8_t type, uint16_t length, void *value);
 void parse_qmi(uint8_t *buf);
+//Write request to device and return buf to pool
 ssize_t qmi_helpers_write(int32_t qmi_fd, uint8_t *buf, ssize_t len);
-int qmi_helpers_set_link(char *ifname, uint8_t up);
+
+//Monotonic time in milliseconds
+uint64_t qmi_helpers_now_ms();
+
+//Set the qmi_wwan raw_ip attribute of ifname. Returns 0 on success (also if
+//the attribute already has the correct value), -1 otherwise
+int qmi_helpers_set_raw_ip(char *ifname, uint8_t enable);
+
+//Find the network interface that belongs to the same USB interface as the
+//cdc-wdm device dev_name (name relative to /dev) and store it in ifname
+//(IFNAMSIZ). Returns 0 on success, -1 otherwise
+int qmi_helpers_get_ifname(const char *dev_name, char *ifname);
+
+//Store the device path (as in uevents, relative to /sys) of the USB interface
+//the cdc-wdm device dev_name belongs to in devpath (PATH_MAX). Returns 0 on
+//success, -1 otherwise
+int qmi_helpers_get_dev_parent(const char *dev_name, char *devpath);
+
+//Return the USB interface number of the device ifname belongs to, or -1
+int32_t qmi_helpers_get_iface_num(char *ifname);
+
+//Read the number of bytes received on ifname. Returns 0 on success, -1
+//otherwise
+int qmi_helpers_get_rx_bytes(const char *ifname, uint64_t *rx_bytes);
+
+//Make sure a qmi_wwan mux interface for mux_id exists on top of ifname and
+//store its name in mux_ifname (IFNAMSIZ). Returns 0 on success, -1 otherwise
+int qmi_helpers_add_mux(char *ifname, uint8_t mux_id, char *mux_ifname);
 #endif
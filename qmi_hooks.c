@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include "qmi_hooks.h"
+#include "qmi_device.h"
+#include "qmi_dialer.h"
+#include "qmi_helpers.h"
+
+extern char **environ;
+
+const char *qmi_hooks_event_str(uint8_t type){
+    switch(type){
+        case QMI_HOOK_CONNECTED:
+            return "connected";
+        case QMI_HOOK_DISCONNECTED:
+            return "disconnected";
+        case QMI_HOOK_SERVICE:
+            return "service";
+        case QMI_HOOK_BEARER:
+            return "bearer";
+        default:
+            return "unknown";
+    }
+}
+
+const char *qmi_hooks_service_str(uint8_t service){
+    switch(service){
+        case SERVICE_GSM:
+            return "gsm";
+        case SERVICE_UMTS:
+            return "umts";
+        case SERVICE_LTE:
+            return "lte";
+        default:
+            return "none";
+    }
+}
+
+void qmi_hooks_init(struct qmi_hooks *hooks){
+    memset(hooks, 0, sizeof(*hooks));
+    hooks->timeout = QMI_HOOKS_DEFAULT_TIMEOUT;
+}
+
+void qmi_hooks_event_init(struct qmi_hooks_event *ev, uint8_t type){
+    ev->type = type;
+    ev->num_env = 0;
+    qmi_hooks_add_env(ev, "QMID_EVENT", "%s", qmi_hooks_event_str(type));
+}
+
+void qmi_hooks_add_env(struct qmi_hooks_event *ev, const char *key,
+        const char *fmt, ...){
+    char *var;
+    va_list ap;
+    int len;
+
+    if(ev->num_env == QMI_HOOKS_MAX_ENV)
+        return;
+
+    var = ev->env[ev->num_env++];
+    len = snprintf(var, QMI_HOOKS_MAX_ENV_LEN, "%s=", key);
+
+    if(len < 0 || len >= QMI_HOOKS_MAX_ENV_LEN)
+        return;
+
+    va_start(ap, fmt);
+    vsnprintf(var + len, QMI_HOOKS_MAX_ENV_LEN - len, fmt, ap);
+    va_end(ap);
+}
+
+//The signals qmid reads from the signalfd are blocked, and the mask is
+//inherited. Hooks must start with a clean mask and default handlers
+static int qmi_hooks_spawn(struct qmi_hooks *hooks,
+        struct qmi_hooks_event *ev){
+    char *argv[] = {(char*) hooks->path,
+        (char*) qmi_hooks_event_str(ev->type), NULL};
+    char *envp[QMI_HOOKS_MAX_INHERITED + QMI_HOOKS_MAX_ENV + 1];
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask, def;
+    uint8_t num_envp = 0, i;
+    int retval;
+
+    //Inherit the environment (PATH and so on), except for stale QMID_*
+    for(i=0; environ[i] != NULL && num_envp < QMI_HOOKS_MAX_INHERITED; i++)
+        if(strncmp(environ[i], "QMID_", 5))
+            envp[num_envp++] = environ[i];
+
+    for(i=0; i<ev->num_env; i++)
+        envp[num_envp++] = ev->env[i];
+
+    envp[num_envp] = NULL;
+
+    sigemptyset(&mask);
+    sigemptyset(&def);
+    sigaddset(&def, SIGTERM);
+    sigaddset(&def, SIGINT);
+    sigaddset(&def, SIGHUP);
+    sigaddset(&def, SIGUSR1);
+    sigaddset(&def, SIGCHLD);
+    sigaddset(&def, SIGPIPE);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+            POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &def);
+    posix_spawnattr_setpgroup(&attr, 0);
+
+    //Output goes to the same place as the log
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null",
+            O_RDONLY, 0);
+
+    retval = posix_spawn(&(hooks->pid), hooks->path, &actions, &attr, argv,
+            envp);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if(retval){
+        hooks->pid = 0;
+        errno = retval;
+        return -1;
+    }
+
+    return 0;
+}
+
+//Start queued hooks until one is running (or the queue is empty)
+static void qmi_hooks_start_next(struct qmi_hooks *hooks){
+    struct qmi_hooks_event *ev;
+
+    while(!hooks->pid && hooks->queue_len){
+        ev = &(hooks->queue[hooks->queue_head]);
+        hooks->queue_head = (hooks->queue_head + 1) % QMI_HOOKS_MAX_QUEUED;
+        hooks->queue_len--;
+
+        if(qmi_hooks_spawn(hooks, ev)){
+            hooks->num_failed++;
+
+            if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+                QMID_DEBUG_PRINT(stderr, "Could not run hook %s %s: %s\n",
+                        hooks->path, qmi_hooks_event_str(ev->type),
+                        strerror(errno));
+            continue;
+        }
+
+        hooks->start_ms = qmi_helpers_now_ms();
+        hooks->terminated = 0;
+        hooks->num_run++;
+
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+            QMID_DEBUG_PRINT(stderr, "Started hook %s %s (pid %d)\n",
+                    hooks->path, qmi_hooks_event_str(ev->type), hooks->pid);
+    }
+}
+
+void qmi_hooks_run(struct qmi_device *qmid, struct qmi_hooks_event *ev){
+    struct qmi_hooks *hooks = &(qmid->hooks);
+    uint8_t idx;
+
+    if(hooks->path == NULL)
+        return;
+
+    if(hooks->queue_len == QMI_HOOKS_MAX_QUEUED){
+        hooks->num_dropped++;
+
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Too many queued hooks, dropping %s\n",
+                    qmi_hooks_event_str(ev->type));
+        return;
+    }
+
+    qmi_hooks_add_env(ev, "QMID_DEVICE", "%s", qmid->dev_path);
+    qmi_hooks_add_env(ev, "QMID_SERVICE", "%s",
+            qmi_hooks_service_str(qmid->cur_service));
+
+    idx = (hooks->queue_head + hooks->queue_len) % QMI_HOOKS_MAX_QUEUED;
+    memcpy(&(hooks->queue[idx]), ev, sizeof(*ev));
+    hooks->queue_len++;
+
+    qmi_hooks_start_next(hooks);
+}
+
+void qmi_hooks_reap(struct qmi_hooks *hooks){
+    pid_t pid;
+    int status;
+
+    //Other children are not expected, but reap them too
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+        if(pid != hooks->pid)
+            continue;
+
+        hooks->pid = 0;
+
+        if(WIFEXITED(status) && !WEXITSTATUS(status))
+            continue;
+
+        hooks->num_failed++;
+
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1){
+            if(WIFEXITED(status))
+                QMID_DEBUG_PRINT(stderr, "Hook %s exited with status %d\n",
+                        hooks->path, WEXITSTATUS(status));
+            else
+                QMID_DEBUG_PRINT(stderr, "Hook %s killed by signal %d\n",
+                        hooks->path, WTERMSIG(status));
+        }
+    }
+
+    qmi_hooks_start_next(hooks);
+}
+
+int32_t qmi_hooks_next(struct qmi_hooks *hooks, uint64_t now_ms){
+    uint64_t deadline;
+
+    if(!hooks->pid)
+        return -1;
+
+    deadline = hooks->start_ms + hooks->timeout * 1000;
+
+    if(hooks->terminated)
+        deadline += QMI_HOOKS_KILL_MS;
+
+    return deadline > now_ms ? deadline - now_ms : 0;
+}
+
+void qmi_hooks_check(struct qmi_hooks *hooks, uint64_t now_ms){
+    if(qmi_hooks_next(hooks, now_ms))
+        return;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Hook %s (pid %d) timed out, %s\n",
+                hooks->path, hooks->pid, hooks->terminated ? "killing" :
+                "terminating");
+
+    //Exit is reported by SIGCHLD as normal
+    kill(-(hooks->pid), hooks->terminated ? SIGKILL : SIGTERM);
+
+    if(hooks->terminated)
+        hooks->start_ms = now_ms;
+
+    hooks->terminated = 1;
+}
+
+void qmi_hooks_print(struct qmi_hooks *hooks){
+    if(hooks->path == NULL)
+        return;
+
+    QMID_DEBUG_PRINT(stderr, "Hook %s: %u run, %u failed, %u dropped, %u "
+            "queued%s\n", hooks->path, hooks->num_run, hooks->num_failed,
+            hooks->num_dropped, hooks->queue_len, hooks->pid ? ", running" :
+            "");
+}
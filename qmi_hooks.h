@@ -0,0 +1,86 @@
+#ifndef QMI_HOOKS_H
+#define QMI_HOOKS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+//Hooks are user scripts run on events (connected, disconnected, service and
+//bearer changes). The script is started with posix_spawn() and the event as
+//its only argument, state is passed as QMID_* environment variables. Hooks are
+//run one at a time, in the order of the events, and never waited for. The
+//exit status is collected when SIGCHLD arrives through the signalfd
+#define QMI_HOOKS_MAX_QUEUED        16
+#define QMI_HOOKS_MAX_ENV           12
+#define QMI_HOOKS_MAX_ENV_LEN       128
+#define QMI_HOOKS_DEFAULT_TIMEOUT   30
+//How long a hook has to exit after SIGTERM, before it is killed
+#define QMI_HOOKS_KILL_MS           2000
+//Max number of variables inherited from qmid's environment
+#define QMI_HOOKS_MAX_INHERITED     64
+
+//Events, the names are passed to the script
+enum{
+    QMI_HOOK_CONNECTED = 0,
+    QMI_HOOK_DISCONNECTED,
+    QMI_HOOK_SERVICE,
+    QMI_HOOK_BEARER,
+};
+
+struct qmi_hooks_event{
+    uint8_t type;
+    uint8_t num_env;
+    char env[QMI_HOOKS_MAX_ENV][QMI_HOOKS_MAX_ENV_LEN];
+};
+
+struct qmi_hooks{
+    //NULL if no hook is configured
+    const char *path;
+    //Seconds a hook can run before it is terminated
+    uint16_t timeout;
+
+    //Running hook, 0 if none. Hooks get their own process group, so that
+    //everything they start is terminated on timeout
+    pid_t pid;
+    uint64_t start_ms;
+    uint8_t terminated;
+
+    struct qmi_hooks_event queue[QMI_HOOKS_MAX_QUEUED];
+    uint8_t queue_head;
+    uint8_t queue_len;
+
+    uint32_t num_run;
+    uint32_t num_failed;
+    uint32_t num_dropped;
+};
+
+struct qmi_device;
+
+void qmi_hooks_init(struct qmi_hooks *hooks);
+
+//Names of events and services (SERVICE_*), also used by the event stream
+const char *qmi_hooks_event_str(uint8_t type);
+const char *qmi_hooks_service_str(uint8_t service);
+
+//Start building an event. The device and current service are added by
+//qmi_hooks_run()
+void qmi_hooks_event_init(struct qmi_hooks_event *ev, uint8_t type);
+
+//Add KEY=value to the environment of the event. Values that do not fit are
+//truncated
+void qmi_hooks_add_env(struct qmi_hooks_event *ev, const char *key,
+        const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+//Queue the event, the hook is started right away if no other is running
+void qmi_hooks_run(struct qmi_device *qmid, struct qmi_hooks_event *ev);
+
+//Collect exited hooks (on SIGCHLD) and start the next one
+void qmi_hooks_reap(struct qmi_hooks *hooks);
+
+//Milliseconds until qmi_hooks_check() must be called, -1 if nothing runs
+int32_t qmi_hooks_next(struct qmi_hooks *hooks, uint64_t now_ms);
+
+//Terminate (and later kill) a hook that has run for too long
+void qmi_hooks_check(struct qmi_hooks *hooks, uint64_t now_ms);
+
+void qmi_hooks_print(struct qmi_hooks *hooks);
+#endif
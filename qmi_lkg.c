@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "qmi_lkg.h"
+#include "qmi_nas.h"
+#include "qmi_dialer.h"
+
+//Active band (RF_BAND_INFO) to bit in the GSM/WCDMA band preference (WCDMA)
+//or to E-UTRA band number (LTE). Bit N-1 in the LTE preference is band N
+struct qmi_lkg_band_map{
+    uint16_t band;
+    uint8_t value;
+};
+
+static const struct qmi_lkg_band_map qmi_lkg_wcdma_bands[] = {
+    {80, 22},   //2100 (I)
+    {81, 23},   //PCS 1900 (II)
+    {82, 24},   //DCS 1800 (III)
+    {83, 25},   //1700 US (IV)
+    {84, 26},   //850 (V)
+    {85, 27},   //800 (VI)
+    {86, 48},   //2600 (VII)
+    {87, 49},   //900 (VIII)
+    {88, 50},   //1700 Japan (IX)
+    {90, 61},   //1500 (XI)
+    {91, 60},   //850 Japan (XIX)
+};
+
+//Active bands 120 - 133 are E-UTRA band 1 - 14, the rest is irregular
+static const struct qmi_lkg_band_map qmi_lkg_lte_bands[] = {
+    {134, 17}, {135, 33}, {136, 34}, {137, 35}, {138, 36}, {139, 37},
+    {140, 38}, {141, 39}, {142, 40}, {143, 18}, {144, 19}, {145, 20},
+    {146, 21}, {147, 24}, {148, 25}, {149, 41}, {150, 42}, {151, 43},
+    {152, 23}, {153, 26}, {154, 32}, {158, 28}, {159, 29}, {160, 30},
+    {163, 46},
+};
+
+#define QMI_LKG_NUM_BANDS(x) (sizeof(x) / sizeof(struct qmi_lkg_band_map))
+
+static const char *qmi_lkg_rat_str(uint8_t radio_if){
+    switch(radio_if){
+        case QMI_NAS_RADIO_IF_GSM:
+            return "gsm";
+        case QMI_NAS_RADIO_IF_UMTS:
+            return "umts";
+        case QMI_NAS_RADIO_IF_LTE:
+            return "lte";
+        default:
+            return NULL;
+    }
+}
+
+void qmi_lkg_init(struct qmi_lkg *lkg){
+    memset(lkg, 0, sizeof(*lkg));
+    lkg->timeout = QMI_LKG_DEFAULT_TIMEOUT;
+}
+
+int qmi_lkg_load(struct qmi_lkg *lkg){
+    char line[QMI_LKG_MAX_LINE], rat[8], mnc[4];
+    unsigned int band, mcc;
+    uint8_t present = 0;
+    FILE *fp;
+
+    lkg->valid = 0;
+
+    //The first connection creates the file
+    if((fp = fopen(lkg->path, "r")) == NULL)
+        return errno == ENOENT ? 0 : -1;
+
+    while(fgets(line, sizeof(line), fp) != NULL){
+        if(sscanf(line, "rat = %7s", rat) == 1){
+            if(!strcmp(rat, "gsm"))
+                lkg->radio_if = QMI_NAS_RADIO_IF_GSM;
+            else if(!strcmp(rat, "umts"))
+                lkg->radio_if = QMI_NAS_RADIO_IF_UMTS;
+            else if(!strcmp(rat, "lte"))
+                lkg->radio_if = QMI_NAS_RADIO_IF_LTE;
+            else
+                break;
+
+            present |= 0x1;
+        } else if(sscanf(line, "band = %u", &band) == 1 &&
+                band <= UINT16_MAX){
+            lkg->band = band;
+            present |= 0x2;
+        } else if(sscanf(line, "plmn = %u-%3[0-9]", &mcc, mnc) == 2 &&
+                mcc <= 999 && strlen(mnc) >= 2){
+            //The number of digits is part of the MNC
+            lkg->mcc = mcc;
+            lkg->mnc = atoi(mnc);
+            lkg->mnc_3digit = strlen(mnc) == 3;
+            present |= 0x4;
+        }
+    }
+
+    fclose(fp);
+
+    if(present != 0x7){
+        errno = EINVAL;
+        return -1;
+    }
+
+    lkg->valid = 1;
+    return 0;
+}
+
+int qmi_lkg_update(struct qmi_lkg *lkg, uint8_t radio_if, uint16_t band,
+        uint16_t mcc, uint16_t mnc, uint8_t mnc_3digit){
+    char tmp_path[PATH_MAX];
+    FILE *fp;
+
+    if(lkg->path == NULL || qmi_lkg_rat_str(radio_if) == NULL)
+        return 0;
+
+    if(lkg->valid && lkg->radio_if == radio_if && lkg->band == band &&
+            lkg->mcc == mcc && lkg->mnc == mnc && lkg->mnc_3digit == mnc_3digit)
+        return 0;
+
+    //Write to a temporary file and rename, a power cut must not leave a
+    //truncated file behind
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", lkg->path);
+
+    if((fp = fopen(tmp_path, "w")) == NULL)
+        return -1;
+
+    fprintf(fp, "#Written by qmid, the last system with good signal\n");
+    fprintf(fp, "rat = %s\n", qmi_lkg_rat_str(radio_if));
+    fprintf(fp, "band = %u\n", band);
+    fprintf(fp, "plmn = %u-%0*u\n", mcc, mnc_3digit ? 3 : 2, mnc);
+
+    if(fclose(fp) || rename(tmp_path, lkg->path)){
+        remove(tmp_path);
+        return -1;
+    }
+
+    lkg->valid = 1;
+    lkg->radio_if = radio_if;
+    lkg->band = band;
+    lkg->mcc = mcc;
+    lkg->mnc = mnc;
+    lkg->mnc_3digit = mnc_3digit;
+
+    return 1;
+}
+
+int8_t qmi_lkg_band_pref_bit(uint8_t radio_if, uint16_t band){
+    const struct qmi_lkg_band_map *map;
+    uint8_t num, i;
+
+    if(radio_if == QMI_NAS_RADIO_IF_LTE && band >= 120 && band <= 133)
+        return band - 120;
+
+    if(radio_if == QMI_NAS_RADIO_IF_LTE){
+        map = qmi_lkg_lte_bands;
+        num = QMI_LKG_NUM_BANDS(qmi_lkg_lte_bands);
+    } else if(radio_if == QMI_NAS_RADIO_IF_UMTS){
+        map = qmi_lkg_wcdma_bands;
+        num = QMI_LKG_NUM_BANDS(qmi_lkg_wcdma_bands);
+    } else{
+        return -1;
+    }
+
+    for(i=0; i<num; i++){
+        if(map[i].band != band)
+            continue;
+
+        return radio_if == QMI_NAS_RADIO_IF_LTE ? map[i].value - 1 :
+            map[i].value;
+    }
+
+    return -1;
+}
+
+uint64_t qmi_lkg_wcdma_band_pref_mask(){
+    uint64_t mask = 0;
+    uint8_t i;
+
+    for(i=0; i<QMI_LKG_NUM_BANDS(qmi_lkg_wcdma_bands); i++)
+        mask |= 1ULL << qmi_lkg_wcdma_bands[i].value;
+
+    return mask;
+}
+
+void qmi_lkg_print(struct qmi_lkg *lkg){
+    if(lkg->path == NULL)
+        return;
+
+    if(!lkg->valid){
+        QMID_DEBUG_PRINT(stderr, "No last-known-good system (%s)\n",
+                lkg->path);
+        return;
+    }
+
+    QMID_DEBUG_PRINT(stderr, "Last-known-good system %s band %u PLMN %u-%0*u, "
+            "bias state %u\n", qmi_lkg_rat_str(lkg->radio_if), lkg->band,
+            lkg->mcc, lkg->mnc_3digit ? 3 : 2, lkg->mnc, lkg->state);
+}
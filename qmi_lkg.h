@@ -0,0 +1,78 @@
+#ifndef QMI_LKG_H
+#define QMI_LKG_H
+
+#include <stdint.h>
+#include <time.h>
+
+//Last-known-good system. The RAT, band and PLMN of the last connection with
+//good signal are kept in a file, so that after a restart (of qmid or the
+//modem) acquisition can be biased towards them. Most sites camp on the same
+//cell every time, and searching it first saves a full scan
+#define QMI_LKG_DEFAULT_TIMEOUT     60
+#define QMI_LKG_MAX_LINE            64
+#define QMI_LKG_MAX_ACQ_ORDER       8
+
+//Bias state, for every time the modem is opened
+enum{
+    //No bias has been tried yet
+    QMI_LKG_IDLE = 0,
+    //Waiting for the current system selection preference
+    QMI_LKG_QUERY,
+    //Biased preference is active
+    QMI_LKG_BIASED,
+    //The full preference is in use (service found, timeout or no bias)
+    QMI_LKG_DONE,
+};
+
+struct qmi_lkg{
+    //File the system is stored in, NULL disables the feature
+    const char *path;
+    //Seconds to bias acquisition before falling back to the full preference
+    uint16_t timeout;
+
+    //The system. Radio interface is QMI_NAS_RADIO_IF_* and band is the
+    //active band as reported by RF_BAND_INFO
+    uint8_t valid;
+    uint8_t radio_if;
+    uint16_t band;
+    uint16_t mcc;
+    uint16_t mnc;
+    //MNC has three digits, stored as written (001 is not 01)
+    uint8_t mnc_3digit;
+
+    uint8_t state;
+    time_t bias_start;
+
+    //The preference before the bias, what is restored afterwards. Only the
+    //parts that were changed are restored
+    uint8_t biased_band_pref;
+    uint8_t biased_lte_band_pref;
+    uint8_t biased_net_sel;
+    uint8_t biased_acq_order;
+    uint64_t band_pref;
+    uint64_t lte_band_pref;
+    uint8_t acq_order_len;
+    uint8_t acq_order[QMI_LKG_MAX_ACQ_ORDER];
+};
+
+void qmi_lkg_init(struct qmi_lkg *lkg);
+
+//Read the system from path. Returns 0 on success (or if the file does not
+//exist yet), -1 if it is invalid
+int qmi_lkg_load(struct qmi_lkg *lkg);
+
+//Store a new system. The file is only written when something has changed, and
+//replaced atomically. Returns 1 if the system was written, 0 if it was
+//unchanged and -1 on failure
+int qmi_lkg_update(struct qmi_lkg *lkg, uint8_t radio_if, uint16_t band,
+        uint16_t mcc, uint16_t mnc, uint8_t mnc_3digit);
+
+//Bit in the GSM/WCDMA (TLV 0x12) or LTE (TLV 0x15) band preference that
+//matches an active band. Returns -1 if the band has no bit of its own
+int8_t qmi_lkg_band_pref_bit(uint8_t radio_if, uint16_t band);
+
+//Mask of all WCDMA bits in the GSM/WCDMA band preference
+uint64_t qmi_lkg_wcdma_band_pref_mask();
+
+void qmi_lkg_print(struct qmi_lkg *lkg);
+#endif
@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <endian.h>
 #include <string.h>
+#include <errno.h>
 
 #include "qmi_nas.h"
 #include "qmi_device.h"
@@ -10,6 +11,19 @@
 #include "qmi_dialer.h"
 #include "qmi_helpers.h"
 #include "qmi_wds.h"
+#include "qmi_sig_history.h"
+#include "qmi_gen.h"
+#include "qmi_lkg.h"
+#include "qmi_policy.h"
+#include "qmi_events.h"
+
+//Requests without TLVs
+static struct qmi_req_tmpl qmi_nas_reset_tmpl;
+static struct qmi_req_tmpl qmi_nas_sys_info_tmpl;
+static struct qmi_req_tmpl qmi_nas_sig_info_tmpl;
+static struct qmi_req_tmpl qmi_nas_rf_band_tmpl;
+static struct qmi_req_tmpl qmi_nas_serving_system_tmpl;
+static struct qmi_req_tmpl qmi_nas_sys_sel_tmpl;
 
 static inline ssize_t qmi_nas_write(struct qmi_device *qmid, uint8_t *buf,
         uint16_t len){
@@ -33,34 +47,38 @@ static inline ssize_t qmi_nas_write(struct qmi_device *qmid, uint8_t *buf,
 }
 
 static ssize_t qmi_nas_send_reset(struct qmi_device *qmid){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
-    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
+    uint8_t *buf;
+    qmux_hdr_t *qmux_hdr;
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
         QMID_DEBUG_PRINT(stderr, "Resetting NAS\n");
 
-    create_qmi_request(buf, QMI_SERVICE_NAS, qmid->nas_id,
-            qmid->nas_transaction_id, QMI_NAS_RESET);
+    buf = qmi_helpers_use_tmpl(&qmi_nas_reset_tmpl, QMI_SERVICE_NAS,
+            qmid->nas_id, qmid->nas_transaction_id, QMI_NAS_RESET);
+    qmux_hdr = (qmux_hdr_t*) buf;
     qmid->nas_state = NAS_RESET;
 
     return qmi_nas_write(qmid, buf, le16toh(qmux_hdr->length));
 }
 
 static ssize_t qmi_nas_send_indication_request(struct qmi_device *qmid){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
+    uint8_t *buf = qmi_helpers_get_buf();
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
     uint8_t enable = 1;
 
     create_qmi_request(buf, QMI_SERVICE_NAS, qmid->nas_id,
             qmid->nas_transaction_id, QMI_NAS_INDICATION_REGISTER);
+    add_tlv(buf, QMI_NAS_TLV_IND_SERVING_SYSTEM, sizeof(uint8_t), &enable);
     add_tlv(buf, QMI_NAS_TLV_IND_SYS_INFO, sizeof(uint8_t), &enable);
+    //Band changes (for example when a secondary carrier is added) are reported
+    //as they happen
+    add_tlv(buf, QMI_NAS_TLV_IND_RF_BAND, sizeof(uint8_t), &enable);
 
-    //Currently not supported
-    //add_tlv(buf, QMI_NAS_TLV_IND_RF_BAND, sizeof(uint8_t), &enable);
-    //add_tlv(buf, QMI_NAS_TLV_IND_SIGNAL_STRENGTH, sizeof(uint8_t), &enable);
+    //Signal indications are not supported by all modems, so they are
+    //registered separately (NAS_SIG_IND_REQ)
 
-    //TODO: Could be that I do not need any more indications (except signal
-    //strength). WDS gives me current technology
+    //TODO: Could be that I do not need any more indications. WDS gives me
+    //current technology
     qmid->nas_state = NAS_IND_REQ;
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
@@ -69,76 +87,231 @@ static ssize_t qmi_nas_send_indication_request(struct qmi_device *qmid){
     return qmi_nas_write(qmid, buf, le16toh(qmux_hdr->length));
 }
 
-static ssize_t qmi_nas_req_sys_info(struct qmi_device *qmid){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
+static ssize_t qmi_nas_send_sig_ind_request(struct qmi_device *qmid){
+    uint8_t *buf = qmi_helpers_get_buf();
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
+    uint8_t enable = 1;
+
+    create_qmi_request(buf, QMI_SERVICE_NAS, qmid->nas_id,
+            qmid->nas_transaction_id, QMI_NAS_INDICATION_REGISTER);
+    add_tlv(buf, QMI_NAS_TLV_IND_SIGNAL_STRENGTH, sizeof(uint8_t), &enable);
+    qmid->nas_state = NAS_SIG_IND_REQ;
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
-        QMID_DEBUG_PRINT(stderr, "Requesting initial SYS_INFO\n");
+        QMID_DEBUG_PRINT(stderr, "Configuring NAS signal indications\n");
+
+    return qmi_nas_write(qmid, buf, le16toh(qmux_hdr->length));
+}
+
+//Indications are sent when the signal crosses one of the levels. The levels
+//are the same as used for computing the number of bars, so a sample is
+//received every time the number of bars changes
+static ssize_t qmi_nas_send_sig_config(struct qmi_device *qmid){
+    uint8_t *buf = qmi_helpers_get_buf();
+    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
+    int8_t rssi[] = {-110, -98, -85, -73};
+    int16_t rsrp[] = {-115, -105, -95, -85};
+    uint8_t rssi_tlv[1 + sizeof(rssi)];
+    uint8_t rsrp_tlv[1 + sizeof(rsrp)];
+    uint8_t i;
 
     create_qmi_request(buf, QMI_SERVICE_NAS, qmid->nas_id,
-            qmid->nas_transaction_id, QMI_NAS_GET_SYS_INFO);
+            qmid->nas_transaction_id, QMI_NAS_CONFIG_SIG_INFO);
+
+    rssi_tlv[0] = sizeof(rssi) / sizeof(rssi[0]);
+    memcpy(rssi_tlv + 1, rssi, sizeof(rssi));
+    add_tlv(buf, QMI_NAS_TLV_SIG_CFG_RSSI, sizeof(rssi_tlv), rssi_tlv);
+
+    rsrp_tlv[0] = sizeof(rsrp) / sizeof(rsrp[0]);
+    for(i=0; i<rsrp_tlv[0]; i++)
+        qmi_helpers_put_le16(rsrp_tlv + 1 + i*2, rsrp[i]);
+    add_tlv(buf, QMI_NAS_TLV_SIG_CFG_LTE_RSRP, sizeof(rsrp_tlv), rsrp_tlv);
+
+    qmid->nas_state = NAS_SIG_CONFIG;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+        QMID_DEBUG_PRINT(stderr, "Configuring signal indication levels\n");
 
     return qmi_nas_write(qmid, buf, le16toh(qmux_hdr->length));
 }
 
+static ssize_t qmi_nas_req_sys_info(struct qmi_device *qmid){
+    uint8_t *buf;
+    qmux_hdr_t *qmux_hdr;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+        QMID_DEBUG_PRINT(stderr, "Requesting initial SYS_INFO\n");
+
+    buf = qmi_helpers_use_tmpl(&qmi_nas_sys_info_tmpl, QMI_SERVICE_NAS,
+            qmid->nas_id, qmid->nas_transaction_id, QMI_NAS_GET_SYS_INFO);
+    qmux_hdr = (qmux_hdr_t*) buf;
+
+    return qmi_nas_write(qmid, buf, le16toh(qmux_hdr->length));
+}
+
+//Add the parts of the preference that the last-known-good bias changes. While
+//biased, the band of the system is the only one allowed for its RAT, its PLMN
+//is selected manually and its RAT is acquired first. Afterwards, the original
+//values are sent, unless the user has configured the bands (the configuration
+//may have changed during the bias). Returns the length of the acquisition
+//order TLV (0 if not included)
+static uint8_t qmi_nas_add_lkg_pref(struct qmi_device *qmid,
+        struct qmi_gen_nas_set_system_selection_preference_req *req,
+        uint8_t *acq_order){
+    struct qmi_lkg *lkg = &(qmid->lkg);
+    uint8_t biased = lkg->state == QMI_LKG_BIASED, len = 0, i;
+    int8_t bit = qmi_lkg_band_pref_bit(lkg->radio_if, lkg->band);
+    uint64_t band_pref = qmid->band_pref ? qmid->band_pref : lkg->band_pref;
+    uint64_t lte_band_pref = qmid->lte_band_pref ? qmid->lte_band_pref :
+        lkg->lte_band_pref;
+
+    if(lkg->biased_band_pref){
+        req->has_band_pref = 1;
+        req->band_pref.mask = band_pref;
+
+        //GSM bands are left alone
+        if(biased)
+            req->band_pref.mask = (band_pref &
+                    ~qmi_lkg_wcdma_band_pref_mask()) | (1ULL << bit);
+    }
+
+    if(lkg->biased_lte_band_pref){
+        req->has_lte_band_pref = 1;
+        req->lte_band_pref.mask = biased ? 1ULL << bit : lte_band_pref;
+    }
+
+    if(lkg->biased_net_sel){
+        req->has_net_sel_pref = 1;
+        req->net_sel_pref.mode = QMI_NAS_NET_SEL_AUTOMATIC;
+
+        if(biased){
+            req->net_sel_pref.mode = QMI_NAS_NET_SEL_MANUAL;
+            req->net_sel_pref.mcc = lkg->mcc;
+            req->net_sel_pref.mnc = lkg->mnc;
+            //01 and 001 are different networks
+            req->has_mnc_pcs_digit = 1;
+            req->mnc_pcs_digit.includes_pcs_digit = lkg->mnc_3digit;
+        }
+    }
+
+    if(!lkg->biased_acq_order)
+        return 0;
+
+    //First byte is the number of RATs
+    if(biased)
+        acq_order[++len] = lkg->radio_if;
+
+    for(i=0; i<lkg->acq_order_len; i++)
+        if(!biased || lkg->acq_order[i] != lkg->radio_if)
+            acq_order[++len] = lkg->acq_order[i];
+
+    acq_order[0] = len;
+    return len + 1;
+}
+
 ssize_t qmi_nas_set_sys_selection(struct qmi_device *qmid){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
+    uint8_t *buf = qmi_helpers_get_buf();
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
-    //TODO: Add mode as a paramter, otherwise set to 0xFFFF
-    uint8_t duration = 0; //Do not make change permanent
-    uint16_t rat_mode_pref = 0;
+    struct qmi_gen_nas_set_system_selection_preference_req req;
+    uint8_t acq_order[QMI_LKG_MAX_ACQ_ORDER + 1], acq_order_len;
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
-        QMID_DEBUG_PRINT(stderr, "Setting system selection preference to %x\n",
-                qmid->rat_mode_pref);
+        QMID_DEBUG_PRINT(stderr, "Setting system selection preference to "
+                "%x bands %llx LTE bands %llx%s\n", qmid->rat_mode_pref,
+                (unsigned long long) qmid->band_pref,
+                (unsigned long long) qmid->lte_band_pref,
+                qmid->lkg.state == QMI_LKG_BIASED ? " (biased)" : "");
+
+    memset(&req, 0, sizeof(req));
+    req.has_mode_pref = 1;
+    req.mode_pref.mode = qmid->rat_mode_pref;
+
+    //The modem keeps its own band preference unless bands are configured
+    if(qmid->band_pref){
+        req.has_band_pref = 1;
+        req.band_pref.mask = qmid->band_pref;
+    }
 
-    create_qmi_request(buf, QMI_SERVICE_NAS, qmid->nas_id,
-            qmid->nas_transaction_id, QMI_NAS_SET_SYSTEM_SELECTION_PREFERENCE);
+    if(qmid->lte_band_pref){
+        req.has_lte_band_pref = 1;
+        req.lte_band_pref.mask = qmid->lte_band_pref;
+    }
+
+    req.has_change_duration = 1;
+    //The configured preference is stored permanently, only the bias is limited
+    //to the current power cycle
+    req.change_duration.duration = QMI_NAS_SS_DURATION_PERMANENT;
+
+    //The bias must not outlive qmid, if it is not around to restore the
+    //preference
+    if(qmid->lkg.state == QMI_LKG_BIASED)
+        req.change_duration.duration = QMI_NAS_SS_DURATION_POWER_CYCLE;
 
-    rat_mode_pref = htole16(qmid->rat_mode_pref);
-	//rat_mode_pref = htole16(0x0018);
-    add_tlv(buf, QMI_NAS_TLV_SS_MODE, sizeof(uint16_t), &rat_mode_pref);
-    add_tlv(buf, QMI_NAS_TLV_SS_DURATION, sizeof(uint8_t), &duration);
+    acq_order_len = qmi_nas_add_lkg_pref(qmid, &req, acq_order);
+
+    if(qmi_gen_nas_set_system_selection_preference_encode(buf, qmid->nas_id,
+                qmid->nas_transaction_id, &req) == QMI_MSG_FAILURE){
+        qmi_helpers_put_buf(buf);
+        return -1;
+    }
+
+    //Variable size, not supported by the generated encoder
+    if(acq_order_len)
+        add_tlv(buf, QMI_NAS_TLV_SS_ORDER, acq_order_len, acq_order);
+
+    return qmi_nas_write(qmid, buf, le16toh(qmux_hdr->length));
+}
+
+static ssize_t qmi_nas_get_sys_selection(struct qmi_device *qmid){
+    uint8_t *buf;
+    qmux_hdr_t *qmux_hdr;
+
+    buf = qmi_helpers_use_tmpl(&qmi_nas_sys_sel_tmpl, QMI_SERVICE_NAS,
+            qmid->nas_id, qmid->nas_transaction_id,
+            QMI_NAS_GET_SYSTEM_SELECTION_PREFERENCE);
+    qmux_hdr = (qmux_hdr_t*) buf;
 
     return qmi_nas_write(qmid, buf, le16toh(qmux_hdr->length));
 }
 
 static ssize_t qmi_nas_req_siginfo(struct qmi_device *qmid){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
-    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
+    uint8_t *buf;
+    qmux_hdr_t *qmux_hdr;
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
         QMID_DEBUG_PRINT(stderr, "Requesting signal info\n");
 
-    create_qmi_request(buf, QMI_SERVICE_NAS, qmid->nas_id,
-            qmid->nas_transaction_id, QMI_NAS_GET_SIG_INFO);
+    buf = qmi_helpers_use_tmpl(&qmi_nas_sig_info_tmpl, QMI_SERVICE_NAS,
+            qmid->nas_id, qmid->nas_transaction_id, QMI_NAS_GET_SIG_INFO);
+    qmux_hdr = (qmux_hdr_t*) buf;
 
     return qmi_nas_write(qmid, buf, le16toh(qmux_hdr->length));
 }
 
 static ssize_t qmi_nas_req_rf_band(struct qmi_device *qmid){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
-    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
+    uint8_t *buf;
+    qmux_hdr_t *qmux_hdr;
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
         QMID_DEBUG_PRINT(stderr, "Requesting RF band info\n");
 
-    create_qmi_request(buf, QMI_SERVICE_NAS, qmid->nas_id,
-            qmid->nas_transaction_id, QMI_NAS_GET_RF_BAND_INFO);
+    buf = qmi_helpers_use_tmpl(&qmi_nas_rf_band_tmpl, QMI_SERVICE_NAS,
+            qmid->nas_id, qmid->nas_transaction_id, QMI_NAS_GET_RF_BAND_INFO);
+    qmux_hdr = (qmux_hdr_t*) buf;
 
     return qmi_nas_write(qmid, buf, le16toh(qmux_hdr->length));
 }
 
 static ssize_t qmi_nas_get_serving_system(struct qmi_device *qmid){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
-    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
+    uint8_t *buf;
+    qmux_hdr_t *qmux_hdr;
 
-    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
-        QMID_DEBUG_PRINT(stderr, "Requesting RF band info\n");
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+        QMID_DEBUG_PRINT(stderr, "Requesting serving system\n");
 
-    create_qmi_request(buf, QMI_SERVICE_NAS, qmid->nas_id,
-            qmid->nas_transaction_id, QMI_NAS_GET_SERVING_SYSTEM);
+    buf = qmi_helpers_use_tmpl(&qmi_nas_serving_system_tmpl, QMI_SERVICE_NAS,
+            qmid->nas_id, qmid->nas_transaction_id, QMI_NAS_GET_SERVING_SYSTEM);
+    qmux_hdr = (qmux_hdr_t*) buf;
 
     return qmi_nas_write(qmid, buf, le16toh(qmux_hdr->length));
 }
@@ -160,19 +333,29 @@ uint8_t qmi_nas_send(struct qmi_device *qmid){
             //Failed sends can be dealt with later
             qmi_nas_send_indication_request(qmid);
             break;
+        case NAS_SIG_IND_REQ:
+            qmi_nas_send_sig_ind_request(qmid);
+            break;
+        case NAS_SIG_CONFIG:
+            qmi_nas_send_sig_config(qmid);
+            break;
         case NAS_SYS_INFO_QUERY:
+            //Initial state, changes are reported using indications
+            qmi_nas_get_serving_system(qmid);
             qmi_nas_req_sys_info(qmid);
             break;
         case NAS_IDLE:
             /*if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
                 QMID_DEBUG_PRINT(stderr, "Nothing to send for NAS\n");
                 */
+            //Registration and attach are reported by indications, so there
+            //is nothing to poll for without service
             if(qmid->cur_service){
                 qmi_nas_req_siginfo(qmid);
                 qmi_nas_req_rf_band(qmid);
-            } else{
-                qmi_nas_get_serving_system(qmid);
             }
+
+            qmi_nas_check_lkg_bias(qmid);
             break;
     }
 
@@ -183,7 +366,7 @@ static uint8_t qmi_nas_handle_reset(struct qmi_device *qmid){
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
     qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
     qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
-    uint16_t result = le16toh(*((uint16_t*) (tlv+1)));
+    uint16_t result = qmi_helpers_get_result(tlv);
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
         QMID_DEBUG_PRINT(stderr, "Received NAS_RESET_RESP\n");
@@ -205,19 +388,30 @@ static uint8_t qmi_nas_handle_system_selection(struct qmi_device *qmid){
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
     qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
     qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
-    uint16_t result = le16toh(*((uint16_t*) (tlv+1)));
+    uint16_t result = qmi_helpers_get_result(tlv);
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
         QMID_DEBUG_PRINT(stderr, "Received SYSTEM_SELECTION_RESP\n");
 
+    //Only a failure during setup is fatal. Later changes (reload, RAT policy,
+    //bias) keep the previous preference
     if(result == QMI_RESULT_FAILURE){
         if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
             QMID_DEBUG_PRINT(stderr, "Could not set system selection\n");
-        return QMI_MSG_FAILURE;
+        return qmid->nas_state == NAS_SET_SYSTEM ? QMI_MSG_FAILURE :
+            QMI_MSG_IGNORE;
     } else {
         if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
             QMID_DEBUG_PRINT(stderr, "Successfully set system selection preference\n");
 
+        //Modems silently drop bands they do not support, read back what is
+        //in use. The biased preference is not what the user asked for
+        if((qmid->band_pref || qmid->lte_band_pref) &&
+                qmid->lkg.state != QMI_LKG_BIASED){
+            qmid->sys_sel_verify = 1;
+            qmi_nas_get_sys_selection(qmid);
+        }
+
         if(qmid->nas_state == NAS_SET_SYSTEM){
             qmid->nas_state = NAS_IND_REQ;
             qmi_nas_send(qmid);
@@ -230,7 +424,7 @@ static uint8_t qmi_nas_handle_ind_req_reply(struct qmi_device *qmid){
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
     qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
     qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
-    uint16_t result = le16toh(*((uint16_t*) (tlv+1)));
+    uint16_t result = qmi_helpers_get_result(tlv);
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
         QMID_DEBUG_PRINT(stderr, "Received SET_INDICATION_RESP\n");
@@ -243,7 +437,7 @@ static uint8_t qmi_nas_handle_ind_req_reply(struct qmi_device *qmid){
         if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
             QMID_DEBUG_PRINT(stderr, "Sucessfully set NAS indications\n");
 
-        qmid->nas_state = NAS_SYS_INFO_QUERY;
+        qmid->nas_state = NAS_SIG_IND_REQ;
         //I don't care about the return value. If something fails, a timeout
         //will make sure the message is resent
         qmi_nas_send(qmid);
@@ -251,6 +445,432 @@ static uint8_t qmi_nas_handle_ind_req_reply(struct qmi_device *qmid){
     }
 }
 
+//Signal indications are optional. Without them, signal is polled as before
+static uint8_t qmi_nas_handle_sig_ind_reply(struct qmi_device *qmid){
+    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
+    qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
+    qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
+    uint16_t result = qmi_helpers_get_result(tlv);
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+        QMID_DEBUG_PRINT(stderr, "Received %s\n", qmid->nas_state ==
+                NAS_SIG_IND_REQ ? "SET_INDICATION_RESP" :
+                "CONFIG_SIG_INFO_RESP");
+
+    if(result == QMI_RESULT_FAILURE){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Signal indications not supported (error "
+                    "%x), will poll\n", qmi_helpers_get_error(tlv));
+
+        qmid->nas_state = NAS_SYS_INFO_QUERY;
+    } else if(qmid->nas_state == NAS_SIG_IND_REQ){
+        qmid->nas_state = NAS_SIG_CONFIG;
+    } else{
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Sucessfully set signal indications\n");
+
+        qmid->nas_sig_ind = 1;
+        qmid->nas_state = NAS_SYS_INFO_QUERY;
+    }
+
+    qmi_nas_send(qmid);
+    return QMI_MSG_SUCCESS;
+}
+
+static const char *qmi_nas_radio_if_str(uint8_t radio_if){
+    switch(radio_if){
+        case QMI_NAS_RADIO_IF_GSM:
+            return "GSM";
+        case QMI_NAS_RADIO_IF_UMTS:
+            return "UMTS";
+        case QMI_NAS_RADIO_IF_LTE:
+            return "LTE";
+        default:
+            return "unknown";
+    }
+}
+
+//Bandwidth in kHz, 0 if unknown
+static uint32_t qmi_nas_bandwidth_khz(uint8_t bandwidth){
+    switch(bandwidth){
+        case QMI_NAS_BANDWIDTH_1_4:
+            return 1400;
+        case QMI_NAS_BANDWIDTH_3:
+            return 3000;
+        case QMI_NAS_BANDWIDTH_5:
+            return 5000;
+        case QMI_NAS_BANDWIDTH_10:
+            return 10000;
+        case QMI_NAS_BANDWIDTH_15:
+            return 15000;
+        case QMI_NAS_BANDWIDTH_20:
+            return 20000;
+        default:
+            return 0;
+    }
+}
+
+static void qmi_nas_print_rf_band_set(struct qmid_rf_band_set *set,
+        const char *desc){
+    struct qmid_rf_band *rf_band;
+    uint32_t bw_khz;
+    uint8_t i;
+
+    if(!set->num_bands){
+        QMID_DEBUG_PRINT(stderr, "%s: no bands (dwell %us)\n", desc,
+                set->dwell);
+        return;
+    }
+
+    for(i=0; i<set->num_bands; i++){
+        rf_band = &(set->bands[i]);
+        bw_khz = qmi_nas_bandwidth_khz(rf_band->bandwidth);
+
+        QMID_DEBUG_PRINT(stderr, "%s: %s carrier %u/%u %s band %u channel %u "
+                "bandwidth %u.%u MHz (dwell %us)\n", desc,
+                i ? "secondary" : "primary", i + 1, set->num_bands,
+                qmi_nas_radio_if_str(rf_band->radio_if), rf_band->band,
+                rf_band->channel, bw_khz / 1000, (bw_khz % 1000) / 100,
+                set->dwell);
+    }
+}
+
+void qmi_nas_print_rf_bands(struct qmi_device *qmid){
+    struct qmid_rf_band_set cur;
+    uint8_t i, idx;
+
+    //Dwell of the current set is how long it has been active so far
+    memcpy(&cur, &(qmid->rf_bands), sizeof(cur));
+
+    if(cur.start)
+        cur.dwell = time(NULL) - cur.start;
+    qmi_nas_print_rf_band_set(&cur, "Current bands");
+
+    //Newest first
+    for(i=0; i<qmid->rf_band_history_len; i++){
+        idx = (qmid->rf_band_history_idx + QMID_RF_BAND_HISTORY - 1 - i) %
+            QMID_RF_BAND_HISTORY;
+        qmi_nas_print_rf_band_set(&(qmid->rf_band_history[idx]),
+                "Previous bands");
+    }
+}
+
+void qmi_nas_print_status(struct qmi_device *qmid){
+    struct qmid_serving_system *srv_sys = &(qmid->serving_system);
+
+    QMID_DEBUG_PRINT(stderr, "NAS status: technology %u. Registration state %s "
+            "CS %s PS %s%s PLMN %u-%0*u (%s)\n", qmid->cur_service,
+            qmi_gen_nas_reg_state_str(srv_sys->reg_state),
+            srv_sys->cs_attached ? "ATTACHED" : "DETACHED",
+            srv_sys->ps_attached ? "ATTACHED" : "DETACHED",
+            srv_sys->roaming ? " roaming" : "", srv_sys->mcc,
+            srv_sys->mnc_3digit ? 3 : 2, srv_sys->mnc, srv_sys->plmn_desc);
+
+    if(qmid->band_pref || qmid->lte_band_pref)
+        QMID_DEBUG_PRINT(stderr, "Configured band preference %llx LTE bands "
+                "%llx\n", (unsigned long long) qmid->band_pref,
+                (unsigned long long) qmid->lte_band_pref);
+}
+
+//Replace the current band combination, if it has changed. The old combination
+//is moved to the history together with how long it was used
+static void qmi_nas_update_rf_bands(struct qmi_device *qmid,
+        struct qmid_rf_band_set *set){
+    struct qmid_rf_band_set *old = &(qmid->rf_bands);
+    time_t now = time(NULL);
+
+    if(set->num_bands == old->num_bands && !memcmp(set->bands, old->bands,
+                sizeof(struct qmid_rf_band) * set->num_bands))
+        return;
+
+    //start is 0 before the first band info is received
+    if(old->start){
+        old->dwell = now - old->start;
+        memcpy(&(qmid->rf_band_history[qmid->rf_band_history_idx]), old,
+                sizeof(struct qmid_rf_band_set));
+        qmid->rf_band_history_idx = (qmid->rf_band_history_idx + 1) %
+            QMID_RF_BAND_HISTORY;
+
+        if(qmid->rf_band_history_len < QMID_RF_BAND_HISTORY)
+            qmid->rf_band_history_len++;
+    }
+
+    memcpy(old, set, sizeof(struct qmid_rf_band_set));
+    old->start = now;
+    old->dwell = 0;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1){
+        if(old->num_bands > 1)
+            QMID_DEBUG_PRINT(stderr, "Band combination changed, %u carriers "
+                    "(carrier aggregation)\n", old->num_bands);
+        else
+            QMID_DEBUG_PRINT(stderr, "Band combination changed, %u carrier(s)\n",
+                    old->num_bands);
+
+        qmi_nas_print_rf_band_set(old, "Current bands");
+    }
+}
+
+//Mode preference bit of a radio interface, 0 if qmid does not use it
+static uint16_t qmi_nas_radio_if_mode(uint8_t radio_if){
+    switch(radio_if){
+        case QMI_NAS_RADIO_IF_GSM:
+            return QMI_NAS_RAT_MODE_PREF_GSM;
+        case QMI_NAS_RADIO_IF_UMTS:
+            return QMI_NAS_RAT_MODE_PREF_UMTS;
+        case QMI_NAS_RADIO_IF_LTE:
+            return QMI_NAS_RAT_MODE_PREF_LTE;
+        default:
+            return 0;
+    }
+}
+
+//The modem has no service after the initial query. If there is a
+//last-known-good system that the preference allows, read the current
+//preference (to know what to restore) before biasing towards the system
+static void qmi_nas_start_lkg_bias(struct qmi_device *qmid){
+    struct qmi_lkg *lkg = &(qmid->lkg);
+
+    if(!lkg->valid || !(qmi_nas_radio_if_mode(lkg->radio_if) &
+                qmid->rat_mode_pref)){
+        lkg->state = QMI_LKG_DONE;
+        return;
+    }
+
+    lkg->biased_band_pref = lkg->biased_lte_band_pref = lkg->biased_net_sel =
+        lkg->biased_acq_order = 0;
+    lkg->state = QMI_LKG_QUERY;
+    lkg->bias_start = time(NULL);
+    qmi_nas_get_sys_selection(qmid);
+}
+
+//Service has been found or the bias has timed out, go back to the full
+//preference
+static void qmi_nas_end_lkg_bias(struct qmi_device *qmid, const char *reason){
+    struct qmi_lkg *lkg = &(qmid->lkg);
+    uint8_t was_biased = lkg->state == QMI_LKG_BIASED;
+
+    lkg->state = QMI_LKG_DONE;
+
+    if(!was_biased)
+        return;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Acquisition bias ended after %lds (%s)\n",
+                (long) (time(NULL) - lkg->bias_start), reason);
+
+    qmi_nas_set_sys_selection(qmid);
+}
+
+void qmi_nas_check_lkg_bias(struct qmi_device *qmid){
+    struct qmi_lkg *lkg = &(qmid->lkg);
+
+    if((lkg->state == QMI_LKG_QUERY || lkg->state == QMI_LKG_BIASED) &&
+            time(NULL) - lkg->bias_start >= lkg->timeout)
+        qmi_nas_end_lkg_bias(qmid, "timeout");
+}
+
+//Compare a configured band mask with what the modem uses. Bands the modem
+//does not support are removed by it, a mask with nothing in common is either
+//rejected or ignored
+static void qmi_nas_verify_band_pref(const char *name, uint64_t configured,
+        uint8_t present, uint64_t mask){
+    if(!configured)
+        return;
+
+    if(mask == configured){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+            QMID_DEBUG_PRINT(stderr, "Modem uses the configured %s %llx\n",
+                    name, (unsigned long long) mask);
+        return;
+    }
+
+    if(qmid_verbose_logging < QMID_LOG_LEVEL_1)
+        return;
+
+    if(!present){
+        QMID_DEBUG_PRINT(stderr, "Modem did not report its %s\n", name);
+    } else if(!(mask & ~configured)){
+        QMID_DEBUG_PRINT(stderr, "Modem uses %s %llx, unsupported bands of "
+                "%llx are ignored\n", name, (unsigned long long) mask,
+                (unsigned long long) configured);
+    } else{
+        QMID_DEBUG_PRINT(stderr, "Modem uses %s %llx instead of %llx\n", name,
+                (unsigned long long) mask, (unsigned long long) configured);
+    }
+}
+
+//The current preference is used to know what to restore after a bias
+static void qmi_nas_lkg_read_pref(struct qmi_device *qmid,
+        struct qmi_gen_nas_get_system_selection_preference *msg){
+    struct qmi_lkg *lkg = &(qmid->lkg);
+    int8_t bit = qmi_lkg_band_pref_bit(lkg->radio_if, lkg->band);
+
+    //A band can only be preferred if it is already part of the preference
+    if(msg->band_pref && lkg->radio_if == QMI_NAS_RADIO_IF_UMTS && bit >= 0){
+        lkg->band_pref = le64toh(msg->band_pref->mask);
+        lkg->biased_band_pref = !!(lkg->band_pref & (1ULL << bit));
+    }
+
+    if(msg->lte_band_pref && lkg->radio_if == QMI_NAS_RADIO_IF_LTE &&
+            bit >= 0){
+        lkg->lte_band_pref = le64toh(msg->lte_band_pref->mask);
+        lkg->biased_lte_band_pref = !!(lkg->lte_band_pref & (1ULL << bit));
+    }
+
+    //Manual selection by the user is left alone
+    if(msg->net_sel_pref && msg->net_sel_pref->mode == QMI_NAS_NET_SEL_AUTOMATIC
+            && lkg->mcc)
+        lkg->biased_net_sel = 1;
+
+    if(msg->acq_order && msg->acq_order->count &&
+            msg->acq_order->count <= QMI_LKG_MAX_ACQ_ORDER){
+        lkg->acq_order_len = msg->acq_order->count;
+        memcpy(lkg->acq_order, msg->acq_order->radio_if, lkg->acq_order_len);
+        lkg->biased_acq_order = 1;
+    }
+
+    if(!lkg->biased_band_pref && !lkg->biased_lte_band_pref &&
+            !lkg->biased_net_sel && !lkg->biased_acq_order){
+        lkg->state = QMI_LKG_DONE;
+        return;
+    }
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Biasing acquisition towards %s band %u PLMN "
+                "%u-%0*u for %us\n", qmi_nas_radio_if_str(lkg->radio_if),
+                lkg->band, lkg->mcc, lkg->mnc_3digit ? 3 : 2, lkg->mnc,
+                lkg->timeout);
+
+    lkg->state = QMI_LKG_BIASED;
+    lkg->bias_start = time(NULL);
+    qmi_nas_set_sys_selection(qmid);
+}
+
+//Read either to verify the configured bands or before biasing acquisition
+static uint8_t qmi_nas_handle_get_sys_selection(struct qmi_device *qmid){
+    struct qmi_gen_nas_get_system_selection_preference msg;
+    uint8_t verify = qmid->sys_sel_verify;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+        QMID_DEBUG_PRINT(stderr, "Received GET_SYSTEM_SELECTION_RESP\n");
+
+    qmid->sys_sel_verify = 0;
+
+    if(qmi_gen_nas_get_system_selection_preference_decode(qmid->buf, &msg) ==
+            QMI_MSG_FAILURE || msg.result == QMI_RESULT_FAILURE){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Could not read system selection%s\n",
+                    qmid->lkg.state == QMI_LKG_QUERY ?
+                    ", will not bias acquisition" : "");
+
+        if(qmid->lkg.state == QMI_LKG_QUERY)
+            qmid->lkg.state = QMI_LKG_DONE;
+
+        return QMI_MSG_IGNORE;
+    }
+
+    if(verify){
+        qmi_nas_verify_band_pref("band preference", qmid->band_pref,
+                msg.band_pref != NULL, msg.band_pref ?
+                le64toh(msg.band_pref->mask) : 0);
+        qmi_nas_verify_band_pref("LTE band preference", qmid->lte_band_pref,
+                msg.lte_band_pref != NULL, msg.lte_band_pref ?
+                le64toh(msg.lte_band_pref->mask) : 0);
+    }
+
+    if(qmid->lkg.state == QMI_LKG_QUERY)
+        qmi_nas_lkg_read_pref(qmid, &msg);
+
+    return QMI_MSG_SUCCESS;
+}
+
+//The system is remembered once it has carried data with good signal
+static void qmi_nas_save_lkg(struct qmi_device *qmid){
+    struct qmid_serving_system *srv_sys = &(qmid->serving_system);
+    struct qmid_rf_band *rf_band = &(qmid->rf_bands.bands[0]);
+    uint8_t i, connected = 0;
+    int retval;
+
+    for(i=0; i<qmid->wds_num_sessions; i++)
+        if(qmid->wds_sessions[i].wds_state == WDS_CONNECTED)
+            connected = 1;
+
+    if(!connected || !qmid->rf_bands.num_bands || !srv_sys->mcc ||
+            srv_sys->reg_state != QMI_GEN_NAS_REG_STATE_REGISTERED)
+        return;
+
+    retval = qmi_lkg_update(&(qmid->lkg), rf_band->radio_if, rf_band->band,
+            srv_sys->mcc, srv_sys->mnc, srv_sys->mnc_3digit);
+
+    if(qmid_verbose_logging < QMID_LOG_LEVEL_1)
+        return;
+
+    if(retval == 1)
+        QMID_DEBUG_PRINT(stderr, "Saved last-known-good system %s band %u "
+                "PLMN %u-%0*u\n", qmi_nas_radio_if_str(rf_band->radio_if),
+                rf_band->band, srv_sys->mcc, srv_sys->mnc_3digit ? 3 : 2,
+                srv_sys->mnc);
+    else if(retval == -1)
+        QMID_DEBUG_PRINT(stderr, "Could not write %s (%s)\n", qmid->lkg.path,
+                strerror(errno));
+}
+
+//Common for SYS_INFO and SERVING_SYSTEM, both can tell that service has been
+//gained or lost. They only report the technology, whether it can be used is
+//decided here for both
+static void qmi_nas_set_service(struct qmi_device *qmid, uint8_t cur_service){
+    struct qmid_serving_system *srv_sys = &(qmid->serving_system);
+    struct qmid_rf_band_set rf_bands;
+    struct qmi_hooks_event ev;
+    uint8_t prev_service = qmid->cur_service;
+
+    //Data can only be used when registered and attached to the PS domain
+    //(SERVING_SYSTEM is requested before SYS_INFO, and indicated on changes).
+    //Modems that do not answer SERVING_SYSTEM, or do not know the attach
+    //state, are trusted on what SYS_INFO says
+    if(srv_sys->known && (srv_sys->reg_state !=
+                QMI_GEN_NAS_REG_STATE_REGISTERED ||
+                (srv_sys->ps_attach_known && !srv_sys->ps_attached)))
+        cur_service = NO_SERVICE;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1 && cur_service
+            != qmid->cur_service){
+        if(cur_service)
+            QMID_DEBUG_PRINT(stderr, "Modem is connected to technology %u\n",
+                    cur_service);
+        else
+            QMID_DEBUG_PRINT(stderr, "Modem has no service\n");
+    }
+
+    //No bands are in use without service. Closes the dwell time of the last
+    //combination
+    if(!cur_service){
+        memset(&rf_bands, 0, sizeof(rf_bands));
+        qmi_nas_update_rf_bands(qmid, &rf_bands);
+    }
+
+    //Bias only if the modem is searching after setup. A registered modem
+    //(for example after a restart of qmid) must not be disturbed
+    if(cur_service)
+        qmi_nas_end_lkg_bias(qmid, "service found");
+    else if(qmid->lkg.state == QMI_LKG_IDLE && qmid->nas_state == NAS_IDLE &&
+            srv_sys->reg_state != QMI_GEN_NAS_REG_STATE_REGISTERED)
+        qmi_nas_start_lkg_bias(qmid);
+
+    //update_connect takes care of the logic related to cur_service
+    qmid->cur_service = cur_service;
+
+    //The hook gets the new service in QMID_SERVICE
+    if(cur_service != prev_service){
+        qmi_hooks_event_init(&ev, QMI_HOOK_SERVICE);
+        qmi_hooks_run(qmid, &ev);
+        qmi_events_service(qmid, prev_service);
+    }
+
+    qmi_wds_update_connect(qmid);
+}
+
 //No return value needed, as no action will be taken if this message is not
 //correct
 static uint8_t qmi_nas_handle_sys_info(struct qmi_device *qmid){
@@ -258,7 +878,7 @@ static uint8_t qmi_nas_handle_sys_info(struct qmi_device *qmid){
     qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
     qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
     uint16_t tlv_length = le16toh(qmi_hdr->length), i = 0;
-    uint16_t result = le16toh(*((uint16_t*) (tlv+1)));
+    uint16_t result = qmi_helpers_get_result(tlv);
     qmi_nas_service_info_t *qsi = NULL;
     uint8_t cur_service = NO_SERVICE;
 
@@ -310,137 +930,301 @@ static uint8_t qmi_nas_handle_sys_info(struct qmi_device *qmid){
             tlv = (qmi_tlv_t*) (((uint8_t*) (tlv+1)) + le16toh(tlv->length));
     }
 
-    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1 && cur_service
-            != qmid->cur_service){
-        if(cur_service)
-            QMID_DEBUG_PRINT(stderr, "Modem is connected to technology %u\n",
-                    cur_service);
-        else
-            QMID_DEBUG_PRINT(stderr, "Modem has no service\n");
+    qmi_nas_set_service(qmid, cur_service);
+
+    return QMI_MSG_SUCCESS;
+}
+
+//Map the radio interfaces from SERVING_SYSTEM to a service. With more than one
+//interface (for example during handover), the best is used
+static uint8_t qmi_nas_radio_if_to_service(const uint8_t *radio_ifs,
+        uint8_t num){
+    uint8_t i, service = NO_SERVICE;
+
+    for(i=0; i<num; i++){
+        if(radio_ifs[i] == QMI_NAS_RADIO_IF_LTE)
+            service = SERVICE_LTE;
+        else if(radio_ifs[i] == QMI_NAS_RADIO_IF_UMTS && service < SERVICE_UMTS)
+            service = SERVICE_UMTS;
+        else if(radio_ifs[i] == QMI_NAS_RADIO_IF_GSM && service < SERVICE_GSM)
+            service = SERVICE_GSM;
     }
 
-    //update_connect takes care of the logic related to cur_service
-    qmid->cur_service = cur_service;
-    qmi_wds_update_connect(qmid);
+    return service;
+}
+
+//Used both for the GET_SERVING_SYSTEM response and the indication. The
+//indication is sent as soon as registration or attach state changes, so a PS
+//attach is acted on immediatly instead of when the next SYS_INFO arrives
+static uint8_t qmi_nas_handle_serving_system(struct qmi_device *qmid){
+    struct qmi_gen_nas_get_serving_system msg;
+    const struct qmi_gen_nas_get_serving_system_serving_system *ss;
+    struct qmid_serving_system srv_sys;
+    uint8_t cur_service = NO_SERVICE, desc_len;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+        QMID_DEBUG_PRINT(stderr, "Received SERVING_SYSTEM_RESP/IND\n");
+
+    if(qmi_gen_nas_get_serving_system_decode(qmid->buf, &msg) ==
+            QMI_MSG_FAILURE || msg.result == QMI_RESULT_FAILURE)
+        return QMI_MSG_IGNORE;
+
+    //Roaming and PLMN are only included when they have changed (indication) or
+    //are known, so start from the previous values
+    memcpy(&srv_sys, &(qmid->serving_system), sizeof(srv_sys));
+
+    ss = msg.serving_system;
+    srv_sys.known = 1;
+    srv_sys.reg_state = ss->reg_state;
+    srv_sys.cs_attached = ss->cs_attach_state ==
+        QMI_GEN_NAS_ATTACH_STATE_ATTACHED;
+    srv_sys.ps_attach_known = ss->ps_attach_state !=
+        QMI_GEN_NAS_ATTACH_STATE_UNKNOWN;
+    srv_sys.ps_attached = ss->ps_attach_state ==
+        QMI_GEN_NAS_ATTACH_STATE_ATTACHED;
+    cur_service = qmi_nas_radio_if_to_service(ss->radio_if,
+            ss->radio_if_count);
+
+    if(msg.roaming)
+        srv_sys.roaming = msg.roaming->indicator == QMI_NAS_ROAMING_ON;
+
+    if(msg.plmn){
+        srv_sys.mcc = le16toh(msg.plmn->mcc);
+        srv_sys.mnc = le16toh(msg.plmn->mnc);
+        //Without the digit count, only a MNC above 99 is known to have three
+        srv_sys.mnc_3digit = srv_sys.mnc > 99;
+        desc_len = msg.plmn->desc_len > QMID_MAX_LENGTH_PLMN ?
+            QMID_MAX_LENGTH_PLMN : msg.plmn->desc_len;
+        memcpy(srv_sys.plmn_desc, msg.plmn->desc, desc_len);
+        srv_sys.plmn_desc[desc_len] = '\0';
+    }
+
+    if(msg.mnc_pcs_digit){
+        srv_sys.mcc = le16toh(msg.mnc_pcs_digit->mcc);
+        srv_sys.mnc = le16toh(msg.mnc_pcs_digit->mnc);
+        srv_sys.mnc_3digit = !!msg.mnc_pcs_digit->includes_pcs_digit;
+    }
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1 &&
+            memcmp(&srv_sys, &(qmid->serving_system), sizeof(srv_sys)))
+        QMID_DEBUG_PRINT(stderr, "Registration state %s CS %s PS %s%s "
+                "PLMN %u-%0*u (%s)\n",
+                qmi_gen_nas_reg_state_str(srv_sys.reg_state),
+                qmi_gen_nas_attach_state_str(ss->cs_attach_state),
+                qmi_gen_nas_attach_state_str(ss->ps_attach_state),
+                srv_sys.roaming ? " roaming" : "", srv_sys.mcc,
+                srv_sys.mnc_3digit ? 3 : 2, srv_sys.mnc, srv_sys.plmn_desc);
+
+    memcpy(&(qmid->serving_system), &srv_sys, sizeof(srv_sys));
+    qmi_nas_set_service(qmid, cur_service);
 
     return QMI_MSG_SUCCESS;
 }
 
 static uint8_t qmi_nas_handle_sig_info(struct qmi_device *qmid){
-    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
-    qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
-    qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
-    uint16_t tlv_length = le16toh(qmi_hdr->length), i = 0;
-    uint16_t result = le16toh(*((uint16_t*) (tlv+1)));
-    qmi_nas_wcdma_signal_info_t *wcdma_sig = NULL;
-    qmi_nas_lte_signal_info_t *lte_sig = NULL;
-    int8_t cur_signal_dbm = 0;
+    struct qmi_gen_nas_get_sig_info msg;
+    const struct qmi_gen_nas_get_sig_info_wcdma *wcdma_sig = NULL;
+    const struct qmi_gen_nas_get_sig_info_lte *lte_sig = NULL;
+    struct qmi_sig_sample sample;
+    //RSRP goes down to -140 dBm, it does not fit in an int8_t
+    int16_t cur_signal_dbm = 0;
     int8_t cur_bars = 0;
 
+    memset(&sample, 0, sizeof(sample));
+
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
-        QMID_DEBUG_PRINT(stderr, "Received SIG_INFO_RESP\n");
+        QMID_DEBUG_PRINT(stderr, "Received SIG_INFO\n");
 
-    if(result == QMI_RESULT_FAILURE)
-        return QMI_MSG_FAILURE;
+    //Signal info is only requested periodically and indicated, neither is
+    //part of setting up the modem. Skip a bad message and wait for the next
+    if(qmi_gen_nas_get_sig_info_decode(qmid->buf, &msg) == QMI_MSG_FAILURE ||
+            msg.result == QMI_RESULT_FAILURE){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Could not get signal info\n");
+        return QMI_MSG_IGNORE;
+    }
 
-    //Remove first tlv
-    tlv_length = tlv_length - sizeof(qmi_tlv_t) - le16toh(tlv->length);
-    tlv = (qmi_tlv_t*) (((uint8_t*) (tlv+1)) + le16toh(tlv->length));
+    //Only one technology is reported at a time
+    if(msg.wcdma != NULL){
+        wcdma_sig = msg.wcdma;
+        //According to Wikipedia, ASU for UMTS should be calculated using
+        //the RSCP value. I dont have access to this one, so use RSSI (which
+        //should be the forward link pilot channel). Check this
+        //Mapping from
+        //http://note19.com/2010/07/04/
+        //mapping-cellular-signal-strength-to-5-bars/
+
+        cur_signal_dbm = wcdma_sig->rssi;
+
+        if(cur_signal_dbm >= -73)
+            cur_bars = SIGNAL_STRENGTH_GREAT;
+        else if(cur_signal_dbm >= -85)
+            cur_bars = SIGNAL_STRENGTH_GOOD;
+        else if(cur_signal_dbm >= -98)
+            cur_bars = SIGNAL_STRENGTH_MODERATE;
+        else if(cur_signal_dbm >= -110)
+            cur_bars = SIGNAL_STRENGTH_POOR;
+        else
+            cur_bars = SIGNAL_STRENGTH_NONE_OR_UNKNOWN;
 
-    while(i<tlv_length){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "WCDMA. RSSI %d dBm ECIO %d "
+                    "# bars %d\n", wcdma_sig->rssi,
+                    (int16_t) le16toh(wcdma_sig->ecio), cur_bars);
+
+        sample.values[QMI_SIG_RSSI] = wcdma_sig->rssi;
+        sample.values[QMI_SIG_ECIO] = (int16_t) le16toh(wcdma_sig->ecio);
+        sample.valid = (1 << QMI_SIG_RSSI) | (1 << QMI_SIG_ECIO);
+    } else if(msg.lte != NULL){
+        lte_sig = msg.lte;
+        cur_signal_dbm = (int16_t) le16toh(lte_sig->rsrp);
+
+        if(cur_signal_dbm == -1)
+            cur_bars = SIGNAL_STRENGTH_NONE_OR_UNKNOWN;
+        else if(cur_signal_dbm >= -85)
+            cur_bars = SIGNAL_STRENGTH_GREAT;
+        else if(cur_signal_dbm >= -95)
+            cur_bars = SIGNAL_STRENGTH_GOOD;
+        else if(cur_signal_dbm >= -105)
+            cur_bars = SIGNAL_STRENGTH_MODERATE;
+        else if(cur_signal_dbm >= -115)
+            cur_bars = SIGNAL_STRENGTH_POOR;
 
-        if(tlv->type == QMI_NAS_TLV_SIG_INFO_WCDMA){
-            wcdma_sig = (qmi_nas_wcdma_signal_info_t*) (tlv+1);
-            //According to Wikipedia, ASU for UMTS should be calculated using
-            //the RSCP value. I dont have access to this one, so use RSSI (which
-            //should be the forward link pilot channel). Check this
-            //Mapping from
-            //http://note19.com/2010/07/04/
-            //mapping-cellular-signal-strength-to-5-bars/
-
-            cur_signal_dbm = wcdma_sig->rssi;
-
-            if(cur_signal_dbm >= -73)
-                cur_bars = SIGNAL_STRENGTH_GREAT;
-            else if(cur_signal_dbm >= -85)
-                cur_bars = SIGNAL_STRENGTH_GOOD;
-            else if(cur_signal_dbm >= -98)
-                cur_bars = SIGNAL_STRENGTH_MODERATE;
-            else if(cur_signal_dbm >= -110)
-                cur_bars = SIGNAL_STRENGTH_POOR;
-            else
-                cur_bars = SIGNAL_STRENGTH_NONE_OR_UNKNOWN;
-
-            if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
-                QMID_DEBUG_PRINT(stderr, "WCDMA. RSSI %d dBm ECIO %d "
-                        "# bars %d\n", wcdma_sig->rssi,
-                        le16toh(wcdma_sig->ecio), cur_bars);
-            break;
-        } else if(tlv->type == QMI_NAS_TLV_SIG_INFO_LTE){
-            lte_sig = (qmi_nas_lte_signal_info_t*) (tlv+1);
-            cur_signal_dbm = le16toh(lte_sig->rsrp);
-
-            if(cur_signal_dbm == -1)
-                cur_bars = SIGNAL_STRENGTH_NONE_OR_UNKNOWN;
-            else if(cur_signal_dbm >= -85)
-                cur_bars = SIGNAL_STRENGTH_GREAT;
-            else if(cur_signal_dbm >= -95)
-                cur_bars = SIGNAL_STRENGTH_GOOD;
-            else if(cur_signal_dbm >= -105)
-                cur_bars = SIGNAL_STRENGTH_MODERATE;
-            else if(cur_signal_dbm >= -115)
-                cur_bars = SIGNAL_STRENGTH_POOR;
-
-            if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
-                QMID_DEBUG_PRINT(stderr, "LTE. RSSI %d dBm RSRQ %d dB RSRP %d "
-                        "SNR %d # bars %d\n", lte_sig->rssi, lte_sig->rsrq,
-                        lte_sig->rsrp, lte_sig->snr/10,
-                        cur_bars);
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "LTE. RSSI %d dBm RSRQ %d dB RSRP %d "
+                    "SNR %d # bars %d\n", lte_sig->rssi, lte_sig->rsrq,
+                    cur_signal_dbm, ((int16_t) le16toh(lte_sig->snr))/10,
+                    cur_bars);
+
+        sample.values[QMI_SIG_RSSI] = lte_sig->rssi;
+        sample.values[QMI_SIG_RSRQ] = lte_sig->rsrq;
+        sample.values[QMI_SIG_RSRP] = cur_signal_dbm;
+        sample.values[QMI_SIG_SNR] = (int16_t) le16toh(lte_sig->snr);
+        sample.valid = (1 << QMI_SIG_RSSI) | (1 << QMI_SIG_RSRQ) |
+            (1 << QMI_SIG_RSRP) | (1 << QMI_SIG_SNR);
+    }
 
-            break;
-        } 
-        
-        i += sizeof(qmi_tlv_t) + le16toh(tlv->length);
+    if(sample.valid){
+        sample.timestamp = time(NULL);
+        sample.service = qmid->cur_service;
+        qmi_sig_history_add(&(qmid->sig_history), &sample);
 
-        if(i==tlv_length)
-            break;
-        else
-            tlv = (qmi_tlv_t*) (((uint8_t*) (tlv+1)) + le16toh(tlv->length));
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+            qmi_sig_history_print(&(qmid->sig_history));
+
+        qmi_events_signal(qmid, &sample);
+        qmi_policy_update(qmid);
     }
 
+    if(cur_bars >= SIGNAL_STRENGTH_GOOD)
+        qmi_nas_save_lkg(qmid);
+
     return QMI_MSG_SUCCESS;
 }
 
+//Used both for GET_RF_BAND_INFO and RF_BAND_INFO_IND. The band list is
+//mandatory, while channel (32 bit) and bandwidth are only included by newer
+//modems. All lists contain one instance per carrier, in the same order
 static uint8_t qmi_nas_handle_rf_band_info(struct qmi_device *qmid){
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
     qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
     qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
-    uint16_t result = le16toh(*((uint16_t*) (tlv+1)));
-    uint8_t retval = QMI_MSG_IGNORE;
-    uint8_t num_instances = 0;
+    uint16_t tlv_length = le16toh(qmi_hdr->length), i = 0;
+    uint16_t result = qmi_helpers_get_result(tlv);
     qmi_nas_rf_band_info_t *rf_info = NULL;
+    qmi_nas_rf_band_info_ext_t *rf_info_ext = NULL;
+    qmi_nas_rf_bandwidth_t *rf_bw = NULL;
+    struct qmid_rf_band_set set;
+    uint8_t num_instances = 0, j, got_bands = 0;
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
-        QMID_DEBUG_PRINT(stderr, "Received RF_BAND_INFO_RECV_RESP\n");
+        QMID_DEBUG_PRINT(stderr, "Received RF_BAND_INFO_RESP/IND\n");
 
-    if(result == QMI_RESULT_FAILURE){
-        return retval;
-    } 
+    memset(&set, 0, sizeof(set));
 
-    tlv = (qmi_tlv_t*) (((uint8_t*) (tlv+1)) + le16toh(tlv->length));
-    num_instances = *((uint8_t*) (tlv+1));
+    for(j=0; j<QMID_MAX_RF_BANDS; j++)
+        set.bands[j].bandwidth = QMI_NAS_BANDWIDTH_UNKNOWN;
 
-    //TODO: Add support if number of bands is > 1
-    if(num_instances > 1)
-        return retval;
+    if(qmi_hdr->control_flags & QMI_CTL_FLAGS_RESP){
+        if(result == QMI_RESULT_FAILURE)
+            return QMI_MSG_IGNORE;
 
-    rf_info = (qmi_nas_rf_band_info_t*) (((uint8_t*) (tlv+1)) + 1);
+        tlv_length = tlv_length - sizeof(qmi_tlv_t) - le16toh(tlv->length);
+        tlv = (qmi_tlv_t*) (((uint8_t*) (tlv+1)) + le16toh(tlv->length));
+    }
 
-    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
-        QMID_DEBUG_PRINT(stderr, "Technology %x Band %u\n", rf_info->radio_if,
-                le16toh(rf_info->active_band));
+    while(i<tlv_length){
+        num_instances = *((uint8_t*) (tlv+1));
 
-    return retval;
+        switch(tlv->type){
+            case QMI_NAS_TLV_RF_BAND_INFO:
+                if(le16toh(tlv->length) < 1 + num_instances *
+                        sizeof(qmi_nas_rf_band_info_t))
+                    return QMI_MSG_IGNORE;
+
+                if(num_instances > QMID_MAX_RF_BANDS)
+                    num_instances = QMID_MAX_RF_BANDS;
+
+                rf_info = (qmi_nas_rf_band_info_t*) (((uint8_t*) (tlv+1)) + 1);
+
+                for(j=0; j<num_instances; j++){
+                    set.bands[j].radio_if = rf_info[j].radio_if;
+                    set.bands[j].band = le16toh(rf_info[j].active_band);
+
+                    //Do not overwrite 32 bit channel if the extended TLV came
+                    //first
+                    if(!set.bands[j].channel)
+                        set.bands[j].channel =
+                            le16toh(rf_info[j].active_channel);
+                }
+
+                set.num_bands = num_instances;
+                got_bands = 1;
+                break;
+            case QMI_NAS_TLV_RF_BAND_INFO_EXT:
+                if(le16toh(tlv->length) < 1 + num_instances *
+                        sizeof(qmi_nas_rf_band_info_ext_t))
+                    break;
+
+                rf_info_ext = (qmi_nas_rf_band_info_ext_t*)
+                    (((uint8_t*) (tlv+1)) + 1);
+
+                for(j=0; j<num_instances && j<QMID_MAX_RF_BANDS; j++)
+                    set.bands[j].channel =
+                        le32toh(rf_info_ext[j].active_channel);
+                break;
+            case QMI_NAS_TLV_RF_BAND_BANDWIDTH:
+                if(le16toh(tlv->length) < 1 + num_instances *
+                        sizeof(qmi_nas_rf_bandwidth_t))
+                    break;
+
+                rf_bw = (qmi_nas_rf_bandwidth_t*) (((uint8_t*) (tlv+1)) + 1);
+
+                for(j=0; j<num_instances && j<QMID_MAX_RF_BANDS; j++)
+                    set.bands[j].bandwidth = le32toh(rf_bw[j].bandwidth);
+                break;
+        }
+
+        i += sizeof(qmi_tlv_t) + le16toh(tlv->length);
+
+        if(i==tlv_length)
+            break;
+        else
+            tlv = (qmi_tlv_t*) (((uint8_t*) (tlv+1)) + le16toh(tlv->length));
+    }
+
+    if(!got_bands)
+        return QMI_MSG_IGNORE;
+
+    //Optional TLVs might contain more instances than the band list
+    for(j=set.num_bands; j<QMID_MAX_RF_BANDS; j++){
+        set.bands[j].channel = 0;
+        set.bands[j].bandwidth = QMI_NAS_BANDWIDTH_UNKNOWN;
+    }
+
+    qmi_nas_update_rf_bands(qmid, &set);
+
+    return QMI_MSG_SUCCESS;
 }
 
 uint8_t qmi_nas_handle_msg(struct qmi_device *qmid){
@@ -465,12 +1249,22 @@ uint8_t qmi_nas_handle_msg(struct qmi_device *qmid){
                 retval = qmi_nas_handle_reset(qmid);
             break;
         case QMI_NAS_SET_SYSTEM_SELECTION_PREFERENCE:
-            if(qmid->nas_state == NAS_SET_SYSTEM)
-                retval = qmi_nas_handle_system_selection(qmid);
+            //Also sent at runtime, the handler checks the state
+            retval = qmi_nas_handle_system_selection(qmid);
             break;
         case QMI_NAS_INDICATION_REGISTER:
             if(qmid->nas_state == NAS_IND_REQ)
                 retval = qmi_nas_handle_ind_req_reply(qmid);
+            else if(qmid->nas_state == NAS_SIG_IND_REQ)
+                retval = qmi_nas_handle_sig_ind_reply(qmid);
+            break;
+        case QMI_NAS_CONFIG_SIG_INFO:
+            if(qmid->nas_state == NAS_SIG_CONFIG)
+                retval = qmi_nas_handle_sig_ind_reply(qmid);
+            break;
+        case QMI_NAS_GET_SYSTEM_SELECTION_PREFERENCE:
+            if(qmid->lkg.state == QMI_LKG_QUERY || qmid->sys_sel_verify)
+                retval = qmi_nas_handle_get_sys_selection(qmid);
             break;
         case QMI_NAS_GET_SYS_INFO:
         case QMI_NAS_SYS_INFO_IND:
@@ -478,10 +1272,16 @@ uint8_t qmi_nas_handle_msg(struct qmi_device *qmid){
             //something has failed with that request, consider it critical.
             retval = qmi_nas_handle_sys_info(qmid);
             break;
+        case QMI_NAS_GET_SERVING_SYSTEM:
+            retval = qmi_nas_handle_serving_system(qmid);
+            break;
         case QMI_NAS_GET_SIG_INFO:
+        case QMI_NAS_SIG_INFO_IND:
+            //Same TLVs, the indication only lacks the result
             retval = qmi_nas_handle_sig_info(qmid);
             break;
         case QMI_NAS_GET_RF_BAND_INFO:
+        case QMI_NAS_RF_BAND_INFO_IND:
             retval = qmi_nas_handle_rf_band_info(qmid);
             break;
         default:
@@ -8,18 +8,28 @@
 #define QMI_NAS_RESET                           0x0000
 #define QMI_NAS_INDICATION_REGISTER             0x0003
 #define QMI_NAS_GET_SERVING_SYSTEM              0x0024
+#define QMI_NAS_SERVING_SYSTEM_IND              0x0024
 #define QMI_NAS_GET_RF_BAND_INFO                0x0031
 #define QMI_NAS_SET_SYSTEM_SELECTION_PREFERENCE 0x0033
+#define QMI_NAS_GET_SYSTEM_SELECTION_PREFERENCE 0x0034
 #define QMI_NAS_GET_SYS_INFO                    0x004D
 #define QMI_NAS_SYS_INFO_IND                    0x004E
 #define QMI_NAS_GET_SIG_INFO                    0x004F
+#define QMI_NAS_CONFIG_SIG_INFO                 0x0050
+#define QMI_NAS_SIG_INFO_IND                    0x0051
 #define QMI_NAS_RF_BAND_INFO_IND                0x0066
 
 //TLVs
+#define QMI_NAS_TLV_IND_SERVING_SYSTEM          0x13
 #define QMI_NAS_TLV_IND_SYS_INFO                0x18
 #define QMI_NAS_TLV_IND_SIGNAL_STRENGTH         0x19
 #define QMI_NAS_TLV_IND_RF_BAND                 0x20
 
+//Signal info config TLVs. Lists of levels (u8 count followed by values), an
+//indication is sent when one is crossed
+#define QMI_NAS_TLV_SIG_CFG_RSSI                0x10
+#define QMI_NAS_TLV_SIG_CFG_LTE_RSRP            0x16
+
 //Sys info TLV
 #define QMI_NAS_TLV_SI_GSM_SS                   0x12
 #define QMI_NAS_TLV_SI_WCDMA_SS                 0x13
@@ -28,11 +38,22 @@
 //Service status info variables
 #define QMI_NAS_TLV_SI_SRV_STATUS_SRV           0x02
 
+//Serving system roaming indicator (layout is in qmi_messages.schema)
+#define QMI_NAS_ROAMING_ON                      0x00
+
 //System selection TLV
 #define QMI_NAS_TLV_SS_MODE                     0x11
 #define QMI_NAS_TLV_SS_DURATION                 0x17
 #define QMI_NAS_TLV_SS_ORDER                    0x1E
 
+//System selection change duration
+#define QMI_NAS_SS_DURATION_PERMANENT           0x00
+#define QMI_NAS_SS_DURATION_POWER_CYCLE         0x01
+
+//Network selection preference
+#define QMI_NAS_NET_SEL_AUTOMATIC               0x00
+#define QMI_NAS_NET_SEL_MANUAL                  0x01
+
 //System selection mode preference values
 #define QMI_NAS_RAT_MODE_PREF_GSM               0x4
 #define QMI_NAS_RAT_MODE_PREF_UMTS              0x8
@@ -40,10 +61,6 @@
 #define QMI_NAS_RAT_MODE_PREF_MIN               (QMI_NAS_RAT_MODE_PREF_GSM | QMI_NAS_RAT_MODE_PREF_UMTS)
 #define QMI_NAS_RAT_MODE_PREF_ALL               (QMI_NAS_RAT_MODE_PREF_MIN | QMI_NAS_RAT_MODE_PREF_LTE)
 
-//SIGINFO TLVs
-#define QMI_NAS_TLV_SIG_INFO_WCDMA              0x13
-#define QMI_NAS_TLV_SIG_INFO_LTE                0x14
-
 //Android constants for number of signal strength bars
 #define SIGNAL_STRENGTH_NONE_OR_UNKNOWN         0
 #define SIGNAL_STRENGTH_POOR                    1
@@ -51,6 +68,20 @@
 #define SIGNAL_STRENGTH_GOOD                    3
 #define SIGNAL_STRENGTH_GREAT                   4
 
+//RF band info TLVs
+#define QMI_NAS_TLV_RF_BAND_INFO                0x01
+#define QMI_NAS_TLV_RF_BAND_INFO_EXT            0x11
+#define QMI_NAS_TLV_RF_BAND_BANDWIDTH           0x12
+
+//Downlink bandwidth of a carrier
+#define QMI_NAS_BANDWIDTH_1_4                   0x00
+#define QMI_NAS_BANDWIDTH_3                     0x01
+#define QMI_NAS_BANDWIDTH_5                     0x02
+#define QMI_NAS_BANDWIDTH_10                    0x03
+#define QMI_NAS_BANDWIDTH_15                    0x04
+#define QMI_NAS_BANDWIDTH_20                    0x05
+#define QMI_NAS_BANDWIDTH_UNKNOWN               0xFF
+
 //Why is there so many definitions of the same variable???
 #define QMI_NAS_RADIO_IF_GSM                    0x04
 #define QMI_NAS_RADIO_IF_UMTS                   0x05
@@ -64,28 +95,27 @@ struct qmi_nas_service_info{
     uint8_t is_pre_data_path;
 } __attribute__((packed));
 
-struct qmi_nas_wcdma_signal_info{
-    int8_t rssi;
-    int16_t ecio;
+struct qmi_nas_rf_band_info{
+    uint8_t radio_if;
+    uint16_t active_band;
+    uint16_t active_channel;
 } __attribute__((packed));
 
-struct qmi_nas_lte_signal_info{
-    int8_t rssi;
-    int8_t rsrq;
-    int16_t rsrp;
-    int16_t snr;
+struct qmi_nas_rf_band_info_ext{
+    uint8_t radio_if;
+    uint16_t active_band;
+    uint32_t active_channel;
 } __attribute__((packed));
 
-struct qmi_nas_rf_band_info{
+struct qmi_nas_rf_bandwidth{
     uint8_t radio_if;
-    uint16_t active_band;
-    uint16_t active_channel;
+    uint32_t bandwidth;
 } __attribute__((packed));
 
 typedef struct qmi_nas_service_info qmi_nas_service_info_t;
-typedef struct qmi_nas_wcdma_signal_info qmi_nas_wcdma_signal_info_t;
-typedef struct qmi_nas_lte_signal_info qmi_nas_lte_signal_info_t;
 typedef struct qmi_nas_rf_band_info qmi_nas_rf_band_info_t;
+typedef struct qmi_nas_rf_band_info_ext qmi_nas_rf_band_info_ext_t;
+typedef struct qmi_nas_rf_bandwidth qmi_nas_rf_bandwidth_t;
 typedef struct qmi_nas_si_order qmi_nas_si_acq_order_t;
 
 struct qmi_device;
@@ -98,4 +128,14 @@ uint8_t qmi_nas_send(struct qmi_device *qmid);
 
 //Update the current system selection
 ssize_t qmi_nas_set_sys_selection(struct qmi_device *qmid);
+
+//Fall back to the full system selection preference if the last-known-good
+//bias has run for too long
+void qmi_nas_check_lkg_bias(struct qmi_device *qmid);
+
+//Output current band combination and history (with dwell times)
+void qmi_nas_print_rf_bands(struct qmi_device *qmid);
+
+//Output current service and serving system
+void qmi_nas_print_status(struct qmi_device *qmid);
 #endif
@@ -0,0 +1,257 @@
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+
+#include "qmi_netlink.h"
+
+#define QMI_NETLINK_BUF_SIZE    512
+//Uevents are a header (action@devpath) followed by KEY=value strings
+#define QMI_NETLINK_UEVENT_SIZE 4096
+//Multicast group of the events sent by the kernel (udev uses group 2)
+#define QMI_NETLINK_UEVENT_KERNEL   1
+
+struct qmi_netlink_req{
+    struct nlmsghdr nlh;
+    union{
+        struct ifaddrmsg ifa;
+        struct rtmsg rtm;
+        struct ifinfomsg ifi;
+    };
+    uint8_t attrs[QMI_NETLINK_BUF_SIZE];
+};
+
+int32_t qmi_netlink_open(){
+    struct sockaddr_nl addr;
+    int32_t nl_fd;
+
+    if((nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE))
+            == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+
+    if(bind(nl_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1){
+        close(nl_fd);
+        return -1;
+    }
+
+    return nl_fd;
+}
+
+static void qmi_netlink_add_attr(struct qmi_netlink_req *req, uint16_t type,
+        const void *data, uint16_t len){
+    struct nlmsghdr *nlh = &(req->nlh);
+    struct rtattr *rta = (struct rtattr*) (((uint8_t*) req) +
+            NLMSG_ALIGN(nlh->nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+//The kernel processes a request while it is being sent, so the ACK is ready
+//when sendto() returns. Reading it here keeps the socket clean and lets me
+//report errors
+static int qmi_netlink_talk(int32_t nl_fd, struct nlmsghdr *nlh){
+    uint8_t buf[QMI_NETLINK_BUF_SIZE];
+    struct nlmsghdr *reply = (struct nlmsghdr*) buf;
+    struct nlmsgerr *err;
+    ssize_t numbytes;
+    static uint32_t seq = 0;
+
+    nlh->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+    nlh->nlmsg_seq = ++seq;
+
+    if(send(nl_fd, nlh, nlh->nlmsg_len, 0) != nlh->nlmsg_len)
+        return -1;
+
+    while(1){
+        numbytes = recv(nl_fd, buf, sizeof(buf), 0);
+
+        if(numbytes == -1 && errno == EINTR)
+            continue;
+        else if(numbytes < (ssize_t) sizeof(struct nlmsghdr))
+            return -1;
+
+        //Ignore stale replies, for example ACKs from failed sends
+        if(reply->nlmsg_seq != seq)
+            continue;
+
+        if(reply->nlmsg_type != NLMSG_ERROR)
+            return 0;
+
+        err = (struct nlmsgerr*) NLMSG_DATA(reply);
+
+        if(err->error){
+            errno = -err->error;
+            return -1;
+        }
+
+        return 0;
+    }
+}
+
+int qmi_netlink_set_mtu(int32_t nl_fd, const char *ifname, uint32_t mtu){
+    struct qmi_netlink_req req;
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.nlh.nlmsg_type = RTM_NEWLINK;
+    req.ifi.ifi_family = AF_UNSPEC;
+
+    if(!(req.ifi.ifi_index = if_nametoindex(ifname)))
+        return -1;
+
+    qmi_netlink_add_attr(&req, IFLA_MTU, &mtu, sizeof(mtu));
+    return qmi_netlink_talk(nl_fd, &req.nlh);
+}
+
+int qmi_netlink_set_link(int32_t nl_fd, const char *ifname, uint8_t up){
+    struct qmi_netlink_req req;
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.nlh.nlmsg_type = RTM_NEWLINK;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_flags = up ? IFF_UP : 0;
+    req.ifi.ifi_change = IFF_UP;
+
+    if(!(req.ifi.ifi_index = if_nametoindex(ifname)))
+        return -1;
+
+    return qmi_netlink_talk(nl_fd, &req.nlh);
+}
+
+int qmi_netlink_update_addr(int32_t nl_fd, const char *ifname, uint8_t add,
+        uint8_t family, const uint8_t *addr, uint8_t prefix_len){
+    struct qmi_netlink_req req;
+    uint16_t addr_len = family == AF_INET6 ? 16 : 4;
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+
+    if(add){
+        req.nlh.nlmsg_type = RTM_NEWADDR;
+        req.nlh.nlmsg_flags = NLM_F_CREATE | NLM_F_REPLACE;
+    } else
+        req.nlh.nlmsg_type = RTM_DELADDR;
+
+    req.ifa.ifa_family = family;
+    req.ifa.ifa_prefixlen = prefix_len;
+    req.ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+
+    if(!(req.ifa.ifa_index = if_nametoindex(ifname)))
+        return -1;
+
+    qmi_netlink_add_attr(&req, IFA_LOCAL, addr, addr_len);
+    qmi_netlink_add_attr(&req, IFA_ADDRESS, addr, addr_len);
+    return qmi_netlink_talk(nl_fd, &req.nlh);
+}
+
+int qmi_netlink_set_default_route(int32_t nl_fd, const char *ifname,
+        uint8_t family, const uint8_t *gateway){
+    struct qmi_netlink_req req;
+    uint16_t addr_len = family == AF_INET6 ? 16 : 4;
+    uint32_t ifindex;
+
+    if(!(ifindex = if_nametoindex(ifname)))
+        return -1;
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+    req.nlh.nlmsg_type = RTM_NEWROUTE;
+    req.nlh.nlmsg_flags = NLM_F_CREATE | NLM_F_REPLACE;
+    req.rtm.rtm_family = family;
+    req.rtm.rtm_table = RT_TABLE_MAIN;
+    req.rtm.rtm_protocol = RTPROT_STATIC;
+    req.rtm.rtm_type = RTN_UNICAST;
+
+    //Without a gateway, the route is a device route
+    if(gateway){
+        req.rtm.rtm_scope = RT_SCOPE_UNIVERSE;
+        qmi_netlink_add_attr(&req, RTA_GATEWAY, gateway, addr_len);
+    } else
+        req.rtm.rtm_scope = RT_SCOPE_LINK;
+
+    qmi_netlink_add_attr(&req, RTA_OIF, &ifindex, sizeof(ifindex));
+    return qmi_netlink_talk(nl_fd, &req.nlh);
+}
+
+int32_t qmi_netlink_open_uevent(){
+    struct sockaddr_nl addr;
+    int32_t nl_fd;
+
+    if((nl_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                    NETLINK_KOBJECT_UEVENT)) == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = QMI_NETLINK_UEVENT_KERNEL;
+
+    if(bind(nl_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1){
+        close(nl_fd);
+        return -1;
+    }
+
+    return nl_fd;
+}
+
+static void qmi_netlink_copy_value(char *dst, size_t dst_len, const char *src){
+    strncpy(dst, src, dst_len - 1);
+    dst[dst_len - 1] = '\0';
+}
+
+int qmi_netlink_read_uevent(int32_t nl_fd, struct qmi_netlink_uevent *ev){
+    char buf[QMI_NETLINK_UEVENT_SIZE + 1];
+    struct sockaddr_nl addr;
+    socklen_t addr_len = sizeof(addr);
+    ssize_t numbytes;
+    char *key;
+
+    while(1){
+        numbytes = recvfrom(nl_fd, buf, QMI_NETLINK_UEVENT_SIZE, 0,
+                (struct sockaddr*) &addr, &addr_len);
+
+        if(numbytes == -1){
+            //Events have been lost, the ones that are left are still valid
+            if(errno == EINTR || errno == ENOBUFS)
+                continue;
+
+            return -1;
+        }
+
+        //Only trust events from the kernel
+        if(addr.nl_pid)
+            continue;
+
+        break;
+    }
+
+    buf[numbytes] = '\0';
+    memset(ev, 0, sizeof(*ev));
+
+    //Skip the action@devpath header, the same information is in the keys
+    for(key = buf + strlen(buf) + 1; key < buf + numbytes;
+            key += strlen(key) + 1){
+        if(!strncmp(key, "ACTION=", 7))
+            qmi_netlink_copy_value(ev->action, sizeof(ev->action), key + 7);
+        else if(!strncmp(key, "SUBSYSTEM=", 10))
+            qmi_netlink_copy_value(ev->subsystem, sizeof(ev->subsystem),
+                    key + 10);
+        else if(!strncmp(key, "DEVNAME=", 8))
+            qmi_netlink_copy_value(ev->devname, sizeof(ev->devname), key + 8);
+        else if(!strncmp(key, "DEVPATH=", 8))
+            qmi_netlink_copy_value(ev->devpath, sizeof(ev->devpath), key + 8);
+    }
+
+    return 0;
+}
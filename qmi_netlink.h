@@ -0,0 +1,38 @@
+#ifndef QMI_NETLINK_H
+#define QMI_NETLINK_H
+
+#include <stdint.h>
+
+//Small rtnetlink helpers for configuring the network interface belonging to
+//the modem. All functions return 0 on success and -1 on failure (errno is set).
+//Family is AF_INET or AF_INET6 and addresses are in network byte order
+int32_t qmi_netlink_open();
+
+int qmi_netlink_set_mtu(int32_t nl_fd, const char *ifname, uint32_t mtu);
+
+int qmi_netlink_set_link(int32_t nl_fd, const char *ifname, uint8_t up);
+
+int qmi_netlink_update_addr(int32_t nl_fd, const char *ifname, uint8_t add,
+        uint8_t family, const uint8_t *addr, uint8_t prefix_len);
+
+//Replace the default route of family so that it points out ifname. gateway is
+//optional
+int qmi_netlink_set_default_route(int32_t nl_fd, const char *ifname,
+        uint8_t family, const uint8_t *gateway);
+
+//Kernel uevents (NETLINK_KOBJECT_UEVENT), used to follow hotplug of the modem.
+//Only the keys qmid cares about are kept, values are truncated to fit
+struct qmi_netlink_uevent{
+    char action[16];
+    char subsystem[32];
+    char devname[64];
+    char devpath[256];
+};
+
+//Non-blocking socket subscribed to kernel uevents
+int32_t qmi_netlink_open_uevent();
+
+//Read and parse one uevent. Returns -1 when there are no more events (errno
+//is EAGAIN) or on failure
+int qmi_netlink_read_uevent(int32_t nl_fd, struct qmi_netlink_uevent *ev);
+#endif
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "qmi_policy.h"
+#include "qmi_device.h"
+#include "qmi_dialer.h"
+#include "qmi_helpers.h"
+#include "qmi_nas.h"
+#include "qmi_sig_history.h"
+
+//LTE quality, as judged from the mean of the shortest signal window
+enum{
+    QMI_POLICY_QUALITY_UNKNOWN = 0,
+    QMI_POLICY_QUALITY_BAD,
+    QMI_POLICY_QUALITY_MARGINAL,
+    QMI_POLICY_QUALITY_GOOD,
+};
+
+static const char *qmi_policy_mode_str(uint8_t mode){
+    return mode == QMI_POLICY_UMTS ? "UMTS-locked" : "LTE-preferred";
+}
+
+void qmi_policy_init(struct qmi_policy *policy){
+    memset(policy, 0, sizeof(*policy));
+    policy->backoff = QMI_POLICY_BACKOFF_SEC;
+}
+
+void qmi_policy_set_base(struct qmi_device *qmid, uint16_t rat_mode_pref){
+    struct qmi_policy *policy = &(qmid->policy);
+
+    policy->base_pref = rat_mode_pref;
+    policy->mode = QMI_POLICY_LTE;
+    policy->mode_start = time(NULL);
+    policy->lte_bad = 0;
+    policy->leave_since = 0;
+    policy->backoff = QMI_POLICY_BACKOFF_SEC;
+
+    qmid->rat_mode_pref = rat_mode_pref;
+}
+
+//Mean of metric in the shortest window, returns 0 if there are too few
+//samples
+static uint8_t qmi_policy_get_mean(struct qmi_device *qmid, uint8_t metric,
+        int32_t *mean_x10){
+    struct qmi_sig_stats stats;
+
+    if(!qmi_sig_history_get(&(qmid->sig_history), metric, 0, &stats) ||
+            stats.count < QMI_POLICY_MIN_SAMPLES)
+        return 0;
+
+    *mean_x10 = stats.mean_x10;
+    return 1;
+}
+
+//Rate LTE and update the bad flag. Between the bad and good thresholds, the
+//flag is left as it is
+static uint8_t qmi_policy_rate_lte(struct qmi_device *qmid){
+    struct qmi_policy *policy = &(qmid->policy);
+    int32_t rsrp, rsrq = QMI_POLICY_LTE_GOOD_RSRQ * 10;
+    int32_t snr = QMI_POLICY_LTE_GOOD_SNR * 10;
+    uint8_t quality = QMI_POLICY_QUALITY_MARGINAL;
+
+    //RSRQ and SNR are not reported by all modems, RSRP is required
+    if(!qmi_policy_get_mean(qmid, QMI_SIG_RSRP, &rsrp))
+        return QMI_POLICY_QUALITY_UNKNOWN;
+
+    qmi_policy_get_mean(qmid, QMI_SIG_RSRQ, &rsrq);
+    qmi_policy_get_mean(qmid, QMI_SIG_SNR, &snr);
+
+    //SNR is stored in 0.1 dB, like the thresholds
+    if(rsrp < QMI_POLICY_LTE_BAD_RSRP * 10 ||
+            rsrq < QMI_POLICY_LTE_BAD_RSRQ * 10 ||
+            snr < QMI_POLICY_LTE_BAD_SNR * 10)
+        quality = QMI_POLICY_QUALITY_BAD;
+    else if(rsrp >= QMI_POLICY_LTE_GOOD_RSRP * 10 &&
+            rsrq >= QMI_POLICY_LTE_GOOD_RSRQ * 10 &&
+            snr >= QMI_POLICY_LTE_GOOD_SNR * 10)
+        quality = QMI_POLICY_QUALITY_GOOD;
+
+    if(quality == QMI_POLICY_QUALITY_BAD)
+        policy->lte_bad = 1;
+    else if(quality == QMI_POLICY_QUALITY_GOOD)
+        policy->lte_bad = 0;
+
+    return quality;
+}
+
+//Average downlink rate since the last sample, counted for mode if the link was
+//busy. The rate is averaged over the time between signal samples
+static void qmi_policy_sample_tput(struct qmi_device *qmid, uint8_t count){
+    struct qmi_policy *policy = &(qmid->policy);
+    uint64_t rx_bytes, now_ms = qmi_helpers_now_ms();
+    uint32_t *tput = &(policy->tput_kbps[policy->mode]);
+    uint32_t kbps;
+
+    if(qmi_helpers_get_rx_bytes(qmid->ifname, &rx_bytes))
+        return;
+
+    //Bytes per ms times eight is kbit/s. The counter is reset when the
+    //interface is recreated
+    if(count && policy->rx_ms && now_ms > policy->rx_ms &&
+            rx_bytes >= policy->rx_bytes){
+        kbps = ((rx_bytes - policy->rx_bytes) * 8) / (now_ms - policy->rx_ms);
+
+        if(kbps >= QMI_POLICY_BUSY_KBPS)
+            *tput = *tput ? (*tput * 3 + kbps) / 4 : kbps;
+    }
+
+    policy->rx_bytes = rx_bytes;
+    policy->rx_ms = now_ms;
+}
+
+static void qmi_policy_switch(struct qmi_device *qmid, uint8_t mode,
+        const char *reason){
+    struct qmi_policy *policy = &(qmid->policy);
+    time_t now = time(NULL);
+
+    //LTE that did not last means that the back-off was too short
+    if(mode == QMI_POLICY_UMTS){
+        if(policy->num_switches && now - policy->mode_start <
+                QMI_POLICY_LTE_LASTED_SEC)
+            policy->backoff = policy->backoff * 2 > QMI_POLICY_MAX_BACKOFF_SEC ?
+                QMI_POLICY_MAX_BACKOFF_SEC : policy->backoff * 2;
+        else
+            policy->backoff = QMI_POLICY_BACKOFF_SEC;
+    }
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "RAT policy: %s -> %s after %lds (%s)\n",
+                qmi_policy_mode_str(policy->mode), qmi_policy_mode_str(mode),
+                (long) (now - policy->mode_start), reason);
+
+    policy->mode = mode;
+    policy->mode_start = now;
+    policy->leave_since = 0;
+    policy->rx_ms = 0;
+    policy->num_switches++;
+
+    qmid->rat_mode_pref = policy->base_pref;
+
+    if(mode == QMI_POLICY_UMTS)
+        qmid->rat_mode_pref &= ~QMI_NAS_RAT_MODE_PREF_LTE;
+
+    qmi_nas_set_sys_selection(qmid);
+}
+
+void qmi_policy_update(struct qmi_device *qmid){
+    struct qmi_policy *policy = &(qmid->policy);
+    time_t now = time(NULL);
+    const char *reason = NULL;
+    uint32_t *tput = policy->tput_kbps;
+    int32_t ecio;
+    uint8_t quality;
+
+    //The user has to allow both, and the preference is part of the NAS setup
+    if(!policy->enabled || qmid->nas_state != NAS_IDLE ||
+            (policy->base_pref & QMI_NAS_RAT_MODE_PREF_ALL) !=
+            QMI_NAS_RAT_MODE_PREF_ALL)
+        return;
+
+    if(policy->mode == QMI_POLICY_LTE){
+        //The modem falling back to UMTS on its own is not a reason to switch
+        qmi_policy_sample_tput(qmid, qmid->cur_service == SERVICE_LTE);
+
+        if(qmid->cur_service != SERVICE_LTE)
+            return;
+
+        quality = qmi_policy_rate_lte(qmid);
+
+        if(policy->lte_bad)
+            reason = "LTE signal is bad";
+        else if(quality != QMI_POLICY_QUALITY_GOOD && tput[QMI_POLICY_LTE] &&
+                tput[QMI_POLICY_LTE] * 100 < tput[QMI_POLICY_UMTS] *
+                QMI_POLICY_TPUT_SHARE)
+            reason = "LTE is slower than UMTS";
+    } else{
+        qmi_policy_sample_tput(qmid, qmid->cur_service == SERVICE_UMTS);
+
+        //ECIO is in -0.5 dB, larger is worse
+        if(qmid->cur_service == SERVICE_UMTS &&
+                qmi_policy_get_mean(qmid, QMI_SIG_ECIO, &ecio) &&
+                ecio > QMI_POLICY_UMTS_BAD_ECIO * 10)
+            reason = "UMTS signal is bad";
+        else if(now - policy->mode_start >= policy->backoff)
+            reason = "back-off has expired";
+    }
+
+    if(reason == NULL){
+        policy->leave_since = 0;
+        return;
+    }
+
+    if(!policy->leave_since)
+        policy->leave_since = now;
+
+    if(now - policy->leave_since < QMI_POLICY_HOLD_SEC ||
+            now - policy->mode_start < QMI_POLICY_MIN_DWELL_SEC)
+        return;
+
+    qmi_policy_switch(qmid, policy->mode == QMI_POLICY_LTE ? QMI_POLICY_UMTS :
+            QMI_POLICY_LTE, reason);
+}
+
+void qmi_policy_print(struct qmi_policy *policy){
+    if(!policy->enabled)
+        return;
+
+    QMID_DEBUG_PRINT(stderr, "RAT policy: %s for %lds, LTE %s, throughput LTE "
+            "%u kbit/s UMTS %u kbit/s, back-off %us, %u switches\n",
+            qmi_policy_mode_str(policy->mode),
+            (long) (time(NULL) - policy->mode_start),
+            policy->lte_bad ? "bad" : "not bad",
+            policy->tput_kbps[QMI_POLICY_LTE],
+            policy->tput_kbps[QMI_POLICY_UMTS], policy->backoff,
+            policy->num_switches);
+}
@@ -0,0 +1,87 @@
+#ifndef QMI_POLICY_H
+#define QMI_POLICY_H
+
+#include <stdint.h>
+#include <time.h>
+
+//RAT selection policy. With LTE and UMTS both allowed, the modem picks LTE as
+//long as it can camp on it, even when marginal LTE performs worse than solid
+//HSPA+. The policy switches between LTE-preferred (the user's preference) and
+//UMTS-locked based on the signal history and the observed throughput. Only
+//the mean over the shortest signal window is used, and a condition must hold
+//for a while (and the current mode must have been used for a while) before
+//switching, so that the modem is not bounced between RATs
+#define QMI_POLICY_MIN_SAMPLES          3
+//Seconds a condition must hold before switching
+#define QMI_POLICY_HOLD_SEC             60
+//Seconds a mode is used before it can be left
+#define QMI_POLICY_MIN_DWELL_SEC        300
+
+//LTE is bad below any of these (RSRP and RSRQ in dB, SNR in 0.1 dB), and only
+//good again when all are above the second set
+#define QMI_POLICY_LTE_BAD_RSRP         -112
+#define QMI_POLICY_LTE_BAD_RSRQ         -15
+#define QMI_POLICY_LTE_BAD_SNR          0
+#define QMI_POLICY_LTE_GOOD_RSRP        -105
+#define QMI_POLICY_LTE_GOOD_RSRQ        -12
+#define QMI_POLICY_LTE_GOOD_SNR         30
+//UMTS is bad when ECIO (in -0.5 dB) is worse than -12 dB, then LTE is tried
+//again regardless of the back-off
+#define QMI_POLICY_UMTS_BAD_ECIO        24
+
+//LTE can not be measured while locked to UMTS, so it is tried again after a
+//back-off. The back-off is doubled every time LTE turns out to be bad again
+//soon after returning, and reset when LTE lasts
+#define QMI_POLICY_BACKOFF_SEC          900
+#define QMI_POLICY_MAX_BACKOFF_SEC      14400
+#define QMI_POLICY_LTE_LASTED_SEC       3600
+
+//Throughput is only sampled while the link is busy (kbit/s). Marginal LTE
+//(neither good nor bad) loses when its throughput is below this share (in
+//percent) of what was seen on UMTS
+#define QMI_POLICY_BUSY_KBPS            256
+#define QMI_POLICY_TPUT_SHARE           80
+
+enum{
+    QMI_POLICY_LTE = 0,
+    QMI_POLICY_UMTS,
+    QMI_POLICY_NUM_MODES,
+};
+
+struct qmi_policy{
+    uint8_t enabled;
+    //QMI_POLICY_*, and the preference used for LTE-preferred (what the user
+    //asked for). rat_mode_pref in qmi_device is what is in use
+    uint8_t mode;
+    uint16_t base_pref;
+    time_t mode_start;
+
+    //LTE quality with hysteresis, and since when the condition for leaving
+    //the current mode has held (0 if it does not)
+    uint8_t lte_bad;
+    time_t leave_since;
+    uint32_t backoff;
+
+    //Downlink counter of the interface, and the busy throughput per mode
+    //(EWMA, 1/4 weight of new samples) in kbit/s. 0 when unknown
+    uint64_t rx_bytes;
+    uint64_t rx_ms;
+    uint32_t tput_kbps[QMI_POLICY_NUM_MODES];
+
+    uint32_t num_switches;
+};
+
+struct qmi_device;
+
+void qmi_policy_init(struct qmi_policy *policy);
+
+//Set the user's preference. The policy only acts when it allows both LTE and
+//UMTS, and starts over in LTE-preferred
+void qmi_policy_set_base(struct qmi_device *qmid, uint16_t rat_mode_pref);
+
+//Evaluate the policy, called for every signal sample. A new mode is applied
+//with qmi_nas_set_sys_selection()
+void qmi_policy_update(struct qmi_device *qmid);
+
+void qmi_policy_print(struct qmi_policy *policy);
+#endif
@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+#include <arpa/inet.h>
+
+#include "qmi_probe.h"
+#include "qmi_dialer.h"
+
+//Large enough for an IPv4 header (raw sockets) and the echo reply
+#define QMI_PROBE_BUF_SIZE  256
+
+//Same layout for ICMP and ICMPv6 echo. Values are in network byte order
+struct qmi_probe_echo{
+    uint8_t type;
+    uint8_t code;
+    uint16_t cksum;
+    uint16_t id;
+    uint16_t seq;
+    uint8_t data[8];
+} __attribute__((packed));
+
+void qmi_probe_init(struct qmi_probe *probe){
+    memset(probe, 0, sizeof(*probe));
+    probe->interval = QMI_PROBE_DEFAULT_INTERVAL;
+    probe->max_failures = QMI_PROBE_DEFAULT_FAILURES;
+    probe->fd4 = probe->fd6 = -1;
+}
+
+int qmi_probe_parse_target(const char *addr, struct qmi_probe_target *target){
+    memset(target, 0, sizeof(*target));
+
+    if(inet_pton(AF_INET, addr, target->addr) == 1)
+        target->family = AF_INET;
+    else if(inet_pton(AF_INET6, addr, target->addr) == 1)
+        target->family = AF_INET6;
+    else
+        return -1;
+
+    return 0;
+}
+
+int qmi_probe_add_target(struct qmi_probe *probe, const char *addr){
+    if(probe->num_targets == QMI_PROBE_MAX_TARGETS ||
+            qmi_probe_parse_target(addr, &(probe->targets[probe->num_targets])))
+        return -1;
+
+    probe->num_targets++;
+    return 0;
+}
+
+static const char *qmi_probe_target_str(struct qmi_probe_target *target,
+        char *buf, socklen_t len){
+    if(inet_ntop(target->family, target->addr, buf, len) == NULL)
+        return "unknown";
+
+    return buf;
+}
+
+static int32_t qmi_probe_open(uint8_t family, const char *ifname,
+        uint8_t *raw){
+    int proto = family == AF_INET ? IPPROTO_ICMP : IPPROTO_ICMPV6;
+    struct icmp6_filter filter;
+    int32_t fd;
+
+    *raw = 0;
+
+    //Ping sockets are not allowed by default, raw sockets require
+    //CAP_NET_RAW
+    if((fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    proto)) == -1){
+        if((fd = socket(family, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        proto)) == -1)
+            return -1;
+
+        *raw = 1;
+    }
+
+    //Probes must test the modem, not whatever the default route points at
+    if(setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, ifname, strlen(ifname) + 1)
+            == -1){
+        close(fd);
+        return -1;
+    }
+
+    //Raw ICMPv6 sockets receive all ICMPv6, for example neighbour discovery
+    if(*raw && family == AF_INET6){
+        ICMP6_FILTER_SETBLOCKALL(&filter);
+        ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter);
+        setsockopt(fd, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter));
+    }
+
+    return fd;
+}
+
+int qmi_probe_start(struct qmi_probe *probe, const char *ifname,
+        uint64_t now_ms){
+    uint8_t i, has_ipv4 = 0, has_ipv6 = 0;
+
+    if(probe->active || !probe->num_targets)
+        return 0;
+
+    for(i=0; i<probe->num_targets; i++){
+        if(probe->targets[i].family == AF_INET)
+            has_ipv4 = 1;
+        else
+            has_ipv6 = 1;
+    }
+
+    if(has_ipv4)
+        probe->fd4 = qmi_probe_open(AF_INET, ifname, &(probe->raw4));
+
+    if(has_ipv6)
+        probe->fd6 = qmi_probe_open(AF_INET6, ifname, &(probe->raw6));
+
+    if(probe->fd4 == -1 && probe->fd6 == -1)
+        return -1;
+
+    memcpy(probe->ifname, ifname, IFNAMSIZ);
+    probe->active = 1;
+    probe->outstanding = 0;
+    probe->failures = 0;
+    probe->id = getpid() & 0xFFFF;
+
+    //Give addressing (or DHCP) some time before the first probe
+    probe->next_ms = now_ms + probe->interval * 1000;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Probing data path on %s every %u s\n",
+                ifname, probe->interval);
+
+    return 0;
+}
+
+void qmi_probe_stop(struct qmi_probe *probe){
+    if(!probe->active)
+        return;
+
+    if(probe->fd4 != -1)
+        close(probe->fd4);
+
+    if(probe->fd6 != -1)
+        close(probe->fd6);
+
+    probe->fd4 = probe->fd6 = -1;
+    probe->active = 0;
+    probe->outstanding = 0;
+}
+
+int32_t qmi_probe_next(struct qmi_probe *probe, uint64_t now_ms){
+    uint64_t deadline;
+
+    if(!probe->active)
+        return -1;
+
+    if(probe->outstanding)
+        deadline = probe->sent_ms + QMI_PROBE_TIMEOUT_MS;
+    else
+        deadline = probe->next_ms;
+
+    return deadline > now_ms ? deadline - now_ms : 0;
+}
+
+static uint16_t qmi_probe_cksum(const void *data, size_t len){
+    const uint8_t *buf = data;
+    uint32_t sum = 0;
+    size_t i;
+
+    for(i=0; i+1<len; i+=2)
+        sum += (buf[i] << 8) | buf[i+1];
+
+    if(len & 1)
+        sum += buf[len-1] << 8;
+
+    while(sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return htons(~sum & 0xFFFF);
+}
+
+static int qmi_probe_send(struct qmi_probe *probe, uint64_t now_ms){
+    struct qmi_probe_target *target = &(probe->targets[probe->cur_target]);
+    struct qmi_probe_echo echo;
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+    struct sockaddr *addr;
+    socklen_t addr_len;
+    int32_t fd;
+
+    memset(&echo, 0, sizeof(echo));
+    echo.id = htons(probe->id);
+    echo.seq = htons(++probe->seq);
+
+    if(target->family == AF_INET){
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        memcpy(&(sin.sin_addr), target->addr, sizeof(sin.sin_addr));
+        addr = (struct sockaddr*) &sin;
+        addr_len = sizeof(sin);
+        fd = probe->fd4;
+        echo.type = ICMP_ECHO;
+        //The kernel computes the checksum for ICMPv6, but not for ICMP
+        echo.cksum = qmi_probe_cksum(&echo, sizeof(echo));
+    } else{
+        memset(&sin6, 0, sizeof(sin6));
+        sin6.sin6_family = AF_INET6;
+        memcpy(&(sin6.sin6_addr), target->addr, sizeof(sin6.sin6_addr));
+        addr = (struct sockaddr*) &sin6;
+        addr_len = sizeof(sin6);
+        fd = probe->fd6;
+        echo.type = ICMP6_ECHO_REQUEST;
+    }
+
+    probe->outstanding = 1;
+    probe->sent_target = probe->cur_target;
+    probe->cur_target = (probe->cur_target + 1) % probe->num_targets;
+    probe->sent_ms = now_ms;
+    probe->sent++;
+
+    if(fd == -1)
+        return -1;
+
+    return sendto(fd, &echo, sizeof(echo), 0, addr, addr_len) ==
+        sizeof(echo) ? 0 : -1;
+}
+
+uint8_t qmi_probe_run(struct qmi_probe *probe, uint64_t now_ms){
+    char addr_str[INET6_ADDRSTRLEN];
+
+    if(!probe->active)
+        return 0;
+
+    if(probe->outstanding && now_ms >= probe->sent_ms + QMI_PROBE_TIMEOUT_MS){
+        probe->outstanding = 0;
+        probe->lost++;
+        probe->failures++;
+
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "No reply from %s on %s (%u in a row)\n",
+                    qmi_probe_target_str(&(probe->targets[probe->sent_target]),
+                        addr_str, sizeof(addr_str)), probe->ifname,
+                    probe->failures);
+
+        if(probe->failures >= probe->max_failures)
+            return 1;
+
+        //Confirm quickly, using the next target
+        probe->next_ms = now_ms;
+    }
+
+    if(!probe->outstanding && now_ms >= probe->next_ms){
+        probe->next_ms = now_ms + probe->interval * 1000;
+
+        //A failed send is handled as a lost reply, the network might be
+        //unreachable
+        if(qmi_probe_send(probe, now_ms) && qmid_verbose_logging >=
+                QMID_LOG_LEVEL_2)
+            QMID_DEBUG_PRINT(stderr, "Could not send probe to %s: %s\n",
+                    qmi_probe_target_str(&(probe->targets[probe->sent_target]),
+                        addr_str, sizeof(addr_str)), strerror(errno));
+    }
+
+    return 0;
+}
+
+void qmi_probe_handle_reply(struct qmi_probe *probe, int32_t fd,
+        uint64_t now_ms){
+    uint8_t buf[QMI_PROBE_BUF_SIZE], raw, reply_type;
+    struct qmi_probe_echo echo;
+    ssize_t numbytes, offset;
+    uint32_t rtt;
+
+    if(fd == probe->fd4){
+        raw = probe->raw4;
+        reply_type = ICMP_ECHOREPLY;
+    } else{
+        raw = probe->raw6;
+        reply_type = ICMP6_ECHO_REPLY;
+    }
+
+    while((numbytes = recv(fd, buf, sizeof(buf), 0)) > 0){
+        //Raw IPv4 sockets include the IP header
+        offset = raw && fd == probe->fd4 ? (buf[0] & 0x0F) * 4 : 0;
+
+        if(numbytes - offset < (ssize_t) sizeof(echo))
+            continue;
+
+        memcpy(&echo, buf + offset, sizeof(echo));
+
+        //Ping sockets only get their own replies, raw sockets get all. Late
+        //replies are ignored, the probe has already been counted as lost
+        if(echo.type != reply_type || (raw && ntohs(echo.id) != probe->id) ||
+                !probe->outstanding || ntohs(echo.seq) != probe->seq)
+            continue;
+
+        rtt = now_ms - probe->sent_ms;
+        probe->outstanding = 0;
+        probe->failures = 0;
+        probe->received++;
+        probe->rtt_last = rtt;
+
+        if(probe->received == 1){
+            probe->rtt_min = probe->rtt_max = rtt;
+            probe->rtt_avg_x8 = rtt << 3;
+        } else{
+            if(rtt < probe->rtt_min)
+                probe->rtt_min = rtt;
+            if(rtt > probe->rtt_max)
+                probe->rtt_max = rtt;
+
+            probe->rtt_avg_x8 = probe->rtt_avg_x8 - (probe->rtt_avg_x8 >> 3) +
+                rtt;
+        }
+
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+            QMID_DEBUG_PRINT(stderr, "Probe reply on %s, RTT %u ms\n",
+                    probe->ifname, rtt);
+    }
+}
+
+void qmi_probe_print(struct qmi_probe *probe){
+    if(!probe->num_targets)
+        return;
+
+    QMID_DEBUG_PRINT(stderr, "Probe (%s): sent %u received %u lost %u. RTT "
+            "last %u min %u avg %u max %u ms. %u lost in a row\n",
+            probe->active ? probe->ifname : "inactive", probe->sent,
+            probe->received, probe->lost, probe->rtt_last, probe->rtt_min,
+            probe->rtt_avg_x8 >> 3, probe->rtt_max, probe->failures);
+}
@@ -0,0 +1,80 @@
+#ifndef QMI_PROBE_H
+#define QMI_PROBE_H
+
+#include <stdint.h>
+#include <net/if.h>
+
+//Liveness prober for the data path. While connected, ICMP echo requests are
+//sent out the network interface to the configured targets (round robin). A
+//modem can report a bearer as connected while no traffic passes, so a streak
+//of lost probes is used to trigger a reconnect
+#define QMI_PROBE_MAX_TARGETS           4
+#define QMI_PROBE_DEFAULT_INTERVAL      10
+#define QMI_PROBE_DEFAULT_FAILURES      3
+//How long to wait for a reply
+#define QMI_PROBE_TIMEOUT_MS            2000
+
+struct qmi_probe_target{
+    //AF_INET or AF_INET6, address in network byte order
+    uint8_t family;
+    uint8_t addr[16];
+};
+
+struct qmi_probe{
+    struct qmi_probe_target targets[QMI_PROBE_MAX_TARGETS];
+    uint8_t num_targets;
+    //Seconds between probes while replies are received
+    uint16_t interval;
+    //Number of lost probes in a row before the connection is considered dead
+    uint8_t max_failures;
+
+    //Sockets for each family, -1 when not probing. Ping sockets are used when
+    //allowed (net.ipv4.ping_group_range), otherwise raw sockets
+    int32_t fd4, fd6;
+    uint8_t raw4, raw6;
+    uint8_t active;
+    char ifname[IFNAMSIZ];
+
+    //The probe waiting for a reply (if any) and when to send the next
+    uint8_t outstanding;
+    uint8_t cur_target, sent_target;
+    uint16_t id, seq;
+    uint64_t sent_ms, next_ms;
+    uint8_t failures;
+
+    //Statistics since qmid was started, RTTs are in ms. Average is an EWMA
+    //(1/8 weight of new samples, as TCP SRTT) stored times 8
+    uint32_t sent, received, lost;
+    uint32_t rtt_last, rtt_min, rtt_max, rtt_avg_x8;
+};
+
+//Set defaults, no targets are configured
+void qmi_probe_init(struct qmi_probe *probe);
+
+//Parse an IPv4 or IPv6 address. Returns 0 on success, -1 otherwise
+int qmi_probe_parse_target(const char *addr, struct qmi_probe_target *target);
+
+//Add an IPv4 or IPv6 target. Returns 0 on success, -1 otherwise
+int qmi_probe_add_target(struct qmi_probe *probe, const char *addr);
+
+//Start probing out ifname. The sockets (fd4/fd6) must be added to the event
+//loop by the caller. Returns 0 on success, -1 otherwise
+int qmi_probe_start(struct qmi_probe *probe, const char *ifname,
+        uint64_t now_ms);
+
+//Stop probing and close the sockets
+void qmi_probe_stop(struct qmi_probe *probe);
+
+//Milliseconds until qmi_probe_run() must be called, -1 if not probing
+int32_t qmi_probe_next(struct qmi_probe *probe, uint64_t now_ms);
+
+//Send probes and check for lost replies. Returns 1 when the failure streak has
+//been reached, the caller is then expected to reconnect and stop the probe
+uint8_t qmi_probe_run(struct qmi_probe *probe, uint64_t now_ms);
+
+//Read replies from fd (fd4 or fd6)
+void qmi_probe_handle_reply(struct qmi_probe *probe, int32_t fd,
+        uint64_t now_ms);
+
+void qmi_probe_print(struct qmi_probe *probe);
+#endif
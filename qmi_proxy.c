@@ -0,0 +1,515 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "qmi_proxy.h"
+#include "qmi_device.h"
+#include "qmi_dialer.h"
+#include "qmi_hdrs.h"
+#include "qmi_shared.h"
+#include "qmi_helpers.h"
+#include "qmi_ctl.h"
+
+void qmi_proxy_init(struct qmi_proxy *proxy){
+    uint8_t i;
+
+    memset(proxy, 0, sizeof(*proxy));
+    proxy->listen_fd = -1;
+
+    for(i=0; i<QMI_PROXY_MAX_CLIENTS; i++)
+        proxy->clients[i].fd = -1;
+}
+
+int32_t qmi_proxy_open(struct qmi_proxy *proxy){
+    struct sockaddr_un addr;
+    int32_t fd;
+
+    if(strlen(proxy->path) >= sizeof(addr.sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    0)) == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, proxy->path, strlen(proxy->path) + 1);
+
+    //Left behind if qmid was killed
+    unlink(proxy->path);
+
+    if(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+            listen(fd, QMI_PROXY_MAX_CLIENTS) == -1){
+        close(fd);
+        return -1;
+    }
+
+    proxy->listen_fd = fd;
+    return fd;
+}
+
+void qmi_proxy_close(struct qmi_proxy *proxy){
+    uint8_t i;
+
+    if(proxy->listen_fd == -1)
+        return;
+
+    for(i=0; i<QMI_PROXY_MAX_CLIENTS; i++){
+        if(proxy->clients[i].fd != -1){
+            close(proxy->clients[i].fd);
+            proxy->clients[i].fd = -1;
+        }
+    }
+
+    close(proxy->listen_fd);
+    proxy->listen_fd = -1;
+    proxy->num_clients = 0;
+    unlink(proxy->path);
+}
+
+static int8_t qmi_proxy_find_client(struct qmi_proxy *proxy, int32_t fd){
+    uint8_t i;
+
+    for(i=0; i<QMI_PROXY_MAX_CLIENTS; i++)
+        if(proxy->clients[i].fd == fd)
+            return i;
+
+    return -1;
+}
+
+uint8_t qmi_proxy_has_fd(struct qmi_proxy *proxy, int32_t fd){
+    if(fd == -1 || proxy->listen_fd == -1)
+        return 0;
+
+    return fd == proxy->listen_fd || qmi_proxy_find_client(proxy, fd) != -1;
+}
+
+static int8_t qmi_proxy_find_cid(struct qmi_proxy_client *client,
+        uint8_t service, uint8_t cid){
+    uint8_t i;
+
+    for(i=0; i<client->num_cids; i++)
+        if(client->cids[i].service == service && client->cids[i].cid == cid)
+            return i;
+
+    return -1;
+}
+
+static uint8_t qmi_proxy_has_service(struct qmi_proxy_client *client,
+        uint8_t service){
+    uint8_t i;
+
+    for(i=0; i<client->num_cids; i++)
+        if(client->cids[i].service == service)
+            return 1;
+
+    return 0;
+}
+
+//Value of TLV type in the CTL message in buf (len bytes), if the TLV is at
+//least min_len long. Returns NULL otherwise
+static uint8_t *qmi_proxy_ctl_tlv(uint8_t *buf, uint16_t len, uint8_t type,
+        uint16_t min_len){
+    qmi_hdr_ctl_t *qmi_hdr = (qmi_hdr_ctl_t*) (buf + sizeof(qmux_hdr_t));
+    uint8_t *pos = (uint8_t*) (qmi_hdr + 1);
+    uint8_t *end = pos + le16toh(qmi_hdr->length);
+    qmi_tlv_t *tlv;
+    uint16_t tlv_len;
+
+    if(end > buf + len)
+        return NULL;
+
+    while(pos + sizeof(qmi_tlv_t) <= end){
+        tlv = (qmi_tlv_t*) pos;
+        tlv_len = le16toh(tlv->length);
+
+        if(pos + sizeof(qmi_tlv_t) + tlv_len > end)
+            return NULL;
+
+        if(tlv->type == type)
+            return tlv_len >= min_len ? (uint8_t*) (tlv + 1) : NULL;
+
+        pos += sizeof(qmi_tlv_t) + tlv_len;
+    }
+
+    return NULL;
+}
+
+//Frames are never queued, a client that does not keep up loses them
+static void qmi_proxy_send(struct qmi_proxy_client *client, uint8_t *buf,
+        uint16_t len){
+    if(send(client->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) != len)
+        client->dropped++;
+}
+
+//Answer a CTL request without involving the modem. error is 0 for success
+static void qmi_proxy_reply_ctl(struct qmi_proxy_client *client,
+        uint8_t transaction_id, uint16_t message_id, uint16_t error){
+    uint8_t *buf = qmi_helpers_get_buf();
+    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
+    uint16_t result[2];
+
+    result[0] = htole16(error ? QMI_RESULT_FAILURE : QMI_RESULT_SUCCESS);
+    result[1] = htole16(error);
+
+    create_qmi_request(buf, QMI_SERVICE_CTL, 0, transaction_id, message_id);
+    add_tlv(buf, QMI_TLV_RESULT_CODE, sizeof(result), result);
+    qmux_hdr->control_flags = QMI_PROXY_QMUX_FLAG_SERVICE;
+    ((qmi_hdr_ctl_t*) (qmux_hdr + 1))->control_flags =
+        QMI_PROXY_CTL_FLAG_RESP;
+
+    qmi_proxy_send(client, buf, le16toh(qmux_hdr->length) + 1);
+    qmi_helpers_put_buf(buf);
+}
+
+//Release a CID on behalf of a client that has gone away. The reply is dropped
+static void qmi_proxy_release_cid(struct qmi_device *qmid, uint8_t service,
+        uint8_t cid){
+    struct qmi_proxy_ctl_req *req =
+        &(qmid->proxy.ctl_reqs[qmid->ctl_transaction_id]);
+
+    if(qmi_ctl_update_cid(qmid, service, true, cid) <= 0)
+        return;
+
+    req->sent = time(NULL);
+    req->client = -1;
+}
+
+static void qmi_proxy_disconnect(struct qmi_device *qmid, int8_t idx){
+    struct qmi_proxy *proxy = &(qmid->proxy);
+    struct qmi_proxy_client *client = &(proxy->clients[idx]);
+    uint16_t i;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Proxy client %d disconnected, %u CID(s), %u "
+                "frame(s) dropped\n", idx, client->num_cids, client->dropped);
+
+    //Replies to requests in flight are dropped, and a CID given to the client
+    //after this is released
+    for(i=0; i<=UINT8_MAX; i++)
+        if(proxy->ctl_reqs[i].sent && proxy->ctl_reqs[i].client == idx)
+            proxy->ctl_reqs[i].client = -1;
+
+    if(qmid->qmi_fd != -1 && qmid->ctl_state == CTL_SYNCED)
+        for(i=0; i<client->num_cids; i++)
+            qmi_proxy_release_cid(qmid, client->cids[i].service,
+                    client->cids[i].cid);
+
+    close(client->fd);
+    client->fd = -1;
+    proxy->num_clients--;
+}
+
+void qmi_proxy_disconnect_clients(struct qmi_device *qmid){
+    uint8_t i;
+
+    for(i=0; i<QMI_PROXY_MAX_CLIENTS; i++)
+        if(qmid->proxy.clients[i].fd != -1)
+            qmi_proxy_disconnect(qmid, i);
+
+    //Transaction ids start over when the device is opened again, replies to
+    //the requests in flight will never come and must not be confused with
+    //replies to qmid
+    if(qmid->qmi_fd == -1)
+        memset(qmid->proxy.ctl_reqs, 0, sizeof(qmid->proxy.ctl_reqs));
+}
+
+static void qmi_proxy_accept(struct qmi_proxy *proxy, int32_t efd){
+    struct qmi_proxy_client *client = NULL;
+    struct epoll_event ev;
+    int32_t fd;
+    uint8_t i;
+
+    if((fd = accept(proxy->listen_fd, NULL, NULL)) == -1)
+        return;
+
+    for(i=0; i<QMI_PROXY_MAX_CLIENTS; i++){
+        if(proxy->clients[i].fd == -1){
+            client = &(proxy->clients[i]);
+            break;
+        }
+    }
+
+    if(client == NULL){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Too many proxy clients\n");
+
+        close(fd);
+        return;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+
+    if(fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+            fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+            epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) == -1){
+        close(fd);
+        return;
+    }
+
+    memset(client, 0, sizeof(*client));
+    client->fd = fd;
+    proxy->num_clients++;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Proxy client %u connected\n", i);
+}
+
+//CIDs are requested and released through the proxy, so that it knows where to
+//route. Requests that would disturb qmid are answered by the proxy
+static void qmi_proxy_forward_ctl(struct qmi_device *qmid, int8_t idx,
+        uint8_t *buf, uint16_t len){
+    struct qmi_proxy *proxy = &(qmid->proxy);
+    struct qmi_proxy_client *client = &(proxy->clients[idx]);
+    qmi_hdr_ctl_t *qmi_hdr = (qmi_hdr_ctl_t*) (buf + sizeof(qmux_hdr_t));
+    uint16_t message_id = le16toh(qmi_hdr->message_id);
+    struct qmi_proxy_ctl_req *req;
+    uint8_t *alloc, transaction_id;
+
+    switch(message_id){
+        case QMI_CTL_SYNC:
+            //Would release the CIDs of everyone, the device is already synced
+            qmi_proxy_reply_ctl(client, qmi_hdr->transaction_id, message_id,
+                    0);
+            return;
+        case QMI_CTL_GET_CID:
+            if(client->num_cids == QMI_PROXY_MAX_CIDS){
+                qmi_proxy_reply_ctl(client, qmi_hdr->transaction_id,
+                        message_id, QMI_PROXY_ERR_CLIENT_IDS_EXHAUSTED);
+                return;
+            }
+            break;
+        case QMI_CTL_RELEASE_CID:
+            alloc = qmi_proxy_ctl_tlv(buf, len, QMI_CTL_TLV_ALLOC_INFO, 2);
+
+            if(alloc == NULL || qmi_proxy_find_cid(client, alloc[0],
+                        alloc[1]) == -1){
+                qmi_proxy_reply_ctl(client, qmi_hdr->transaction_id,
+                        message_id, QMI_PROXY_ERR_INVALID_CLIENT_ID);
+                return;
+            }
+            break;
+        case QMI_CTL_GET_VERSION_INFO:
+            break;
+        default:
+            //For example the data format, which belongs to qmid
+            qmi_proxy_reply_ctl(client, qmi_hdr->transaction_id, message_id,
+                    QMI_PROXY_ERR_NOT_SUPPORTED);
+            return;
+    }
+
+    if(qmid->qmi_fd == -1 || qmid->ctl_state != CTL_SYNCED){
+        qmi_proxy_reply_ctl(client, qmi_hdr->transaction_id, message_id,
+                QMI_PROXY_ERR_DEVICE_NOT_READY);
+        return;
+    }
+
+    transaction_id = qmi_ctl_next_transaction_id(qmid);
+    req = &(proxy->ctl_reqs[transaction_id]);
+    req->client = idx;
+    req->transaction_id = qmi_hdr->transaction_id;
+    qmi_hdr->transaction_id = transaction_id;
+
+    if(write(qmid->qmi_fd, buf, len) != len){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Could not forward CTL request from proxy "
+                    "client %d\n", idx);
+        req->sent = 0;
+        return;
+    }
+
+    req->sent = time(NULL);
+}
+
+static void qmi_proxy_handle_client(struct qmi_device *qmid, int8_t idx){
+    struct qmi_proxy_client *client = &(qmid->proxy.clients[idx]);
+    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
+    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
+    ssize_t len;
+
+    //With MSG_TRUNC, the real length of a frame that is too large is returned
+    len = recv(client->fd, buf, sizeof(buf), MSG_TRUNC);
+
+    if(len == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+
+    if(len <= 0){
+        qmi_proxy_disconnect(qmid, idx);
+        return;
+    }
+
+    //Only complete requests are accepted
+    if(len > (ssize_t) sizeof(buf) || len < (ssize_t) (sizeof(qmux_hdr_t) +
+                sizeof(qmi_hdr_ctl_t)) || qmux_hdr->type != QMUX_IF_TYPE ||
+            le16toh(qmux_hdr->length) + 1 != len ||
+            qmux_hdr->control_flags){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Dropping invalid frame from proxy client "
+                    "%d\n", idx);
+        return;
+    }
+
+    if(qmux_hdr->service_type == QMI_SERVICE_CTL){
+        qmi_proxy_forward_ctl(qmid, idx, buf, len);
+        return;
+    }
+
+    //A client can only use the CIDs it has been given
+    if(len < (ssize_t) (sizeof(qmux_hdr_t) + sizeof(qmi_hdr_gen_t)) ||
+            qmi_proxy_find_cid(client, qmux_hdr->service_type,
+                qmux_hdr->client_id) == -1){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Proxy client %d does not own CID %u of "
+                    "service %x\n", idx, qmux_hdr->client_id,
+                    qmux_hdr->service_type);
+        return;
+    }
+
+    if(qmid->qmi_fd != -1 && write(qmid->qmi_fd, buf, len) != len &&
+            qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Could not forward frame from proxy client "
+                "%d\n", idx);
+}
+
+void qmi_proxy_handle_fd(struct qmi_device *qmid, int32_t efd, int32_t fd){
+    int8_t idx;
+
+    if(fd == qmid->proxy.listen_fd)
+        qmi_proxy_accept(&(qmid->proxy), efd);
+    else if((idx = qmi_proxy_find_client(&(qmid->proxy), fd)) != -1)
+        qmi_proxy_handle_client(qmid, idx);
+}
+
+static uint8_t qmi_proxy_route_ctl(struct qmi_device *qmid, uint16_t len){
+    struct qmi_proxy *proxy = &(qmid->proxy);
+    qmi_hdr_ctl_t *qmi_hdr = (qmi_hdr_ctl_t*) (qmid->buf + sizeof(qmux_hdr_t));
+    struct qmi_proxy_ctl_req *req;
+    struct qmi_proxy_client *client;
+    uint8_t *result, *alloc, success, i;
+    uint16_t message_id;
+    int8_t cid_idx;
+
+    if(len < sizeof(qmux_hdr_t) + sizeof(qmi_hdr_ctl_t))
+        return 0;
+
+    req = &(proxy->ctl_reqs[qmi_hdr->transaction_id]);
+    message_id = le16toh(qmi_hdr->message_id);
+
+    //CTL indications (for example a revoked CID) concern everyone
+    if(qmi_hdr->control_flags & QMI_PROXY_CTL_FLAG_IND){
+        for(i=0; i<QMI_PROXY_MAX_CLIENTS; i++)
+            if(proxy->clients[i].fd != -1)
+                qmi_proxy_send(&(proxy->clients[i]), qmid->buf, len);
+
+        return 0;
+    }
+
+    if(!req->sent || time(NULL) - req->sent > QMI_PROXY_CTL_TIMEOUT)
+        return 0;
+
+    req->sent = 0;
+
+    result = qmi_proxy_ctl_tlv(qmid->buf, len, QMI_TLV_RESULT_CODE,
+            2 * sizeof(uint16_t));
+    success = result != NULL &&
+        qmi_helpers_get_le16(result) == QMI_RESULT_SUCCESS;
+    alloc = qmi_proxy_ctl_tlv(qmid->buf, len, QMI_CTL_TLV_ALLOC_INFO, 2);
+
+    //A CID given to a client that has gone away, or a client with too many
+    //requests in flight
+    if(req->client == -1 || (message_id == QMI_CTL_GET_CID &&
+                proxy->clients[req->client].num_cids == QMI_PROXY_MAX_CIDS)){
+        if(message_id == QMI_CTL_GET_CID && success && alloc != NULL)
+            qmi_proxy_release_cid(qmid, alloc[0], alloc[1]);
+
+        if(req->client != -1)
+            qmi_proxy_reply_ctl(&(proxy->clients[req->client]),
+                    req->transaction_id, message_id,
+                    QMI_PROXY_ERR_CLIENT_IDS_EXHAUSTED);
+
+        return 1;
+    }
+
+    client = &(proxy->clients[req->client]);
+
+    if(success && alloc != NULL && message_id == QMI_CTL_GET_CID){
+        client->cids[client->num_cids].service = alloc[0];
+        client->cids[client->num_cids].cid = alloc[1];
+        client->num_cids++;
+    } else if(success && alloc != NULL && message_id == QMI_CTL_RELEASE_CID &&
+            (cid_idx = qmi_proxy_find_cid(client, alloc[0], alloc[1])) != -1){
+        client->cids[cid_idx] = client->cids[--client->num_cids];
+    }
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+        QMID_DEBUG_PRINT(stderr, "CTL reply %x for proxy client %d\n",
+                message_id, req->client);
+
+    qmi_hdr->transaction_id = req->transaction_id;
+    qmi_proxy_send(client, qmid->buf, len);
+    return 1;
+}
+
+uint8_t qmi_proxy_route(struct qmi_device *qmid){
+    struct qmi_proxy *proxy = &(qmid->proxy);
+    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
+    uint16_t len = le16toh(qmux_hdr->length) + 1;
+    uint8_t i;
+
+    //Replies to CIDs released by the proxy can arrive after the last client
+    //has gone
+    if(proxy->listen_fd == -1)
+        return 0;
+
+    if(qmux_hdr->service_type == QMI_SERVICE_CTL)
+        return qmi_proxy_route_ctl(qmid, len);
+
+    if(!proxy->num_clients)
+        return 0;
+
+    if(qmux_hdr->client_id == QMI_PROXY_BROADCAST_CID){
+        for(i=0; i<QMI_PROXY_MAX_CLIENTS; i++)
+            if(proxy->clients[i].fd != -1 && qmi_proxy_has_service(
+                        &(proxy->clients[i]), qmux_hdr->service_type))
+                qmi_proxy_send(&(proxy->clients[i]), qmid->buf, len);
+
+        return 0;
+    }
+
+    for(i=0; i<QMI_PROXY_MAX_CLIENTS; i++){
+        if(proxy->clients[i].fd != -1 && qmi_proxy_find_cid(
+                    &(proxy->clients[i]), qmux_hdr->service_type,
+                    qmux_hdr->client_id) != -1){
+            qmi_proxy_send(&(proxy->clients[i]), qmid->buf, len);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void qmi_proxy_print(struct qmi_proxy *proxy){
+    uint8_t i;
+
+    if(proxy->listen_fd == -1)
+        return;
+
+    QMID_DEBUG_PRINT(stderr, "Proxy %s, %u client(s)\n", proxy->path,
+            proxy->num_clients);
+
+    for(i=0; i<QMI_PROXY_MAX_CLIENTS; i++)
+        if(proxy->clients[i].fd != -1)
+            QMID_DEBUG_PRINT(stderr, "Proxy client %u: %u CID(s), %u frame(s) "
+                    "dropped\n", i, proxy->clients[i].num_cids,
+                    proxy->clients[i].dropped);
+}
@@ -0,0 +1,92 @@
+#ifndef QMI_PROXY_H
+#define QMI_PROXY_H
+
+#include <stdint.h>
+#include <time.h>
+
+//Proxy that lets other programs (monitoring tools and the like) use the device
+//while qmid owns it. Clients connect to a SOCK_SEQPACKET Unix socket and
+//exchange QMUX frames with it, one frame per packet, exactly as they would with
+//the cdc-wdm device. Clients get their own CIDs with CTL GET_CID, and frames
+//from the modem are routed on (service, CID). CTL transaction ids are shared by
+//everyone using the device, so the ids of clients are rewritten
+#define QMI_PROXY_MAX_CLIENTS       8
+#define QMI_PROXY_MAX_CIDS          16
+//A CTL request without a reply for this long is forgotten
+#define QMI_PROXY_CTL_TIMEOUT       30
+#define QMI_PROXY_BROADCAST_CID     0xFF
+
+//Flags in the CTL header, other services use different values
+#define QMI_PROXY_CTL_FLAG_RESP     0x01
+#define QMI_PROXY_CTL_FLAG_IND      0x02
+//QMUX control flags of frames sent by the modem
+#define QMI_PROXY_QMUX_FLAG_SERVICE 0x80
+
+//Errors returned for CTL requests that are answered by the proxy
+#define QMI_PROXY_ERR_CLIENT_IDS_EXHAUSTED  0x0005
+#define QMI_PROXY_ERR_INVALID_CLIENT_ID 0x0007
+#define QMI_PROXY_ERR_DEVICE_NOT_READY  0x0034
+#define QMI_PROXY_ERR_NOT_SUPPORTED     0x005E
+
+struct qmi_proxy_cid{
+    uint8_t service;
+    uint8_t cid;
+};
+
+struct qmi_proxy_client{
+    //-1 when the slot is free
+    int32_t fd;
+    uint8_t num_cids;
+    struct qmi_proxy_cid cids[QMI_PROXY_MAX_CIDS];
+    //Frames that could not be delivered, the client is not reading
+    uint32_t dropped;
+};
+
+//CTL request forwarded to the modem, indexed by the transaction id it was
+//sent with
+struct qmi_proxy_ctl_req{
+    //0 when there is no request
+    time_t sent;
+    //Index of the client, -1 when the client has gone away or the request was
+    //made by the proxy itself (releasing the CIDs of a client)
+    int8_t client;
+    uint8_t transaction_id;
+};
+
+struct qmi_proxy{
+    //Path of the socket, NULL disables the proxy
+    const char *path;
+    int32_t listen_fd;
+    uint8_t num_clients;
+    struct qmi_proxy_client clients[QMI_PROXY_MAX_CLIENTS];
+    struct qmi_proxy_ctl_req ctl_reqs[UINT8_MAX + 1];
+};
+
+struct qmi_device;
+
+void qmi_proxy_init(struct qmi_proxy *proxy);
+
+//Create the listening socket, an old socket at path is replaced. Returns the
+//fd, -1 on failure
+int32_t qmi_proxy_open(struct qmi_proxy *proxy);
+
+//Close all sockets and remove path
+void qmi_proxy_close(struct qmi_proxy *proxy);
+
+//Returns 1 if fd is the listening socket or a client
+uint8_t qmi_proxy_has_fd(struct qmi_proxy *proxy, int32_t fd);
+
+//Accept a new client (added to efd) or handle a frame from a client
+void qmi_proxy_handle_fd(struct qmi_device *qmid, int32_t efd, int32_t fd);
+
+//Route the frame in qmid->buf to clients. Returns 1 if the frame belongs to a
+//client only, and must not be handled by qmid. Broadcast indications are
+//given to both
+uint8_t qmi_proxy_route(struct qmi_device *qmid);
+
+//Disconnect all clients. Their CIDs are released if the device is still
+//usable, otherwise they are lost with it
+void qmi_proxy_disconnect_clients(struct qmi_device *qmid);
+
+void qmi_proxy_print(struct qmi_proxy *proxy);
+#endif
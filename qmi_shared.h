@@ -7,7 +7,37 @@
 
 #define QMID_NUM_SERVICES       3
 #define QMID_TIMEOUT_SEC        5
+//Polling intervals. Every poll wakes up the USB link and the modem, so once
+//connected, polling backs off while the signal is stable (the range of the
+//shortest signal window is within QMID_POLL_STABLE_RANGE dB). Signal
+//indications, when supported, make polling a fallback only
+#define QMID_POLL_SETUP_SEC         QMID_TIMEOUT_SEC
+#define QMID_POLL_NO_SERVICE_SEC    30
+#define QMID_POLL_CONNECTED_SEC     15
+#define QMID_POLL_STABLE_SEC        60
+#define QMID_POLL_IND_ONLY_SEC      300
+#define QMID_POLL_STABLE_RANGE      6
+#define QMID_POLL_STABLE_SAMPLES    3
+//How long to wait for CIDs to be released when shutting down
+#define QMID_SHUTDOWN_TIMEOUT_MS    1000
 #define QMID_MAX_LENGTH_PIN     8
+//Max length of the device node name (relative to /dev), as used in uevents
+#define QMID_MAX_LENGTH_DEV_NAME    64
+//Max length of APN according to 3GPP TS 23.003
+#define QMID_MAX_LENGTH_APN     100
+//Each PDN (APN) has one WDS client per IP family
+#define QMID_MAX_PDNS           4
+#define QMID_MAX_WDS_SESSIONS   (QMID_MAX_PDNS * 2)
+//Primary and secondary
+#define QMID_MAX_DNS            2
+//CIDs owned by qmid, NAS, DMS and WDA plus one per WDS session
+#define QMID_MAX_CIDS           (QMID_MAX_WDS_SESSIONS + 3)
+//Primary carrier plus secondary (carrier aggregation) carriers
+#define QMID_MAX_RF_BANDS       8
+//Number of previous band combinations that are remembered
+#define QMID_RF_BAND_HISTORY    16
+//Max length of network name (without terminator)
+#define QMID_MAX_LENGTH_PLMN    32
 
 //I/F type
 #define QMUX_IF_TYPE            0x01
@@ -17,11 +47,15 @@
 #define QMI_SERVICE_WDS         0x01
 #define QMI_SERVICE_NAS         0x03
 #define QMI_SERVICE_DMS         0x02
+#define QMI_SERVICE_WDA         0x1A
 
 //Control flags
 #define QMI_CTL_FLAGS_RESP      0x3
 #define QMI_CTL_FLAGS_IND       0x4
 
+//Result TLV, first TLV of every response
+#define QMI_TLV_RESULT_CODE     0x02
+
 //Variables
 #define QMI_RESULT_SUCCESS      0x0000
 #define QMI_RESULT_FAILURE      0x0001
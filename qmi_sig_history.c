@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "qmi_sig_history.h"
+#include "qmi_dialer.h"
+
+static const char *qmi_sig_metric_str[QMI_SIG_NUM_METRICS] = {
+    "RSSI", "ECIO", "RSRQ", "RSRP", "SNR"
+};
+
+void qmi_sig_history_init(struct qmi_sig_history *hist, uint16_t *windows,
+        uint8_t num_windows, uint8_t ewma_alpha){
+    uint8_t i;
+
+    memset(hist, 0, sizeof(struct qmi_sig_history));
+
+    if(num_windows > QMI_SIG_MAX_WINDOWS)
+        num_windows = QMI_SIG_MAX_WINDOWS;
+
+    for(i=0; i<num_windows; i++){
+        hist->windows[i].len = windows[i];
+
+        if(hist->windows[i].len > QMI_SIG_HISTORY_LEN)
+            hist->windows[i].len = QMI_SIG_HISTORY_LEN;
+        else if(!hist->windows[i].len)
+            hist->windows[i].len = 1;
+    }
+
+    hist->num_windows = num_windows;
+    hist->ewma_alpha = ewma_alpha > 100 ? 100 : ewma_alpha;
+}
+
+static inline int16_t qmi_sig_value(struct qmi_sig_history *hist, uint16_t seq,
+        uint8_t metric){
+    return hist->samples[seq & QMI_SIG_HISTORY_MASK].values[metric];
+}
+
+static void qmi_sig_window_evict(struct qmi_sig_history *hist,
+        struct qmi_sig_window *win, uint16_t seq){
+    struct qmi_sig_sample *sample = &(hist->samples[seq & QMI_SIG_HISTORY_MASK]);
+    uint8_t m;
+
+    for(m=0; m<QMI_SIG_NUM_METRICS; m++){
+        if(!(sample->valid & (1 << m)))
+            continue;
+
+        win->sum[m] -= sample->values[m];
+        win->count[m]--;
+
+        //A sample is at most at the front of the queues when it leaves
+        if(win->min_size[m] && win->min_q[m][win->min_head[m]] == seq){
+            win->min_head[m] = (win->min_head[m] + 1) & QMI_SIG_HISTORY_MASK;
+            win->min_size[m]--;
+        }
+
+        if(win->max_size[m] && win->max_q[m][win->max_head[m]] == seq){
+            win->max_head[m] = (win->max_head[m] + 1) & QMI_SIG_HISTORY_MASK;
+            win->max_size[m]--;
+        }
+    }
+}
+
+static void qmi_sig_window_insert(struct qmi_sig_history *hist,
+        struct qmi_sig_window *win, uint16_t seq){
+    struct qmi_sig_sample *sample = &(hist->samples[seq & QMI_SIG_HISTORY_MASK]);
+    uint16_t tail;
+    uint8_t m;
+    int16_t value;
+
+    for(m=0; m<QMI_SIG_NUM_METRICS; m++){
+        if(!(sample->valid & (1 << m)))
+            continue;
+
+        value = sample->values[m];
+        win->sum[m] += value;
+        win->count[m]++;
+
+        //Samples that are larger (min) or smaller (max) than the new one can
+        //never be the extreme again, since the new sample outlives them
+        while(win->min_size[m]){
+            tail = (win->min_head[m] + win->min_size[m] - 1) &
+                QMI_SIG_HISTORY_MASK;
+
+            if(qmi_sig_value(hist, win->min_q[m][tail], m) < value)
+                break;
+
+            win->min_size[m]--;
+        }
+
+        win->min_q[m][(win->min_head[m] + win->min_size[m]) &
+            QMI_SIG_HISTORY_MASK] = seq;
+        win->min_size[m]++;
+
+        while(win->max_size[m]){
+            tail = (win->max_head[m] + win->max_size[m] - 1) &
+                QMI_SIG_HISTORY_MASK;
+
+            if(qmi_sig_value(hist, win->max_q[m][tail], m) > value)
+                break;
+
+            win->max_size[m]--;
+        }
+
+        win->max_q[m][(win->max_head[m] + win->max_size[m]) &
+            QMI_SIG_HISTORY_MASK] = seq;
+        win->max_size[m]++;
+    }
+}
+
+void qmi_sig_history_add(struct qmi_sig_history *hist,
+        struct qmi_sig_sample *sample){
+    struct qmi_sig_window *win;
+    uint16_t seq = hist->seq;
+    uint8_t i, m;
+
+    //Evict before the new sample is written, it might overwrite the sample that
+    //leaves the longest window
+    for(i=0; i<hist->num_windows; i++){
+        win = &(hist->windows[i]);
+
+        if(hist->num_samples >= win->len)
+            qmi_sig_window_evict(hist, win, seq - win->len);
+    }
+
+    memcpy(&(hist->samples[seq & QMI_SIG_HISTORY_MASK]), sample,
+            sizeof(struct qmi_sig_sample));
+
+    for(i=0; i<hist->num_windows; i++)
+        qmi_sig_window_insert(hist, &(hist->windows[i]), seq);
+
+    for(m=0; m<QMI_SIG_NUM_METRICS; m++){
+        if(!(sample->valid & (1 << m)))
+            continue;
+
+        if(!(hist->ewma_valid & (1 << m))){
+            hist->ewma[m] = sample->values[m] * 256;
+            hist->ewma_valid |= 1 << m;
+        } else
+            hist->ewma[m] += (hist->ewma_alpha * (sample->values[m] * 256 -
+                        hist->ewma[m])) / 100;
+    }
+
+    hist->seq++;
+
+    if(hist->num_samples < QMI_SIG_HISTORY_LEN)
+        hist->num_samples++;
+}
+
+uint8_t qmi_sig_history_get(struct qmi_sig_history *hist, uint8_t metric,
+        uint8_t window, struct qmi_sig_stats *stats){
+    struct qmi_sig_window *win;
+    uint16_t i;
+
+    if(metric >= QMI_SIG_NUM_METRICS || window >= hist->num_windows)
+        return 0;
+
+    win = &(hist->windows[window]);
+
+    if(!win->count[metric])
+        return 0;
+
+    stats->count = win->count[metric];
+    stats->min = qmi_sig_value(hist, win->min_q[metric][win->min_head[metric]],
+            metric);
+    stats->max = qmi_sig_value(hist, win->max_q[metric][win->max_head[metric]],
+            metric);
+    stats->mean_x10 = (win->sum[metric] * 10) / win->count[metric];
+    stats->ewma_x10 = (hist->ewma[metric] * 10) / 256;
+
+    //The newest valid sample is in the max queue (nothing outlives it)
+    i = (win->max_head[metric] + win->max_size[metric] - 1) &
+        QMI_SIG_HISTORY_MASK;
+    stats->last = qmi_sig_value(hist, win->max_q[metric][i], metric);
+
+    return 1;
+}
+
+//Values in tenths are printed as x.y, the sign has to be handled separately
+//since -0.5 would otherwise be printed as 0.5
+#define QMI_SIG_X10_FMT "%s%d.%d"
+#define QMI_SIG_X10_ARG(v) ((v) < 0 ? "-" : ""), \
+    ((v) < 0 ? -(v) : (v)) / 10, ((v) < 0 ? -(v) : (v)) % 10
+
+void qmi_sig_history_print(struct qmi_sig_history *hist){
+    struct qmi_sig_stats stats;
+    uint8_t i, m;
+
+    for(i=0; i<hist->num_windows; i++){
+        for(m=0; m<QMI_SIG_NUM_METRICS; m++){
+            if(!qmi_sig_history_get(hist, m, i, &stats))
+                continue;
+
+            QMID_DEBUG_PRINT(stderr, "%s (last %u samples, %u valid): last %d "
+                    "min %d max %d mean " QMI_SIG_X10_FMT " ewma "
+                    QMI_SIG_X10_FMT "\n", qmi_sig_metric_str[m],
+                    hist->windows[i].len, stats.count, stats.last, stats.min,
+                    stats.max, QMI_SIG_X10_ARG(stats.mean_x10),
+                    QMI_SIG_X10_ARG(stats.ewma_x10));
+        }
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef QMI_SIG_HISTORY_H
+#define QMI_SIG_HISTORY_H
+
+#include <stdint.h>
+#include <time.h>
+
+//Number of samples kept, must be a power of two. When polling every five
+//seconds this is a little more than 20 minutes, but polling backs off (and
+//indications arrive irregularly) once connected
+#define QMI_SIG_HISTORY_LEN         256
+#define QMI_SIG_HISTORY_MASK        (QMI_SIG_HISTORY_LEN - 1)
+#define QMI_SIG_MAX_WINDOWS         3
+
+//Default windows (in samples) and EWMA weight (in percent)
+#define QMI_SIG_DEFAULT_WINDOW_0    12
+#define QMI_SIG_DEFAULT_WINDOW_1    60
+#define QMI_SIG_DEFAULT_WINDOW_2    240
+#define QMI_SIG_DEFAULT_EWMA_ALPHA  20
+
+//The metrics that are stored. Values are stored as reported by the modem
+//(RSSI/RSRP in dBm, RSRQ in dB, ECIO in -0.5 dB and SNR in 0.1 dB)
+enum{
+    QMI_SIG_RSSI = 0,
+    QMI_SIG_ECIO,
+    QMI_SIG_RSRQ,
+    QMI_SIG_RSRP,
+    QMI_SIG_SNR,
+    QMI_SIG_NUM_METRICS,
+};
+
+struct qmi_sig_sample{
+    time_t timestamp;
+    int16_t values[QMI_SIG_NUM_METRICS];
+    //Bit per metric, not all technologies report all metrics
+    uint8_t valid;
+    //SERVICE_* when the sample was taken
+    uint8_t service;
+};
+
+//Rolling statistics over the last len samples. Sum and count gives the mean,
+//while min and max are kept in monotonic queues of sample sequence numbers, so
+//that all updates and queries are O(1) (amortized)
+struct qmi_sig_window{
+    uint16_t len;
+    int32_t sum[QMI_SIG_NUM_METRICS];
+    uint16_t count[QMI_SIG_NUM_METRICS];
+
+    uint16_t min_q[QMI_SIG_NUM_METRICS][QMI_SIG_HISTORY_LEN];
+    uint16_t min_head[QMI_SIG_NUM_METRICS];
+    uint16_t min_size[QMI_SIG_NUM_METRICS];
+    uint16_t max_q[QMI_SIG_NUM_METRICS][QMI_SIG_HISTORY_LEN];
+    uint16_t max_head[QMI_SIG_NUM_METRICS];
+    uint16_t max_size[QMI_SIG_NUM_METRICS];
+};
+
+struct qmi_sig_history{
+    struct qmi_sig_sample samples[QMI_SIG_HISTORY_LEN];
+    //Sequence number of next sample. Wraps, but windows are much shorter
+    uint16_t seq;
+    uint16_t num_samples;
+
+    uint8_t num_windows;
+    struct qmi_sig_window windows[QMI_SIG_MAX_WINDOWS];
+
+    //EWMA is stored in fixed point (x256), routers seldom have an FPU
+    uint8_t ewma_alpha;
+    uint8_t ewma_valid;
+    int32_t ewma[QMI_SIG_NUM_METRICS];
+};
+
+//Result of a query. Mean and EWMA are in tenths of the unit of the metric
+struct qmi_sig_stats{
+    int16_t last;
+    int16_t min;
+    int16_t max;
+    int32_t mean_x10;
+    int32_t ewma_x10;
+    uint16_t count;
+};
+
+//Window lengths are in samples and are capped to QMI_SIG_HISTORY_LEN
+void qmi_sig_history_init(struct qmi_sig_history *hist, uint16_t *windows,
+        uint8_t num_windows, uint8_t ewma_alpha);
+
+void qmi_sig_history_add(struct qmi_sig_history *hist,
+        struct qmi_sig_sample *sample);
+
+//Returns 0 if there are no valid samples of metric in window, 1 otherwise
+uint8_t qmi_sig_history_get(struct qmi_sig_history *hist, uint8_t metric,
+        uint8_t window, struct qmi_sig_stats *stats);
+
+//Output statistics for all windows
+void qmi_sig_history_print(struct qmi_sig_history *hist);
+#endif
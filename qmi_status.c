@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "qmi_status.h"
+#include "qmi_device.h"
+#include "qmi_sig_history.h"
+
+int qmi_status_open(struct qmi_status *status){
+    char tmp_path[PATH_MAX];
+    struct qmi_status_page *page;
+    uint8_t i;
+    int fd;
+
+    //Readers must never see a file that is not fully set up
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", status->path);
+
+    if((fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0644)) == -1)
+        return -1;
+
+    if(ftruncate(fd, sizeof(struct qmi_status_page)) == -1){
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    page = mmap(NULL, sizeof(struct qmi_status_page), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(page == MAP_FAILED){
+        unlink(tmp_path);
+        return -1;
+    }
+
+    page->magic = QMI_STATUS_MAGIC;
+    page->version = QMI_STATUS_VERSION;
+    page->size = sizeof(struct qmi_status_page);
+    page->pid = getpid();
+
+    if(rename(tmp_path, status->path) == -1){
+        munmap(page, sizeof(struct qmi_status_page));
+        unlink(tmp_path);
+        return -1;
+    }
+
+    //Nothing has changed since qmid started
+    memset(&(status->data), 0, sizeof(status->data));
+    status->data.started = status->data.service_since = time(NULL);
+
+    for(i=0; i<QMID_MAX_WDS_SESSIONS; i++)
+        status->data.sessions[i].state_since = status->data.started;
+
+    status->page = page;
+
+    return 0;
+}
+
+void qmi_status_close(struct qmi_status *status){
+    if(status->page == NULL)
+        return;
+
+    munmap(status->page, sizeof(struct qmi_status_page));
+    status->page = NULL;
+    unlink(status->path);
+}
+
+static void qmi_status_collect(struct qmi_device *qmid,
+        struct qmi_status_data *data){
+    struct qmi_status_data *prev = &(qmid->status.data);
+    struct qmi_sig_history *hist = &(qmid->sig_history);
+    struct qmid_serving_system *srv_sys = &(qmid->serving_system);
+    struct qmi_status_session *session;
+    struct qmi_wds_session *wds;
+    struct qmi_sig_stats stats;
+    time_t now = time(NULL);
+    uint16_t last;
+    uint8_t i;
+
+    //Padding must be zero, the data is compared with memcmp()
+    memset(data, 0, sizeof(*data));
+    data->started = prev->started;
+
+    data->ctl_state = qmid->ctl_state;
+    data->nas_state = qmid->nas_state;
+    data->dms_state = qmid->dms_state;
+    data->wda_state = qmid->wda_state;
+    data->service = qmid->cur_service;
+    data->subservice = qmid->cur_subservice;
+    data->service_since = data->service == prev->service ?
+        prev->service_since : now;
+
+    data->reg_state = srv_sys->reg_state;
+    data->roaming = srv_sys->roaming;
+    data->cs_attached = srv_sys->cs_attached;
+    data->ps_attached = srv_sys->ps_attached;
+    data->mcc = srv_sys->mcc;
+    data->mnc = srv_sys->mnc;
+
+    data->rat_mode_pref = qmid->rat_mode_pref;
+    data->policy_mode = qmid->policy.mode;
+    data->lkg_state = qmid->lkg.state;
+
+    data->bands_since = qmid->rf_bands.start;
+    data->num_bands = qmid->rf_bands.num_bands;
+
+    for(i=0; i<data->num_bands; i++){
+        data->bands[i].radio_if = qmid->rf_bands.bands[i].radio_if;
+        data->bands[i].bandwidth = qmid->rf_bands.bands[i].bandwidth;
+        data->bands[i].band = qmid->rf_bands.bands[i].band;
+        data->bands[i].channel = qmid->rf_bands.bands[i].channel;
+    }
+
+    if(hist->num_samples){
+        last = (hist->seq - 1) & QMI_SIG_HISTORY_MASK;
+        data->sig_updated = hist->samples[last].timestamp;
+    }
+
+    for(i=0; i<QMI_SIG_NUM_METRICS; i++){
+        if(!qmi_sig_history_get(hist, i, 0, &stats))
+            continue;
+
+        data->sig_valid |= 1 << i;
+        data->sig_last[i] = stats.last;
+        data->sig_mean_x10[i] = stats.mean_x10;
+    }
+
+    data->num_sessions = qmid->wds_num_sessions;
+
+    for(i=0; i<qmid->wds_num_sessions; i++){
+        wds = &(qmid->wds_sessions[i]);
+        session = &(data->sessions[i]);
+
+        session->pdn = wds->pdn;
+        session->ip_family = wds->ip_family;
+        session->mux_id = wds->mux_id;
+        session->wds_state = wds->wds_state;
+        session->bearer_rat_mask = wds->bearer_rat_mask;
+        session->state_since = session->wds_state ==
+            prev->sessions[i].wds_state ? prev->sessions[i].state_since : now;
+        memcpy(session->ifname, wds->ifname, IFNAMSIZ);
+
+        if(wds->wds_state == WDS_CONNECTED){
+            memcpy(session->addr, wds->ip_cfg.addr, sizeof(session->addr));
+            session->prefix_len = wds->ip_cfg.prefix_len;
+        }
+    }
+
+    data->wakeups = qmid->wakeups;
+    data->wakeups_last_hour = qmid->wakeups_last_hour;
+    data->probe_sent = qmid->probe.sent;
+    data->probe_lost = qmid->probe.lost;
+    data->probe_rtt_last = qmid->probe.rtt_last;
+    data->policy_switches = qmid->policy.num_switches;
+}
+
+void qmi_status_update(struct qmi_device *qmid){
+    struct qmi_status *status = &(qmid->status);
+    struct qmi_status_page *page = status->page;
+    struct qmi_status_data data;
+    uint32_t seq;
+
+    if(page == NULL)
+        return;
+
+    qmi_status_collect(qmid, &data);
+
+    if(!memcmp(&data, &(status->data), sizeof(data)))
+        return;
+
+    memcpy(&(status->data), &data, sizeof(data));
+
+    //Odd sequence number tells readers that a write is in progress. The
+    //fences keep the data writes between the two sequence updates
+    seq = page->seq;
+    __atomic_store_n(&(page->seq), seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(&(page->data), &data, sizeof(data));
+    page->updated = time(NULL);
+    page->num_updates++;
+
+    __atomic_store_n(&(page->seq), seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,127 @@
+#ifndef QMI_STATUS_H
+#define QMI_STATUS_H
+
+#include <stdint.h>
+#include <net/if.h>
+
+#include "qmi_shared.h"
+#include "qmi_sig_history.h"
+
+//Status page. The state of qmid is published in a memory-mapped file (for
+//example under /run), so that monitoring agents can read it as often as they
+//want without syscalls or any work for qmid. The page is only written when
+//something has changed, protected by a sequence lock. Readers copy the data
+//and retry if the sequence number was odd or changed while copying:
+//
+//  do{
+//      seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+//      memcpy(&data, &page->data, sizeof(data));
+//      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+//  } while((seq & 1) || seq != __atomic_load_n(&page->seq, __ATOMIC_RELAXED));
+//
+//The layout only changes together with the version. Times are wall-clock
+//seconds, states and values are the ones qmid uses internally
+#define QMI_STATUS_MAGIC        0x716d6964
+#define QMI_STATUS_VERSION      1
+
+struct qmi_status_band{
+    uint8_t radio_if;
+    uint8_t bandwidth;
+    uint16_t band;
+    uint32_t channel;
+};
+
+struct qmi_status_session{
+    uint8_t pdn;
+    //QMI_WDS_IP_FAMILY_*
+    uint8_t ip_family;
+    uint8_t mux_id;
+    uint8_t wds_state;
+    //Data bearer (QMI_WDS_ER_RAT_*)
+    uint32_t bearer_rat_mask;
+    int64_t state_since;
+    char ifname[IFNAMSIZ];
+    //Network byte order, IPv4 only uses the first four bytes
+    uint8_t addr[16];
+    uint8_t prefix_len;
+    uint8_t pad[7];
+};
+
+struct qmi_status_data{
+    int64_t started;
+    int64_t service_since;
+    int64_t bands_since;
+    //Time of the last signal sample
+    int64_t sig_updated;
+
+    uint8_t ctl_state;
+    uint8_t nas_state;
+    uint8_t dms_state;
+    uint8_t wda_state;
+    uint8_t service;
+    uint8_t subservice;
+    //QMI_GEN_NAS_REG_STATE_*
+    uint8_t reg_state;
+    uint8_t roaming;
+    uint8_t cs_attached;
+    uint8_t ps_attached;
+    uint16_t mcc;
+    uint16_t mnc;
+    uint8_t num_bands;
+    uint8_t num_sessions;
+    //Preference in use, RAT policy mode and last-known-good bias state
+    uint16_t rat_mode_pref;
+    uint8_t policy_mode;
+    uint8_t lkg_state;
+    struct qmi_status_band bands[QMID_MAX_RF_BANDS];
+
+    //Last value and mean of the shortest window (times ten) of each metric
+    //(QMI_SIG_*), in the units of the signal history. Bit per valid metric
+    uint32_t sig_valid;
+    int32_t sig_last[QMI_SIG_NUM_METRICS];
+    int32_t sig_mean_x10[QMI_SIG_NUM_METRICS];
+
+    struct qmi_status_session sessions[QMID_MAX_WDS_SESSIONS];
+
+    uint32_t wakeups;
+    uint32_t wakeups_last_hour;
+    uint32_t probe_sent;
+    uint32_t probe_lost;
+    uint32_t probe_rtt_last;
+    uint32_t policy_switches;
+};
+
+struct qmi_status_page{
+    //Set when the file is created, never changed
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;
+    int32_t pid;
+    //Odd while the rest is written
+    uint32_t seq;
+    uint32_t num_updates;
+    uint32_t pad;
+    int64_t updated;
+    struct qmi_status_data data;
+};
+
+struct qmi_status{
+    //File to publish in, NULL disables the page
+    const char *path;
+    struct qmi_status_page *page;
+    //What was last published, to detect changes
+    struct qmi_status_data data;
+};
+
+struct qmi_device;
+
+//Create the file (replacing any old one atomically) and map it. Returns 0 on
+//success, -1 otherwise
+int qmi_status_open(struct qmi_status *status);
+
+//Unmap and remove the file, qmid is no longer running
+void qmi_status_close(struct qmi_status *status);
+
+//Build the status from qmid, and publish it if it has changed
+void qmi_status_update(struct qmi_device *qmid);
+#endif
@@ -0,0 +1,215 @@
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#include "qmi_dialer.h"
+#include "qmi_helpers.h"
+#include "qmi_hdrs.h"
+#include "qmi_wda.h"
+#include "qmi_ctl.h"
+#include "qmi_device.h"
+#include "qmi_wds.h"
+#include "qmi_netlink.h"
+#include "qmi_gen.h"
+
+static inline ssize_t qmi_wda_write(struct qmi_device *qmid, uint8_t *buf,
+        uint16_t len){
+    //TODO: Only do this if request is sucessful?
+    qmid->wda_transaction_id = (qmid->wda_transaction_id + 1) % UINT8_MAX;
+
+    //According to spec, transaction id must be non-zero
+    if(!qmid->wda_transaction_id)
+        qmid->wda_transaction_id = 1;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_3){
+        QMID_DEBUG_PRINT(stderr, "Will send (WDA):\n");
+        parse_qmi(buf);
+    }
+
+    qmid->wda_sent_time = time(NULL);
+
+    //+1 is to include marker
+    //len is passed as qmux_hdr->length, which is store as little endian
+    return qmi_helpers_write(qmid->qmi_fd, buf, len + 1);
+}
+
+uint8_t qmi_wda_needed(struct qmi_device *qmid){
+    //QMAP frames are IP packets with a small header, so raw-ip is required
+    return qmid->qmap_enabled &&
+        qmid->link_proto == QMI_CTL_LINK_PROTO_RAW_IP;
+}
+
+static ssize_t qmi_wda_send_data_format(struct qmi_device *qmid){
+    uint8_t *buf = qmi_helpers_get_buf();
+    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
+    uint32_t link_proto = htole32(QMI_WDA_LINK_PROTO_RAW_IP);
+    uint32_t agg_proto = htole32(QMI_WDA_AGG_PROTO_QMAP);
+    uint32_t dl_max_datagrams = htole32(qmid->qmap_req.dl_max_datagrams);
+    uint32_t dl_max_size = htole32(qmid->qmap_req.dl_max_size);
+    qmi_wda_endpoint_info_t ep_info;
+    int32_t iface_num;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+        QMID_DEBUG_PRINT(stderr, "Requesting QMAP aggregation (%u datagrams, "
+                "%u bytes)\n", qmid->qmap_req.dl_max_datagrams,
+                qmid->qmap_req.dl_max_size);
+
+    create_qmi_request(buf, QMI_SERVICE_WDA, qmid->wda_id,
+            qmid->wda_transaction_id, QMI_WDA_SET_DATA_FORMAT);
+    add_tlv(buf, QMI_WDA_TLV_DF_LINK_PROTO, sizeof(uint32_t), &link_proto);
+    add_tlv(buf, QMI_WDA_TLV_DF_UL_AGG_PROTO, sizeof(uint32_t), &agg_proto);
+    add_tlv(buf, QMI_WDA_TLV_DF_DL_AGG_PROTO, sizeof(uint32_t), &agg_proto);
+    add_tlv(buf, QMI_WDA_TLV_DF_DL_MAX_DATAGRAMS, sizeof(uint32_t),
+            &dl_max_datagrams);
+    add_tlv(buf, QMI_WDA_TLV_DF_DL_MAX_SIZE, sizeof(uint32_t), &dl_max_size);
+
+    //Newer modems want to know which USB interface the settings apply to.
+    //Older ones ignore it
+    if((iface_num = qmi_helpers_get_iface_num(qmid->ifname)) >= 0){
+        ep_info.ep_type = htole32(QMI_WDA_EP_TYPE_HSUSB);
+        ep_info.iface_num = htole32(iface_num);
+        add_tlv(buf, QMI_WDA_TLV_DF_ENDPOINT_INFO, sizeof(ep_info), &ep_info);
+    }
+
+    qmid->wda_state = WDA_SET_FORMAT;
+
+    return qmi_wda_write(qmid, buf, le16toh(qmux_hdr->length));
+}
+
+uint8_t qmi_wda_send(struct qmi_device *qmid){
+    uint8_t retval = QMI_MSG_IGNORE;
+
+    switch(qmid->wda_state){
+        case WDA_GOT_CID:
+        case WDA_SET_FORMAT:
+            qmi_wda_send_data_format(qmid);
+            break;
+        default:
+            break;
+    }
+
+    return retval;
+}
+
+//Create one mux interface per PDN. Sessions whose interface can't be created
+//keep using the device interface
+static void qmi_wda_add_mux_ifaces(struct qmi_device *qmid){
+    struct qmi_wds_session *wds;
+    char mux_ifname[IFNAMSIZ];
+    uint8_t i;
+
+    for(i=0; i<qmid->wds_num_sessions; i++){
+        wds = &(qmid->wds_sessions[i]);
+
+        if(!wds->mux_id)
+            continue;
+
+        if(qmi_helpers_add_mux(qmid->ifname, wds->mux_id, mux_ifname)){
+            if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+                QMID_DEBUG_PRINT(stderr, "Could not add mux interface for "
+                        "mux ID %u\n", wds->mux_id);
+            continue;
+        }
+
+        memcpy(wds->ifname, mux_ifname, IFNAMSIZ);
+
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+            QMID_DEBUG_PRINT(stderr, "Mux ID %u (%s) is %s\n", wds->mux_id,
+                    wds->apn_name, wds->ifname);
+    }
+}
+
+//Sessions waiting for the data format to be configured can continue now
+static void qmi_wda_kick_sessions(struct qmi_device *qmid){
+    uint8_t i;
+
+    for(i=0; i<qmid->wds_num_sessions; i++)
+        if(qmid->wds_sessions[i].wds_state == WDS_BIND_MUX)
+            qmi_wds_send(qmid, &(qmid->wds_sessions[i]));
+
+    qmi_wds_update_connect(qmid);
+}
+
+static uint8_t qmi_wda_handle_data_format(struct qmi_device *qmid){
+    struct qmid_qmap_config *qmap = &(qmid->qmap);
+    struct qmi_gen_wda_set_data_format msg;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+        QMID_DEBUG_PRINT(stderr, "Received WDA_SET_DATA_FORMAT_RESP\n");
+
+    qmid->wda_state = WDA_IDLE;
+    memset(qmap, 0, sizeof(struct qmid_qmap_config));
+
+    //Not being able to aggregate is not critical, data will just flow one
+    //packet per transfer
+    if(qmi_gen_wda_set_data_format_decode(qmid->buf, &msg) ==
+            QMI_MSG_FAILURE || msg.result == QMI_RESULT_FAILURE){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Modem does not support QMAP "
+                    "aggregation\n");
+        qmi_wda_kick_sessions(qmid);
+        return QMI_MSG_SUCCESS;
+    }
+
+    if(msg.ul_agg_proto)
+        qmap->ul_proto = le32toh(msg.ul_agg_proto->proto);
+
+    if(msg.dl_agg_proto)
+        qmap->dl_proto = le32toh(msg.dl_agg_proto->proto);
+
+    if(msg.dl_max_datagrams)
+        qmap->dl_max_datagrams = le32toh(msg.dl_max_datagrams->count);
+
+    if(msg.dl_max_size)
+        qmap->dl_max_size = le32toh(msg.dl_max_size->size);
+
+    if(msg.ul_max_datagrams)
+        qmap->ul_max_datagrams = le32toh(msg.ul_max_datagrams->count);
+
+    if(msg.ul_max_size)
+        qmap->ul_max_size = le32toh(msg.ul_max_size->size);
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1){
+        QMID_DEBUG_PRINT(stderr, "QMAP downlink: %s, %u datagrams, %u bytes\n",
+                qmap->dl_proto == QMI_WDA_AGG_PROTO_QMAP ? "enabled" :
+                "disabled", qmap->dl_max_datagrams, qmap->dl_max_size);
+        QMID_DEBUG_PRINT(stderr, "QMAP uplink: %s, %u datagrams, %u bytes\n",
+                qmap->ul_proto == QMI_WDA_AGG_PROTO_QMAP ? "enabled" :
+                "disabled", qmap->ul_max_datagrams, qmap->ul_max_size);
+    }
+
+    //qmi_wwan sizes its receive buffers after the MTU of the interface, so it
+    //has to be able to hold a complete aggregate
+    if(qmap->dl_proto == QMI_WDA_AGG_PROTO_QMAP && qmap->dl_max_size &&
+            qmi_netlink_set_mtu(qmid->rtnl_fd, qmid->ifname,
+                qmap->dl_max_size) &&
+            qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Could not set MTU of %s to %u\n",
+                qmid->ifname, qmap->dl_max_size);
+
+    if(qmap->dl_proto == QMI_WDA_AGG_PROTO_QMAP)
+        qmi_wda_add_mux_ifaces(qmid);
+
+    qmi_wda_kick_sessions(qmid);
+    return QMI_MSG_SUCCESS;
+}
+
+uint8_t qmi_wda_handle_msg(struct qmi_device *qmid){
+    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
+    qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
+    uint8_t retval = QMI_MSG_IGNORE;
+
+    switch(le16toh(qmi_hdr->message_id)){
+        case QMI_WDA_SET_DATA_FORMAT:
+            if(qmid->wda_state == WDA_SET_FORMAT)
+                retval = qmi_wda_handle_data_format(qmid);
+            break;
+        default:
+            if(qmid_verbose_logging >= QMID_LOG_LEVEL_3)
+                QMID_DEBUG_PRINT(stderr, "Unknown WDA packet of type %x\n",
+                        le16toh(qmi_hdr->message_id));
+            break;
+    }
+
+    return retval;
+}
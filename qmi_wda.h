@@ -0,0 +1,53 @@
+#ifndef QMI_WDA_H
+#define QMI_WDA_H
+
+#include <stdint.h>
+#include "qmi_shared.h"
+
+//Message types
+#define QMI_WDA_SET_DATA_FORMAT             0x0020
+
+//SET_DATA_FORMAT request TLVs, the reply is in qmi_messages.schema
+#define QMI_WDA_TLV_DF_LINK_PROTO           0x11
+#define QMI_WDA_TLV_DF_UL_AGG_PROTO         0x12
+#define QMI_WDA_TLV_DF_DL_AGG_PROTO         0x13
+#define QMI_WDA_TLV_DF_DL_MAX_DATAGRAMS     0x15
+#define QMI_WDA_TLV_DF_DL_MAX_SIZE          0x16
+#define QMI_WDA_TLV_DF_ENDPOINT_INFO        0x17
+
+//Link protocol values (same as CTL, but 32 bit)
+#define QMI_WDA_LINK_PROTO_802_3            0x01
+#define QMI_WDA_LINK_PROTO_RAW_IP           0x02
+
+//Aggregation protocol values
+#define QMI_WDA_AGG_PROTO_DISABLED          0x00
+#define QMI_WDA_AGG_PROTO_QMAP              0x05
+
+//Endpoint type
+#define QMI_WDA_EP_TYPE_HSUSB               0x02
+
+//Default aggregation limits, same as what most modems accept
+#define QMID_QMAP_DEFAULT_DATAGRAMS         32
+#define QMID_QMAP_DEFAULT_SIZE              16384
+//Accepted limits. An aggregate must hold at least one full-sized packet, and
+//the interface MTU is raised to the size
+#define QMID_QMAP_MAX_DATAGRAMS             1024
+#define QMID_QMAP_MIN_SIZE                  2048
+#define QMID_QMAP_MAX_SIZE                  65536
+
+struct qmi_wda_endpoint_info{
+    uint32_t ep_type;
+    uint32_t iface_num;
+} __attribute__((packed));
+
+typedef struct qmi_wda_endpoint_info qmi_wda_endpoint_info_t;
+
+struct qmi_device;
+
+uint8_t qmi_wda_send(struct qmi_device *qmid);
+uint8_t qmi_wda_handle_msg(struct qmi_device *qmid);
+
+//If a WDA client is needed (QMAP is wanted and the link is raw-ip)
+uint8_t qmi_wda_needed(struct qmi_device *qmid);
+
+#endif
@@ -3,6 +3,9 @@
 #include <endian.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 
 #include "qmi_wds.h"
 #include "qmi_device.h"
@@ -11,128 +14,355 @@
 #include "qmi_hdrs.h"
 #include "qmi_helpers.h"
 #include "qmi_nas.h"
+#include "qmi_netlink.h"
+#include "qmi_wda.h"
+#include "qmi_gen.h"
+#include "qmi_events.h"
+
+//Requests without TLVs
+static struct qmi_req_tmpl qmi_wds_reset_tmpl;
+static struct qmi_req_tmpl qmi_wds_pkt_srvc_tmpl;
+static struct qmi_req_tmpl qmi_wds_data_bearer_tmpl;
+
+static const char *qmi_wds_family_str(struct qmi_wds_session *wds){
+    return wds->ip_family == QMI_WDS_IP_FAMILY_IPV6 ? "IPv6" : "IPv4";
+}
+
+static const char *qmi_wds_state_str(struct qmi_wds_session *wds){
+    switch(wds->wds_state){
+        case WDS_DISCONNECTED:
+            return "disconnected";
+        case WDS_CONNECTING:
+            return "connecting";
+        case WDS_CONNECTED:
+            return "connected";
+        case WDS_DISCONNECTING:
+            return "disconnecting";
+        default:
+            return "configuring";
+    }
+}
+
+static struct qmi_wds_session *qmi_wds_get_session(struct qmi_device *qmid,
+        uint8_t wds_id){
+    uint8_t i;
+
+    for(i=0; i<qmid->wds_num_sessions; i++)
+        if(qmid->wds_sessions[i].wds_id == wds_id)
+            return &(qmid->wds_sessions[i]);
+
+    return NULL;
+}
+
+//Number of connected sessions using ifname, NULL counts all sessions
+static uint8_t qmi_wds_num_connected(struct qmi_device *qmid,
+        const char *ifname){
+    uint8_t i, num_connected = 0;
+
+    for(i=0; i<qmid->wds_num_sessions; i++)
+        if(qmid->wds_sessions[i].wds_state == WDS_CONNECTED && (ifname == NULL
+                    || !strcmp(qmid->wds_sessions[i].ifname, ifname)))
+            num_connected++;
+
+    return num_connected;
+}
 
-static inline ssize_t qmi_wds_write(struct qmi_device *qmid, uint8_t *buf,
-        uint16_t len){
+void qmi_wds_print_status(struct qmi_device *qmid){
+    struct qmi_wds_session *wds;
+    uint8_t i;
+
+    for(i=0; i<qmid->wds_num_sessions; i++){
+        wds = &(qmid->wds_sessions[i]);
+        QMID_DEBUG_PRINT(stderr, "WDS status: %s %s (cid %u, mux %u, %s) is "
+                "%s. Handle %x\n", wds->apn_name, qmi_wds_family_str(wds),
+                wds->wds_id, wds->mux_id, wds->ifname, qmi_wds_state_str(wds),
+                wds->pkt_data_handle);
+    }
+}
+
+static inline ssize_t qmi_wds_write(struct qmi_device *qmid,
+        struct qmi_wds_session *wds, uint8_t *buf, uint16_t len){
     //TODO: Only do this if request is sucessful?
-    qmid->wds_transaction_id = (qmid->wds_transaction_id + 1) % UINT8_MAX;
+    wds->wds_transaction_id = (wds->wds_transaction_id + 1) % UINT8_MAX;
 
     //According to spec, transaction id must be non-zero
-    if(!qmid->wds_transaction_id)
-        qmid->wds_transaction_id = 1;
+    if(!wds->wds_transaction_id)
+        wds->wds_transaction_id = 1;
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_3){
-        QMID_DEBUG_PRINT(stderr, "Will send (WDS):\n");
+        QMID_DEBUG_PRINT(stderr, "Will send (WDS %s):\n",
+                qmi_wds_family_str(wds));
         parse_qmi(buf);
     }
 
-    qmid->wds_sent_time = time(NULL);
+    wds->wds_sent_time = time(NULL);
 
     //+1 is to include marker
     //len is passed as qmux_hdr->length, which is store as little endian
     return qmi_helpers_write(qmid->qmi_fd, buf, len + 1);
 }
 
-static ssize_t qmi_wds_connect(struct qmi_device *qmid){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
+static ssize_t qmi_wds_connect(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
+    uint8_t *buf = qmi_helpers_get_buf();
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
-    //Convert to little endian
-
-    create_qmi_request(buf, QMI_SERVICE_WDS, qmid->wds_id,
-            qmid->wds_transaction_id, QMI_WDS_START_NETWORK_INTERFACE);
-    add_tlv(buf, QMI_WDS_TLV_SNI_APN_NAME, strlen(qmid->apn_name),
-            qmid->apn_name);
+    uint16_t len;
+
+    create_qmi_request(buf, QMI_SERVICE_WDS, wds->wds_id,
+            wds->wds_transaction_id, QMI_WDS_START_NETWORK_INTERFACE);
+    add_tlv(buf, QMI_WDS_TLV_SNI_APN_NAME, strlen(wds->apn_name),
+            wds->apn_name);
+    //Some modems ignore the client preference, so also request family here
+    add_tlv(buf, QMI_WDS_TLV_SNI_IP_FAMILY_PREF, sizeof(uint8_t),
+            &(wds->ip_family));
     //add_tlv(buf, QMI_WDS_TLV_SNI_EXT_TECH_PREF, sizeof(int16_t), &etp_val); 
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
-        QMID_DEBUG_PRINT(stderr, "Will connect to APN %s\n", qmid->apn_name);
+        QMID_DEBUG_PRINT(stderr, "Will connect to APN %s (%s)\n",
+                wds->apn_name, qmi_wds_family_str(wds));
+
+    //The buffer is returned to the pool by the write, so store length first
+    len = le16toh(qmux_hdr->length);
 
     //This is so far the only critical write I have. However, I will not do
     //anything right now, the next connect will be controlled by a timeout
-    if(qmi_wds_write(qmid, buf, le16toh(qmux_hdr->length)) ==
-            le16toh(qmux_hdr->length) + 1){
-        qmid->wds_state = WDS_CONNECTING;
+    if(qmi_wds_write(qmid, wds, buf, len) == len + 1){
+        wds->wds_state = WDS_CONNECTING;
         return QMI_MSG_SUCCESS;
     } else
         return QMI_MSG_FAILURE;
 }
 
-uint8_t qmi_wds_disconnect(struct qmi_device *qmid){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
-    uint32_t pkt_data_handle = htole32(qmid->pkt_data_handle);
+static uint8_t qmi_wds_disconnect_session(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
+    uint8_t *buf = qmi_helpers_get_buf();
+    uint32_t pkt_data_handle = htole32(wds->pkt_data_handle);
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
     uint8_t enable = 1;
 
-    create_qmi_request(buf, QMI_SERVICE_WDS, qmid->wds_id,
-            qmid->wds_transaction_id, QMI_WDS_STOP_NETWORK_INTERFACE);
+    create_qmi_request(buf, QMI_SERVICE_WDS, wds->wds_id,
+            wds->wds_transaction_id, QMI_WDS_STOP_NETWORK_INTERFACE);
     add_tlv(buf, QMI_WDS_TLV_SNI_PACKET_HANDLE, sizeof(uint32_t),
             &pkt_data_handle);
     add_tlv(buf, QMI_WDS_TLV_SNI_STOP_AUTO_CONNECT, sizeof(uint8_t),
             &enable);
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
-        QMID_DEBUG_PRINT(stderr, "Will disconnect\n");
+        QMID_DEBUG_PRINT(stderr, "Will disconnect %s\n",
+                qmi_wds_family_str(wds));
 
     //TODO: There can't be any partial writes, the file descriptor is in
     //blocking mode
-    if(qmi_wds_write(qmid, buf, le16toh(qmux_hdr->length))){
+    if(qmi_wds_write(qmid, wds, buf, le16toh(qmux_hdr->length))){
         //TODO: Should perhaps be disconnecting, look into it
-        qmid->wds_state = WDS_DISCONNECTED;
+        wds->wds_state = WDS_DISCONNECTED;
         return QMI_MSG_SUCCESS;
     } else
         return QMI_MSG_FAILURE;
 }
 
+uint8_t qmi_wds_disconnect(struct qmi_device *qmid){
+    uint8_t i, retval = QMI_MSG_SUCCESS;
+
+    for(i=0; i<qmid->wds_num_sessions; i++){
+        if(!qmid->wds_sessions[i].pkt_data_handle)
+            continue;
+
+        if(qmi_wds_disconnect_session(qmid, &(qmid->wds_sessions[i])) ==
+                QMI_MSG_FAILURE)
+            retval = QMI_MSG_FAILURE;
+    }
+
+    return retval;
+}
+
+uint8_t qmi_wds_reconnect(struct qmi_device *qmid, const char *ifname){
+    struct qmi_wds_session *wds;
+    uint8_t i, retval = QMI_MSG_SUCCESS;
+
+    for(i=0; i<qmid->wds_num_sessions; i++){
+        wds = &(qmid->wds_sessions[i]);
+
+        if(!wds->pkt_data_handle || strcmp(wds->ifname, ifname))
+            continue;
+
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Reconnecting %s %s\n", wds->apn_name,
+                    qmi_wds_family_str(wds));
+
+        if(qmi_wds_disconnect_session(qmid, wds) == QMI_MSG_FAILURE)
+            retval = QMI_MSG_FAILURE;
+    }
+
+    return retval;
+}
+
+uint8_t qmi_wds_reconnect_pdn(struct qmi_device *qmid, uint8_t pdn){
+    struct qmi_wds_session *wds;
+    uint8_t i, retval = QMI_MSG_SUCCESS;
+
+    for(i=0; i<qmid->wds_num_sessions; i++){
+        wds = &(qmid->wds_sessions[i]);
+
+        if(!wds->pkt_data_handle || wds->pdn != pdn)
+            continue;
+
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Reconnecting PDN %u to %s %s\n", pdn,
+                    wds->apn_name, qmi_wds_family_str(wds));
+
+        if(qmi_wds_disconnect_session(qmid, wds) == QMI_MSG_FAILURE)
+            retval = QMI_MSG_FAILURE;
+    }
+
+    return retval;
+}
+
 //TODO: Fix return values here
 uint8_t qmi_wds_update_connect(struct qmi_device *qmid){
+    struct qmi_wds_session *wds;
+    uint8_t i;
     
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2){
         if(!qmid->pin_unlocked)
             QMID_DEBUG_PRINT(stderr, "Could not connect, PIN locked\n");
         if(!qmid->cur_service)
             QMID_DEBUG_PRINT(stderr, "Could not connect, no service\n");
-        if(qmid->wds_state == WDS_CONNECTING)
-            QMID_DEBUG_PRINT(stderr, "Could not connect, connection in "
-                    "progress\n");
-        else if(qmid->wds_state == WDS_CONNECTED)
-            QMID_DEBUG_PRINT(stderr, "Already connected\n");
+        if(qmid->wda_id && qmid->wda_state != WDA_IDLE)
+            QMID_DEBUG_PRINT(stderr, "Could not connect, data format not "
+                    "set\n");
     }
 
-    if(qmid->pin_unlocked && qmid->cur_service && qmid->wds_state ==
-            WDS_DISCONNECTED)
-        qmi_wds_connect(qmid);
+    //The data format must be in place before the data path is up
+    if(qmid->wda_id && qmid->wda_state != WDA_IDLE)
+        return 0;
+
+    //The sessions are independent, so all families are dialed in parallel
+    for(i=0; i<qmid->wds_num_sessions; i++){
+        wds = &(qmid->wds_sessions[i]);
+
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_2){
+            if(wds->wds_state == WDS_CONNECTING)
+                QMID_DEBUG_PRINT(stderr, "Could not connect %s, connection in "
+                        "progress\n", qmi_wds_family_str(wds));
+            else if(wds->wds_state == WDS_CONNECTED)
+                QMID_DEBUG_PRINT(stderr, "%s already connected\n",
+                        qmi_wds_family_str(wds));
+        }
+
+        //Only the first PDN can share the interface with the device, the
+        //others are unusable without their own mux interface
+        if(wds->pdn && !wds->mux_id){
+            if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+                QMID_DEBUG_PRINT(stderr, "Could not connect %s, no mux "
+                        "interface\n", wds->apn_name);
+            continue;
+        }
+
+        if(qmid->pin_unlocked && qmid->cur_service && wds->wds_state ==
+                WDS_DISCONNECTED)
+            qmi_wds_connect(qmid, wds);
+    }
     
     return 0;
 }
 
-static ssize_t qmi_wds_send_reset(struct qmi_device *qmid){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
+static ssize_t qmi_wds_send_reset(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
+    uint8_t *buf;
+    qmux_hdr_t *qmux_hdr;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+        QMID_DEBUG_PRINT(stderr, "Resetting WDS (%s)\n",
+                qmi_wds_family_str(wds));
+
+    buf = qmi_helpers_use_tmpl(&qmi_wds_reset_tmpl, QMI_SERVICE_WDS,
+            wds->wds_id, wds->wds_transaction_id, QMI_WDS_RESET);
+    qmux_hdr = (qmux_hdr_t*) buf;
+    wds->wds_state = WDS_RESET;
+
+    return qmi_wds_write(qmid, wds, buf, le16toh(qmux_hdr->length));
+}
+
+static ssize_t qmi_wds_send_bind_mux(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
+    uint8_t *buf = qmi_helpers_get_buf();
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
+    struct qmi_gen_wds_bind_mux_data_port_req req;
+    int32_t iface_num;
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
-        QMID_DEBUG_PRINT(stderr, "Resetting WDS\n");
+        QMID_DEBUG_PRINT(stderr, "Binding WDS client %u to mux ID %u\n",
+                wds->wds_id, wds->mux_id);
+
+    memset(&req, 0, sizeof(req));
+
+    if((iface_num = qmi_helpers_get_iface_num(qmid->ifname)) >= 0){
+        req.has_endpoint_info = 1;
+        req.endpoint_info.ep_type = QMI_WDA_EP_TYPE_HSUSB;
+        req.endpoint_info.iface_num = iface_num;
+    }
 
-    create_qmi_request(buf, QMI_SERVICE_WDS, qmid->wds_id,
-            qmid->wds_transaction_id, QMI_WDS_RESET);
-    qmid->wds_state = WDS_RESET;
+    req.has_mux_id = 1;
+    req.mux_id.mux_id = wds->mux_id;
 
-    return qmi_wds_write(qmid, buf, le16toh(qmux_hdr->length));
+    if(qmi_gen_wds_bind_mux_data_port_encode(buf, wds->wds_id,
+                wds->wds_transaction_id, &req) == QMI_MSG_FAILURE){
+        qmi_helpers_put_buf(buf);
+        return -1;
+    }
+    wds->wds_state = WDS_BIND_MUX;
+
+    return qmi_wds_write(qmid, wds, buf, le16toh(qmux_hdr->length));
 }
 
-static ssize_t qmi_wds_send_set_event_report(struct qmi_device *qmid){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
+//Mux is not possible after all (QMAP rejected or binding failed), so the
+//session has to use the interface of the device
+static void qmi_wds_disable_mux(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
+    wds->mux_id = 0;
+    memcpy(wds->ifname, qmid->ifname, IFNAMSIZ);
+}
+
+static ssize_t qmi_wds_send_ip_family(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
+    uint8_t *buf = qmi_helpers_get_buf();
+    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
+    struct qmi_gen_wds_set_client_ip_family_pref_req req;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+        QMID_DEBUG_PRINT(stderr, "Binding WDS client %u to %s\n",
+                wds->wds_id, qmi_wds_family_str(wds));
+
+    memset(&req, 0, sizeof(req));
+    req.has_ip_family = 1;
+    req.ip_family.family = wds->ip_family;
+
+    if(qmi_gen_wds_set_client_ip_family_pref_encode(buf, wds->wds_id,
+                wds->wds_transaction_id, &req) == QMI_MSG_FAILURE){
+        qmi_helpers_put_buf(buf);
+        return -1;
+    }
+    wds->wds_state = WDS_IP_FAMILY;
+
+    return qmi_wds_write(qmid, wds, buf, le16toh(qmux_hdr->length));
+}
+
+static ssize_t qmi_wds_send_set_event_report(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
+    uint8_t *buf = qmi_helpers_get_buf();
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
     uint8_t enable = 1;
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
         QMID_DEBUG_PRINT(stderr, "Configuring event reports\n");
 
-    create_qmi_request(buf, QMI_SERVICE_WDS, qmid->wds_id,
-            qmid->wds_transaction_id, QMI_WDS_SET_EVENT_REPORT);
+    create_qmi_request(buf, QMI_SERVICE_WDS, wds->wds_id,
+            wds->wds_transaction_id, QMI_WDS_SET_EVENT_REPORT);
     add_tlv(buf, QMI_WDS_TLV_ER_CUR_DATA_BEARER_IND, sizeof(uint8_t), &enable);
-    qmid->wds_state = WDS_IND_REQ;
+    wds->wds_state = WDS_IND_REQ;
 
-    return qmi_wds_write(qmid, buf, le16toh(qmux_hdr->length));
+    return qmi_wds_write(qmid, wds, buf, le16toh(qmux_hdr->length));
 }
 
 //Keep this function for now, even though it is not used. With the MF821D, I see
@@ -144,22 +374,24 @@ static ssize_t qmi_wds_send_set_event_report(struct qmi_device *qmid){
 //have service. However, a connection attempt causes me to loose service and
 //start from the beginning. Similar behavior is not observed with for example
 //the Alcatel OneTouch
-static ssize_t qmi_wds_send_get_pkt_srvc(struct qmi_device *qmid){ 
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE]; 
-    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
+static ssize_t qmi_wds_send_get_pkt_srvc(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){ 
+    uint8_t *buf;
+    qmux_hdr_t *qmux_hdr;
     
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
         QMID_DEBUG_PRINT(stderr, "Requesting current packet serivce status\n");
 
-    create_qmi_request(buf, QMI_SERVICE_WDS, qmid->wds_id,
-            qmid->wds_transaction_id, QMI_WDS_GET_PKT_SRVC_STATUS);
+    buf = qmi_helpers_use_tmpl(&qmi_wds_pkt_srvc_tmpl, QMI_SERVICE_WDS,
+            wds->wds_id, wds->wds_transaction_id, QMI_WDS_GET_PKT_SRVC_STATUS);
+    qmux_hdr = (qmux_hdr_t*) buf;
 
-    return qmi_wds_write(qmid, buf, le16toh(qmux_hdr->length));
+    return qmi_wds_write(qmid, wds, buf, le16toh(qmux_hdr->length));
 }
 
 static ssize_t qmi_wds_send_update_autoconnect(struct qmi_device *qmid,
-        uint8_t enabled){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
+        struct qmi_wds_session *wds, uint8_t enabled){
+    uint8_t *buf = qmi_helpers_get_buf();
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2){
@@ -169,34 +401,205 @@ static ssize_t qmi_wds_send_update_autoconnect(struct qmi_device *qmid,
             QMID_DEBUG_PRINT(stderr, "Disabling autoconnect\n");
     }
 
-    create_qmi_request(buf, QMI_SERVICE_WDS, qmid->wds_id,
-            qmid->wds_transaction_id, QMI_WDS_SET_AUTOCONNECT_SETTINGS);
+    create_qmi_request(buf, QMI_SERVICE_WDS, wds->wds_id,
+            wds->wds_transaction_id, QMI_WDS_SET_AUTOCONNECT_SETTINGS);
     add_tlv(buf, QMI_WDS_TLV_SAS_SETTING, sizeof(uint8_t), &enabled);
 
-    return qmi_wds_write(qmid, buf, le16toh(qmux_hdr->length));
+    return qmi_wds_write(qmid, wds, buf, le16toh(qmux_hdr->length));
 }
 
-static ssize_t qmi_wds_request_data_bearer(struct qmi_device *qmid){
-    uint8_t buf[QMI_DEFAULT_BUF_SIZE];
-    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
+static ssize_t qmi_wds_request_data_bearer(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
+    uint8_t *buf;
+    qmux_hdr_t *qmux_hdr;
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
         QMID_DEBUG_PRINT(stderr, "Requesting current data bearer\n");
 
-    create_qmi_request(buf, QMI_SERVICE_WDS, qmid->wds_id,
-            qmid->wds_transaction_id, QMI_WDS_GET_DATA_BEARER_TECHNOLOGY);
+    buf = qmi_helpers_use_tmpl(&qmi_wds_data_bearer_tmpl, QMI_SERVICE_WDS,
+            wds->wds_id, wds->wds_transaction_id,
+            QMI_WDS_GET_DATA_BEARER_TECHNOLOGY);
+    qmux_hdr = (qmux_hdr_t*) buf;
 
-    return qmi_wds_write(qmid, buf, le16toh(qmux_hdr->length));
+    return qmi_wds_write(qmid, wds, buf, le16toh(qmux_hdr->length));
 }
 
+static ssize_t qmi_wds_request_runtime_settings(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
+    uint8_t *buf = qmi_helpers_get_buf();
+    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) buf;
+    struct qmi_gen_wds_get_runtime_settings_req req;
 
-uint8_t qmi_wds_send(struct qmi_device *qmid){
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+        QMID_DEBUG_PRINT(stderr, "Requesting runtime settings (%s)\n",
+                qmi_wds_family_str(wds));
+
+    memset(&req, 0, sizeof(req));
+    req.has_requested_settings = 1;
+    req.requested_settings.mask = QMI_WDS_RS_DNS_ADDR | QMI_WDS_RS_IP_ADDR |
+        QMI_WDS_RS_GATEWAY_INFO | QMI_WDS_RS_MTU | QMI_WDS_RS_IP_FAMILY;
+
+    if(qmi_gen_wds_get_runtime_settings_encode(buf, wds->wds_id,
+                wds->wds_transaction_id, &req) == QMI_MSG_FAILURE){
+        qmi_helpers_put_buf(buf);
+        return -1;
+    }
+
+    return qmi_wds_write(qmid, wds, buf, le16toh(qmux_hdr->length));
+}
+
+static uint8_t qmi_wds_af(struct qmi_wds_session *wds){
+    return wds->ip_family == QMI_WDS_IP_FAMILY_IPV6 ? AF_INET6 : AF_INET;
+}
+
+static void qmi_wds_remove_ip_config(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
+    if(!wds->ip_cfg_applied)
+        return;
+
+    //Routes using the address are removed by the kernel together with it
+    if(qmi_netlink_update_addr(qmid->rtnl_fd, wds->ifname, 0,
+                qmi_wds_af(wds), wds->ip_cfg.addr, wds->ip_cfg.prefix_len) &&
+            qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Failed to remove address from %s (%s)\n",
+                wds->ifname, strerror(errno));
+
+    wds->ip_cfg_applied = 0;
+}
+
+static void qmi_wds_apply_ip_config(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
+    struct qmid_ip_config *cfg = &(wds->ip_cfg);
+    uint8_t af = qmi_wds_af(wds);
+
+    //The MTU is shared by the families, the last one to report wins. With
+    //QMAP, the MTU of the device interface decides the size of the aggregates
+    //and must be left alone
+    if(cfg->mtu && (qmid->qmap.dl_proto != QMI_WDA_AGG_PROTO_QMAP ||
+                strcmp(wds->ifname, qmid->ifname)) &&
+            qmi_netlink_set_mtu(qmid->rtnl_fd, wds->ifname, cfg->mtu)
+            && qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Failed to set MTU %u on %s (%s)\n",
+                cfg->mtu, wds->ifname, strerror(errno));
+
+    if(qmi_netlink_update_addr(qmid->rtnl_fd, wds->ifname, 1, af, cfg->addr,
+                cfg->prefix_len)){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Failed to add address to %s (%s)\n",
+                    wds->ifname, strerror(errno));
+        return;
+    }
+
+    wds->ip_cfg_applied = 1;
+
+    //The first PDN is the data PDN, the others (for example management) are
+    //only reachable through their subnet
+    if(wds->pdn)
+        return;
+
+    if(qmi_netlink_set_default_route(qmid->rtnl_fd, wds->ifname, af,
+                cfg->has_gateway ? cfg->gateway : NULL) &&
+            qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "Failed to set default route on %s (%s)\n",
+                wds->ifname, strerror(errno));
+}
+
+void qmi_wds_run_hook(struct qmi_device *qmid, struct qmi_wds_session *wds,
+        uint8_t type){
+    struct qmid_ip_config *cfg = &(wds->ip_cfg);
+    char addr_str[INET6_ADDRSTRLEN], dns_str[2 * INET6_ADDRSTRLEN] = "";
+    struct qmi_hooks_event ev;
+    uint8_t af = qmi_wds_af(wds), i;
+
+    wds->hook_connected = type != QMI_HOOK_DISCONNECTED;
+
+    qmi_hooks_event_init(&ev, type);
+    qmi_hooks_add_env(&ev, "QMID_IFNAME", "%s", wds->ifname);
+    qmi_hooks_add_env(&ev, "QMID_APN", "%s", wds->apn_name);
+    qmi_hooks_add_env(&ev, "QMID_PDN", "%u", wds->pdn);
+    qmi_hooks_add_env(&ev, "QMID_FAMILY", "%s", qmi_wds_family_str(wds));
+    qmi_hooks_add_env(&ev, "QMID_BEARER", "0x%x", wds->bearer_rat_mask);
+
+    //Addressing is only known when qmid configures the interface
+    if(wds->ip_cfg_applied){
+        inet_ntop(af, cfg->addr, addr_str, sizeof(addr_str));
+        qmi_hooks_add_env(&ev, "QMID_ADDRESS", "%s/%u", addr_str,
+                cfg->prefix_len);
+
+        if(cfg->has_gateway){
+            inet_ntop(af, cfg->gateway, addr_str, sizeof(addr_str));
+            qmi_hooks_add_env(&ev, "QMID_GATEWAY", "%s", addr_str);
+        }
+
+        for(i=0; i<cfg->num_dns; i++){
+            inet_ntop(af, cfg->dns[i], addr_str, sizeof(addr_str));
+
+            if(i)
+                strcat(dns_str, " ");
+
+            strcat(dns_str, addr_str);
+        }
+
+        if(cfg->num_dns)
+            qmi_hooks_add_env(&ev, "QMID_DNS", "%s", dns_str);
+
+        if(cfg->mtu)
+            qmi_hooks_add_env(&ev, "QMID_MTU", "%u", cfg->mtu);
+    }
+
+    //Subscribers get the same events as the hook
+    qmi_events_session(qmid, wds, type);
+    qmi_hooks_run(qmid, &ev);
+}
+
+static void qmi_wds_print_ip_config(struct qmi_wds_session *wds){
+    struct qmid_ip_config *cfg = &(wds->ip_cfg);
+    uint8_t af = qmi_wds_af(wds), i;
+    char addr_str[INET6_ADDRSTRLEN], gw_str[INET6_ADDRSTRLEN];
+
+    inet_ntop(af, cfg->addr, addr_str, sizeof(addr_str));
+
+    if(cfg->has_gateway)
+        inet_ntop(af, cfg->gateway, gw_str, sizeof(gw_str));
+    else
+        strcpy(gw_str, "none");
+
+    QMID_DEBUG_PRINT(stderr, "%s address %s/%u gateway %s MTU %u\n",
+            qmi_wds_family_str(wds), addr_str, cfg->prefix_len, gw_str,
+            cfg->mtu);
+
+    for(i=0; i<cfg->num_dns; i++){
+        inet_ntop(af, cfg->dns[i], addr_str, sizeof(addr_str));
+        QMID_DEBUG_PRINT(stderr, "%s DNS %s\n", qmi_wds_family_str(wds),
+                addr_str);
+    }
+}
+
+uint8_t qmi_wds_send(struct qmi_device *qmid, struct qmi_wds_session *wds){
     uint8_t retval = QMI_MSG_IGNORE;
 
-    switch(qmid->wds_state){
+    switch(wds->wds_state){
         case WDS_GOT_CID:
         case WDS_RESET:
-            qmi_wds_send_reset(qmid);
+            qmi_wds_send_reset(qmid, wds);
+            break;
+        case WDS_BIND_MUX:
+            //Which mux interfaces exist is not known until WDA is done. WDA
+            //will kick the session when it is ready
+            if(qmid->wda_id && qmid->wda_state != WDA_IDLE)
+                break;
+
+            if(wds->mux_id && qmid->qmap.dl_proto == QMI_WDA_AGG_PROTO_QMAP &&
+                    strcmp(wds->ifname, qmid->ifname)){
+                qmi_wds_send_bind_mux(qmid, wds);
+                break;
+            }
+
+            qmi_wds_disable_mux(qmid, wds);
+            qmi_wds_send_ip_family(qmid, wds);
+            break;
+        case WDS_IP_FAMILY:
+            qmi_wds_send_ip_family(qmid, wds);
             break;
         case WDS_IND_REQ:
             //Failed sends are not that interesting. It will just take longer
@@ -204,8 +607,8 @@ uint8_t qmi_wds_send(struct qmi_device *qmid){
             //Disable autoconnect, otherwise the dialer will just become
             //confused, connections will not be made and so on (MF821D has
             //seemingly large problems with this value)
-            qmi_wds_send_update_autoconnect(qmid, 0);
-            qmi_wds_send_set_event_report(qmid);
+            qmi_wds_send_update_autoconnect(qmid, wds, 0);
+            qmi_wds_send_set_event_report(qmid, wds);
             break;
         case WDS_DISCONNECTED:
             //wds_send also needs to support disconnect, but this function
@@ -224,11 +627,12 @@ uint8_t qmi_wds_send(struct qmi_device *qmid){
     return retval;
 }
 
-static uint8_t qmi_wds_handle_reset(struct qmi_device *qmid){
+static uint8_t qmi_wds_handle_reset(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
     qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
     qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
-    uint16_t result = le16toh(*((uint16_t*) (tlv+1)));
+    uint16_t result = qmi_helpers_get_result(tlv);
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
         QMID_DEBUG_PRINT(stderr, "Received WDS_RESET_RESP\n");
@@ -240,21 +644,76 @@ static uint8_t qmi_wds_handle_reset(struct qmi_device *qmid){
     } else {
         if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
             QMID_DEBUG_PRINT(stderr, "WDS is reset\n");
-        qmid->wds_state = WDS_IND_REQ;
-        qmi_wds_send(qmid);
+        wds->wds_state = wds->mux_id ? WDS_BIND_MUX : WDS_IP_FAMILY;
+        qmi_wds_send(qmid, wds);
         return QMI_MSG_SUCCESS;
     }
 }
 
-static uint8_t qmi_wds_handle_event_report(struct qmi_device *qmid){
+static uint8_t qmi_wds_handle_bind_mux(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
+    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
+    qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
+    qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
+    uint16_t result = qmi_helpers_get_result(tlv);
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+        QMID_DEBUG_PRINT(stderr, "Received BIND_MUX_DATA_PORT_RESP\n");
+
+    if(result == QMI_RESULT_FAILURE){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Could not bind %s to mux ID %u\n",
+                    wds->apn_name, wds->mux_id);
+        qmi_wds_disable_mux(qmid, wds);
+    } else if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "%s (%s) is using mux ID %u on %s\n",
+                wds->apn_name, qmi_wds_family_str(wds), wds->mux_id,
+                wds->ifname);
+
+    wds->wds_state = WDS_IP_FAMILY;
+    qmi_wds_send(qmid, wds);
+    return QMI_MSG_SUCCESS;
+}
+
+static uint8_t qmi_wds_handle_ip_family(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
+    qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
+    qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
+    qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
+    uint16_t result = qmi_helpers_get_result(tlv);
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+        QMID_DEBUG_PRINT(stderr, "Received SET_CLIENT_IP_FAMILY_PREF_RESP\n");
+
+    //Without the binding, the modem would pick a family for me and the two
+    //sessions could end up requesting the same one
+    if(result == QMI_RESULT_FAILURE){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Could not bind WDS client to %s\n",
+                    qmi_wds_family_str(wds));
+        return QMI_MSG_FAILURE;
+    }
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        QMID_DEBUG_PRINT(stderr, "WDS client %u bound to %s\n", wds->wds_id,
+                qmi_wds_family_str(wds));
+
+    wds->wds_state = WDS_IND_REQ;
+    qmi_wds_send(qmid, wds);
+    return QMI_MSG_SUCCESS;
+}
+
+static uint8_t qmi_wds_handle_event_report(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
     qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
     qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1), *tlv_db = NULL;
     qmi_wds_cur_db_t *cur_db = NULL;
 
     uint16_t tlv_length = le16toh(qmi_hdr->length), i = 0;
-    uint16_t result = le16toh(*((uint16_t*) (tlv+1)));
-    uint8_t retval = QMI_MSG_IGNORE;
+    uint16_t result = qmi_helpers_get_result(tlv);
+    uint8_t retval = QMI_MSG_IGNORE, bearer_changed;
+    uint32_t rat_mask;
 
     if(result == QMI_RESULT_FAILURE)
         return QMI_MSG_FAILURE;
@@ -268,9 +727,9 @@ static uint8_t qmi_wds_handle_event_report(struct qmi_device *qmid){
     //the request (WDS can only move into >= PKT_SRVC_QUERY from here)
     //if(qmid->wds_state < WDS_DISCONNECTED){
     if(qmi_hdr->control_flags & QMI_CTL_FLAGS_RESP){
-        qmid->wds_state = WDS_DISCONNECTED;
+        wds->wds_state = WDS_DISCONNECTED;
         retval = QMI_MSG_SUCCESS;
-        qmi_wds_send(qmid);
+        qmi_wds_send(qmid, wds);
     }
     
     //Remove first tlv if this message was the result of a request
@@ -300,6 +759,22 @@ static uint8_t qmi_wds_handle_event_report(struct qmi_device *qmid){
         return retval;
 
     cur_db = (qmi_wds_cur_db_t*) (tlv+1);
+    rat_mask = le32toh(cur_db->rat_mask);
+
+    //The first bearer is part of connecting, only changes are hooked
+    if(rat_mask != wds->bearer_rat_mask){
+        bearer_changed = wds->bearer_rat_mask != 0;
+        wds->bearer_rat_mask = rat_mask;
+
+        if(bearer_changed && wds->hook_connected)
+            qmi_wds_run_hook(qmid, wds, QMI_HOOK_BEARER);
+    }
+
+    //The modem might have changed addressing (for example MTU) together with
+    //the bearer, so make sure the interface matches
+    if(!(qmi_hdr->control_flags & QMI_CTL_FLAGS_RESP) &&
+            wds->wds_state == WDS_CONNECTED && !qmid->use_dhcp)
+        qmi_wds_request_runtime_settings(qmid, wds);
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_1){
         if(cur_db->rat_mask & QMI_WDS_ER_RAT_WCDMA)
@@ -323,11 +798,12 @@ static uint8_t qmi_wds_handle_event_report(struct qmi_device *qmid){
     return retval;
 }
 
-static uint8_t qmi_wds_handle_connect(struct qmi_device *qmid){
+static uint8_t qmi_wds_handle_connect(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
     qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
     qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
-    uint16_t result = le16toh(*((uint16_t*) (tlv+1)));
+    uint16_t result = qmi_helpers_get_result(tlv);
     uint8_t retval = QMI_MSG_IGNORE;
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
@@ -336,17 +812,18 @@ static uint8_t qmi_wds_handle_connect(struct qmi_device *qmid){
     if(result == QMI_RESULT_FAILURE){
         //TODO: Consider adding the actual error code too
         if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
-            QMID_DEBUG_PRINT(stderr, "Connection attempt failed\n");
+            QMID_DEBUG_PRINT(stderr, "Connection attempt failed (%s)\n",
+                    qmi_wds_family_str(wds));
 
-		//qmi_wds_send_get_pkt_srvc(qmid);
+		//qmi_wds_send_get_pkt_srvc(qmid, wds);
 
-        if(qmid->wds_state != WDS_CONNECTED)
+        if(wds->wds_state != WDS_CONNECTED)
             //No need to update rat_mode_pref in case of Netcom mode. Rat mode
             //is only set to allow LTE after a successful connected. A
             //connection failed attempt is either the initial connection
             //(rat_pref has not been set) or preceded by a packet service
             //disconnect (rat_pref has been set to RAT_MODE_PREF_MIN)
-            qmid->wds_state = WDS_DISCONNECTED;
+            wds->wds_state = WDS_DISCONNECTED;
         else if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
             QMID_DEBUG_PRINT(stderr, "Connection attempt failed, but "
                     "autoconnected\n");
@@ -354,12 +831,14 @@ static uint8_t qmi_wds_handle_connect(struct qmi_device *qmid){
     }
 
     tlv = (qmi_tlv_t*) (((uint8_t*) (tlv+1)) + le16toh(tlv->length));
-    qmid->pkt_data_handle = le32toh(*((uint32_t*) (tlv + 1)));
-    qmid->wds_state = WDS_CONNECTED;
+    wds->pkt_data_handle = qmi_helpers_get_le32(tlv+1);
+    wds->wds_state = WDS_CONNECTED;
     
-    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
-        QMID_DEBUG_PRINT(stderr, "Modem is connected. Handle %x\n",
-                qmid->pkt_data_handle);
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1){
+        QMID_DEBUG_PRINT(stderr, "Modem is connected (%s). Handle %x\n",
+                qmi_wds_family_str(wds), wds->pkt_data_handle);
+        qmi_wds_print_status(qmid);
+    }
 
     return retval;
 }
@@ -368,7 +847,7 @@ static uint8_t qmi_wds_handle_get_db_tech(struct qmi_device *qmid){
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
     qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
     qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
-    uint16_t result = le16toh(*((uint16_t*) (tlv+1)));
+    uint16_t result = qmi_helpers_get_result(tlv);
     uint8_t retval = QMI_MSG_IGNORE;
     uint8_t data_bearer = 0;
 
@@ -415,74 +894,245 @@ static uint8_t qmi_wds_handle_get_db_tech(struct qmi_device *qmid){
     return retval;
 }
 
-static uint8_t qmi_wds_handle_pkt_srvc(struct qmi_device *qmid){
+static uint8_t qmi_wds_handle_pkt_srvc(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
     qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
     qmi_tlv_t *tlv = (qmi_tlv_t*) (qmi_hdr + 1);
+    uint16_t tlv_length = le16toh(qmi_hdr->length), i = 0;
     uint8_t retval = QMI_MSG_IGNORE;
+    uint8_t conn_status = 0, reconn_required = 0;
+    uint8_t ip_family = wds->ip_family;
 
-    //I am only interested in the first TLV and never request this one
-    uint8_t conn_status = *((uint8_t*) (tlv+1));
-    uint8_t reconn_required = *(((uint8_t*) (tlv+1))+1);
+    //I only care about the status and which family the indication is for
+    while(i<tlv_length){
+        if(tlv->type == QMI_WDS_TLV_PSS_STATUS){
+            conn_status = *((uint8_t*) (tlv+1));
+            reconn_required = *(((uint8_t*) (tlv+1))+1);
+        } else if(tlv->type == QMI_WDS_TLV_PSS_IP_FAMILY){
+            ip_family = *((uint8_t*) (tlv+1));
+        }
+
+        i += sizeof(qmi_tlv_t) + le16toh(tlv->length);
+
+        if(i==tlv_length)
+            break;
+        else
+            tlv = (qmi_tlv_t*) (((uint8_t*) (tlv+1)) + le16toh(tlv->length));
+    }
 
     if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
-        QMID_DEBUG_PRINT(stderr, "pkt srvc status: %x reconn: %x\n",
-                conn_status, reconn_required);
+        QMID_DEBUG_PRINT(stderr, "pkt srvc status (%s): %x reconn: %x "
+                "family: %u\n", qmi_wds_family_str(wds), conn_status,
+                reconn_required, ip_family);
 
     if(conn_status == QMI_WDS_PSS_CONNECTED){
-        qmid->wds_state = WDS_CONNECTED;
+        wds->wds_state = WDS_CONNECTED;
         //Request current data bearer (in case I have missed the initial
         //indication)
-        qmi_wds_request_data_bearer(qmid);
-        qmi_helpers_set_link(qmid->ifname, 1);
+        qmi_wds_request_data_bearer(qmid, wds);
+
+        //Mux interfaces only pass traffic when the device interface is up
+        qmi_netlink_set_link(qmid->rtnl_fd, qmid->ifname, 1);
+
+        if(strcmp(wds->ifname, qmid->ifname))
+            qmi_netlink_set_link(qmid->rtnl_fd, wds->ifname, 1);
+
+        //Routes can only be added once the link is up. Without runtime
+        //settings, the hook is run right away
+        if(!qmid->use_dhcp)
+            qmi_wds_request_runtime_settings(qmid, wds);
+        else if(!wds->hook_connected)
+            qmi_wds_run_hook(qmid, wds, QMI_HOOK_CONNECTED);
 
         //No need to update rat_mode_pref here, done when the connection is
         //established (in case of Netcom mode)
     } else{
-        qmid->wds_state = WDS_DISCONNECTED;
+        wds->wds_state = WDS_DISCONNECTED;
+        wds->pkt_data_handle = 0;
+
+        //Run before the address is removed, so that the hook sees it
+        if(wds->hook_connected)
+            qmi_wds_run_hook(qmid, wds, QMI_HOOK_DISCONNECTED);
+
+        wds->bearer_rat_mask = 0;
+        qmi_wds_remove_ip_config(qmid, wds);
 
         //Set network interface as down. This will not fail in a normal usage
         //scenario, network interface depends on qmi-device. So it is only
-        //removed if qmi device is removed too
+        //removed if qmi device is removed too. Interfaces are shared by
+        //families and PDNs, so keep them up as long as one session is
+        //connected
         //TODO: Check for typos in ifname
-        qmi_helpers_set_link(qmid->ifname, 0);
+        if(strcmp(wds->ifname, qmid->ifname) &&
+                !qmi_wds_num_connected(qmid, wds->ifname))
+            qmi_netlink_set_link(qmid->rtnl_fd, wds->ifname, 0);
+
+        if(!qmi_wds_num_connected(qmid, NULL))
+            qmi_netlink_set_link(qmid->rtnl_fd, qmid->ifname, 0);
         //We have only lost packet serivce, not network service. So don't change
         //service. Only handle_sys info is allowed to do that
     }
 
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        qmi_wds_print_status(qmid);
+
     return retval;
 }
 
+//QMI stores IPv4 addresses as little endian integers
+static void qmi_wds_copy_ipv4(uint8_t *dst, uint32_t le_addr){
+    uint32_t addr = htonl(le32toh(le_addr));
+    memcpy(dst, &addr, sizeof(addr));
+}
+
+static uint8_t qmi_wds_handle_runtime_settings(struct qmi_device *qmid,
+        struct qmi_wds_session *wds){
+    struct qmi_gen_wds_get_runtime_settings msg;
+    struct qmid_ip_config cfg;
+    uint8_t has_addr = 0;
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_2)
+        QMID_DEBUG_PRINT(stderr, "Received GET_RUNTIME_SETTINGS_RESP\n");
+
+    if(qmi_gen_wds_get_runtime_settings_decode(qmid->buf, &msg) ==
+            QMI_MSG_FAILURE || msg.result == QMI_RESULT_FAILURE){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Could not get runtime settings (%s)\n",
+                    qmi_wds_family_str(wds));
+        return QMI_MSG_IGNORE;
+    }
+
+    memset(&cfg, 0, sizeof(cfg));
+
+    if(msg.ipv4_addr){
+        qmi_wds_copy_ipv4(cfg.addr, msg.ipv4_addr->addr);
+        has_addr = 1;
+    }
+
+    if(msg.ipv4_subnet_mask)
+        cfg.prefix_len = __builtin_popcount(
+                le32toh(msg.ipv4_subnet_mask->mask));
+
+    if(msg.ipv4_gateway){
+        qmi_wds_copy_ipv4(cfg.gateway, msg.ipv4_gateway->addr);
+        cfg.has_gateway = 1;
+    }
+
+    if(msg.ipv4_dns_primary && cfg.num_dns < QMID_MAX_DNS)
+        qmi_wds_copy_ipv4(cfg.dns[cfg.num_dns++], msg.ipv4_dns_primary->addr);
+
+    if(msg.ipv4_dns_secondary && cfg.num_dns < QMID_MAX_DNS)
+        qmi_wds_copy_ipv4(cfg.dns[cfg.num_dns++],
+                msg.ipv4_dns_secondary->addr);
+
+    if(msg.ipv6_addr){
+        memcpy(cfg.addr, msg.ipv6_addr->addr, sizeof(msg.ipv6_addr->addr));
+        cfg.prefix_len = msg.ipv6_addr->prefix_len;
+        has_addr = 1;
+    }
+
+    if(msg.ipv6_gateway){
+        memcpy(cfg.gateway, msg.ipv6_gateway->addr,
+                sizeof(msg.ipv6_gateway->addr));
+        cfg.has_gateway = 1;
+    }
+
+    if(msg.ipv6_dns_primary && cfg.num_dns < QMID_MAX_DNS)
+        memcpy(cfg.dns[cfg.num_dns++], msg.ipv6_dns_primary->addr,
+                sizeof(msg.ipv6_dns_primary->addr));
+
+    if(msg.ipv6_dns_secondary && cfg.num_dns < QMID_MAX_DNS)
+        memcpy(cfg.dns[cfg.num_dns++], msg.ipv6_dns_secondary->addr,
+                sizeof(msg.ipv6_dns_secondary->addr));
+
+    if(msg.mtu)
+        cfg.mtu = le32toh(msg.mtu->mtu);
+
+    if(!has_addr){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+            QMID_DEBUG_PRINT(stderr, "Runtime settings without address (%s)\n",
+                    qmi_wds_family_str(wds));
+        return QMI_MSG_IGNORE;
+    }
+
+    //Only touch the interface if something has changed, a bearer change
+    //typically keeps the addressing
+    if(wds->ip_cfg_applied && !memcmp(&cfg, &(wds->ip_cfg), sizeof(cfg)))
+        return QMI_MSG_SUCCESS;
+
+    //A new address replaces the old one
+    if(wds->ip_cfg_applied && (memcmp(cfg.addr, wds->ip_cfg.addr,
+                    sizeof(cfg.addr)) || cfg.prefix_len !=
+                wds->ip_cfg.prefix_len))
+        qmi_wds_remove_ip_config(qmid, wds);
+
+    memcpy(&(wds->ip_cfg), &cfg, sizeof(cfg));
+
+    if(qmid_verbose_logging >= QMID_LOG_LEVEL_1)
+        qmi_wds_print_ip_config(wds);
+
+    qmi_wds_apply_ip_config(qmid, wds);
+
+    if(!wds->hook_connected)
+        qmi_wds_run_hook(qmid, wds, QMI_HOOK_CONNECTED);
+
+    return QMI_MSG_SUCCESS;
+}
+
 uint8_t qmi_wds_handle_msg(struct qmi_device *qmid){
     qmux_hdr_t *qmux_hdr = (qmux_hdr_t*) qmid->buf;
     qmi_hdr_gen_t *qmi_hdr = (qmi_hdr_gen_t*) (qmux_hdr + 1);
     uint8_t retval = QMI_MSG_IGNORE;
+    struct qmi_wds_session *wds = qmi_wds_get_session(qmid,
+            qmux_hdr->client_id);
+
+    //Each session has its own client, so the CID tells me which state machine
+    //the message belongs to
+    if(wds == NULL){
+        if(qmid_verbose_logging >= QMID_LOG_LEVEL_3)
+            QMID_DEBUG_PRINT(stderr, "WDS message for unknown client %u\n",
+                    qmux_hdr->client_id);
+        return retval;
+    }
 
     switch(le16toh(qmi_hdr->message_id)){
         case QMI_WDS_RESET:
-            if(qmid->wds_state == WDS_RESET)
-                retval = qmi_wds_handle_reset(qmid);
+            if(wds->wds_state == WDS_RESET)
+                retval = qmi_wds_handle_reset(qmid, wds);
+            break;
+        case QMI_WDS_BIND_MUX_DATA_PORT:
+            if(wds->wds_state == WDS_BIND_MUX)
+                retval = qmi_wds_handle_bind_mux(qmid, wds);
+            break;
+        case QMI_WDS_SET_CLIENT_IP_FAMILY_PREF:
+            if(wds->wds_state == WDS_IP_FAMILY)
+                retval = qmi_wds_handle_ip_family(qmid, wds);
             break;
         //This one also covers the reply to the set event report
         case QMI_WDS_EVENT_REPORT_IND:
             //Adding a guard against reordering here is tricky, since this value
             //is used both by response and indication. Think some more
-            retval = qmi_wds_handle_event_report(qmid);
+            retval = qmi_wds_handle_event_report(qmid, wds);
             //Setting up the event report is the only configuration step for
             //WDS, so check if I can connect. The reason for checking sucess and
             //not just >0 is the indications that also match
             //QMI_WDS_EVENT_REPORT_IND.
             break;
         case QMI_WDS_START_NETWORK_INTERFACE:
-            if(qmid->wds_state >= WDS_CONNECTING)
-                retval = qmi_wds_handle_connect(qmid);
+            if(wds->wds_state >= WDS_CONNECTING)
+                retval = qmi_wds_handle_connect(qmid, wds);
             break;
         case QMI_WDS_GET_DATA_BEARER_TECHNOLOGY:
-            if(qmid->wds_state == WDS_CONNECTED)
+            if(wds->wds_state == WDS_CONNECTED)
                 retval = qmi_wds_handle_get_db_tech(qmid);
             break;
         case QMI_WDS_GET_PKT_SRVC_STATUS:
-            retval = qmi_wds_handle_pkt_srvc(qmid);
+            retval = qmi_wds_handle_pkt_srvc(qmid, wds);
+            break;
+        case QMI_WDS_GET_RUNTIME_SETTINGS:
+            if(wds->wds_state == WDS_CONNECTED && !qmid->use_dhcp)
+                retval = qmi_wds_handle_runtime_settings(qmid, wds);
             break;
         default:
             if(qmid_verbose_logging >= QMID_LOG_LEVEL_3)
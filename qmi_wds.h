@@ -10,8 +10,11 @@
 #define QMI_WDS_START_NETWORK_INTERFACE     0x0020
 #define QMI_WDS_STOP_NETWORK_INTERFACE      0x0021
 #define QMI_WDS_GET_PKT_SRVC_STATUS         0x0022
+#define QMI_WDS_GET_RUNTIME_SETTINGS        0x002D
 #define QMI_WDS_GET_DATA_BEARER_TECHNOLOGY  0x0037
+#define QMI_WDS_SET_CLIENT_IP_FAMILY_PREF   0x004D
 #define QMI_WDS_SET_AUTOCONNECT_SETTINGS    0x0051
+#define QMI_WDS_BIND_MUX_DATA_PORT          0x00A2
 
 //Event report TLVs
 //This one has a confusing name. It is used to set the indication
@@ -20,6 +23,7 @@
 
 //START_NETWORK_INTERFACE TLVs
 #define QMI_WDS_TLV_SNI_APN_NAME            0x14
+#define QMI_WDS_TLV_SNI_IP_FAMILY_PREF      0x19
 #define QMI_WDS_TLV_SNI_AUTO_CONNECT        0x33
 
 //STOP_NETWORK_INTERFACE TLV
@@ -29,6 +33,25 @@
 //SET_AUTOCONNECT_SETTINGS TLVs
 #define QMI_WDS_TLV_SAS_SETTING             0x01
 
+//SET_CLIENT_IP_FAMILY_PREF, GET_RUNTIME_SETTINGS and BIND_MUX_DATA_PORT are in
+//qmi_messages.schema
+
+//GET_PKT_SRVC_STATUS TLVs
+#define QMI_WDS_TLV_PSS_STATUS              0x01
+#define QMI_WDS_TLV_PSS_IP_FAMILY           0x12
+
+//Requested settings flags
+#define QMI_WDS_RS_DNS_ADDR                 0x0010
+#define QMI_WDS_RS_IP_ADDR                  0x0100
+#define QMI_WDS_RS_GATEWAY_INFO             0x0200
+#define QMI_WDS_RS_MTU                      0x2000
+#define QMI_WDS_RS_IP_FAMILY                0x8000
+
+//IP family values
+#define QMI_WDS_IP_FAMILY_IPV4              0x04
+#define QMI_WDS_IP_FAMILY_IPV6              0x06
+#define QMI_WDS_IP_FAMILY_UNSPEC            0x08
+
 //Packet service
 #define QMI_WDS_PSS_DISCONNECTED            0x01
 #define QMI_WDS_PSS_CONNECTED               0x02
@@ -70,16 +93,32 @@ struct qmi_wds_cur_db{
 typedef struct qmi_wds_cur_db qmi_wds_cur_db_t;
 
 struct qmi_device;
+struct qmi_wds_session;
 
 //Handle a WDS message. Returns false if something went wrong
 uint8_t qmi_wds_handle_msg(struct qmi_device *qmid);
 
-//Send message based on state in state machine
-uint8_t qmi_wds_send(struct qmi_device *qmid);
+//Send message based on state in the state machine of one session
+uint8_t qmi_wds_send(struct qmi_device *qmid, struct qmi_wds_session *wds);
 
-//Update a connection based on a change in service or WDS connection
+//Update the connections based on a change in service or WDS connection
 uint8_t qmi_wds_update_connect(struct qmi_device *qmid);
 
-//Disconnect is only called when I exit application
+//Disconnect all sessions. Is only called when I exit application
 uint8_t qmi_wds_disconnect(struct qmi_device *qmid);
+
+//Disconnect the sessions using ifname. They are connected again by the state
+//machine, like after any other disconnect
+uint8_t qmi_wds_reconnect(struct qmi_device *qmid, const char *ifname);
+
+//Disconnect the sessions of one PDN, for example after the APN has changed
+uint8_t qmi_wds_reconnect_pdn(struct qmi_device *qmid, uint8_t pdn);
+
+//Run the hook for a session event (QMI_HOOK_*), with the addressing of the
+//session in the environment
+void qmi_wds_run_hook(struct qmi_device *qmid, struct qmi_wds_session *wds,
+        uint8_t type);
+
+//Output the state of all sessions
+void qmi_wds_print_status(struct qmi_device *qmid);
 #endif